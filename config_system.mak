@@ -36,6 +36,17 @@ CCFLAGS = -O2 -pipe -ggdb
 LDFLAGS = 
 LIBS = 
 EXEEXT = 
+# HOSTCC/HOSTEXEEXT are used for tools that run during the build, set them when cross-compiling
+ifeq ($(BUILD),)
+HOSTCC ?= $(CC)
+else
+HOSTCC ?= cc
+endif
+HOSTEXEEXT = 
+
+# POSIX threads are used for multi-threading (on Windows, they are provided by winpthreads)
+CFLAGS += -pthread
+LIBS += -pthread
 
 ifeq ($(WITH_GTK), 1)
 CFLAGS += $(shell $(PKG_CONFIG) --cflags gtk+-3.0)
@@ -0,0 +1,488 @@
+/* This file is part of ImPack2.
+ *
+ * ImPack2 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ImPack2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ImPack2. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _POSIX_C_SOURCE 200112L // For clock_gettime()
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "impack.h"
+#include "impack_internal.h"
+#include "cli.h"
+#include "config.h"
+
+#define JOBS_STEP 64
+#define MANIFEST_BUFSTEP 4096
+
+typedef struct batch batch_t;
+
+typedef struct {
+	batch_t *batch;
+	char *input_path;
+	char *output_path;
+	impack_error_t res;
+	bool no_passphrase; // Skipped because no passphrase could be read
+	bool encrypted;
+	double seconds;
+} batch_job_t;
+
+struct batch {
+	impack_batch_params_t *params;
+	char *extension; // Appended to the filename when encoding
+	batch_job_t *jobs;
+	size_t jobs_count;
+	size_t jobs_size;
+	pthread_mutex_t ctx_lock;
+	impack_ctx_t **ctx_pool; // Contexts that are not in use, there is one for each worker
+	uint32_t ctx_free;
+	const impack_key_cache_t *encode_key_cache;
+#ifdef IMPACK_WITH_CRYPTO
+	pthread_mutex_t key_lock; // Held while deriving a key when decoding, images from the same session only need it once
+	impack_key_cache_t decode_key_cache;
+	bool passphrase_failed;
+#endif
+};
+
+// Allocates "dir/name" + suffix
+static char* join_path(char *dir, char *name, char *suffix) {
+	
+	char *path = malloc(strlen(dir) + strlen(name) + strlen(suffix) + 2);
+	if (path == NULL) {
+		return NULL;
+	}
+	sprintf(path, "%s/%s%s", dir, name, suffix);
+	return path;
+	
+}
+
+static char* copy_string(char *str) {
+	
+	char *copy = malloc(strlen(str) + 1);
+	if (copy != NULL) {
+		strcpy(copy, str);
+	}
+	return copy;
+	
+}
+
+// Takes ownership of input_path, output_path may be NULL to select the default
+static bool add_job(batch_t *batch, char *input_path, char *output_path) {
+	
+	if (input_path == NULL) {
+		return false;
+	}
+	if (output_path == NULL) {
+		if (batch->params->decode) {
+			output_path = copy_string(batch->params->output_dir); // The included filename is appended
+		} else {
+			output_path = join_path(batch->params->output_dir, impack_filename(input_path), batch->extension);
+		}
+	} else {
+		output_path = copy_string(output_path);
+	}
+	if (output_path == NULL) {
+		free(input_path);
+		return false;
+	}
+	if (batch->jobs_count == batch->jobs_size) {
+		batch_job_t *jobs_new = realloc(batch->jobs, (batch->jobs_size + JOBS_STEP) * sizeof(batch_job_t));
+		if (jobs_new == NULL) {
+			free(input_path);
+			free(output_path);
+			return false;
+		}
+		batch->jobs = jobs_new;
+		batch->jobs_size += JOBS_STEP;
+	}
+	batch_job_t *job = &batch->jobs[batch->jobs_count++];
+	job->batch = batch;
+	job->input_path = input_path;
+	job->output_path = output_path;
+	job->res = ERROR_OK;
+	job->no_passphrase = false;
+	job->encrypted = false;
+	job->seconds = 0;
+	return true;
+	
+}
+
+static int add_jobs_dir(batch_t *batch, char *input_dir) {
+	
+	DIR *dir = opendir(input_dir);
+	if (dir == NULL) {
+		fprintf(stderr, "Can not read input directory\n");
+		return RETURN_USER_ERROR;
+	}
+	int ret = RETURN_OK;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		char *input_path = join_path(input_dir, entry->d_name, "");
+		if (input_path == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			ret = RETURN_SYSTEM_ERROR;
+			break;
+		}
+		struct stat input_stat;
+		if (stat(input_path, &input_stat) != 0 || !S_ISREG(input_stat.st_mode)) {
+			free(input_path);
+			continue;
+		}
+		if (!add_job(batch, input_path, NULL)) {
+			fprintf(stderr, "Out of memory\n");
+			ret = RETURN_SYSTEM_ERROR;
+			break;
+		}
+	}
+	closedir(dir);
+	return ret;
+	
+}
+
+static int add_jobs_manifest(batch_t *batch, char *manifest_path) {
+	
+	FILE *manifest = fopen(manifest_path, "rb");
+	if (manifest == NULL) {
+		fprintf(stderr, "Can not read manifest file\n");
+		return RETURN_USER_ERROR;
+	}
+	char *text = NULL;
+	size_t text_len = 0;
+	size_t text_size = 0;
+	while (true) {
+		if (text_len + 1 >= text_size) { // Always leave room for the terminator
+			char *text_new = realloc(text, text_size + MANIFEST_BUFSTEP);
+			if (text_new == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				free(text);
+				fclose(manifest);
+				return RETURN_SYSTEM_ERROR;
+			}
+			text = text_new;
+			text_size += MANIFEST_BUFSTEP;
+		}
+		size_t len = fread(text + text_len, 1, text_size - text_len - 1, manifest);
+		text_len += len;
+		if (len == 0) {
+			break;
+		}
+	}
+	if (ferror(manifest)) {
+		fprintf(stderr, "Can not read manifest file: I/O error\n");
+		free(text);
+		fclose(manifest);
+		return RETURN_SYSTEM_ERROR;
+	}
+	fclose(manifest);
+	text[text_len] = 0;
+	
+	int ret = RETURN_OK;
+	char *line = text;
+	while (*line != 0) {
+		char *next = strchr(line, '\n');
+		if (next != NULL) {
+			*next = 0;
+			next++;
+		} else {
+			next = line + strlen(line);
+		}
+		size_t len = strlen(line);
+		if (len != 0 && line[len - 1] == '\r') {
+			line[len - 1] = 0;
+		}
+		char *output_path = strchr(line, '\t');
+		if (output_path != NULL) {
+			*output_path = 0;
+			output_path++;
+			if (*output_path == 0) {
+				output_path = NULL;
+			}
+		}
+		if (*line != 0) {
+			if (!add_job(batch, copy_string(line), output_path)) {
+				fprintf(stderr, "Out of memory\n");
+				ret = RETURN_SYSTEM_ERROR;
+				break;
+			}
+		}
+		line = next;
+	}
+	free(text);
+	return ret;
+	
+}
+
+static double elapsed(struct timespec *start) {
+	
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+	
+}
+
+static impack_error_t decode_job(batch_job_t *job, impack_ctx_t *ctx) {
+	
+	impack_decode_state_t state;
+	impack_error_t res = impack_decode_stage1_ctx(ctx, &state, job->input_path);
+	if (res != ERROR_OK) {
+		return res;
+	}
+	state.threads = job->batch->params->threads;
+#ifdef IMPACK_WITH_CRYPTO
+	if (state.encryption != ENCRYPTION_NONE) {
+		batch_t *batch = job->batch;
+		job->encrypted = true;
+		pthread_mutex_lock(&batch->key_lock);
+		if (batch->params->passphrase == NULL && !batch->passphrase_failed) { // Only ask once, when the first encrypted image is found
+			if (impack_get_passphrase(&batch->params->passphrase, batch->params->options, batch->params->options_count, false) != RETURN_OK) {
+				batch->params->passphrase = NULL;
+				batch->passphrase_failed = true;
+			}
+		}
+		char *passphrase = NULL;
+		if (batch->params->passphrase != NULL) {
+			passphrase = copy_string(batch->params->passphrase); // Stage 2 erases it
+		}
+		if (passphrase == NULL) {
+			pthread_mutex_unlock(&batch->key_lock);
+			impack_decode_free(&state);
+			if (batch->passphrase_failed) {
+				job->no_passphrase = true;
+				return ERROR_OK;
+			}
+			return ERROR_MALLOC;
+		}
+		res = impack_decode_stage2_cache(&state, passphrase, &batch->decode_key_cache);
+		pthread_mutex_unlock(&batch->key_lock);
+		free(passphrase);
+	} else {
+		res = impack_decode_stage2(&state, NULL);
+	}
+#else
+	res = impack_decode_stage2(&state, NULL);
+#endif
+	if (res != ERROR_OK) {
+		return res;
+	}
+	return impack_decode_stage3(&state, job->output_path);
+	
+}
+
+static impack_error_t encode_job(batch_job_t *job, impack_ctx_t *ctx) {
+	
+	batch_t *batch = job->batch;
+	impack_batch_params_t *params = batch->params;
+	impack_encode_params_t encode_params;
+	impack_encode_params_init(&encode_params);
+	encode_params.encrypt = params->encrypt;
+	encode_params.kdf_params = params->kdf_params;
+	encode_params.key_cache = batch->encode_key_cache;
+	encode_params.compress = params->compression;
+	encode_params.compress_level = params->compression_level;
+	encode_params.channels = params->channels;
+	encode_params.img_width = params->width;
+	encode_params.img_height = params->height;
+	encode_params.format = params->format;
+	encode_params.filename_include = params->no_filename ? "out" : job->input_path;
+	encode_params.format_version = params->format_version;
+	encode_params.threads = params->threads;
+	encode_params.block_size = params->block_size;
+#ifdef IMPACK_WITH_CRYPTO
+	if (params->encrypt != ENCRYPTION_NONE && batch->encode_key_cache == NULL) { // The key is derived for every file
+		encode_params.passphrase = copy_string(params->passphrase); // Encoding erases it
+		if (encode_params.passphrase == NULL) {
+			return ERROR_MALLOC;
+		}
+	}
+#endif
+	impack_error_t res = impack_encode_ctx(ctx, job->input_path, job->output_path, &encode_params);
+	free(encode_params.passphrase);
+	return res;
+	
+}
+
+static void run_job(void *item) {
+	
+	batch_job_t *job = item;
+	batch_t *batch = job->batch;
+	impack_batch_params_t *params = batch->params;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	pthread_mutex_lock(&batch->ctx_lock);
+	impack_ctx_t *ctx = batch->ctx_pool[--batch->ctx_free];
+	pthread_mutex_unlock(&batch->ctx_lock);
+	if (params->decode) {
+		job->res = decode_job(job, ctx);
+	} else {
+		job->res = encode_job(job, ctx);
+	}
+	pthread_mutex_lock(&batch->ctx_lock);
+	batch->ctx_pool[batch->ctx_free++] = ctx;
+	pthread_mutex_unlock(&batch->ctx_lock);
+	
+	job->seconds = elapsed(&start);
+	
+}
+
+static int print_summary(batch_t *batch, double seconds) {
+	
+	int ret = RETURN_OK;
+	size_t failed = 0;
+	bool note_passphrase = false;
+	for (size_t i = 0; i < batch->jobs_count; i++) {
+		batch_job_t *job = &batch->jobs[i];
+		fprintf(stderr, "%s: ", job->input_path);
+		int job_ret = RETURN_OK;
+		if (job->no_passphrase) {
+			fprintf(stderr, "Skipped, no passphrase\n");
+			job_ret = RETURN_USER_ERROR;
+		} else if (job->res == ERROR_OK) {
+			fprintf(stderr, "OK (%.2f s)\n", job->seconds);
+		} else {
+			job_ret = impack_print_error(job->res);
+			if ((job->res == ERROR_INPUT_IMG_INVALID || job->res == ERROR_CRC) && job->encrypted) {
+				note_passphrase = true;
+			}
+		}
+		if (job_ret != RETURN_OK) {
+			failed++;
+		}
+		if (job_ret > ret) {
+			ret = job_ret;
+		}
+	}
+	fprintf(stderr, "%zu files, %zu failed, %.2f s\n", batch->jobs_count, failed, seconds);
+	if (note_passphrase) {
+		fprintf(stderr, "Note: Some errors may be caused by an incorrect passphrase\n");
+	}
+	return ret;
+	
+}
+
+int impack_batch(impack_batch_params_t *params) {
+	
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	batch_t batch;
+	memset(&batch, 0, sizeof(batch_t));
+	batch.params = params;
+	batch.extension = "";
+	int ret = RETURN_OK;
+#ifdef IMPACK_WITH_CRYPTO
+	impack_key_cache_t key_cache;
+#endif
+	
+	if (!params->decode) {
+		if (params->format == FORMAT_AUTO) {
+			params->format = impack_default_img_format();
+		}
+		batch.extension = impack_img_format_desc(params->format)->extension + 1; // Skip the "*"
+	}
+	
+	struct stat input_stat;
+	if (stat(params->input, &input_stat) != 0) {
+		fprintf(stderr, "Can not read input directory or manifest file\n");
+		ret = RETURN_USER_ERROR;
+		goto cleanup;
+	}
+	if (S_ISDIR(input_stat.st_mode)) {
+		ret = add_jobs_dir(&batch, params->input);
+	} else {
+		ret = add_jobs_manifest(&batch, params->input);
+	}
+	if (ret != RETURN_OK) {
+		goto cleanup;
+	}
+	if (batch.jobs_count == 0) {
+		fprintf(stderr, "No input files found\n");
+		goto cleanup;
+	}
+	
+	uint32_t workers = params->jobs;
+	if (workers > batch.jobs_count) {
+		workers = batch.jobs_count;
+	}
+	if (params->threads == 0) { // Each encoder / decoder would use every core otherwise
+		params->threads = impack_cpu_count() / workers;
+		if (params->threads == 0) {
+			params->threads = 1;
+		}
+	}
+	batch.ctx_pool = malloc(workers * sizeof(impack_ctx_t*));
+	if (batch.ctx_pool == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		ret = RETURN_SYSTEM_ERROR;
+		goto cleanup;
+	}
+	for (batch.ctx_free = 0; batch.ctx_free < workers; batch.ctx_free++) {
+		batch.ctx_pool[batch.ctx_free] = impack_ctx_new();
+		if (batch.ctx_pool[batch.ctx_free] == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			ret = RETURN_SYSTEM_ERROR;
+			goto cleanup;
+		}
+	}
+#ifdef IMPACK_WITH_CRYPTO
+	if (!params->decode && params->encrypt != ENCRYPTION_NONE && params->format_version != IMPACK_FORMAT_VERSION_STREAM) { // Images for older versions can't use a cached key
+		impack_error_t res = impack_key_cache_init(&key_cache, params->encrypt, params->passphrase, params->kdf_params);
+		if (res != ERROR_OK) {
+			ret = impack_print_error(res);
+			goto cleanup;
+		}
+		batch.encode_key_cache = &key_cache;
+	}
+	pthread_mutex_init(&batch.key_lock, NULL);
+#endif
+	pthread_mutex_init(&batch.ctx_lock, NULL);
+	
+	impack_parallel(run_job, batch.jobs, sizeof(batch_job_t), batch.jobs_count, workers);
+	
+	pthread_mutex_destroy(&batch.ctx_lock);
+#ifdef IMPACK_WITH_CRYPTO
+	pthread_mutex_destroy(&batch.key_lock);
+	impack_key_cache_free(&batch.decode_key_cache);
+	if (batch.encode_key_cache != NULL) {
+		impack_key_cache_free(&key_cache);
+	}
+#endif
+	ret = print_summary(&batch, elapsed(&start));
+	
+cleanup:
+#ifdef IMPACK_WITH_CRYPTO
+	if (params->passphrase != NULL) {
+		impack_secure_erase((uint8_t*) params->passphrase, strlen(params->passphrase));
+		free(params->passphrase);
+		params->passphrase = NULL;
+	}
+#endif
+	if (batch.ctx_pool != NULL) {
+		for (uint32_t i = 0; i < batch.ctx_free; i++) {
+			impack_ctx_free(batch.ctx_pool[i]);
+		}
+		free(batch.ctx_pool);
+	}
+	for (size_t i = 0; i < batch.jobs_count; i++) {
+		free(batch.jobs[i].input_path);
+		free(batch.jobs[i].output_path);
+	}
+	free(batch.jobs);
+	return ret;
+	
+}
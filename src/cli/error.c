@@ -92,6 +92,12 @@ int impack_print_error(impack_error_t error) {
 		case ERROR_COMPRESSION_UNKNOWN:
 			fprintf(stderr, "The image was created by an incompatible newer version of ImPack2\n");
 			return RETURN_DATA_ERROR;
+		case ERROR_VOLUMES_INCOMPLETE:
+			fprintf(stderr, "Some volumes are missing or belong to a different file\n");
+			return RETURN_USER_ERROR;
+		case ERROR_FORMAT_VERSION_INVALID:
+			fprintf(stderr, "The selected image format version can not be written\n");
+			return RETURN_USER_ERROR;
 	}
 	abort(); // Should never get here
 	
@@ -67,6 +67,20 @@ void impack_print_help() {
 	printf("\n");
 	printf("  -n, --no-filename:   Do not include the original filename in the image\n");
 	printf("  --custom-filename:   Include a custom filename instead of the original one\n");
+	printf("  --batch:             Encode / decode every file from the input directory into\n");
+	printf("                       the output directory, the input can also be a manifest\n");
+	printf("                       file with one path per line (optionally followed by a\n");
+	printf("                       tab and the output path), with --blocks the key is only\n");
+	printf("                       derived once for all files\n");
+	printf("  --jobs:              Number of files processed at the same time in batch mode\n");
+	printf("                       (default: 1)\n");
+	printf("  --volumes:           Split the file into this many images, which are encoded\n");
+	printf("                       at the same time (named like the output with the number\n");
+	printf("                       before the extension: out.1.png, out.2.png, ...)\n");
+	printf("                       When decoding, -i is the name without the number\n");
+	printf("  --range:             Only extract part of the file when decoding, given as\n");
+	printf("                       offset:length in bytes (or only the offset to extract\n");
+	printf("                       everything after it)\n");
 	printf("\n");
 #ifdef IMPACK_WITH_CRYPTO
 	printf("Encryption:\n");
@@ -81,6 +95,10 @@ void impack_print_help() {
 #ifdef IMPACK_WITH_ARGON2
 	printf("  --pbkdf2:            Use the older PBKDF2 algorithm for key derivation\n");
 	printf("                       instead of Argon2\n");
+	printf("  --argon2-iterations: Number of Argon2 iterations (default: 10)\n");
+	printf("  --argon2-memory:     Memory used by Argon2 in MiB (default: 128)\n");
+	printf("  --argon2-lanes:      Number of parallel Argon2 lanes (default: number of\n");
+	printf("                       CPU cores)\n");
 #endif
 	printf("\n");
 #endif
@@ -108,6 +126,25 @@ void impack_print_help() {
 	printf("  --grayscale:         Select color channels that should be used to store data\n");
 	printf("                       By default, all channels are used\n");
 	printf("\n");
+	printf("Format and performance (when encoding):\n");
+	printf("  --threads:           Number of threads used for processing the data (also\n");
+	printf("                       when decoding)\n");
+	printf("                       By default, one thread per CPU core is used (split\n");
+	printf("                       between the jobs in batch mode)\n");
+	printf("  --block-size:        Amount of data per block in KiB (64 to 65536)\n");
+	printf("                       By default, this depends on the file size and the\n");
+	printf("                       number of threads (1 to 8 MiB)\n");
+	printf("                       Encoding and decoding need about 4 times the block\n");
+	printf("                       size in memory per thread, fewer threads are used if\n");
+	printf("                       that is more than a quarter of the physical memory\n");
+	printf("  --blocks:            Split the data into blocks that are processed by\n");
+	printf("                       multiple threads (much faster on multi-core CPUs)\n");
+	printf("                       The image can only be decoded by ImPack2 1.6 or newer\n");
+	printf("                       Needed for --block-size, Argon2 parameters and\n");
+	printf("                       authenticated encryption, always used with --volumes\n");
+	printf("                       By default, the data is processed as a single stream\n");
+	printf("                       that older versions can decode\n");
+	printf("\n");
 	
 	printf("Supported image formats:\n");
 	int linelen = 2;
@@ -123,7 +160,9 @@ void impack_print_help() {
 #ifdef IMPACK_WITH_CRYPTO
 	printf("\n");
 	printf("Supported encryption types:\n");
-	printf("  AES (Default), Camellia, Serpent, Twofish\n");
+	printf("  AES (Default), Camellia, Serpent, Twofish,\n");
+	printf("  AES-GCM, ChaCha20-Poly1305 (authenticated, faster on multiple cores,\n");
+	printf("  need --blocks)\n");
 #endif
 	
 #ifdef IMPACK_WITH_COMPRESSION
@@ -25,7 +25,7 @@
 #define PASSPHRASE_BUFSTEP 25
 
 #ifdef IMPACK_WITH_CRYPTO
-int get_passphrase(char **passphrase_out, impack_argparse_t *options, int options_count, bool confirm) {
+int impack_get_passphrase(char **passphrase_out, impack_argparse_t *options, int options_count, bool confirm) {
 	
 	int option_input = impack_find_option(options, options_count, false, "i");
 	int option_passphrase = impack_find_option(options, options_count, false, "p");
@@ -127,6 +127,63 @@ int get_passphrase(char **passphrase_out, impack_argparse_t *options, int option
 }
 #endif
 
+#ifdef IMPACK_WITH_ARGON2
+// Parse the argument of one of the --argon2-* options (if found), must be a positive number
+bool parse_kdf_option(impack_argparse_t *option, uint32_t *out) {
+	
+	if (!option->found) {
+		return true;
+	}
+	char *endptr;
+	int64_t val = strtoll(option->arg_out, &endptr, 10);
+	if (*endptr != 0 || strlen(option->arg_out) == 0 || val <= 0 || val > UINT32_MAX) {
+		return false;
+	}
+	*out = val;
+	return true;
+	
+}
+#endif
+
+// Filenames for a set of volumes, the number is inserted before the file extension (out.png -> out.1.png, out.2.png, ...)
+char** volume_paths(char *path, uint32_t count) {
+	
+	char **paths = calloc(count, sizeof(char*));
+	if (paths == NULL) {
+		return NULL;
+	}
+	size_t path_length = strlen(path);
+	size_t extension = path_length;
+	for (size_t i = path_length; i > 0 && path[i - 1] != '/' && path[i - 1] != '\\'; i--) {
+		if (path[i - 1] == '.' && i > 1) {
+			extension = i - 1;
+			break;
+		}
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		paths[i] = malloc(path_length + 12); // Dot, up to 10 digits and the terminator
+		if (paths[i] == NULL) {
+			for (uint32_t j = 0; j < i; j++) {
+				free(paths[j]);
+			}
+			free(paths);
+			return NULL;
+		}
+		sprintf(paths[i], "%.*s.%u%s", (int) extension, path, (unsigned int) i + 1, path + extension);
+	}
+	return paths;
+	
+}
+
+void volume_paths_free(char **paths, uint32_t count) {
+	
+	for (uint32_t i = 0; i < count; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+	
+}
+
 int main(int argc, char **argv) {
 	
 	impack_argparse_t options[] = {
@@ -145,6 +202,13 @@ int main(int argc, char **argv) {
 		{ "format", 'f', true, false, NULL },
 		{ "no-filename", 'n', false, false, NULL },
 		{ "custom-filename", 0, true, false, NULL },
+		{ "threads", 0, true, false, NULL },
+		{ "block-size", 0, true, false, NULL },
+		{ "blocks", 0, false, false, NULL },
+		{ "batch", 0, false, false, NULL },
+		{ "jobs", 0, true, false, NULL },
+		{ "volumes", 0, true, false, NULL },
+		{ "range", 0, true, false, NULL },
 #ifdef IMPACK_WITH_CRYPTO
 		{ "encrypt", 'c', false, false, NULL },
 		{ "encryption-type", 0, true, false, NULL },
@@ -152,6 +216,9 @@ int main(int argc, char **argv) {
 		{ "passphrase-file", 0, true, false, NULL },
 #ifdef IMPACK_WITH_ARGON2
 		{ "pbkdf2", 0, false, false, NULL },
+		{ "argon2-iterations", 0, true, false, NULL },
+		{ "argon2-memory", 0, true, false, NULL },
+		{ "argon2-lanes", 0, true, false, NULL },
 #endif
 #endif
 #ifdef IMPACK_WITH_COMPRESSION
@@ -187,11 +254,23 @@ int main(int argc, char **argv) {
 	int option_format = impack_find_option(options, options_count, false, "f");
 	int option_no_filename = impack_find_option(options, options_count, false, "n");
 	int option_custom_filename = impack_find_option(options, options_count, true, "custom-filename");
+	int option_threads = impack_find_option(options, options_count, true, "threads");
+	int option_block_size = impack_find_option(options, options_count, true, "block-size");
+	int option_blocks = impack_find_option(options, options_count, true, "blocks");
+	int option_batch = impack_find_option(options, options_count, true, "batch");
+	int option_jobs = impack_find_option(options, options_count, true, "jobs");
+	int option_volumes = impack_find_option(options, options_count, true, "volumes");
+	int option_range = impack_find_option(options, options_count, true, "range");
+	bool block_format = options[option_blocks].found || options[option_volumes].found; // Volumes always use the block format
 #ifdef IMPACK_WITH_CRYPTO
 	int option_encrypt = impack_find_option(options, options_count, false, "c");
 	int option_encryption_type = impack_find_option(options, options_count, true, "encryption-type");
 #ifdef IMPACK_WITH_ARGON2
 	int option_pbkdf2 = impack_find_option(options, options_count, true, "pbkdf2");
+	int option_argon2_iterations = impack_find_option(options, options_count, true, "argon2-iterations");
+	int option_argon2_memory = impack_find_option(options, options_count, true, "argon2-memory");
+	int option_argon2_lanes = impack_find_option(options, options_count, true, "argon2-lanes");
+	bool argon2_params_found = options[option_argon2_iterations].found || options[option_argon2_memory].found || options[option_argon2_lanes].found;
 #endif
 #endif
 #ifdef IMPACK_WITH_COMPRESSION
@@ -223,7 +302,7 @@ int main(int argc, char **argv) {
 			return RETURN_USER_ERROR;
 		}
 #ifdef IMPACK_WITH_ARGON2
-		if (options[option_pbkdf2].found) {
+		if (options[option_pbkdf2].found || argon2_params_found) {
 			fprintf(stderr, "Can not request encryption when decoding\n");
 			return RETURN_USER_ERROR;
 		}
@@ -251,6 +330,14 @@ int main(int argc, char **argv) {
 			fprintf(stderr, "Can not select the included filename when decoding\n");
 			return RETURN_USER_ERROR;
 		}
+		if (options[option_block_size].found) {
+			fprintf(stderr, "Can not select the block size when decoding\n");
+			return RETURN_USER_ERROR;
+		}
+		if (options[option_blocks].found) {
+			fprintf(stderr, "Can not select the block format when decoding\n");
+			return RETURN_USER_ERROR;
+		}
 	}
 	if (options[option_grayscale].found && (options[option_channel_red].found || options[option_channel_green].found || options[option_channel_blue].found)) {
 		fprintf(stderr, "Can not select color channels in grayscale mode\n");
@@ -266,6 +353,94 @@ int main(int argc, char **argv) {
 			return RETURN_USER_ERROR;
 		}
 	}
+	if (!block_format && options[option_block_size].found) {
+		fprintf(stderr, "Can not select the block size without the block format\n");
+		return RETURN_USER_ERROR;
+	}
+	if (options[option_batch].found) {
+		if (options[option_custom_filename].found) {
+			fprintf(stderr, "Can not select a custom filename in batch mode\n");
+			return RETURN_USER_ERROR;
+		}
+	} else if (options[option_jobs].found) {
+		fprintf(stderr, "Can not select the number of jobs without batch mode\n");
+		return RETURN_USER_ERROR;
+	}
+	impack_batch_params_t batch_params;
+	memset(&batch_params, 0, sizeof(impack_batch_params_t));
+	batch_params.decode = options[option_decode].found;
+	batch_params.input = options[option_input].arg_out;
+	batch_params.output_dir = options[option_output].found ? options[option_output].arg_out : ".";
+	batch_params.jobs = 1;
+	batch_params.options = options;
+	batch_params.options_count = options_count;
+	if (options[option_jobs].found) {
+		char *endptr;
+		int64_t jobs = strtol(options[option_jobs].arg_out, &endptr, 10);
+		if (*endptr != 0 || strlen(options[option_jobs].arg_out) == 0 || jobs <= 0 || jobs > UINT32_MAX) {
+			fprintf(stderr, "Invalid number of jobs\n");
+			return RETURN_USER_ERROR;
+		}
+		batch_params.jobs = jobs;
+	}
+	int64_t threads = 0;
+	if (options[option_threads].found) {
+		char *endptr;
+		threads = strtol(options[option_threads].arg_out, &endptr, 10);
+		if (*endptr != 0 || strlen(options[option_threads].arg_out) == 0) {
+			fprintf(stderr, "Invalid number of threads\n");
+			return RETURN_USER_ERROR;
+		}
+		if (threads <= 0 || threads > UINT32_MAX) {
+			fprintf(stderr, "Invalid number of threads\n");
+			return RETURN_USER_ERROR;
+		}
+	}
+	batch_params.threads = threads;
+	uint32_t volumes = 0;
+	if (options[option_volumes].found) {
+		char *endptr;
+		int64_t count = strtol(options[option_volumes].arg_out, &endptr, 10);
+		if (*endptr != 0 || strlen(options[option_volumes].arg_out) == 0 || count <= 0 || count > UINT32_MAX) {
+			fprintf(stderr, "Invalid number of volumes\n");
+			return RETURN_USER_ERROR;
+		}
+		if (options[option_batch].found) {
+			fprintf(stderr, "Can not split files into volumes in batch mode\n");
+			return RETURN_USER_ERROR;
+		}
+		if ((strlen(options[option_input].arg_out) == 1 && options[option_input].arg_out[0] == '-') || (options[option_output].found && strlen(options[option_output].arg_out) == 1 && options[option_output].arg_out[0] == '-')) {
+			fprintf(stderr, "Can not use stdin or stdout with volumes\n");
+			return RETURN_USER_ERROR;
+		}
+		volumes = count;
+	}
+	uint64_t range_offset = 0;
+	uint64_t range_length = UINT64_MAX;
+	if (options[option_range].found) {
+		if (!options[option_decode].found) {
+			fprintf(stderr, "Can only select a range when decoding\n");
+			return RETURN_USER_ERROR;
+		}
+		if (options[option_batch].found || options[option_volumes].found) {
+			fprintf(stderr, "Can not select a range in batch mode or with volumes\n");
+			return RETURN_USER_ERROR;
+		}
+		char *arg = options[option_range].arg_out;
+		char *endptr;
+		errno = 0;
+		range_offset = strtoull(arg, &endptr, 10);
+		bool valid = (endptr != arg && arg[0] != '-' && errno == 0);
+		if (valid && *endptr == ':') { // Otherwise, everything after the offset is extracted
+			char *length_arg = endptr + 1;
+			range_length = strtoull(length_arg, &endptr, 10);
+			valid = (endptr != length_arg && length_arg[0] != '-' && errno == 0);
+		}
+		if (!valid || *endptr != 0) {
+			fprintf(stderr, "Invalid range\n");
+			return RETURN_USER_ERROR;
+		}
+	}
 #ifdef IMPACK_WITH_CRYPTO
 	if (!options[option_encrypt].found && options[option_encryption_type].found) {
 		fprintf(stderr, "Can not select the encryption type when encryption is disabled\n");
@@ -276,6 +451,18 @@ int main(int argc, char **argv) {
 		fprintf(stderr, "Can not select the encryption type when encryption is disabled\n");
 		return RETURN_USER_ERROR;
 	}
+	if (!options[option_encrypt].found && argon2_params_found) {
+		fprintf(stderr, "Can not select key derivation parameters when encryption is disabled\n");
+		return RETURN_USER_ERROR;
+	}
+	if (options[option_pbkdf2].found && argon2_params_found) {
+		fprintf(stderr, "Can not select Argon2 parameters when using PBKDF2\n");
+		return RETURN_USER_ERROR;
+	}
+	if (!block_format && argon2_params_found) {
+		fprintf(stderr, "Can not select Argon2 parameters without the block format\n");
+		return RETURN_USER_ERROR;
+	}
 #endif
 #endif
 #ifdef IMPACK_WITH_COMPRESSION
@@ -322,6 +509,20 @@ int main(int argc, char **argv) {
 				return RETURN_USER_ERROR;
 			}
 		}
+		int64_t block_size = 0;
+		if (options[option_block_size].found) {
+			char *endptr;
+			block_size = strtol(options[option_block_size].arg_out, &endptr, 10);
+			if (*endptr != 0 || strlen(options[option_block_size].arg_out) == 0) {
+				fprintf(stderr, "Invalid block size\n");
+				return RETURN_USER_ERROR;
+			}
+			if (block_size < IMPACK_BLOCK_SIZE_MIN / 1024 || block_size > IMPACK_BLOCK_SIZE_MAX / 1024) {
+				fprintf(stderr, "Invalid block size (must be between %d and %d KiB)\n", IMPACK_BLOCK_SIZE_MIN / 1024, IMPACK_BLOCK_SIZE_MAX / 1024);
+				return RETURN_USER_ERROR;
+			}
+			block_size *= 1024;
+		}
 		
 		uint8_t compression = COMPRESSION_NONE;
 		int32_t compression_level = 0;
@@ -363,6 +564,7 @@ int main(int argc, char **argv) {
 		
 		impack_encryption_type_t encrypt = ENCRYPTION_NONE;
 		char *passphrase = NULL;
+		impack_kdf_params_t kdf_params = { IMPACK_ARGON2_ITERATIONS, IMPACK_ARGON2_MEMORY, 0 };
 #ifdef IMPACK_WITH_CRYPTO
 		if (options[option_encrypt].found) {
 #ifdef IMPACK_WITH_ARGON2
@@ -378,11 +580,27 @@ int main(int argc, char **argv) {
 					return RETURN_USER_ERROR;
 				}
 			}
+			if (!block_format && impack_encryption_authenticated(encrypt)) {
+				fprintf(stderr, "Can not use authenticated encryption without the block format\n");
+				return RETURN_USER_ERROR;
+			}
+#ifdef IMPACK_WITH_ARGON2
+			uint32_t memory_mib = IMPACK_ARGON2_MEMORY / 1024;
+			if (!parse_kdf_option(&options[option_argon2_iterations], &kdf_params.iterations) || !parse_kdf_option(&options[option_argon2_memory], &memory_mib) || !parse_kdf_option(&options[option_argon2_lanes], &kdf_params.lanes)) {
+				fprintf(stderr, "Invalid Argon2 parameters\n");
+				return RETURN_USER_ERROR;
+			}
+			kdf_params.memory = (memory_mib <= IMPACK_ARGON2_MEMORY_MAX / 1024) ? memory_mib * 1024 : 0; // Too large, fails the check below
+			if (!impack_kdf_params_valid(&kdf_params)) {
+				fprintf(stderr, "Invalid Argon2 parameters\n");
+				return RETURN_USER_ERROR;
+			}
+#endif
 			if (options[option_passphrase].found && options[option_passphrase_file].found) {
 				fprintf(stderr, "Multiple sources for a passphrase specified\n");
 				return RETURN_USER_ERROR;
 			}
-			int res = get_passphrase(&passphrase, options, options_count, true);
+			int res = impack_get_passphrase(&passphrase, options, options_count, true);
 			if (res != RETURN_OK) {
 				return res;
 			}
@@ -416,7 +634,53 @@ int main(int argc, char **argv) {
 		} else if (options[option_custom_filename].found) {
 			filename_include = options[option_custom_filename].arg_out;
 		}
-		impack_error_t res = impack_encode(options[option_input].arg_out, options[option_output].arg_out, encrypt, passphrase, compression, compression_level, channels, width, height, format, filename_include);
+		if (options[option_batch].found) {
+			batch_params.passphrase = passphrase;
+			batch_params.encrypt = encrypt;
+			batch_params.kdf_params = &kdf_params;
+			batch_params.compression = compression;
+			batch_params.compression_level = compression_level;
+			batch_params.channels = channels;
+			batch_params.width = width;
+			batch_params.height = height;
+			batch_params.format = format;
+			batch_params.no_filename = options[option_no_filename].found;
+			batch_params.block_size = block_size;
+			batch_params.format_version = block_format ? IMPACK_FORMAT_VERSION_BLOCKS : IMPACK_FORMAT_VERSION_STREAM;
+			return impack_batch(&batch_params);
+		}
+		impack_encode_params_t encode_params;
+		impack_encode_params_init(&encode_params);
+		encode_params.encrypt = encrypt;
+		encode_params.passphrase = passphrase;
+		encode_params.kdf_params = &kdf_params;
+		encode_params.compress = compression;
+		encode_params.compress_level = compression_level;
+		encode_params.channels = channels;
+		encode_params.img_width = width;
+		encode_params.img_height = height;
+		encode_params.format = format;
+		encode_params.filename_include = filename_include;
+		encode_params.format_version = block_format ? IMPACK_FORMAT_VERSION_BLOCKS : IMPACK_FORMAT_VERSION_STREAM;
+		encode_params.threads = threads;
+		encode_params.block_size = block_size;
+		if (volumes != 0) {
+			char **output_paths = volume_paths(options[option_output].arg_out, volumes);
+			if (output_paths == NULL) {
+#ifdef IMPACK_WITH_CRYPTO
+				free(passphrase);
+#endif
+				fprintf(stderr, "Out of memory\n");
+				return RETURN_SYSTEM_ERROR;
+			}
+			impack_error_t res = impack_encode_volumes(options[option_input].arg_out, output_paths, volumes, &encode_params);
+			volume_paths_free(output_paths, volumes);
+#ifdef IMPACK_WITH_CRYPTO
+			free(passphrase);
+#endif
+			return impack_print_error(res);
+		}
+		impack_error_t res = impack_encode(options[option_input].arg_out, options[option_output].arg_out, &encode_params);
 #ifdef IMPACK_WITH_CRYPTO
 		free(passphrase);
 #endif
@@ -429,16 +693,64 @@ int main(int argc, char **argv) {
 		}
 #endif
 		char *passphrase = NULL;
+		if (options[option_batch].found) {
+#ifdef IMPACK_WITH_CRYPTO
+			if (options[option_passphrase].found || options[option_passphrase_file].found) { // Otherwise, ask when the first encrypted image is found
+				int res = impack_get_passphrase(&batch_params.passphrase, options, options_count, false);
+				if (res != RETURN_OK) {
+					return res;
+				}
+			}
+#endif
+			return impack_batch(&batch_params);
+		}
+		char *out_path = ".";
+		if (options[option_output].arg_out != NULL) {
+			out_path = options[option_output].arg_out;
+		}
 		impack_decode_state_t state;
+		if (volumes != 0) {
+			char **input_paths = volume_paths(options[option_input].arg_out, volumes);
+			if (input_paths == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				return RETURN_SYSTEM_ERROR;
+			}
+			impack_error_t res = impack_decode_stage1(&state, input_paths[0]); // Only to find out if a passphrase is needed
+			if (res != ERROR_OK) {
+				volume_paths_free(input_paths, volumes);
+				return impack_print_error(res);
+			}
+			impack_decode_free(&state);
+#ifdef IMPACK_WITH_CRYPTO
+			if (state.encryption != 0) {
+				int passphrase_res = impack_get_passphrase(&passphrase, options, options_count, false);
+				if (passphrase_res != RETURN_OK) {
+					volume_paths_free(input_paths, volumes);
+					return passphrase_res;
+				}
+			}
+#endif
+			res = impack_decode_volumes(input_paths, volumes, passphrase, out_path, threads);
+			volume_paths_free(input_paths, volumes);
+			free(passphrase);
+			int return_val = impack_print_error(res);
+#ifdef IMPACK_WITH_CRYPTO
+			if ((res == ERROR_INPUT_IMG_INVALID || res == ERROR_CRC) && state.encryption != 0) {
+				fprintf(stderr, "Note: This may be caused by an incorrect passphrase\n");
+			}
+#endif
+			return return_val;
+		}
 		impack_error_t res = impack_decode_stage1(&state, options[option_input].arg_out);
 		if (res != ERROR_OK) {
 			return impack_print_error(res);
 		}
+		state.threads = threads;
 #ifdef IMPACK_WITH_CRYPTO
 		if (state.encryption != 0) {
-			res = get_passphrase(&passphrase, options, options_count, false);
+			res = impack_get_passphrase(&passphrase, options, options_count, false);
 			if (res != ERROR_OK) {
-				free(state.pixeldata);
+				impack_decode_free(&state);
 				return res;
 			}
 		}
@@ -453,17 +765,16 @@ int main(int argc, char **argv) {
 #endif
 			return return_val;
 		}
-		char *out_path = ".";
-		if (options[option_output].arg_out != NULL) {
-			out_path = options[option_output].arg_out;
-		}
-		res = impack_decode_stage3(&state, out_path);
+		res = impack_decode_range(&state, range_offset, range_length, out_path);
 		int return_val = impack_print_error(res);
 #ifdef IMPACK_WITH_CRYPTO
 		if ((res == ERROR_INPUT_IMG_INVALID || res == ERROR_CRC) && state.encryption != 0) {
 			fprintf(stderr, "Note: This may be caused by an incorrect passphrase\n");
 		}
 #endif
+		if (res == ERROR_OK && state.volume_count > 1) {
+			fprintf(stderr, "Warning: This image only contains part %u of %u of the file, use --volumes to decode all of them\n", (unsigned int) state.volume_number + 1, (unsigned int) state.volume_count);
+		}
 #ifndef IMPACK_WITH_CRYPTO
 		if (res == ERROR_OK && state.legacy) {
 			fprintf(stderr, "Warning: This build of ImPack2 can not check if the data in legacy images is corrupted\n");
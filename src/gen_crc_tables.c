@@ -0,0 +1,104 @@
+/* This file is part of ImPack2.
+ *
+ * ImPack2 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ImPack2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ImPack2. If not, see <http://www.gnu.org/licenses/>. */
+
+// Generates the lookup tables and constants used by src/lib/crc.c (runs on the build machine)
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "include/crc_poly.h"
+
+#define CRC_X2N_COUNT 67
+
+// x^n mod P
+static uint64_t crc_xpow(uint64_t n) {
+	
+	uint64_t res = 1ULL << 63;
+	for (uint64_t i = 0; i < n; i++) {
+		res = crc_mulx(res);
+	}
+	return res;
+	
+}
+
+static void print_values(const uint64_t *values, int count, const char *indent) {
+	
+	for (int i = 0; i < count; i++) {
+		if (i % 4 == 0) {
+			printf("%s", indent);
+		}
+		printf("0x%016" PRIX64 "ULL", values[i]);
+		if (i != count - 1) {
+			printf(",");
+		}
+		if (i % 4 == 3 || i == count - 1) {
+			printf("\n");
+		} else {
+			printf(" ");
+		}
+	}
+	
+}
+
+int main() {
+	
+	static uint64_t table[16][256];
+	for (int i = 0; i < 256; i++) {
+		uint64_t crc = i;
+		for (int j = 0; j < 8; j++) {
+			crc = crc_mulx(crc);
+		}
+		table[0][i] = crc;
+	}
+	for (int i = 0; i < 256; i++) {
+		for (int j = 1; j < 16; j++) {
+			table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 255];
+		}
+	}
+	uint64_t x2n[CRC_X2N_COUNT];
+	x2n[0] = 1ULL << 62; // x^1
+	for (int i = 1; i < CRC_X2N_COUNT; i++) {
+		x2n[i] = crc_multmodp(x2n[i - 1], x2n[i - 1]);
+	}
+	/* Folding a 128 bit block forward by n bits multiplies its first half by
+	 * x^(n+64) and its second half by x^n. The carry-less product of two
+	 * reflected values is off by one bit, hence the -1. */
+	uint64_t fold_128[2] = { crc_xpow(128 + 63), crc_xpow(128 - 1) };
+	uint64_t fold_512[2] = { crc_xpow(512 + 63), crc_xpow(512 - 1) };
+	
+	printf("// Auto-generated by src/gen_crc_tables.c\n\n");
+	printf("#ifndef __IMPACK_CRC_TABLES_GENERATED_H__\n");
+	printf("#define __IMPACK_CRC_TABLES_GENERATED_H__\n\n");
+	printf("// Slicing-by-16, crc_table[0] is the classic table\n");
+	printf("static const uint64_t crc_table[16][256] = {\n");
+	for (int i = 0; i < 16; i++) {
+		printf("\t{\n");
+		print_values(table[i], 256, "\t\t");
+		printf(i != 15 ? "\t},\n" : "\t}\n");
+	}
+	printf("};\n\n");
+	printf("// x^(2^n) mod P\n");
+	printf("static const uint64_t crc_x2n[%d] = {\n", CRC_X2N_COUNT);
+	print_values(x2n, CRC_X2N_COUNT, "\t");
+	printf("};\n\n");
+	printf("#if defined(IMPACK_CRC_CLMUL) || defined(IMPACK_CRC_PMULL)\n");
+	printf("// Folding constants for carry-less multiplication\n");
+	printf("static const uint64_t crc_fold_128[2] = { 0x%016" PRIX64 "ULL, 0x%016" PRIX64 "ULL };\n", fold_128[0], fold_128[1]);
+	printf("static const uint64_t crc_fold_512[2] = { 0x%016" PRIX64 "ULL, 0x%016" PRIX64 "ULL };\n", fold_512[0], fold_512[1]);
+	printf("#endif\n\n");
+	printf("#endif\n");
+	return 0;
+	
+}
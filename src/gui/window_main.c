@@ -219,6 +219,14 @@ void encode_height_checkbox_toggled() {
 	
 }
 
+void encode_threads_checkbox_toggled() {
+	
+	GtkCheckButton *box = GTK_CHECK_BUTTON(gtk_builder_get_object(builder, "EncodeThreadsBox"));
+	GtkSpinButton *number = GTK_SPIN_BUTTON(gtk_builder_get_object(builder, "EncodeThreadsNumber"));
+	gtk_widget_set_sensitive(GTK_WIDGET(number), gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(box)));
+	
+}
+
 void encode_compress_level_checkbox_toggled() {
 	
 	GtkCheckButton *box = GTK_CHECK_BUTTON(gtk_builder_get_object(builder, "EncodeCompressLevelCheckbox"));
@@ -481,6 +489,12 @@ void show_impack_error(impack_error_t error, bool maybe_passphrase) {
 		case ERROR_COMPRESSION_UNKNOWN:
 			msg = "The image was created by an incompatible newer version of ImPack2";
 			break;
+		case ERROR_VOLUMES_INCOMPLETE:
+			msg = "Some volumes are missing or belong to a different file";
+			break;
+		case ERROR_FORMAT_VERSION_INVALID:
+			msg = "The selected image format version can not be written";
+			break;
 		default:
 			abort();
 	}
@@ -561,6 +575,11 @@ void encode_button_click() {
 			bool want_pbkdf2 = true;
 #endif
 			encode_params.encrypt = impack_select_encryption((char*) gtk_combo_box_get_active_id(GTK_COMBO_BOX(encrypt_type_box)), want_pbkdf2);
+			if (impack_encryption_authenticated(encode_params.encrypt) && !gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(gtk_builder_get_object(builder, "EncodeBlocksBox")))) {
+				free(encode_params.passphrase);
+				show_error("Authenticated encryption needs the block format");
+				return;
+			}
 		} else {
 			encode_params.encrypt = impack_default_encryption(false);
 		}
@@ -600,6 +619,16 @@ void encode_button_click() {
 		GtkSpinButton *height_number = GTK_SPIN_BUTTON(gtk_builder_get_object(builder, "EncodeHeightNumber"));
 		encode_params.img_height = gtk_spin_button_get_value_as_int(height_number);
 	}
+	GtkCheckButton *threads_box = GTK_CHECK_BUTTON(gtk_builder_get_object(builder, "EncodeThreadsBox"));
+	encode_params.threads = 0; // Auto-select
+	if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(threads_box))) {
+		GtkSpinButton *threads_number = GTK_SPIN_BUTTON(gtk_builder_get_object(builder, "EncodeThreadsNumber"));
+		encode_params.threads = gtk_spin_button_get_value_as_int(threads_number);
+	}
+	encode_params.format_version = IMPACK_FORMAT_VERSION_STREAM; // Can be decoded by older versions
+	if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(adv_box)) && gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(gtk_builder_get_object(builder, "EncodeBlocksBox")))) {
+		encode_params.format_version = IMPACK_FORMAT_VERSION_BLOCKS;
+	}
 	encode_params.filename_include = encode_params.input_path;
 	if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(adv_box))) {
 		if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(gtk_builder_get_object(builder, "EncodeNoFilenameCheckbox")))) {
@@ -697,13 +726,13 @@ void decode_button_click() {
 			decode_params.passphrase = malloc(strlen(passphrase) + 1);
 			if (decode_params.passphrase == NULL) {
 				show_error("Out of memory");
-				free(decode_params.state.pixeldata);
+				impack_decode_free(&decode_params.state);
 				running = false;
 			} else {
 				strcpy(decode_params.passphrase, passphrase);
 			}
 		} else {
-			free(decode_params.state.pixeldata);
+			impack_decode_free(&decode_params.state);
 			running = false;
 		}
 		gtk_widget_destroy(GTK_WIDGET(dialog));
@@ -733,7 +762,7 @@ void decode_button_click() {
 				impack_secure_erase(decode_params.state.crypt_key, IMPACK_CRYPT_KEY_SIZE);
 			}
 #endif
-			free(decode_params.state.pixeldata);
+			impack_decode_free(&decode_params.state);
 			free(decode_params.state.filename);
 			running = false;
 		}
@@ -792,6 +821,7 @@ void window_main_add_callbacks(GtkBuilder *b) {
 	gtk_builder_add_callback_symbol(b, "encode_grayscale_checkbox_toggle", encode_grayscale_checkbox_toggle);
 	gtk_builder_add_callback_symbol(b, "encode_width_checkbox_toggled", encode_width_checkbox_toggled);
 	gtk_builder_add_callback_symbol(b, "encode_height_checkbox_toggled", encode_height_checkbox_toggled);
+	gtk_builder_add_callback_symbol(b, "encode_threads_checkbox_toggled", encode_threads_checkbox_toggled);
 	gtk_builder_add_callback_symbol(b, "encode_no_filename_toggled", encode_no_filename_toggled);
 	gtk_builder_add_callback_symbol(b, "encode_custom_filename_toggled", encode_custom_filename_toggled);
 	gtk_builder_add_callback_symbol(b, "encode_compress_level_checkbox_toggled", encode_compress_level_checkbox_toggled);
@@ -822,6 +852,8 @@ void window_main_setup(GtkBuilder *b) {
 	gtk_combo_box_text_append(encrypt_box, "camellia", "Camellia");
 	gtk_combo_box_text_append(encrypt_box, "serpent", "Serpent");
 	gtk_combo_box_text_append(encrypt_box, "twofish", "Twofish");
+	gtk_combo_box_text_append(encrypt_box, "aes-gcm", "AES-GCM");
+	gtk_combo_box_text_append(encrypt_box, "chacha20-poly1305", "ChaCha20-Poly1305");
 	gtk_combo_box_set_active_id(GTK_COMBO_BOX(encrypt_box), "aes");
 #else
 	GtkCheckButton *encrypt_box = GTK_CHECK_BUTTON(gtk_builder_get_object(b, "EncodeEncryptCheckbox"));
@@ -24,7 +24,19 @@ bool decode_thread_running;
 void* encode_thread_main(void *data) {
 	
 	encode_thread_data_t *params = (encode_thread_data_t*) data;
-	params->res = impack_encode(params->input_path, params->output_path, params->encrypt, params->passphrase, params->compress, params->compress_level, params->channels, params->img_width, params->img_height, FORMAT_AUTO, params->filename_include);
+	impack_encode_params_t encode_params;
+	impack_encode_params_init(&encode_params);
+	encode_params.encrypt = params->encrypt;
+	encode_params.passphrase = params->passphrase;
+	encode_params.compress = params->compress;
+	encode_params.compress_level = params->compress_level;
+	encode_params.channels = params->channels;
+	encode_params.img_width = params->img_width;
+	encode_params.img_height = params->img_height;
+	encode_params.filename_include = params->filename_include;
+	encode_params.format_version = params->format_version;
+	encode_params.threads = params->threads;
+	params->res = impack_encode(params->input_path, params->output_path, &encode_params);
 	encode_thread_running = false;
 	return NULL;
 	
@@ -34,6 +34,28 @@ typedef struct {
 	char *arg_out; // If this option takes an argument, impack_argparse sets this to that argument (pointer into argv)
 } impack_argparse_t;
 
+typedef struct {
+	bool decode;
+	char *input; // Directory or manifest file (one input path per line, optionally followed by a tab and the output path)
+	char *output_dir; // Used for every file without an output path from the manifest
+	uint32_t jobs; // Number of files processed at the same time
+	impack_argparse_t *options; // Used to ask for the passphrase when decoding, if passphrase is NULL
+	size_t options_count;
+	char *passphrase; // Erased by impack_batch()
+	uint32_t threads; // 0 splits the CPU cores between the jobs
+	impack_encryption_type_t encrypt; // The remaining options are only used when encoding
+	const impack_kdf_params_t *kdf_params;
+	impack_compression_type_t compression;
+	int32_t compression_level;
+	uint8_t channels;
+	uint64_t width;
+	uint64_t height;
+	impack_img_format_t format;
+	bool no_filename;
+	uint8_t format_version; // IMPACK_FORMAT_VERSION_STREAM or IMPACK_FORMAT_VERSION_BLOCKS
+	uint32_t block_size; // 0 selects it for every file
+} impack_batch_params_t;
+
 // Somewhat similar to getopt_long
 bool impack_argparse(impack_argparse_t *options, size_t options_count, char **argv, int argc);
 // Find an option by name and return its index
@@ -43,5 +65,11 @@ void impack_print_version();
 int impack_print_error(impack_error_t error);
 // Read a passphrase from the terminal (or stdin, if ncurses is disabled)
 char* impack_readpass();
+#ifdef IMPACK_WITH_CRYPTO
+// Get the passphrase from -p, --passphrase-file or the terminal
+int impack_get_passphrase(char **passphrase_out, impack_argparse_t *options, int options_count, bool confirm);
+#endif
+// Encode or decode every file from a directory or manifest, then print a summary
+int impack_batch(impack_batch_params_t *params);
 
 #endif
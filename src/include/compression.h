@@ -50,5 +50,8 @@ bool impack_compress_level_valid_zstd(int32_t level);
 bool impack_compress_level_valid_lzma(int32_t level);
 bool impack_compress_level_valid_bzip2(int32_t level);
 bool impack_compress_level_valid_brotli(int32_t level);
+bool impack_compress_reset_zlib(impack_compress_state_t *state);
+bool impack_compress_reset_zstd(impack_compress_state_t *state);
+bool impack_compress_reset_lzma(impack_compress_state_t *state);
 
 #endif
@@ -0,0 +1,27 @@
+// Auto-generated, edit config_build.mak instead
+
+#ifndef __IMPACK_CONFIG_GENERATED_H__
+#define __IMPACK_CONFIG_GENERATED_H__
+
+#define IMPACK_VERSION_STRING "1.5"
+
+#define IMPACK_CONFIG_NETTLE 1
+#define IMPACK_CONFIG_ARGON2 0
+#define IMPACK_CONFIG_PNG 1
+#define IMPACK_CONFIG_WEBP 0
+#define IMPACK_CONFIG_TIFF 0
+#define IMPACK_CONFIG_BMP 0
+#define IMPACK_CONFIG_JP2K 0
+#define IMPACK_CONFIG_FLIF 0
+#define IMPACK_CONFIG_JXR 0
+#define IMPACK_CONFIG_JPEGLS 0
+#define IMPACK_CONFIG_HEIF 0
+#define IMPACK_CONFIG_AVIF 0
+#define IMPACK_CONFIG_JXL 0
+#define IMPACK_CONFIG_ZLIB 1
+#define IMPACK_CONFIG_ZSTD 0
+#define IMPACK_CONFIG_LZMA 1
+#define IMPACK_CONFIG_BZIP2 1
+#define IMPACK_CONFIG_BROTLI 1
+
+#endif
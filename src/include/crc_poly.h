@@ -0,0 +1,52 @@
+/* This file is part of ImPack2.
+ *
+ * ImPack2 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ImPack2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ImPack2. If not, see <http://www.gnu.org/licenses/>. */
+
+// CRC-64 polynomial arithmetic, shared by src/lib/crc.c and src/gen_crc_tables.c (which is built for the host)
+
+#ifndef __IMPACK_CRC_POLY_H__
+#define __IMPACK_CRC_POLY_H__
+
+#include <stdint.h>
+
+#define CRC_POLY 0xC96C5795D7870F42ULL
+
+/* All polynomials are stored bit-reflected, like the CRC itself: The most
+ * significant bit represents x^0 and the least significant bit x^63. */
+
+// Multiply a polynomial by x, modulo P
+static inline uint64_t crc_mulx(uint64_t val) {
+	
+	if (val & 1) {
+		return (val >> 1) ^ CRC_POLY;
+	}
+	return val >> 1;
+	
+}
+
+// Multiply two polynomials, modulo P
+static inline uint64_t crc_multmodp(uint64_t a, uint64_t b) {
+	
+	uint64_t res = 0;
+	for (uint64_t mask = 1ULL << 63; mask != 0; mask >>= 1) {
+		if (a & mask) {
+			res ^= b;
+		}
+		b = crc_mulx(b);
+	}
+	return res;
+	
+}
+
+#endif
@@ -32,6 +32,8 @@ typedef struct {
 	uint64_t img_width;
 	uint64_t img_height;
 	char *filename_include;
+	uint32_t threads;
+	uint8_t format_version;
 	impack_error_t res;
 } encode_thread_data_t;
 
@@ -20,27 +20,33 @@
 #include <stdio.h>
 #include "impack.h"
 
-impack_error_t impack_read_img_png(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
-impack_error_t impack_read_img_webp(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
-impack_error_t impack_read_img_tiff(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
-impack_error_t impack_read_img_bmp(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
-impack_error_t impack_read_img_jp2k(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
-impack_error_t impack_read_img_flif(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
-impack_error_t impack_read_img_jxr(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
-impack_error_t impack_read_img_jpegls(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
-impack_error_t impack_read_img_heif(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
-impack_error_t impack_read_img_avif(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
-impack_error_t impack_read_img_jxl(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
-impack_error_t impack_write_img_png(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
-impack_error_t impack_write_img_webp(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
-impack_error_t impack_write_img_tiff(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
-impack_error_t impack_write_img_bmp(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
-impack_error_t impack_write_img_jp2k(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
-impack_error_t impack_write_img_flif(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
-impack_error_t impack_write_img_jxr(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
-impack_error_t impack_write_img_jpegls(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
-impack_error_t impack_write_img_heif(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
-impack_error_t impack_write_img_avif(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
-impack_error_t impack_write_img_jxl(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
+impack_error_t impack_read_img_png(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
+impack_error_t impack_read_img_png_rows(impack_io_t *input, uint8_t *magic, impack_img_reader_t *reader);
+impack_error_t impack_read_img_webp(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
+impack_error_t impack_read_img_tiff(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
+impack_error_t impack_read_img_tiff_rows(impack_io_t *input, uint8_t *magic, impack_img_reader_t *reader);
+impack_error_t impack_read_img_bmp(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
+impack_error_t impack_read_img_bmp_rows(impack_io_t *input, uint8_t *magic, impack_img_reader_t *reader);
+impack_error_t impack_read_img_jp2k(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
+impack_error_t impack_read_img_flif(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
+impack_error_t impack_read_img_jxr(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
+impack_error_t impack_read_img_jpegls(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
+impack_error_t impack_read_img_heif(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
+impack_error_t impack_read_img_avif(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
+impack_error_t impack_read_img_jxl(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size);
+impack_error_t impack_write_img_png(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
+impack_error_t impack_write_img_png_rows(impack_io_t *output, impack_row_func_t func_row, void *row_ctx, uint64_t img_width, uint64_t img_height);
+impack_error_t impack_write_img_webp(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
+impack_error_t impack_write_img_tiff(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
+impack_error_t impack_write_img_tiff_rows(impack_io_t *output, impack_row_func_t func_row, void *row_ctx, uint64_t img_width, uint64_t img_height);
+impack_error_t impack_write_img_bmp(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
+impack_error_t impack_write_img_bmp_rows(impack_io_t *output, impack_row_func_t func_row, void *row_ctx, uint64_t img_width, uint64_t img_height);
+impack_error_t impack_write_img_jp2k(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
+impack_error_t impack_write_img_flif(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
+impack_error_t impack_write_img_jxr(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
+impack_error_t impack_write_img_jpegls(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
+impack_error_t impack_write_img_heif(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
+impack_error_t impack_write_img_avif(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
+impack_error_t impack_write_img_jxl(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
 
 #endif
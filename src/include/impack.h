@@ -45,12 +45,29 @@ typedef enum {
 	ERROR_ENCRYPTION_UNKNOWN, // Unknown encryption algorithm
 	ERROR_COMPRESSION_UNAVAILABLE, // Compression not compiled in at all
 	ERROR_COMPRESSION_UNSUPPORTED, // Required compression algorithm not compiled in
-	ERROR_COMPRESSION_UNKNOWN // Unknown compression algorithm
+	ERROR_COMPRESSION_UNKNOWN, // Unknown compression algorithm
+	ERROR_VOLUMES_INCOMPLETE, // Images of a split file are missing, duplicated or from different files
+	ERROR_FORMAT_VERSION_INVALID // Requested format version can not be written (unknown, or volumes outside of impack_encode_volumes())
 } impack_error_t;
 
+#define IMPACK_FORMAT_VERSION_STREAM 0 // All data is compressed and encrypted as one stream (can be decoded by ImPack2 1.5 and older)
+#define IMPACK_FORMAT_VERSION_BLOCKS 1 // Data is split into blocks that are compressed and encrypted independently by multiple threads
+#define IMPACK_FORMAT_VERSION_VOLUMES 2 // Same as IMPACK_FORMAT_VERSION_BLOCKS, but the image is one volume of a file that was split into multiple images (only written by impack_encode_volumes())
+
+#define IMPACK_VOLUME_ID_SIZE 16 // Random ID shared by all volumes of a file
+
+#define IMPACK_BLOCK_SIZE_MIN 65536 // 64 KiB, limits for the block size selected when encoding
+#define IMPACK_BLOCK_SIZE_MAX 67108864 // 64 MiB, also the limit for images that can be decoded (every block in flight needs about twice this much memory)
+
 #define IMPACK_CRYPT_BLOCK_SIZE 16 // 128 bits
 #define IMPACK_CRYPT_KEY_SIZE 32 // 256 bits
 
+#define IMPACK_ARGON2_ITERATIONS 10 // Default key derivation parameters
+#define IMPACK_ARGON2_MEMORY 131072 // 128 MiB (in KiB)
+#define IMPACK_ARGON2_ITERATIONS_MAX 1000 // Limits for images that can be decoded
+#define IMPACK_ARGON2_MEMORY_MAX 4194304 // 4 GiB
+#define IMPACK_ARGON2_LANES_MAX 255
+
 typedef enum {
 	ENCRYPTION_NONE = 0,
 	ENCRYPTION_AES = 1, // Original variants, PBKDF2
@@ -60,9 +77,27 @@ typedef enum {
 	ENCRYPTION_AES_ARGON2 = 5,
 	ENCRYPTION_CAMELLIA_ARGON2 = 6,
 	ENCRYPTION_SERPENT_ARGON2 = 7,
-	ENCRYPTION_TWOFISH_ARGON2 = 8
+	ENCRYPTION_TWOFISH_ARGON2 = 8,
+	ENCRYPTION_AES_GCM = 9, // Authenticated encryption, PBKDF2 (format version 1 only)
+	ENCRYPTION_CHACHA20_POLY1305 = 10,
+	ENCRYPTION_AES_GCM_ARGON2 = 11,
+	ENCRYPTION_CHACHA20_POLY1305_ARGON2 = 12
 } impack_encryption_type_t;
 
+typedef struct {
+	uint32_t iterations; // Argon2 time cost
+	uint32_t memory; // Argon2 memory cost in KiB
+	uint32_t lanes; // Argon2 parallelism, 0 selects the number of CPU cores
+} impack_kdf_params_t;
+
+typedef struct {
+	impack_encryption_type_t encryption;
+	impack_kdf_params_t kdf_params;
+	uint8_t salt[IMPACK_CRYPT_BLOCK_SIZE]; // Stored in every image, used to derive the master key again when decoding
+	uint8_t master_key[IMPACK_CRYPT_KEY_SIZE];
+	uint8_t passphrase_check[IMPACK_CRYPT_KEY_SIZE]; // Identifies the passphrase the master key was derived from
+} impack_key_cache_t;
+
 typedef enum {
 	COMPRESSION_NONE = 0,
 	COMPRESSION_ZLIB = 1,
@@ -87,15 +122,41 @@ typedef enum {
 	FORMAT_JXL
 } impack_img_format_t;
 
-typedef impack_error_t (*impack_read_img_func_t)(FILE* input_file, uint8_t *magic, uint8_t** pixeldata, uint64_t* pixeldata_size);
-typedef impack_error_t (*impack_write_img_func_t)(FILE* output_file, uint8_t* pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
+// Source or destination for data and images (files, buffers in memory, pipes, etc.)
+typedef struct {
+	void *ctx;
+	int64_t (*func_read)(void *ctx, uint8_t *buf, uint64_t len); // Input only, returns the number of bytes read (0 at the end of the data) or -1 on errors
+	bool (*func_write)(void *ctx, const uint8_t *buf, uint64_t len); // Output only, must write all of buf
+	bool (*func_seek)(void *ctx, uint64_t pos); // Optional (NULL for pipes etc.), jumps to an absolute position
+	bool (*func_size)(void *ctx, uint64_t *size); // Optional, total size of the input, if it is known
+	const uint8_t* (*func_data)(void *ctx, uint64_t *size); // Optional, the whole input if it is in memory already (used instead of copying it, may return NULL)
+	void (*func_close)(void *ctx); // Optional, called when ImPack2 no longer needs the stream (also after errors)
+	uint64_t pos; // Current position, eof and error are set by ImPack2
+	bool eof;
+	bool error;
+} impack_io_t;
+
+typedef impack_error_t (*impack_read_img_func_t)(impack_io_t* input, uint8_t *magic, uint8_t** pixeldata, uint64_t* pixeldata_size);
+typedef impack_error_t (*impack_write_img_func_t)(impack_io_t* output, uint8_t* pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height);
+typedef impack_error_t (*impack_row_func_t)(void *ctx, uint8_t *row); // Provides the next row of an image (img_width * 3 bytes)
+typedef impack_error_t (*impack_write_img_rows_func_t)(impack_io_t* output, impack_row_func_t func_row, void *row_ctx, uint64_t img_width, uint64_t img_height);
+typedef struct {
+	void *ctx;
+	impack_row_func_t func_row; // Reads the next row
+	void (*func_close)(void *ctx); // Frees ctx and everything else used by the reader
+	uint64_t img_width;
+	uint64_t img_height;
+} impack_img_reader_t;
+typedef impack_error_t (*impack_read_img_rows_func_t)(impack_io_t* input, uint8_t *magic, impack_img_reader_t *reader);
 typedef struct {
 	impack_img_format_t id;
 	char *name; // Name displayed in CLI/GUI
 	char *extension; // Default file extension (format "*.ext" used for GTK)
 	const char **extension_alt; // Alternative file extensions for format auto-detection from filename
 	impack_read_img_func_t func_read;
+	impack_read_img_rows_func_t func_read_rows; // Optional, opens the image to read it row by row without having all pixels in memory
 	impack_write_img_func_t func_write;
+	impack_write_img_rows_func_t func_write_rows; // Optional, writes the image row by row without having all pixels in memory
 	const uint8_t *magic; // Magic number + length for format auto-detection
 	int magic_len;
 	int magic_offset;
@@ -112,6 +173,7 @@ typedef struct {
 	impack_compress_func_generic_t func_write;
 	impack_compress_func_generic_t func_flush;
 	impack_compress_func_generic_t func_level_valid;
+	impack_compress_func_generic_t func_reset; // Optional, prepares the state for a new stream without allocating it again
 } impack_compression_desc_t;
 
 extern const impack_img_format_desc_t *impack_img_formats[];
@@ -123,6 +185,8 @@ typedef enum {
 	CHANNEL_BLUE = 4
 } impack_channel_t;
 
+typedef struct impack_ctx impack_ctx_t; // Buffers and compressor states that are kept between calls, see impack_ctx_new()
+
 typedef struct {
 	uint8_t *pixeldata;
 	uint64_t pixeldata_size;
@@ -133,20 +197,95 @@ typedef struct {
 	uint64_t crc;
 	uint8_t checksum_legacy[64];
 	bool legacy;
+	uint8_t format_version;
+	uint32_t block_size; // Amount of data per block (format version 1)
+	uint32_t volume_number; // Position of this image in a set of volumes (format version 2, starting at 0)
+	uint32_t volume_count; // Number of volumes the file was split into, 1 for other images
+	uint64_t volume_offset; // Position of the data from this image in the whole file
+	uint64_t volume_total; // Length of the whole file
+	uint8_t volume_id[IMPACK_VOLUME_ID_SIZE];
 	uint8_t crypt_key[IMPACK_CRYPT_KEY_SIZE];
 	uint8_t crypt_iv[IMPACK_CRYPT_BLOCK_SIZE];
 	uint64_t data_length;
 	uint32_t filename_length;
 	char *filename;
+	impack_img_reader_t reader; // Only used if the image is read row by row, pixeldata then holds some of the rows
+	impack_io_t input; // Kept open while the image is read row by row
+	bool input_open;
+	uint64_t pixeldata_offset; // Position of pixeldata[0] in the image
+	uint64_t pixeldata_buffered; // Number of bytes (full rows) in pixeldata
+	impack_ctx_t *ctx; // Context passed to impack_decode_stage1_ctx() or NULL
+	uint32_t threads; // Number of threads used for decompression, decryption and checksums, set to 0 by stage 1 (selects the number of CPU cores), can be changed before stage 3
 } impack_decode_state_t;
 
-impack_error_t impack_encode(char *input_path, char *output_path, impack_encryption_type_t encrypt, char *passphrase, impack_compression_type_t compress, int32_t compress_level, uint8_t channels, uint64_t img_width, uint64_t img_height, impack_img_format_t format, char *filename_include);
+typedef struct { // Options for encoding, impack_encode_params_init() sets the defaults
+	impack_encryption_type_t encrypt;
+	char *passphrase; // Erased after use (not needed with key_cache)
+	const impack_kdf_params_t *kdf_params; // Argon2 parameters (stored in the image), NULL selects the defaults (ignored with IMPACK_FORMAT_VERSION_STREAM)
+	const impack_key_cache_t *key_cache; // Master key from impack_key_cache_init() (encrypt must match, passphrase and kdf_params are ignored), NULL derives a new one from the passphrase
+	impack_compression_type_t compress;
+	int32_t compress_level; // 0 selects the default level
+	uint8_t channels; // CHANNEL_* flags, 0 for grayscale
+	uint64_t img_width; // 0 selects it automatically
+	uint64_t img_height;
+	impack_img_format_t format; // FORMAT_AUTO selects it from the output path (or the default format if there is none)
+	char *filename_include; // Path of the file, only the filename is stored in the image (must be set, must not be empty)
+	uint8_t format_version; // IMPACK_FORMAT_VERSION_STREAM (can be decoded by older versions) or IMPACK_FORMAT_VERSION_BLOCKS (faster with multiple threads, needs ImPack2 1.6 or newer, required for key_cache and authenticated encryption)
+	uint32_t threads; // Number of threads used for compression and checksums, 0 selects the number of CPU cores
+	uint32_t block_size; // Amount of data per block (limited to IMPACK_BLOCK_SIZE_MIN to IMPACK_BLOCK_SIZE_MAX), 0 selects it from the input size and the number of threads (ignored with IMPACK_FORMAT_VERSION_STREAM)
+} impack_encode_params_t;
+
+// No encryption or compression, all channels, automatic image size and format, IMPACK_FORMAT_VERSION_STREAM, automatic threads and block size (filename_include is NULL)
+void impack_encode_params_init(impack_encode_params_t *params);
+impack_error_t impack_encode(char *input_path, char *output_path, const impack_encode_params_t *params);
+// Same as impack_encode(), but buffers and compressor states are taken from (and kept in) ctx
+impack_error_t impack_encode_ctx(impack_ctx_t *ctx, char *input_path, char *output_path, const impack_encode_params_t *params);
+// Same as impack_encode_ctx() (ctx may be NULL), but the data is taken from input and the image is returned in *output (from malloc(), only set on success)
+impack_error_t impack_encode_mem(impack_ctx_t *ctx, const uint8_t *input, uint64_t input_size, uint8_t **output, uint64_t *output_size, const impack_encode_params_t *params);
+// Same as impack_encode_ctx() (ctx may be NULL), but the data is read from input and the image is written to output, both are closed at the end
+impack_error_t impack_encode_io(impack_ctx_t *ctx, impack_io_t *input, impack_io_t *output, const impack_encode_params_t *params);
+// Split the input (must be a regular file) into volume_count images, one for each path in output_paths, which are encoded at the same time
+// The threads are split between the volumes, the other parameters are the same as for impack_encode() (format_version is ignored, always uses format version 2)
+impack_error_t impack_encode_volumes(char *input_path, char **output_paths, uint32_t volume_count, const impack_encode_params_t *params);
+// Derive a master key once, so that multiple files can be encrypted with the same passphrase without repeating the expensive key derivation (erases the passphrase)
+impack_error_t impack_key_cache_init(impack_key_cache_t *cache, impack_encryption_type_t encrypt, char *passphrase, const impack_kdf_params_t *kdf_params);
+void impack_key_cache_free(impack_key_cache_t *cache);
 // Decode stage 1: Load the image and check if the content is encrypted (may ask for the passphrase after this)
 impack_error_t impack_decode_stage1(impack_decode_state_t *state, char *input_path);
+// Same as impack_decode_stage1(), stage 2 and 3 then also use ctx
+impack_error_t impack_decode_stage1_ctx(impack_ctx_t *ctx, impack_decode_state_t *state, char *input_path);
+// Same as impack_decode_stage1_ctx() (ctx may be NULL), but the image is read from input (must stay valid until stage 3 or impack_decode_free())
+impack_error_t impack_decode_stage1_mem(impack_ctx_t *ctx, impack_decode_state_t *state, const uint8_t *input, uint64_t input_size);
+// Same as impack_decode_stage1_ctx() (ctx may be NULL), but the image is read from input (used until stage 3 or impack_decode_free())
+impack_error_t impack_decode_stage1_io(impack_ctx_t *ctx, impack_decode_state_t *state, impack_io_t *input);
 // Decode stage 2: Extract the included filename (select final output path after this)
 impack_error_t impack_decode_stage2(impack_decode_state_t *state, char *passphrase);
+// Same as impack_decode_stage2(), but the master key is taken from key_cache if the image is from the same session and passphrase (the cache must start zeroed)
+// A newly derived key only replaces the cached one after the passphrase has been verified, free the cache with impack_key_cache_free()
+impack_error_t impack_decode_stage2_cache(impack_decode_state_t *state, char *passphrase, impack_key_cache_t *key_cache);
 // Decode stage 3: Extract and save the actual content
 impack_error_t impack_decode_stage3(impack_decode_state_t *state, char *output_path);
+// Same as impack_decode_stage3(), but the content is written to output (closed at the end)
+impack_error_t impack_decode_stage3_io(impack_decode_state_t *state, impack_io_t *output);
+// Same as impack_decode_stage3(), but the content is returned in *output (from malloc(), only set on success)
+impack_error_t impack_decode_stage3_mem(impack_decode_state_t *state, uint8_t **output, uint64_t *output_size);
+// Same as impack_decode_stage3(), but only length bytes starting at offset are extracted (less if the data ends before that)
+// Only the blocks containing the range are decoded, images with IMPACK_FORMAT_VERSION_STREAM still need to decode everything before it
+impack_error_t impack_decode_range(impack_decode_state_t *state, uint64_t offset, uint64_t length, char *output_path);
+impack_error_t impack_decode_range_io(impack_decode_state_t *state, uint64_t offset, uint64_t length, impack_io_t *output);
+// All decode stages at once from memory (passphrase is only used if the image is encrypted), *filename receives the included filename (from malloc(), NULL-terminated) if filename isn't NULL
+impack_error_t impack_decode_mem(impack_ctx_t *ctx, const uint8_t *input, uint64_t input_size, char *passphrase, uint8_t **output, uint64_t *output_size, char **filename);
+// Decode all volumes from impack_encode_volumes() (in any order) into one file at the same time, the included filename is appended if output_path is a directory
+// passphrase is only used if the images are encrypted (the key is derived once for all of them)
+// threads: Split between the volumes, 0 selects the number of CPU cores
+impack_error_t impack_decode_volumes(char **input_paths, uint32_t volume_count, char *passphrase, char *output_path, uint32_t threads);
+// Free the input image if decoding is stopped after stage 1 or 2 (stages do this on their own if they fail)
+void impack_decode_free(impack_decode_state_t *state);
+
+// A context speeds up processing many (small) files by keeping buffers and compressor states between calls
+// Each context must only be used by one call at a time, use one context per thread
+impack_ctx_t* impack_ctx_new();
+void impack_ctx_free(impack_ctx_t *ctx);
 
 // Helpers to select things depending on what's compiled in
 impack_img_format_t impack_select_img_format(char *name, bool fileextension);
@@ -155,7 +294,9 @@ impack_compression_type_t impack_select_compression(char *name);
 impack_compression_type_t impack_default_compression();
 impack_encryption_type_t impack_select_encryption(char *name, bool force_pbkdf2);
 impack_encryption_type_t impack_default_encryption(bool force_pbkdf2);
+bool impack_encryption_authenticated(impack_encryption_type_t type); // Authenticated encryption types can't be used with IMPACK_FORMAT_VERSION_STREAM
 
 bool impack_compress_level_valid(impack_compression_type_t type, int32_t level);
+bool impack_kdf_params_valid(const impack_kdf_params_t *params);
 
 #endif
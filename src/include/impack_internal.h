@@ -25,12 +25,28 @@
 #ifdef IMPACK_WITH_CRYPTO
 #include <nettle/aes.h>
 #include <nettle/camellia.h>
+#include <nettle/chacha-poly1305.h>
+#include <nettle/gcm.h>
 #include <nettle/serpent.h>
 #include <nettle/twofish.h>
 #endif
 #include "impack.h"
 
-#define IMPACK_FORMAT_VERSION 0
+#define IMPACK_FORMAT_VERSION IMPACK_FORMAT_VERSION_VOLUMES // Latest format version, images with a higher version number can't be decoded
+
+#define IMPACK_BLOCK_SIZE 4194304 // 4 MiB, amount of data per block (format version 1) if the input size is unknown
+#define IMPACK_BLOCK_SIZE_AUTO_MIN 1048576 // 1 MiB, limits for the block size selected from the input size
+#define IMPACK_BLOCK_SIZE_AUTO_MAX 8388608 // 8 MiB
+
+#define IMPACK_CHUNK_SIZE 1048576 // 1 MiB, amount of data passed to the compression libraries and read or written at once
+#define IMPACK_MEMORY_FRACTION 4 // Blocks in flight may use up to 1/4 of the physical memory
+
+#define IMPACK_COMPRESSION_TYPE_COUNT (COMPRESSION_BROTLI + 1) // Size of tables indexed by impack_compression_type_t
+#define IMPACK_IMG_FORMAT_COUNT (FORMAT_JXL + 1) // Size of tables indexed by impack_img_format_t
+
+#define IMPACK_CRYPT_NONCE_SIZE 12 // 96 bits, for authenticated encryption
+#define IMPACK_CRYPT_TAG_SIZE 16 // 128 bits
+#define IMPACK_BLOCK_ENTRY_MAX (12 + IMPACK_CRYPT_BLOCK_SIZE) // Largest entry in the block index
 
 #define IMPACK_MAGIC_NUMBER { 73, 109, 80, 50 } // ASCII string "ImP2"
 
@@ -41,24 +57,39 @@ typedef enum {
 	COMPRESSION_RES_ERROR
 } impack_compression_result_t;
 
+typedef enum {
+	CRC_IMPL_BYTEWISE, // One table lookup per byte
+	CRC_IMPL_SLICE, // Slicing-by-16
+	CRC_IMPL_CLMUL // Carry-less multiplication (PCLMULQDQ/PMULL), the remaining bytes use slicing
+} impack_crc_impl_t;
+
 #ifdef IMPACK_WITH_CRYPTO
 typedef struct {
 	struct aes256_ctx aes;
 	struct camellia256_ctx camellia;
 	struct serpent_ctx serpent;
 	struct twofish_ctx twofish;
+	struct gcm_aes256_ctx gcm_aes;
+	struct chacha_poly1305_ctx chacha_poly1305;
 	uint8_t iv[IMPACK_CRYPT_BLOCK_SIZE];
 } impack_crypt_ctx_t;
+
+typedef enum {
+	NONCE_BLOCK = 0,
+	NONCE_BLOCK_LAST = 1, // Marks the end of the data, so that removing blocks can be detected
+	NONCE_FILENAME = 2
+} impack_nonce_type_t;
 #endif
 
 typedef struct {
 	void *lib_object;
 	impack_compression_type_t type;
+	const impack_compression_desc_t *desc; // Set by impack_compress_init() from type
 	int32_t level;
+	uint32_t threads; // Number of worker threads, only used by libraries that support multi-threaded compression
 	bool is_compress;
-	uint8_t *input_buf;
-	uint8_t *output_buf;
-	uint64_t bufsize;
+	bool output_pending; // The caller's output buffer is only partly filled, the next call continues there
+	uint64_t bufsize; // Size of the caller's output buffers
 } impack_compress_state_t;
 
 typedef bool (*impack_compress_func_init_t)(impack_compress_state_t* state);
@@ -67,6 +98,70 @@ typedef impack_compression_result_t (*impack_compress_func_read_t)(impack_compre
 typedef void (*impack_compress_func_write_t)(impack_compress_state_t* state, uint8_t* buf, uint64_t len);
 typedef impack_compression_result_t (*impack_compress_func_flush_t)(impack_compress_state_t* state, uint8_t* buf, uint64_t* lenout);
 typedef bool (*impack_compress_func_level_valid_t)(int32_t level);
+typedef bool (*impack_compress_func_reset_t)(impack_compress_state_t* state);
+typedef void (*impack_parallel_func_t)(void *item);
+typedef struct impack_workers impack_workers_t; // Threads that are kept running for many calls to impack_workers_run()
+typedef bool (*impack_pipeline_produce_t)(void *ctx, void *item, bool *last); // Fills the next item, returns false if there is none (end of the data or an error)
+typedef bool (*impack_pipeline_consume_t)(void *ctx, void *item); // Returns false to stop the pipeline
+
+typedef struct {
+	uint8_t *pixeldata;
+	uint64_t row_size;
+	uint64_t row;
+} impack_row_buffer_t;
+
+typedef struct {
+	uint8_t *data;
+	uint64_t size;
+	bool borrowed; // Data provided by the stream (memory-mapped file, buffer from the user) instead of a buffer from malloc()
+} impack_filebuf_t;
+
+typedef struct {
+	uint8_t *data;
+	uint64_t size;
+	uint64_t capacity;
+	uint64_t pos;
+} impack_io_buf_t;
+
+typedef struct {
+	impack_encryption_type_t encryption;
+	impack_compression_type_t compression;
+	int32_t compress_level;
+#ifdef IMPACK_WITH_CRYPTO
+	impack_crypt_ctx_t crypt_ctx; // Only holds the key, every block uses its own IV
+#endif
+} impack_block_params_t;
+
+typedef struct {
+	const impack_block_params_t *params;
+	uint8_t *data; // Original data when encoding, stored data when decoding (replaced by the result)
+	uint64_t data_size;
+	uint8_t *tmp;
+	uint64_t tmp_size;
+	uint64_t length; // Length of the original data
+	uint64_t stored_length; // Length of the compressed data, without encryption padding
+	uint64_t crc; // CRC of the original data (not used with authenticated encryption)
+	uint8_t iv[IMPACK_CRYPT_BLOCK_SIZE];
+	uint8_t tag[IMPACK_CRYPT_TAG_SIZE]; // Authentication tag, replaces the CRC and IV
+	uint64_t number; // Position of the block in the image
+	bool last;
+	impack_error_t res;
+	impack_compress_state_t compress_state; // Kept for the next block with the same settings, reset instead of being created again
+	int32_t compress_level; // Level requested when compress_state was created
+	bool compress_ready;
+} impack_block_t;
+
+struct impack_ctx {
+	impack_block_t *blocks; // Block slots, including their buffers and compressor states
+	uint32_t blocks_count;
+	uint8_t *buf; // Buffer for reading/writing data
+	uint64_t buf_size;
+	uint8_t *index; // Block index when encoding
+	uint64_t index_size;
+	uint8_t *pixeldata; // Pixel buffer when encoding, buffered rows when decoding
+	uint64_t pixeldata_size;
+	uint64_t pixeldata_dirty; // Amount of data at the start of pixeldata that may be non-zero
+};
 
 // Get the filename from a path (similar to basename())
 char* impack_filename(char *path);
@@ -75,31 +170,101 @@ uint64_t impack_endian64(uint64_t val);
 uint32_t impack_endian32(uint32_t val);
 uint32_t impack_endian32_le(uint32_t val);
 uint16_t impack_endian16_le(uint16_t val);
+// Store/extract data in the enabled color channels of the pixel data
+uint64_t impack_channels_end(uint64_t pos, uint8_t channels, uint64_t len);
+void impack_channels_store(uint8_t *pixeldata, uint64_t *pos, uint8_t channels, const uint8_t *data, uint64_t len);
+void impack_channels_load(const uint8_t *pixeldata, uint64_t *pos, uint8_t channels, uint8_t *data, uint64_t len);
+uint64_t impack_channels_count(uint64_t pos, uint8_t channels, uint64_t end); // Number of data bytes stored between pos and end
 // CRC-64 calculation
-void impack_crc_init();
 void impack_crc(uint64_t *crc, uint8_t *buf, size_t buflen);
+// Same as impack_crc(), but large buffers are split into slices that are processed by the threads of workers (may be NULL)
+void impack_crc_parallel(uint64_t *crc, uint8_t *buf, size_t buflen, impack_workers_t *workers);
+// CRC of two concatenated blocks of data, given the CRCs of both and the length of the second one
+uint64_t impack_crc_combine(uint64_t crc1, uint64_t crc2, uint64_t len2);
+// Same as impack_crc(), but always uses the given implementation (for testing), returns false if it isn't available on this CPU
+bool impack_crc_impl(impack_crc_impl_t impl, uint64_t *crc, const uint8_t *buf, size_t buflen);
 // Image read/write helpers (with library/format-specific code)
-impack_error_t impack_write_img(char *output_path, FILE *output_file, uint8_t **pixeldata, uint64_t pixeldata_size, uint64_t pixeldata_pos, uint64_t img_width, uint64_t img_height, impack_img_format_t format);
-impack_error_t impack_read_img(FILE *input_file, uint8_t **pixeldata, uint64_t *pixeldata_size);
+impack_error_t impack_img_size(uint64_t pixeldata_pos, uint64_t *img_width, uint64_t *img_height); // Select the image dimensions (0 = automatic) for the given amount of pixel data
+impack_img_format_t impack_output_format(char *output_path, impack_img_format_t format); // Resolves FORMAT_AUTO using the file extension
+const impack_img_format_desc_t* impack_img_format_desc(impack_img_format_t format);
+impack_error_t impack_row_from_buffer(void *ctx, uint8_t *row); // impack_row_func_t that reads from an impack_row_buffer_t
+impack_error_t impack_write_img(impack_io_t *output, uint8_t **pixeldata, uint64_t pixeldata_size, uint64_t pixeldata_pos, uint64_t img_width, uint64_t img_height, impack_img_format_t format);
+impack_error_t impack_read_img(impack_io_t *input, uint8_t **pixeldata, uint64_t *pixeldata_size, impack_img_reader_t *reader); // Opens the image for reading row by row instead, if supported by the format and reader isn't NULL (*pixeldata is NULL then)
+impack_error_t impack_read_img_from_rows(impack_img_reader_t *reader, uint8_t **pixeldata, uint64_t *pixeldata_size); // Reads all rows into one buffer and closes the reader
+// Number of available CPU cores
+uint32_t impack_cpu_count();
+// Physical memory in bytes, 0 if unknown
+uint64_t impack_memory_size();
+// Call func for each of count items (stored in an array with itemsize bytes per item), using up to threads threads
+void impack_parallel(impack_parallel_func_t func, void *items, size_t itemsize, size_t count, uint32_t threads);
+// Same as impack_parallel(), but the threads are started once and reused, for work that is split up again and again (returns NULL for a single thread, which runs everything on the calling thread)
+impack_workers_t* impack_workers_new(uint32_t threads);
+uint32_t impack_workers_count(const impack_workers_t *workers); // Including the calling thread
+void impack_workers_run(impack_workers_t *workers, impack_parallel_func_t func, void *items, size_t itemsize, size_t count);
+void impack_workers_free(impack_workers_t *workers);
+// Pass items through three stages that run at the same time: produce (own thread, in order) -> func (up to threads threads) -> consume (calling thread, in order)
+// The slots items (stored in an array with itemsize bytes per item) are reused as a ring, so at most slots items are in flight
+void impack_pipeline(impack_pipeline_produce_t produce, impack_parallel_func_t func, impack_pipeline_consume_t consume, void *ctx, void *items, size_t itemsize, size_t slots, uint32_t threads);
 // Get secure random data
 bool impack_random(uint8_t *dst, size_t count);
 // Zero-out an area of memory, without the compiler optimizing it out
 void impack_secure_erase(uint8_t *buf, size_t len);
 // Derive a key from a passphrase
-bool impack_derive_key(char *passphrase, uint8_t *keyout, size_t keysize, uint8_t *salt, size_t saltsize, impack_encryption_type_t type);
+bool impack_derive_key(char *passphrase, uint8_t *keyout, size_t keysize, uint8_t *salt, size_t saltsize, impack_encryption_type_t type, const impack_kdf_params_t *kdf_params); // kdf_params is only used with Argon2
 void impack_derive_key_legacy(char *passphrase, uint8_t *keyout, size_t keysize, uint8_t *salt, size_t saltsize);
+void impack_derive_file_key(const uint8_t *master_key, const uint8_t *iv, uint8_t *keyout); // Cheap per-file key (HKDF) from a master key, used by format version 1
+void impack_passphrase_check(const uint8_t *master_key, const char *passphrase, uint8_t *checkout); // Cheap check value (HMAC keyed with the master key) for impack_key_cache_t
+bool impack_key_cache_match(const impack_key_cache_t *cache, impack_encryption_type_t type, const uint8_t *salt, const impack_kdf_params_t *kdf_params, const char *passphrase); // The cached master key belongs to this session and passphrase
 #ifdef IMPACK_WITH_CRYPTO
 void impack_set_encrypt_key(impack_crypt_ctx_t *ctx, uint8_t *key, impack_encryption_type_t type);
 void impack_set_decrypt_key(impack_crypt_ctx_t *ctx, uint8_t *key, impack_encryption_type_t type);
 void impack_encrypt(impack_crypt_ctx_t *ctx, uint8_t *data, uint64_t length, impack_encryption_type_t type);
 void impack_decrypt(impack_crypt_ctx_t *ctx, uint8_t *data, uint64_t length, impack_encryption_type_t type);
+// Authenticated encryption (no padding), decryption returns false if the tag doesn't match
+void impack_encrypt_aead(impack_crypt_ctx_t *ctx, const uint8_t *nonce, uint8_t *data, uint64_t length, uint8_t *tag, impack_encryption_type_t type);
+bool impack_decrypt_aead(impack_crypt_ctx_t *ctx, const uint8_t *nonce, uint8_t *data, uint64_t length, const uint8_t *tag, impack_encryption_type_t type);
+void impack_crypt_nonce(uint8_t *nonce, uint64_t number, impack_nonce_type_t type); // Nonces are never reused because every image has its own key
+bool impack_crypt_argon2(impack_encryption_type_t type); // Key derived using Argon2 instead of PBKDF2
+uint32_t impack_kdf_default_lanes(uint32_t memory); // One lane per CPU core, as far as the memory allows
 #endif
 bool impack_compress_init(impack_compress_state_t *state);
 void impack_compress_free(impack_compress_state_t *state);
+// The libraries work directly on the caller's buffers, nothing is copied
+// read/flush write into buf (bufsize bytes), which must stay the same until a call returns anything but COMPRESSION_RES_AGAIN from read (more input needed)
+// The input from write is used in place and must stay unchanged until read returns COMPRESSION_RES_AGAIN or flush returns COMPRESSION_RES_FINAL
 impack_compression_result_t impack_compress_read(impack_compress_state_t *state, uint8_t *buf, uint64_t *lenout);
 void impack_compress_write(impack_compress_state_t *state, uint8_t *buf, uint64_t len);
 impack_compression_result_t impack_compress_flush(impack_compress_state_t *state, uint8_t *buf, uint64_t *lenout);
-// Load a file into memory, leave some bytes free at the start of the buffer if requested
-impack_error_t impack_loadfile(FILE *f, uint8_t **buf, uint64_t *bufsize, uint64_t skip);
+bool impack_compress_reset(impack_compress_state_t *state); // Returns false if the compression library can't do this (the state must be freed and created again)
+// Process one block of data, encoding: checksum -> compress -> encrypt, decoding: decrypt -> decompress -> verify checksum (used with impack_parallel())
+void impack_block_encode(void *item);
+void impack_block_decode(void *item);
+void impack_block_free(impack_block_t *blocks, size_t count);
+uint64_t impack_block_padded_length(const impack_block_params_t *params, uint64_t length); // Length including encryption padding
+uint64_t impack_block_entry_length(const impack_block_params_t *params); // Size of one entry in the block index
+bool impack_block_reserve(uint8_t **buf, uint64_t *size, uint64_t needed); // Grow a buffer geometrically to at least needed bytes
+uint32_t impack_block_slots(uint32_t *threads, uint32_t depth, uint32_t block_size); // Number of blocks in flight (depth per thread), *threads is reduced if they don't fit into the memory budget
+// Contexts (impack_ctx_init()/impack_ctx_clear() are used for temporary contexts on the stack)
+void impack_ctx_init(impack_ctx_t *ctx);
+void impack_ctx_clear(impack_ctx_t *ctx);
+impack_block_t* impack_ctx_blocks(impack_ctx_t *ctx, uint32_t count); // Get at least count block slots, their buffers are kept between calls
+uint8_t* impack_ctx_take_pixeldata(impack_ctx_t *ctx, uint64_t *size); // Zeroed pixel buffer (NULL if there is none), owned by the caller until impack_ctx_keep_pixeldata()
+void impack_ctx_keep_pixeldata(impack_ctx_t *ctx, uint8_t *pixeldata, uint64_t size, uint64_t dirty);
+void impack_ctx_trim(impack_ctx_t *ctx); // Free buffers that are too large to keep after a call
+// Load a whole input into memory (without copying it, if possible), the magic number that was already read from the input is put at the start
+impack_error_t impack_loadfile(impack_io_t *input, const uint8_t *magic, uint64_t magic_len, impack_filebuf_t *buf);
+void impack_unloadfile(impack_filebuf_t *buf);
+// Stream helpers, these keep io->pos, io->eof and io->error up to date
+void impack_io_start(impack_io_t *io); // Resets the position and status of a stream from the user
+uint64_t impack_io_read(impack_io_t *io, uint8_t *buf, uint64_t len); // Reads len bytes, less only at the end of the data or on errors (like fread())
+bool impack_io_write(impack_io_t *io, const uint8_t *buf, uint64_t len);
+bool impack_io_seek(impack_io_t *io, uint64_t pos); // Returns false if the stream can't seek
+void impack_io_close(impack_io_t *io);
+// Streams for files (closed with the stream, memory-mapped if possible), buffers in memory and growing output buffers
+bool impack_io_open_file(impack_io_t *io, FILE *f);
+bool impack_io_open_mem(impack_io_t *io, const uint8_t *data, uint64_t size);
+void impack_io_open_buf(impack_io_t *io, impack_io_buf_t *buf); // The written data is kept in buf, owned by the caller
+bool impack_io_open_slice(impack_io_t *io, impack_io_t *base, uint64_t offset, uint64_t length); // Reads at most length bytes from offset in base (must be able to seek), base is taken over and closed with io
+bool impack_io_open_window(impack_io_t *io, impack_io_t *base, uint64_t offset, uint64_t length); // Only the bytes from offset to offset + length that are written to io are passed on to base (which stays open)
 
 #endif
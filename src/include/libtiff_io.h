@@ -24,16 +24,31 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "impack.h"
+#include "impack_internal.h"
 #include <tiffio.h>
 
 /* Libtiff requires seeking on it's input/output file
- * Since ImPack2 might be working with stdin/stdout, this code emulates
- * file I/O on a buffer in memory */
+ * Images are written directly if the output can seek. Otherwise (and
+ * for reading), since ImPack2 might be working with stdin/stdout, this
+ * code emulates file I/O on a buffer in memory (input data is used in
+ * place instead if the stream provides it, see impack_loadfile()) */
 
-impack_error_t impack_tiff_init_read(FILE *input_file, uint8_t *magic);
-bool impack_tiff_init_write();
-void impack_tiff_finish_read();
-bool impack_tiff_finish_write(FILE *output_file);
+typedef struct { // Passed to TIFFClientOpen() as the client data, one per open image
+	uint8_t *buf;
+	uint64_t bufsize;
+	uint64_t filesize;
+	uint64_t fileoff;
+	bool writing;
+	impack_filebuf_t input; // Only used for reading, buf points to its data
+	impack_io_t *output; // Only used for writing
+	uint64_t output_start; // Position of the image in output
+	bool direct; // Writing directly to output (buf is unused then)
+} impack_tiff_file_t;
+
+impack_error_t impack_tiff_init_read(impack_tiff_file_t *file, impack_io_t *input, uint8_t *magic);
+bool impack_tiff_init_write(impack_tiff_file_t *file, impack_io_t *output);
+void impack_tiff_finish_read(impack_tiff_file_t *file);
+bool impack_tiff_finish_write(impack_tiff_file_t *file, bool ok); // Copies the buffer to the output and frees it (if the image was built in memory), ok is false to discard the image after errors
 tsize_t impack_tiff_read(thandle_t data, tdata_t buf, tsize_t len);
 tsize_t impack_tiff_write(thandle_t data, tdata_t buf, tsize_t len);
 toff_t impack_tiff_seek(thandle_t data, toff_t offset, int whence);
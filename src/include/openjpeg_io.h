@@ -29,7 +29,7 @@
    Openjpeg wants a seekable stream and ImPack2 might be working on stdin/stdout */
 
 extern impack_error_t impack_opj_stream_write_errno;
-opj_stream_t *impack_create_opj_stream(FILE *f, bool is_input);
+opj_stream_t *impack_create_opj_stream(impack_io_t *io, bool is_input);
 
 #endif
 #endif
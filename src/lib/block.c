@@ -0,0 +1,324 @@
+/* This file is part of ImPack2.
+ *
+ * ImPack2 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ImPack2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ImPack2. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "config.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "impack.h"
+#include "impack_internal.h"
+
+bool impack_block_reserve(uint8_t **buf, uint64_t *size, uint64_t needed) {
+	
+	if (needed <= *size) {
+		return true;
+	}
+	uint64_t newsize = *size * 2;
+	if (newsize < needed) {
+		newsize = needed;
+	}
+	uint8_t *newbuf = realloc(*buf, newsize);
+	if (newbuf == NULL) {
+		return false;
+	}
+	*buf = newbuf;
+	*size = newsize;
+	return true;
+	
+}
+
+uint32_t impack_block_slots(uint32_t *threads, uint32_t depth, uint32_t block_size) {
+	
+	uint64_t slots = (uint64_t) *threads * depth;
+	uint64_t budget = impack_memory_size() / IMPACK_MEMORY_FRACTION;
+	if (budget != 0) {
+		uint64_t fit = budget / ((uint64_t) block_size * 2); // Data and temporary buffer
+		if (fit == 0) {
+			fit = 1;
+		}
+		if (slots > fit) {
+			slots = fit;
+		}
+		if (*threads > slots) {
+			*threads = slots;
+		}
+	}
+	return slots;
+	
+}
+
+uint64_t impack_block_padded_length(const impack_block_params_t *params, uint64_t length) {
+	
+	if (params->encryption != ENCRYPTION_NONE && !impack_encryption_authenticated(params->encryption) && length % IMPACK_CRYPT_BLOCK_SIZE != 0) {
+		length += IMPACK_CRYPT_BLOCK_SIZE - (length % IMPACK_CRYPT_BLOCK_SIZE);
+	}
+	return length;
+	
+}
+
+uint64_t impack_block_entry_length(const impack_block_params_t *params) {
+	
+	if (impack_encryption_authenticated(params->encryption)) {
+		return 4 + IMPACK_CRYPT_TAG_SIZE; // Stored length, tag
+	} else if (params->encryption != ENCRYPTION_NONE) {
+		return 12 + IMPACK_CRYPT_BLOCK_SIZE; // Stored length, CRC, IV
+	}
+	return 12;
+	
+}
+
+#ifdef IMPACK_WITH_COMPRESSION
+// Prepare block->compress_state, the state from the previous block is reused if it has the same settings
+static bool block_compress_state(impack_block_t *block, bool is_compress) {
+	
+	impack_compress_state_t *state = &block->compress_state;
+	int32_t level = is_compress ? block->params->compress_level : 0;
+	if (block->compress_ready) {
+		if (state->type == block->params->compression && state->is_compress == is_compress && block->compress_level == level && impack_compress_reset(state)) {
+			return true;
+		}
+		impack_compress_free(state);
+		block->compress_ready = false;
+	}
+	state->type = block->params->compression;
+	state->level = level;
+	state->threads = 1; // Blocks are already processed in parallel
+	state->is_compress = is_compress;
+	state->bufsize = IMPACK_CHUNK_SIZE;
+	if (!impack_compress_init(state)) {
+		return false;
+	}
+	block->compress_level = level;
+	block->compress_ready = true;
+	return true;
+	
+}
+
+// Compress a whole block into block->tmp, leaving enough space for encryption padding
+static impack_error_t block_compress(impack_block_t *block) {
+	
+	if (!block_compress_state(block, true)) {
+		return ERROR_MALLOC;
+	}
+	impack_compress_state_t *state = &block->compress_state;
+	
+	impack_error_t ret = ERROR_MALLOC;
+	uint64_t inpos = 0;
+	uint64_t outpos = 0;
+	bool input_done = false;
+	while (true) {
+		if (!impack_block_reserve(&block->tmp, &block->tmp_size, outpos + IMPACK_CHUNK_SIZE + IMPACK_CRYPT_BLOCK_SIZE)) {
+			goto cleanup;
+		}
+		uint64_t len;
+		if (input_done) {
+			impack_compression_result_t res = impack_compress_flush(state, block->tmp + outpos, &len);
+			if (res == COMPRESSION_RES_ERROR) {
+				goto cleanup;
+			} else if (res == COMPRESSION_RES_FINAL) {
+				outpos += len;
+				break;
+			}
+			outpos += IMPACK_CHUNK_SIZE;
+		} else {
+			impack_compression_result_t res = impack_compress_read(state, block->tmp + outpos, &len);
+			if (res == COMPRESSION_RES_ERROR) {
+				goto cleanup;
+			} else if (res == COMPRESSION_RES_AGAIN) {
+				len = IMPACK_CHUNK_SIZE;
+				if (block->length - inpos < len) {
+					len = block->length - inpos;
+				}
+				impack_compress_write(state, block->data + inpos, len);
+				inpos += len;
+				if (len != IMPACK_CHUNK_SIZE) {
+					input_done = true;
+				}
+			} else {
+				outpos += IMPACK_CHUNK_SIZE;
+			}
+		}
+	}
+	block->stored_length = outpos;
+	ret = ERROR_OK;
+	
+cleanup: // The state is kept for the next block
+	return ret;
+	
+}
+
+// Decompress block->stored_length bytes into block->tmp, the result must have exactly block->length bytes
+static impack_error_t block_decompress(impack_block_t *block) {
+	
+	if (!impack_block_reserve(&block->tmp, &block->tmp_size, block->length + IMPACK_CHUNK_SIZE)) {
+		return ERROR_MALLOC;
+	}
+	if (!block_compress_state(block, false)) {
+		return ERROR_MALLOC;
+	}
+	impack_compress_state_t *state = &block->compress_state;
+	
+	impack_error_t ret = ERROR_INPUT_IMG_INVALID;
+	uint64_t inpos = 0;
+	uint64_t outpos = 0;
+	while (true) {
+		uint64_t len;
+		impack_compression_result_t res = impack_compress_read(state, block->tmp + outpos, &len);
+		if (res == COMPRESSION_RES_ERROR) {
+			goto cleanup;
+		} else if (res == COMPRESSION_RES_AGAIN) {
+			len = IMPACK_CHUNK_SIZE;
+			if (block->stored_length - inpos < len) {
+				len = block->stored_length - inpos;
+			}
+			if (len == 0) { // The decompressor wants more data but we have none
+				goto cleanup;
+			}
+			impack_compress_write(state, block->data + inpos, len);
+			inpos += len;
+		} else {
+			outpos += len;
+			if (outpos > block->length) {
+				goto cleanup;
+			}
+			if (res == COMPRESSION_RES_FINAL) {
+				break;
+			}
+		}
+	}
+	if (outpos == block->length && inpos == block->stored_length) {
+		ret = ERROR_OK;
+	}
+	
+cleanup:
+	return ret;
+	
+}
+#endif
+
+static void block_swap(impack_block_t *block) {
+	
+	uint8_t *buf = block->data;
+	uint64_t size = block->data_size;
+	block->data = block->tmp;
+	block->data_size = block->tmp_size;
+	block->tmp = buf;
+	block->tmp_size = size;
+	
+}
+
+void impack_block_encode(void *item) {
+	
+	impack_block_t *block = item;
+	block->crc = 0;
+	if (!impack_encryption_authenticated(block->params->encryption)) { // Otherwise, the authentication tag replaces the CRC
+		impack_crc(&block->crc, block->data, block->length);
+	}
+	block->stored_length = block->length;
+#ifdef IMPACK_WITH_COMPRESSION
+	if (block->params->compression != COMPRESSION_NONE) {
+		block->res = block_compress(block);
+		if (block->res != ERROR_OK) {
+			return;
+		}
+		block_swap(block);
+	}
+#endif
+#ifdef IMPACK_WITH_CRYPTO
+	if (block->params->encryption != ENCRYPTION_NONE) {
+		impack_crypt_ctx_t ctx;
+		memcpy(&ctx, &block->params->crypt_ctx, sizeof(impack_crypt_ctx_t));
+		if (impack_encryption_authenticated(block->params->encryption)) {
+			uint8_t nonce[IMPACK_CRYPT_NONCE_SIZE];
+			impack_crypt_nonce(nonce, block->number, block->last ? NONCE_BLOCK_LAST : NONCE_BLOCK);
+			impack_encrypt_aead(&ctx, nonce, block->data, block->stored_length, block->tag, block->params->encryption);
+		} else {
+			uint64_t padded_length = impack_block_padded_length(block->params, block->stored_length);
+			memset(block->data + block->stored_length, 0, padded_length - block->stored_length); // The buffers always have room for the padding
+			memcpy(ctx.iv, block->iv, IMPACK_CRYPT_BLOCK_SIZE);
+			impack_encrypt(&ctx, block->data, padded_length, block->params->encryption);
+		}
+		impack_secure_erase((uint8_t*) &ctx, sizeof(impack_crypt_ctx_t));
+	}
+#endif
+	block->res = ERROR_OK;
+	
+}
+
+void impack_block_decode(void *item) {
+	
+	impack_block_t *block = item;
+#ifdef IMPACK_WITH_CRYPTO
+	if (block->params->encryption != ENCRYPTION_NONE) {
+		impack_crypt_ctx_t ctx;
+		memcpy(&ctx, &block->params->crypt_ctx, sizeof(impack_crypt_ctx_t));
+		if (impack_encryption_authenticated(block->params->encryption)) {
+			uint8_t nonce[IMPACK_CRYPT_NONCE_SIZE];
+			impack_crypt_nonce(nonce, block->number, block->last ? NONCE_BLOCK_LAST : NONCE_BLOCK);
+			bool valid = impack_decrypt_aead(&ctx, nonce, block->data, block->stored_length, block->tag, block->params->encryption);
+			impack_secure_erase((uint8_t*) &ctx, sizeof(impack_crypt_ctx_t));
+			if (!valid) {
+				block->res = ERROR_CRC;
+				return;
+			}
+		} else {
+			memcpy(ctx.iv, block->iv, IMPACK_CRYPT_BLOCK_SIZE);
+			impack_decrypt(&ctx, block->data, impack_block_padded_length(block->params, block->stored_length), block->params->encryption);
+			impack_secure_erase((uint8_t*) &ctx, sizeof(impack_crypt_ctx_t));
+		}
+	}
+#endif
+#ifdef IMPACK_WITH_COMPRESSION
+	if (block->params->compression != COMPRESSION_NONE) {
+		block->res = block_decompress(block);
+		if (block->res != ERROR_OK) {
+			return;
+		}
+		block_swap(block);
+	}
+#endif
+	if (impack_encryption_authenticated(block->params->encryption)) { // Already verified using the tag
+		block->res = ERROR_OK;
+		return;
+	}
+	uint64_t crc = 0;
+	impack_crc(&crc, block->data, block->length);
+	if (crc != block->crc) {
+		block->res = ERROR_CRC;
+	} else {
+		block->res = ERROR_OK;
+	}
+	
+}
+
+void impack_block_free(impack_block_t *blocks, size_t count) {
+	
+	if (blocks == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < count; i++) {
+		free(blocks[i].data);
+		free(blocks[i].tmp);
+#ifdef IMPACK_WITH_COMPRESSION
+		if (blocks[i].compress_ready) {
+			impack_compress_free(&blocks[i].compress_state);
+		}
+#endif
+	}
+	free(blocks);
+	
+}
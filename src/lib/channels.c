@@ -0,0 +1,528 @@
+/* This file is part of ImPack2.
+ *
+ * ImPack2 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ImPack2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ImPack2. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "config.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "impack.h"
+#include "impack_internal.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMPACK_CHANNELS_SSSE3
+#include <tmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define IMPACK_CHANNELS_NEON
+#include <arm_neon.h>
+#endif
+
+#define ALL_CHANNELS (CHANNEL_RED | CHANNEL_GREEN | CHANNEL_BLUE)
+
+/* The kernels below always process whole pixels (count pixels starting at px).
+ * Each pixel consumes one data byte per enabled channel (one byte in grayscale
+ * mode), disabled channels are set to 0. */
+
+static int channel_count(uint8_t channels) {
+
+	if (channels == 0) { // Grayscale
+		return 1;
+	}
+	return ((channels & CHANNEL_RED) != 0) + ((channels & CHANNEL_GREEN) != 0) + ((channels & CHANNEL_BLUE) != 0);
+
+}
+
+static void scatter_scalar(uint8_t *px, const uint8_t *data, uint64_t count, uint8_t channels) {
+
+	uint64_t i;
+	switch (channels) {
+		case 0:
+			for (i = 0; i < count; i++) {
+				px[0] = data[i];
+				px[1] = data[i];
+				px[2] = data[i];
+				px += 3;
+			}
+			break;
+		case CHANNEL_RED:
+			for (i = 0; i < count; i++) {
+				px[0] = data[i];
+				px[1] = 0;
+				px[2] = 0;
+				px += 3;
+			}
+			break;
+		case CHANNEL_GREEN:
+			for (i = 0; i < count; i++) {
+				px[0] = 0;
+				px[1] = data[i];
+				px[2] = 0;
+				px += 3;
+			}
+			break;
+		case CHANNEL_BLUE:
+			for (i = 0; i < count; i++) {
+				px[0] = 0;
+				px[1] = 0;
+				px[2] = data[i];
+				px += 3;
+			}
+			break;
+		case CHANNEL_RED | CHANNEL_GREEN:
+			for (i = 0; i < count; i++) {
+				px[0] = data[0];
+				px[1] = data[1];
+				px[2] = 0;
+				px += 3;
+				data += 2;
+			}
+			break;
+		case CHANNEL_RED | CHANNEL_BLUE:
+			for (i = 0; i < count; i++) {
+				px[0] = data[0];
+				px[1] = 0;
+				px[2] = data[1];
+				px += 3;
+				data += 2;
+			}
+			break;
+		case CHANNEL_GREEN | CHANNEL_BLUE:
+			for (i = 0; i < count; i++) {
+				px[0] = 0;
+				px[1] = data[0];
+				px[2] = data[1];
+				px += 3;
+				data += 2;
+			}
+			break;
+		case ALL_CHANNELS:
+			memcpy(px, data, count * 3);
+			break;
+	}
+
+}
+
+static void gather_scalar(uint8_t *data, const uint8_t *px, uint64_t count, uint8_t channels) {
+
+	uint64_t i;
+	switch (channels) {
+		case 0:
+		case CHANNEL_RED:
+			for (i = 0; i < count; i++) {
+				data[i] = px[0];
+				px += 3;
+			}
+			break;
+		case CHANNEL_GREEN:
+			for (i = 0; i < count; i++) {
+				data[i] = px[1];
+				px += 3;
+			}
+			break;
+		case CHANNEL_BLUE:
+			for (i = 0; i < count; i++) {
+				data[i] = px[2];
+				px += 3;
+			}
+			break;
+		case CHANNEL_RED | CHANNEL_GREEN:
+			for (i = 0; i < count; i++) {
+				data[0] = px[0];
+				data[1] = px[1];
+				px += 3;
+				data += 2;
+			}
+			break;
+		case CHANNEL_RED | CHANNEL_BLUE:
+			for (i = 0; i < count; i++) {
+				data[0] = px[0];
+				data[1] = px[2];
+				px += 3;
+				data += 2;
+			}
+			break;
+		case CHANNEL_GREEN | CHANNEL_BLUE:
+			for (i = 0; i < count; i++) {
+				data[0] = px[1];
+				data[1] = px[2];
+				px += 3;
+				data += 2;
+			}
+			break;
+		case ALL_CHANNELS:
+			memcpy(data, px, count * 3);
+			break;
+	}
+
+}
+
+#ifdef IMPACK_CHANNELS_SSSE3
+/* Blocks of 16 pixels (48 bytes, 3 registers) are converted from/to 16 bytes
+ * of data per enabled channel using byte shuffles. The shuffle masks depend on
+ * the channel selection and are built once per call. Index 0x80 produces a
+ * zero byte, which is used for disabled channels and unused source registers. */
+
+static void slot_ranks(uint8_t channels, int rank[3]) {
+
+	int next = 0;
+	for (int slot = 0; slot < 3; slot++) {
+		if (channels == 0) {
+			rank[slot] = 0;
+		} else if (channels & (1 << slot)) {
+			rank[slot] = next;
+			next++;
+		} else {
+			rank[slot] = -1;
+		}
+	}
+
+}
+
+__attribute__((target("ssse3")))
+static void scatter_ssse3(uint8_t *px, const uint8_t *data, uint64_t count, uint8_t channels) {
+
+	int k = channel_count(channels);
+	int rank[3];
+	slot_ranks(channels, rank);
+	uint8_t masks[3][3][16];
+	memset(masks, 0x80, sizeof(masks));
+	for (int o = 0; o < 48; o++) {
+		if (rank[o % 3] >= 0) {
+			int d = (o / 3) * k + rank[o % 3];
+			masks[o / 16][d / 16][o % 16] = d % 16;
+		}
+	}
+	__m128i m[3][3];
+	for (int j = 0; j < 3; j++) {
+		for (int s = 0; s < k; s++) {
+			m[j][s] = _mm_loadu_si128((const __m128i*) masks[j][s]);
+		}
+	}
+
+	uint64_t blocks = count / 16;
+	for (uint64_t i = 0; i < blocks; i++) {
+		__m128i in[3];
+		for (int s = 0; s < k; s++) {
+			in[s] = _mm_loadu_si128((const __m128i*) (data + (s * 16)));
+		}
+		for (int j = 0; j < 3; j++) {
+			__m128i out = _mm_shuffle_epi8(in[0], m[j][0]);
+			for (int s = 1; s < k; s++) {
+				out = _mm_or_si128(out, _mm_shuffle_epi8(in[s], m[j][s]));
+			}
+			_mm_storeu_si128((__m128i*) (px + (j * 16)), out);
+		}
+		data += k * 16;
+		px += 48;
+	}
+	scatter_scalar(px, data, count % 16, channels);
+
+}
+
+__attribute__((target("ssse3")))
+static void gather_ssse3(uint8_t *data, const uint8_t *px, uint64_t count, uint8_t channels) {
+
+	int k = channel_count(channels);
+	int slot_of_rank[3];
+	int next = 0;
+	for (int slot = 0; slot < 3; slot++) {
+		if (channels & (1 << slot)) {
+			slot_of_rank[next] = slot;
+			next++;
+		}
+	}
+	uint8_t masks[3][3][16];
+	memset(masks, 0x80, sizeof(masks));
+	for (int d = 0; d < k * 16; d++) {
+		int o = (d / k) * 3 + slot_of_rank[d % k];
+		masks[d / 16][o / 16][d % 16] = o % 16;
+	}
+	__m128i m[3][3];
+	for (int s = 0; s < k; s++) {
+		for (int j = 0; j < 3; j++) {
+			m[s][j] = _mm_loadu_si128((const __m128i*) masks[s][j]);
+		}
+	}
+
+	uint64_t blocks = count / 16;
+	for (uint64_t i = 0; i < blocks; i++) {
+		__m128i in0 = _mm_loadu_si128((const __m128i*) px);
+		__m128i in1 = _mm_loadu_si128((const __m128i*) (px + 16));
+		__m128i in2 = _mm_loadu_si128((const __m128i*) (px + 32));
+		for (int s = 0; s < k; s++) {
+			__m128i out = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in0, m[s][0]), _mm_shuffle_epi8(in1, m[s][1])), _mm_shuffle_epi8(in2, m[s][2]));
+			_mm_storeu_si128((__m128i*) (data + (s * 16)), out);
+		}
+		data += k * 16;
+		px += 48;
+	}
+	gather_scalar(data, px, count % 16, channels);
+
+}
+#endif
+
+#ifdef IMPACK_CHANNELS_NEON
+// NEON can (de)interleave RGB triplets directly while loading/storing
+static void scatter_neon(uint8_t *px, const uint8_t *data, uint64_t count, uint8_t channels) {
+
+	uint64_t blocks = count / 16;
+	uint8x16_t zero = vdupq_n_u8(0);
+	for (uint64_t i = 0; i < blocks; i++) {
+		uint8x16x3_t out;
+		out.val[0] = zero;
+		out.val[1] = zero;
+		out.val[2] = zero;
+		switch (channels) {
+			case 0:
+				out.val[0] = vld1q_u8(data);
+				out.val[1] = out.val[0];
+				out.val[2] = out.val[0];
+				break;
+			case CHANNEL_RED:
+			case CHANNEL_GREEN:
+			case CHANNEL_BLUE:
+				out.val[channels >> 1] = vld1q_u8(data);
+				break;
+			case CHANNEL_RED | CHANNEL_GREEN: {
+				uint8x16x2_t in = vld2q_u8(data);
+				out.val[0] = in.val[0];
+				out.val[1] = in.val[1];
+				break;
+			}
+			case CHANNEL_RED | CHANNEL_BLUE: {
+				uint8x16x2_t in = vld2q_u8(data);
+				out.val[0] = in.val[0];
+				out.val[2] = in.val[1];
+				break;
+			}
+			case CHANNEL_GREEN | CHANNEL_BLUE: {
+				uint8x16x2_t in = vld2q_u8(data);
+				out.val[1] = in.val[0];
+				out.val[2] = in.val[1];
+				break;
+			}
+			case ALL_CHANNELS:
+				out = vld3q_u8(data);
+				break;
+		}
+		vst3q_u8(px, out);
+		data += channel_count(channels) * 16;
+		px += 48;
+	}
+	scatter_scalar(px, data, count % 16, channels);
+
+}
+
+static void gather_neon(uint8_t *data, const uint8_t *px, uint64_t count, uint8_t channels) {
+
+	uint64_t blocks = count / 16;
+	for (uint64_t i = 0; i < blocks; i++) {
+		uint8x16x3_t in = vld3q_u8(px);
+		switch (channels) {
+			case 0:
+			case CHANNEL_RED:
+			case CHANNEL_GREEN:
+			case CHANNEL_BLUE:
+				vst1q_u8(data, in.val[channels >> 1]);
+				break;
+			case CHANNEL_RED | CHANNEL_GREEN: {
+				uint8x16x2_t out = { { in.val[0], in.val[1] } };
+				vst2q_u8(data, out);
+				break;
+			}
+			case CHANNEL_RED | CHANNEL_BLUE: {
+				uint8x16x2_t out = { { in.val[0], in.val[2] } };
+				vst2q_u8(data, out);
+				break;
+			}
+			case CHANNEL_GREEN | CHANNEL_BLUE: {
+				uint8x16x2_t out = { { in.val[1], in.val[2] } };
+				vst2q_u8(data, out);
+				break;
+			}
+			case ALL_CHANNELS:
+				vst3q_u8(data, in);
+				break;
+		}
+		data += channel_count(channels) * 16;
+		px += 48;
+	}
+	gather_scalar(data, px, count % 16, channels);
+
+}
+#endif
+
+static void scatter(uint8_t *px, const uint8_t *data, uint64_t count, uint8_t channels) {
+
+	if (channels == ALL_CHANNELS) {
+		memcpy(px, data, count * 3);
+		return;
+	}
+#if defined(IMPACK_CHANNELS_SSSE3)
+	if (count >= 16 && __builtin_cpu_supports("ssse3")) {
+		scatter_ssse3(px, data, count, channels);
+		return;
+	}
+#elif defined(IMPACK_CHANNELS_NEON)
+	scatter_neon(px, data, count, channels);
+	return;
+#endif
+	scatter_scalar(px, data, count, channels);
+
+}
+
+static void gather(uint8_t *data, const uint8_t *px, uint64_t count, uint8_t channels) {
+
+	if (channels == ALL_CHANNELS) {
+		memcpy(data, px, count * 3);
+		return;
+	}
+#if defined(IMPACK_CHANNELS_SSSE3)
+	if (count >= 16 && __builtin_cpu_supports("ssse3")) {
+		gather_ssse3(data, px, count, channels);
+		return;
+	}
+#elif defined(IMPACK_CHANNELS_NEON)
+	gather_neon(data, px, count, channels);
+	return;
+#endif
+	gather_scalar(data, px, count, channels);
+
+}
+
+uint64_t impack_channels_end(uint64_t pos, uint8_t channels, uint64_t len) {
+
+	if (len == 0) {
+		return pos;
+	}
+	if (channels == 0) {
+		return pos + (len * 3);
+	}
+	while (pos % 3 != 0) { // Partially used pixel
+		if (channels & (1 << (pos % 3))) {
+			len--;
+			if (len == 0) {
+				return pos + 1;
+			}
+		}
+		pos++;
+	}
+	int k = channel_count(channels);
+	uint64_t full = (len - 1) / k;
+	pos += full * 3;
+	len -= full * k;
+	for (int slot = 0; ; slot++) {
+		if (channels & (1 << slot)) {
+			len--;
+			if (len == 0) {
+				return pos + slot + 1;
+			}
+		}
+	}
+
+}
+
+uint64_t impack_channels_count(uint64_t pos, uint8_t channels, uint64_t end) {
+
+	if (channels == 0) {
+		return (end - pos) / 3;
+	}
+	uint64_t count = 0;
+	while (pos < end && pos % 3 != 0) {
+		if (channels & (1 << (pos % 3))) {
+			count++;
+		}
+		pos++;
+	}
+	uint64_t full = (end - pos) / 3;
+	count += full * channel_count(channels);
+	pos += full * 3;
+	while (pos < end) {
+		if (channels & (1 << (pos % 3))) {
+			count++;
+		}
+		pos++;
+	}
+	return count;
+
+}
+
+/* Partial pixels at the start and the end are handled byte by byte, so *pos
+ * always ends up right after the last byte that was stored/extracted. */
+
+void impack_channels_store(uint8_t *pixeldata, uint64_t *pos, uint8_t channels, const uint8_t *data, uint64_t len) {
+
+	if (channels == 0) { // Grayscale mode, always starts at a full pixel
+		scatter(pixeldata + *pos, data, len, 0);
+		*pos += len * 3;
+		return;
+	}
+	while (len > 0 && *pos % 3 != 0) {
+		if (channels & (1 << (*pos % 3))) {
+			pixeldata[*pos] = *data;
+			data++;
+			len--;
+		}
+		(*pos)++;
+	}
+	int k = channel_count(channels);
+	uint64_t count = len / k;
+	if (count > 0 && count * k == len) {
+		count--;
+	}
+	scatter(pixeldata + *pos, data, count, channels);
+	*pos += count * 3;
+	data += count * k;
+	len -= count * k;
+	while (len > 0) {
+		if (channels & (1 << (*pos % 3))) {
+			pixeldata[*pos] = *data;
+			data++;
+			len--;
+		}
+		(*pos)++;
+	}
+
+}
+
+void impack_channels_load(const uint8_t *pixeldata, uint64_t *pos, uint8_t channels, uint8_t *data, uint64_t len) {
+
+	while (len > 0 && *pos % 3 != 0) {
+		if (channels & (1 << (*pos % 3))) {
+			*data = pixeldata[*pos];
+			data++;
+			len--;
+		}
+		(*pos)++;
+	}
+	int k = channel_count(channels);
+	uint64_t count = len / k;
+	if (count > 0 && count * k == len) {
+		count--;
+	}
+	gather(data, pixeldata + *pos, count, channels);
+	*pos += count * 3;
+	data += count * k;
+	len -= count * k;
+	while (len > 0) {
+		if (channels & (1 << (*pos % 3))) {
+			*data = pixeldata[*pos];
+			data++;
+			len--;
+		}
+		(*pos)++;
+	}
+
+}
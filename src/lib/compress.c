@@ -32,7 +32,8 @@ const impack_compression_desc_t impack_compression_zlib = {
 	(impack_compress_func_generic_t) impack_compress_read_zlib,
 	(impack_compress_func_generic_t) impack_compress_write_zlib,
 	(impack_compress_func_generic_t) impack_compress_flush_zlib,
-	(impack_compress_func_generic_t) impack_compress_level_valid_zlib
+	(impack_compress_func_generic_t) impack_compress_level_valid_zlib,
+	(impack_compress_func_generic_t) impack_compress_reset_zlib
 };
 #endif
 
@@ -45,7 +46,8 @@ const impack_compression_desc_t impack_compression_zstd = {
 	(impack_compress_func_generic_t) impack_compress_read_zstd,
 	(impack_compress_func_generic_t) impack_compress_write_zstd,
 	(impack_compress_func_generic_t) impack_compress_flush_zstd,
-	(impack_compress_func_generic_t) impack_compress_level_valid_zstd
+	(impack_compress_func_generic_t) impack_compress_level_valid_zstd,
+	(impack_compress_func_generic_t) impack_compress_reset_zstd
 };
 #endif
 
@@ -58,7 +60,8 @@ const impack_compression_desc_t impack_compression_lzma = {
 	(impack_compress_func_generic_t) impack_compress_read_lzma,
 	(impack_compress_func_generic_t) impack_compress_write_lzma,
 	(impack_compress_func_generic_t) impack_compress_flush_lzma,
-	(impack_compress_func_generic_t) impack_compress_level_valid_lzma
+	(impack_compress_func_generic_t) impack_compress_level_valid_lzma,
+	(impack_compress_func_generic_t) impack_compress_reset_lzma
 };
 #endif
 
@@ -71,7 +74,8 @@ const impack_compression_desc_t impack_compression_bzip2 = {
 	(impack_compress_func_generic_t) impack_compress_read_bzip2,
 	(impack_compress_func_generic_t) impack_compress_write_bzip2,
 	(impack_compress_func_generic_t) impack_compress_flush_bzip2,
-	(impack_compress_func_generic_t) impack_compress_level_valid_bzip2
+	(impack_compress_func_generic_t) impack_compress_level_valid_bzip2,
+	NULL
 };
 #endif
 
@@ -84,7 +88,8 @@ const impack_compression_desc_t impack_compression_brotli = {
 	(impack_compress_func_generic_t) impack_compress_read_brotli,
 	(impack_compress_func_generic_t) impack_compress_write_brotli,
 	(impack_compress_func_generic_t) impack_compress_flush_brotli,
-	(impack_compress_func_generic_t) impack_compress_level_valid_brotli
+	(impack_compress_func_generic_t) impack_compress_level_valid_brotli,
+	NULL
 };
 #endif
 
@@ -107,83 +112,77 @@ const impack_compression_desc_t *impack_compression_types[] = {
 	NULL
 };
 
-bool impack_compress_init(impack_compress_state_t *state) {
+// Same types, indexed by impack_compression_type_t (NULL for types that aren't compiled in)
+static const impack_compression_desc_t *compression_types_by_id[IMPACK_COMPRESSION_TYPE_COUNT] = {
+#ifdef IMPACK_WITH_ZLIB
+	[COMPRESSION_ZLIB] = &impack_compression_zlib,
+#endif
+#ifdef IMPACK_WITH_ZSTD
+	[COMPRESSION_ZSTD] = &impack_compression_zstd,
+#endif
+#ifdef IMPACK_WITH_LZMA
+	[COMPRESSION_LZMA] = &impack_compression_lzma,
+#endif
+#ifdef IMPACK_WITH_BZIP2
+	[COMPRESSION_BZIP2] = &impack_compression_bzip2,
+#endif
+#ifdef IMPACK_WITH_BROTLI
+	[COMPRESSION_BROTLI] = &impack_compression_brotli,
+#endif
+};
+
+static const impack_compression_desc_t* compression_desc(impack_compression_type_t type) {
 	
-	int i = 0;
-	while (impack_compression_types[i] != NULL) {
-		if (impack_compression_types[i]->id == state->type) {
-			return ((impack_compress_func_init_t) impack_compression_types[i]->func_init)(state);
-		}
-		i++;
+	if ((unsigned int) type >= IMPACK_COMPRESSION_TYPE_COUNT || compression_types_by_id[type] == NULL) {
+		abort(); // Requested a type that isn't compiled in
 	}
-	abort();
+	return compression_types_by_id[type];
+	
+}
+
+bool impack_compress_init(impack_compress_state_t *state) {
+	
+	state->desc = compression_desc(state->type); // Looked up once, the other functions are called for every chunk of data
+	return ((impack_compress_func_init_t) state->desc->func_init)(state);
 	
 }
 
 void impack_compress_free(impack_compress_state_t *state) {
 	
-	int i = 0;
-	while (impack_compression_types[i] != NULL) {
-		if (impack_compression_types[i]->id == state->type) {
-			((impack_compress_func_free_t) impack_compression_types[i]->func_free)(state);
-			return;
-		}
-		i++;
-	}
-	abort();
+	((impack_compress_func_free_t) state->desc->func_free)(state);
 	
 }
 
 impack_compression_result_t impack_compress_read(impack_compress_state_t *state, uint8_t *buf, uint64_t *lenout) {
 	
-	int i = 0;
-	while (impack_compression_types[i] != NULL) {
-		if (impack_compression_types[i]->id == state->type) {
-			return ((impack_compress_func_read_t) impack_compression_types[i]->func_read)(state, buf, lenout);
-		}
-		i++;
-	}
-	abort();
+	return ((impack_compress_func_read_t) state->desc->func_read)(state, buf, lenout);
 	
 }
 
 void impack_compress_write(impack_compress_state_t *state, uint8_t *buf, uint64_t len) {
 	
-	int i = 0;
-	while (impack_compression_types[i] != NULL) {
-		if (impack_compression_types[i]->id == state->type) {
-			((impack_compress_func_write_t) impack_compression_types[i]->func_write)(state, buf, len);
-			return;
-		}
-		i++;
-	}
-	abort();
+	((impack_compress_func_write_t) state->desc->func_write)(state, buf, len);
 	
 }
 
 impack_compression_result_t impack_compress_flush(impack_compress_state_t *state, uint8_t *buf, uint64_t *lenout) {
 	
-	int i = 0;
-	while (impack_compression_types[i] != NULL) {
-		if (impack_compression_types[i]->id == state->type) {
-			return ((impack_compress_func_flush_t) impack_compression_types[i]->func_flush)(state, buf, lenout);
-		}
-		i++;
+	return ((impack_compress_func_flush_t) state->desc->func_flush)(state, buf, lenout);
+	
+}
+
+bool impack_compress_reset(impack_compress_state_t *state) {
+	
+	if (state->desc->func_reset == NULL) {
+		return false;
 	}
-	abort();
+	return ((impack_compress_func_reset_t) state->desc->func_reset)(state);
 	
 }
 
 bool impack_compress_level_valid(impack_compression_type_t type, int32_t level) {
 	
-	int i = 0;
-	while (impack_compression_types[i] != NULL) {
-		if (impack_compression_types[i]->id == type) {
-			return ((impack_compress_func_level_valid_t) impack_compression_types[i]->func_level_valid)(level);
-		}
-		i++;
-	}
-	abort();
+	return ((impack_compress_func_level_valid_t) compression_desc(type)->func_level_valid)(level);
 	
 }
 
@@ -21,7 +21,6 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <string.h>
 #include <brotli/decode.h>
 #include <brotli/encode.h>
 #include "impack_internal.h"
@@ -53,19 +52,11 @@ bool impack_compress_init_brotli(impack_compress_state_t *state) {
 	if (strm == NULL) {
 		return ERROR_MALLOC;
 	}
-	state->output_buf = NULL;
-	state->input_buf = malloc(state->bufsize);
-	if (state->input_buf == NULL) {
-		goto cleanup;
-	}
-	state->output_buf = malloc(state->bufsize);
-	if (state->output_buf == NULL) {
-		goto cleanup;
-	}
-	strm->next_in = state->input_buf;
-	strm->next_out = state->output_buf;
+	state->output_pending = false;
+	strm->next_in = NULL;
+	strm->next_out = NULL;
 	strm->avail_in = 0;
-	strm->avail_out = state->bufsize;
+	strm->avail_out = 0;
 	
 	if (state->is_compress) {
 		strm->enc = BrotliEncoderCreateInstance((brotli_alloc_func) impack_brotli_malloc, impack_brotli_free, NULL);
@@ -87,12 +78,6 @@ bool impack_compress_init_brotli(impack_compress_state_t *state) {
 	
 cleanup:
 	free(strm);
-	if (state->input_buf != NULL) {
-		free(state->input_buf);
-	}
-	if (state->output_buf != NULL) {
-		free(state->output_buf);
-	}
 	return false;
 	
 }
@@ -105,15 +90,25 @@ void impack_compress_free_brotli(impack_compress_state_t *state) {
 	} else {
 		BrotliDecoderDestroyInstance(strm->dec);
 	}
-	free(state->input_buf);
-	free(state->output_buf);
 	free(strm);
 	
 }
 
+// Start filling a new output buffer, unless the last one isn't full yet
+static void brotli_output(impack_compress_state_t *state, impack_brotli_state_t *strm, uint8_t *buf) {
+	
+	if (!state->output_pending) {
+		strm->next_out = buf;
+		strm->avail_out = state->bufsize;
+		state->output_pending = true;
+	}
+	
+}
+
 impack_compression_result_t impack_compress_read_brotli(impack_compress_state_t *state, uint8_t *buf, uint64_t *lenout) {
 	
 	impack_brotli_state_t *strm = (impack_brotli_state_t*) state->lib_object;
+	brotli_output(state, strm, buf);
 	size_t dummy = 0;
 	if (state->is_compress) {
 		BrotliEncoderCompressStream(strm->enc, BROTLI_OPERATION_PROCESS, &strm->avail_in, (const uint8_t**) &strm->next_in, &strm->avail_out, &strm->next_out, &dummy);
@@ -130,10 +125,8 @@ impack_compression_result_t impack_compress_read_brotli(impack_compress_state_t
 		}
 	}
 	if (strm->avail_out == 0 || final) {
-		memcpy(buf, state->output_buf, state->bufsize - strm->avail_out);
 		*lenout = state->bufsize - strm->avail_out;
-		strm->next_out = state->output_buf;
-		strm->avail_out = state->bufsize;
+		state->output_pending = false;
 		if (final) {
 			return COMPRESSION_RES_FINAL;
 		} else {
@@ -148,8 +141,7 @@ impack_compression_result_t impack_compress_read_brotli(impack_compress_state_t
 void impack_compress_write_brotli(impack_compress_state_t *state, uint8_t *buf, uint64_t len) {
 	
 	impack_brotli_state_t *strm = (impack_brotli_state_t*) state->lib_object;
-	memcpy(state->input_buf, buf, len);
-	strm->next_in = state->input_buf;
+	strm->next_in = buf;
 	strm->avail_in = len;
 	
 }
@@ -157,16 +149,18 @@ void impack_compress_write_brotli(impack_compress_state_t *state, uint8_t *buf,
 impack_compression_result_t impack_compress_flush_brotli(impack_compress_state_t *state, uint8_t *buf, uint64_t *lenout) {
 	
 	impack_brotli_state_t *strm = (impack_brotli_state_t*) state->lib_object;
+	brotli_output(state, strm, buf);
 	size_t dummy = 0;
-	BrotliEncoderCompressStream(strm->enc, BROTLI_OPERATION_FINISH, &strm->avail_in, (const uint8_t**) &strm->next_in, &strm->avail_out, &strm->next_out, &dummy);
+	do { // The buffer must be full when returning COMPRESSION_RES_AGAIN
+		if (!BrotliEncoderCompressStream(strm->enc, BROTLI_OPERATION_FINISH, &strm->avail_in, (const uint8_t**) &strm->next_in, &strm->avail_out, &strm->next_out, &dummy)) {
+			return COMPRESSION_RES_ERROR;
+		}
+	} while (strm->avail_out != 0 && !BrotliEncoderIsFinished(strm->enc));
+	state->output_pending = false;
 	if (BrotliEncoderIsFinished(strm->enc)) {
-		memcpy(buf, state->output_buf, state->bufsize - strm->avail_out);
 		*lenout = state->bufsize - strm->avail_out;
 		return COMPRESSION_RES_FINAL;
 	} else {
-		memcpy(buf, state->output_buf, state->bufsize);
-		strm->next_out = state->output_buf;
-		strm->avail_out = state->bufsize;
 		return COMPRESSION_RES_AGAIN;
 	}
 	
@@ -20,7 +20,6 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <string.h>
 #include "impack_internal.h"
 #include <bzlib.h>
 
@@ -30,19 +29,11 @@ bool impack_compress_init_bzip2(impack_compress_state_t *state) {
 	if (strm == NULL) {
 		return false;
 	}
-	state->output_buf = NULL;
-	state->input_buf = malloc(state->bufsize);
-	if (state->input_buf == NULL) {
-		goto cleanup;
-	}
-	state->output_buf = malloc(state->bufsize);
-	if (state->output_buf == NULL) {
-		goto cleanup;
-	}
-	strm->next_in = (char*) state->input_buf;
-	strm->next_out = (char*) state->output_buf;
+	state->output_pending = false;
+	strm->next_in = NULL;
+	strm->next_out = NULL;
 	strm->avail_in = 0;
-	strm->avail_out = state->bufsize;
+	strm->avail_out = 0;
 	strm->bzalloc = NULL;
 	strm->bzfree = NULL;
 	strm->opaque = NULL;
@@ -60,18 +51,9 @@ bool impack_compress_init_bzip2(impack_compress_state_t *state) {
 	if (res == BZ_OK) {
 		return true;
 	} else {
-		goto cleanup;
-	}
-	
-cleanup:
-	free(strm);
-	if (state->input_buf != NULL) {
-		free(state->input_buf);
-	}
-	if (state->output_buf != NULL) {
-		free(state->output_buf);
+		free(strm);
+		return false;
 	}
-	return false;
 	
 }
 
@@ -83,15 +65,25 @@ void impack_compress_free_bzip2(impack_compress_state_t *state) {
 	} else {
 		BZ2_bzDecompressEnd(strm);
 	}
-	free(state->input_buf);
-	free(state->output_buf);
 	free(strm);
 	
 }
 
+// Start filling a new output buffer, unless the last one isn't full yet
+static void bzip2_output(impack_compress_state_t *state, bz_stream *strm, uint8_t *buf) {
+	
+	if (!state->output_pending) {
+		strm->next_out = (char*) buf;
+		strm->avail_out = state->bufsize;
+		state->output_pending = true;
+	}
+	
+}
+
 impack_compression_result_t impack_compress_read_bzip2(impack_compress_state_t *state, uint8_t *buf, uint64_t *lenout) {
 	
 	bz_stream *strm = (bz_stream*) state->lib_object;
+	bzip2_output(state, strm, buf);
 	int res;
 	if (state->is_compress) {
 		res = BZ2_bzCompress(strm, BZ_RUN);
@@ -103,10 +95,8 @@ impack_compression_result_t impack_compress_read_bzip2(impack_compress_state_t *
 		return COMPRESSION_RES_ERROR;
 	}
 	if (strm->avail_out == 0 || res == BZ_STREAM_END) {
-		memcpy(buf, state->output_buf, state->bufsize - strm->avail_out);
 		*lenout = state->bufsize - strm->avail_out;
-		strm->next_out = (char*) state->output_buf;
-		strm->avail_out = state->bufsize;
+		state->output_pending = false;
 		if (res == BZ_STREAM_END) {
 			return COMPRESSION_RES_FINAL;
 		} else {
@@ -121,8 +111,7 @@ impack_compression_result_t impack_compress_read_bzip2(impack_compress_state_t *
 void impack_compress_write_bzip2(impack_compress_state_t *state, uint8_t *buf, uint64_t len) {
 	
 	bz_stream *strm = (bz_stream*) state->lib_object;
-	memcpy(state->input_buf, buf, len);
-	strm->next_in = (char*) state->input_buf;
+	strm->next_in = (char*) buf;
 	strm->avail_in = len;
 	
 }
@@ -130,15 +119,13 @@ void impack_compress_write_bzip2(impack_compress_state_t *state, uint8_t *buf, u
 impack_compression_result_t impack_compress_flush_bzip2(impack_compress_state_t *state, uint8_t *buf, uint64_t *lenout) {
 	
 	bz_stream *strm = (bz_stream*) state->lib_object;
+	bzip2_output(state, strm, buf);
 	int res = BZ2_bzCompress(strm, BZ_FINISH);
+	state->output_pending = false;
 	if (res == BZ_STREAM_END) {
-		memcpy(buf, state->output_buf, state->bufsize - strm->avail_out);
 		*lenout = state->bufsize - strm->avail_out;
 		return COMPRESSION_RES_FINAL;
 	} else {
-		memcpy(buf, state->output_buf, state->bufsize);
-		strm->next_out = (char*) state->output_buf;
-		strm->avail_out = state->bufsize;
 		return COMPRESSION_RES_AGAIN;
 	}
 	
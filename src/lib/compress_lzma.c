@@ -24,73 +24,88 @@
 #include <lzma.h>
 #include "impack_internal.h"
 
-bool impack_compress_init_lzma(impack_compress_state_t *state) {
+// Set up the encoder or decoder, liblzma reuses the memory if strm was already used before
+static lzma_ret lzma_start(impack_compress_state_t *state, lzma_stream *strm) {
 	
-	lzma_stream *strm = malloc(sizeof(lzma_stream));
-	if (strm == NULL) {
-		return false;
-	}
-	memset(strm, 0, sizeof(lzma_stream));
 	lzma_ret res;
 	if (state->is_compress) {
 		if (state->level == 0) {
 			state->level = LZMA_PRESET_DEFAULT;
 		}
+#if LZMA_VERSION >= 50020002
+		if (state->threads > 1) {
+			lzma_mt mt;
+			memset(&mt, 0, sizeof(lzma_mt));
+			mt.threads = state->threads;
+			mt.preset = state->level;
+			mt.check = LZMA_CHECK_NONE;
+			// Every thread needs its own dictionary and buffers, use less threads if this would take up too much memory
+			uint64_t memlimit = lzma_physmem() / 4;
+			while (mt.threads > 1 && memlimit != 0 && lzma_stream_encoder_mt_memusage(&mt) > memlimit) {
+				mt.threads--;
+			}
+			res = lzma_stream_encoder_mt(strm, &mt);
+		} else {
+			res = lzma_easy_encoder(strm, state->level, LZMA_CHECK_NONE);
+		}
+#else
 		res = lzma_easy_encoder(strm, state->level, LZMA_CHECK_NONE);
+#endif
 	} else {
 		res = lzma_stream_decoder(strm, UINT64_MAX, LZMA_IGNORE_CHECK);
 	}
+	return res;
+	
+}
+
+bool impack_compress_init_lzma(impack_compress_state_t *state) {
+	
+	lzma_stream *strm = malloc(sizeof(lzma_stream));
+	if (strm == NULL) {
+		return false;
+	}
+	memset(strm, 0, sizeof(lzma_stream));
+	lzma_ret res = lzma_start(state, strm);
 	if (res != LZMA_OK) {
 		free(strm);
 		return false;
 	}
-	state->input_buf = malloc(state->bufsize);
-	if (state->input_buf == NULL) {
-		goto cleanup;
-	}
-	state->output_buf = malloc(state->bufsize);
-	if (state->output_buf == NULL) {
-		goto cleanup;
-	}
-	strm->next_in = state->input_buf;
-	strm->next_out = state->output_buf;
-	strm->avail_in = 0;
-	strm->avail_out = state->bufsize;
+	state->output_pending = false;
 	state->lib_object = strm;
 	return true;
 	
-cleanup:
-	lzma_end(strm);
-	free(strm);
-	if (state->input_buf != NULL) {
-		free(state->input_buf);
-	}
-	return false;
-	
 }
 
 void impack_compress_free_lzma(impack_compress_state_t *state) {
 	
 	lzma_stream *strm = (lzma_stream*) state->lib_object;
 	lzma_end(strm);
-	free(state->input_buf);
-	free(state->output_buf);
 	free(strm);
 	
 }
 
+// Start filling a new output buffer, unless the last one isn't full yet
+static void lzma_output(impack_compress_state_t *state, lzma_stream *strm, uint8_t *buf) {
+	
+	if (!state->output_pending) {
+		strm->next_out = buf;
+		strm->avail_out = state->bufsize;
+		state->output_pending = true;
+	}
+	
+}
+
 impack_compression_result_t impack_compress_read_lzma(impack_compress_state_t *state, uint8_t *buf, uint64_t *lenout) {
 	
 	lzma_stream *strm = (lzma_stream*) state->lib_object;
+	lzma_output(state, strm, buf);
 	lzma_ret res = lzma_code(strm, LZMA_RUN);
 	if (res != LZMA_OK && res != LZMA_STREAM_END && res != LZMA_BUF_ERROR) {
 		return COMPRESSION_RES_ERROR;
 	}
 	if (strm->avail_out == 0 || res == LZMA_STREAM_END) {
-		memcpy(buf, state->output_buf, state->bufsize - strm->avail_out);
 		*lenout = state->bufsize - strm->avail_out;
-		strm->next_out = state->output_buf;
-		strm->avail_out = state->bufsize;
+		state->output_pending = false;
 		if (res == LZMA_STREAM_END) {
 			return COMPRESSION_RES_FINAL;
 		} else {
@@ -105,8 +120,7 @@ impack_compression_result_t impack_compress_read_lzma(impack_compress_state_t *s
 void impack_compress_write_lzma(impack_compress_state_t *state, uint8_t *buf, uint64_t len) {
 	
 	lzma_stream *strm = (lzma_stream*) state->lib_object;
-	memcpy(state->input_buf, buf, len);
-	strm->next_in = state->input_buf;
+	strm->next_in = buf;
 	strm->avail_in = len;
 	
 }
@@ -114,19 +128,31 @@ void impack_compress_write_lzma(impack_compress_state_t *state, uint8_t *buf, ui
 impack_compression_result_t impack_compress_flush_lzma(impack_compress_state_t *state, uint8_t *buf, uint64_t *lenout) {
 	
 	lzma_stream *strm = (lzma_stream*) state->lib_object;
-	if (lzma_code(strm, LZMA_FINISH) == LZMA_STREAM_END) {
-		memcpy(buf, state->output_buf, state->bufsize - strm->avail_out);
+	lzma_output(state, strm, buf);
+	lzma_ret res = lzma_code(strm, LZMA_FINISH);
+	state->output_pending = false;
+	if (res == LZMA_STREAM_END) {
 		*lenout = state->bufsize - strm->avail_out;
 		return COMPRESSION_RES_FINAL;
 	} else {
-		memcpy(buf, state->output_buf, state->bufsize);
-		strm->next_out = state->output_buf;
-		strm->avail_out = state->bufsize;
 		return COMPRESSION_RES_AGAIN;
 	}
 	
 }
 
+bool impack_compress_reset_lzma(impack_compress_state_t *state) {
+	
+	lzma_stream *strm = (lzma_stream*) state->lib_object;
+	if (lzma_start(state, strm) != LZMA_OK) {
+		return false;
+	}
+	strm->next_in = NULL;
+	strm->avail_in = 0;
+	state->output_pending = false;
+	return true;
+	
+}
+
 bool impack_compress_level_valid_lzma(int32_t level) {
 	
 	return (level <= 9);
@@ -20,7 +20,6 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <string.h>
 #include <zlib.h>
 #include "impack_internal.h"
 
@@ -30,19 +29,11 @@ bool impack_compress_init_zlib(impack_compress_state_t *state) {
 	if (strm == NULL) {
 		return false;
 	}
-	state->output_buf = NULL;
-	state->input_buf = malloc(state->bufsize);
-	if (state->input_buf == NULL) {
-		goto cleanup;
-	}
-	state->output_buf = malloc(state->bufsize);
-	if (state->output_buf == NULL) {
-		goto cleanup;
-	}
-	strm->next_in = state->input_buf;
-	strm->next_out = state->output_buf;
+	state->output_pending = false;
+	strm->next_in = NULL;
+	strm->next_out = NULL;
 	strm->avail_in = 0;
-	strm->avail_out = state->bufsize;
+	strm->avail_out = 0;
 	strm->zalloc = NULL;
 	strm->zfree = NULL;
 	strm->opaque = NULL;
@@ -60,18 +51,9 @@ bool impack_compress_init_zlib(impack_compress_state_t *state) {
 	if (res == Z_OK) {
 		return true;
 	} else {
-		goto cleanup;
-	}
-	
-cleanup:
-	free(strm);
-	if (state->input_buf != NULL) {
-		free(state->input_buf);
-	}
-	if (state->output_buf != NULL) {
-		free(state->output_buf);
+		free(strm);
+		return false;
 	}
-	return false;
 	
 }
 
@@ -83,15 +65,25 @@ void impack_compress_free_zlib(impack_compress_state_t *state) {
 	} else {
 		inflateEnd(strm);
 	}
-	free(state->input_buf);
-	free(state->output_buf);
 	free(strm);
 	
 }
 
+// Start filling a new output buffer, unless the last one isn't full yet
+static void zlib_output(impack_compress_state_t *state, z_stream *strm, uint8_t *buf) {
+	
+	if (!state->output_pending) {
+		strm->next_out = buf;
+		strm->avail_out = state->bufsize;
+		state->output_pending = true;
+	}
+	
+}
+
 impack_compression_result_t impack_compress_read_zlib(impack_compress_state_t *state, uint8_t *buf, uint64_t *lenout) {
 	
 	z_stream *strm = (z_stream*) state->lib_object;
+	zlib_output(state, strm, buf);
 	int res;
 	if (state->is_compress) {
 		res = deflate(strm, Z_NO_FLUSH);
@@ -103,10 +95,8 @@ impack_compression_result_t impack_compress_read_zlib(impack_compress_state_t *s
 		return COMPRESSION_RES_ERROR;
 	}
 	if (strm->avail_out == 0 || res == Z_STREAM_END) {
-		memcpy(buf, state->output_buf, state->bufsize - strm->avail_out);
 		*lenout = state->bufsize - strm->avail_out;
-		strm->next_out = state->output_buf;
-		strm->avail_out = state->bufsize;
+		state->output_pending = false;
 		if (res == Z_STREAM_END) {
 			return COMPRESSION_RES_FINAL;
 		} else {
@@ -121,8 +111,7 @@ impack_compression_result_t impack_compress_read_zlib(impack_compress_state_t *s
 void impack_compress_write_zlib(impack_compress_state_t *state, uint8_t *buf, uint64_t len) {
 	
 	z_stream *strm = (z_stream*) state->lib_object;
-	memcpy(state->input_buf, buf, len);
-	strm->next_in = state->input_buf;
+	strm->next_in = buf;
 	strm->avail_in = len;
 	
 }
@@ -130,20 +119,34 @@ void impack_compress_write_zlib(impack_compress_state_t *state, uint8_t *buf, ui
 impack_compression_result_t impack_compress_flush_zlib(impack_compress_state_t *state, uint8_t *buf, uint64_t *lenout) {
 	
 	z_stream *strm = (z_stream*) state->lib_object;
+	zlib_output(state, strm, buf);
 	int res = deflate(strm, Z_FINISH);
+	state->output_pending = false;
 	if (res == Z_STREAM_END) {
-		memcpy(buf, state->output_buf, state->bufsize - strm->avail_out);
 		*lenout = state->bufsize - strm->avail_out;
 		return COMPRESSION_RES_FINAL;
 	} else {
-		memcpy(buf, state->output_buf, state->bufsize);
-		strm->next_out = state->output_buf;
-		strm->avail_out = state->bufsize;
 		return COMPRESSION_RES_AGAIN;
 	}
 	
 }
 
+bool impack_compress_reset_zlib(impack_compress_state_t *state) {
+	
+	z_stream *strm = (z_stream*) state->lib_object;
+	int res;
+	if (state->is_compress) {
+		res = deflateReset(strm);
+	} else {
+		res = inflateReset(strm);
+	}
+	strm->next_in = NULL;
+	strm->avail_in = 0;
+	state->output_pending = false;
+	return (res == Z_OK);
+	
+}
+
 bool impack_compress_level_valid_zlib(int32_t level) {
 	
 	return (level <= Z_BEST_COMPRESSION);
@@ -21,7 +21,6 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <string.h>
 #include <zstd.h>
 #include "impack_internal.h"
 
@@ -39,30 +38,18 @@ bool impack_compress_init_zstd(impack_compress_state_t *state) {
 		return false;
 	}
 	state->lib_object = zstate;
-	state->input_buf = malloc(state->bufsize);
-	zstate->inbuf.src = state->input_buf;
-	if (zstate->inbuf.src == NULL) {
-		free(zstate);
-		return false;
-	}
-	zstate->inbuf.size = state->bufsize;
-	zstate->inbuf.pos = state->bufsize;
-	state->output_buf = malloc(state->bufsize);
-	zstate->outbuf.dst = state->output_buf;
-	if (zstate->outbuf.dst == NULL) {
-		free((void*) zstate->inbuf.src);
-		free(zstate);
-		return false;
-	}
-	zstate->outbuf.size = state->bufsize;
+	state->output_pending = false;
+	zstate->inbuf.src = NULL;
+	zstate->inbuf.size = 0;
+	zstate->inbuf.pos = 0;
+	zstate->outbuf.dst = NULL;
+	zstate->outbuf.size = 0;
 	zstate->outbuf.pos = 0;
 	zstate->cstrm = NULL;
 	zstate->dstrm = NULL;
 	if (state->is_compress) {
 		zstate->cstrm = ZSTD_createCStream();
 		if (zstate->cstrm == NULL) {
-			free((void*) zstate->inbuf.src);
-			free(zstate->outbuf.dst);
 			free(zstate);
 			return false;
 		}
@@ -70,23 +57,23 @@ bool impack_compress_init_zstd(impack_compress_state_t *state) {
 			state->level = 3; // Default from zstd code
 		}
 		if (ZSTD_isError(ZSTD_initCStream(zstate->cstrm, state->level))) {
-			free((void*) zstate->inbuf.src);
-			free(zstate->outbuf.dst);
 			ZSTD_freeCStream(zstate->cstrm);
 			free(zstate);
 			return false;
 		}
+#if ZSTD_VERSION_NUMBER >= 10400
+		if (state->threads > 1) {
+			// Fails if libzstd was built without multi-threading support, just keep using a single thread in that case
+			ZSTD_CCtx_setParameter(zstate->cstrm, ZSTD_c_nbWorkers, state->threads);
+		}
+#endif
 	} else {
 		zstate->dstrm = ZSTD_createDStream();
 		if (zstate->dstrm == NULL) {
-			free((void*) zstate->inbuf.src);
-			free(zstate->outbuf.dst);
 			free(zstate);
 			return false;
 		}
 		if (ZSTD_isError(ZSTD_initDStream(zstate->dstrm))) {
-			free((void*) zstate->inbuf.src);
-			free(zstate->outbuf.dst);
 			ZSTD_freeDStream(zstate->dstrm);
 			free(zstate);
 			return false;
@@ -99,8 +86,6 @@ bool impack_compress_init_zstd(impack_compress_state_t *state) {
 void impack_compress_free_zstd(impack_compress_state_t *state) {
 	
 	impack_zstd_state_t *zstate = (impack_zstd_state_t*) state->lib_object;
-	free((void*) zstate->inbuf.src);
-	free(zstate->outbuf.dst);
 	if (zstate->cstrm != NULL) {
 		ZSTD_freeCStream(zstate->cstrm);
 	}
@@ -111,18 +96,32 @@ void impack_compress_free_zstd(impack_compress_state_t *state) {
 	
 }
 
+// Start filling a new output buffer, unless the last one isn't full yet
+static void zstd_output(impack_compress_state_t *state, impack_zstd_state_t *zstate, uint8_t *buf) {
+	
+	if (!state->output_pending) {
+		zstate->outbuf.dst = buf;
+		zstate->outbuf.size = state->bufsize;
+		zstate->outbuf.pos = 0;
+		state->output_pending = true;
+	}
+	
+}
+
 impack_compression_result_t impack_compress_read_zstd(impack_compress_state_t *state, uint8_t *buf, uint64_t *lenout) {
 	
 	impack_zstd_state_t *zstate = (impack_zstd_state_t*) state->lib_object;
+	zstd_output(state, zstate, buf);
 	if (state->is_compress) {
-		size_t res = ZSTD_compressStream(zstate->cstrm, &zstate->outbuf, &zstate->inbuf);
-		if (ZSTD_isError(res)) {
-			return COMPRESSION_RES_ERROR;
-		}
+		do { // With worker threads, zstd may return before all input is consumed
+			size_t res = ZSTD_compressStream(zstate->cstrm, &zstate->outbuf, &zstate->inbuf);
+			if (ZSTD_isError(res)) {
+				return COMPRESSION_RES_ERROR;
+			}
+		} while (zstate->inbuf.pos != zstate->inbuf.size && zstate->outbuf.pos != state->bufsize);
 		if (zstate->outbuf.pos == state->bufsize) {
-			memcpy(buf, zstate->outbuf.dst, zstate->outbuf.pos);
 			*lenout = zstate->outbuf.pos;
-			zstate->outbuf.pos = 0;
+			state->output_pending = false;
 			return COMPRESSION_RES_OK;
 		} else {
 			return COMPRESSION_RES_AGAIN;
@@ -133,9 +132,8 @@ impack_compression_result_t impack_compress_read_zstd(impack_compress_state_t *s
 			return COMPRESSION_RES_ERROR;
 		}
 		if (zstate->outbuf.pos == state->bufsize || res == 0) {
-			memcpy(buf, zstate->outbuf.dst, zstate->outbuf.pos);
 			*lenout = zstate->outbuf.pos;
-			zstate->outbuf.pos = 0;
+			state->output_pending = false;
 			if (res == 0) {
 				return COMPRESSION_RES_FINAL;
 			} else {
@@ -151,7 +149,7 @@ impack_compression_result_t impack_compress_read_zstd(impack_compress_state_t *s
 void impack_compress_write_zstd(impack_compress_state_t *state, uint8_t *buf, uint64_t len) {
 	
 	impack_zstd_state_t *zstate = (impack_zstd_state_t*) state->lib_object;
-	memcpy((void*) zstate->inbuf.src, buf, len);
+	zstate->inbuf.src = buf;
 	zstate->inbuf.pos = 0;
 	zstate->inbuf.size = len;
 	
@@ -169,22 +167,36 @@ impack_compression_result_t impack_compress_flush_zstd(impack_compress_state_t *
 		}
 	}
 	
+	zstd_output(state, zstate, buf);
 	size_t res = ZSTD_endStream(zstate->cstrm, &zstate->outbuf);
 	if (ZSTD_isError(res)) {
 		return COMPRESSION_RES_ERROR;
 	}
+	state->output_pending = false;
 	if (res == 0) {
-		memcpy(buf, zstate->outbuf.dst, zstate->outbuf.pos);
 		*lenout = zstate->outbuf.pos;
 		return COMPRESSION_RES_FINAL;
 	} else {
-		memcpy(buf, zstate->outbuf.dst, state->bufsize);
-		zstate->outbuf.pos = 0;
 		return COMPRESSION_RES_AGAIN;
 	}
 	
 }
 
+bool impack_compress_reset_zstd(impack_compress_state_t *state) {
+	
+	impack_zstd_state_t *zstate = (impack_zstd_state_t*) state->lib_object;
+	zstate->inbuf.src = NULL;
+	zstate->inbuf.size = 0;
+	zstate->inbuf.pos = 0;
+	state->output_pending = false;
+	if (state->is_compress) {
+		return !ZSTD_isError(ZSTD_initCStream(zstate->cstrm, state->level)); // Keeps the context and its buffers
+	} else {
+		return !ZSTD_isError(ZSTD_initDStream(zstate->dstrm));
+	}
+	
+}
+
 bool impack_compress_level_valid_zstd(int32_t level) {
 	
 	return (level <= ZSTD_maxCLevel());
@@ -13,36 +13,269 @@
  * You should have received a copy of the GNU General Public License
  * along with ImPack2. If not, see <http://www.gnu.org/licenses/>. */
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include "impack.h"
+#include "impack_internal.h"
 
-#define CRC_POLY 0xC96C5795D7870F42ULL
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMPACK_CRC_CLMUL
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#elif defined(__aarch64__) && !defined(__AARCH64EB__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#define IMPACK_CRC_PMULL
+#include <arm_neon.h>
+#endif
 
-uint64_t crc_table[256];
+#include "crc_poly.h"
+#include "crc_tables_generated.h"
 
-void impack_crc_init() {
+#define CRC_SLICE_MIN 1048576 // 1 MiB, smaller slices aren't worth starting a thread
+
+typedef struct {
+	uint8_t *buf;
+	size_t len;
+	uint64_t crc;
+} crc_job_t;
+
+static inline uint64_t crc_load64(const uint8_t *buf) {
+	
+	return ((uint64_t) buf[0]) | ((uint64_t) buf[1] << 8) | ((uint64_t) buf[2] << 16) | ((uint64_t) buf[3] << 24) | \
+		((uint64_t) buf[4] << 32) | ((uint64_t) buf[5] << 40) | ((uint64_t) buf[6] << 48) | ((uint64_t) buf[7] << 56);
+	
+}
+
+// Classic table-based implementation, one byte per iteration
+static uint64_t crc_bytewise(uint64_t crc, const uint8_t *buf, size_t buflen) {
+	
+	for (size_t i = 0; i < buflen; i++) {
+		crc = crc_table[0][buf[i] ^ (crc & 255)] ^ (crc >> 8);
+	}
+	return crc;
+	
+}
+
+// Table-based implementation, processes 16 bytes per iteration
+static uint64_t crc_slice(uint64_t crc, const uint8_t *buf, size_t buflen) {
+	
+	while (buflen >= 16) {
+		uint64_t a = crc ^ crc_load64(buf);
+		uint64_t b = crc_load64(buf + 8);
+		crc = crc_table[15][a & 255] ^ crc_table[14][(a >> 8) & 255] ^ \
+			crc_table[13][(a >> 16) & 255] ^ crc_table[12][(a >> 24) & 255] ^ \
+			crc_table[11][(a >> 32) & 255] ^ crc_table[10][(a >> 40) & 255] ^ \
+			crc_table[9][(a >> 48) & 255] ^ crc_table[8][a >> 56] ^ \
+			crc_table[7][b & 255] ^ crc_table[6][(b >> 8) & 255] ^ \
+			crc_table[5][(b >> 16) & 255] ^ crc_table[4][(b >> 24) & 255] ^ \
+			crc_table[3][(b >> 32) & 255] ^ crc_table[2][(b >> 40) & 255] ^ \
+			crc_table[1][(b >> 48) & 255] ^ crc_table[0][b >> 56];
+		buf += 16;
+		buflen -= 16;
+	}
+	return crc_bytewise(crc, buf, buflen);
+	
+}
+
+/* Carry-less multiplication: The CRC is XORed into the first block, then
+ * 4 blocks of 128 bits are folded forward in parallel. The remaining block
+ * has the same remainder as all data before it and is reduced using the
+ * tables. buflen needs to be a multiple of 16 and at least 64. */
+
+#ifdef IMPACK_CRC_CLMUL
+__attribute__((target("pclmul,sse2")))
+static inline __m128i crc_fold(__m128i val, __m128i k) {
+	
+	return _mm_xor_si128(_mm_clmulepi64_si128(val, k, 0x00), _mm_clmulepi64_si128(val, k, 0x11));
+	
+}
+
+__attribute__((target("pclmul,sse2")))
+static uint64_t crc_clmul(uint64_t crc, const uint8_t *buf, size_t buflen) {
+	
+	__m128i k512 = _mm_set_epi64x((long long) crc_fold_512[1], (long long) crc_fold_512[0]);
+	__m128i k128 = _mm_set_epi64x((long long) crc_fold_128[1], (long long) crc_fold_128[0]);
+	__m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) buf), _mm_set_epi64x(0, (long long) crc));
+	__m128i x1 = _mm_loadu_si128((const __m128i*) (buf + 16));
+	__m128i x2 = _mm_loadu_si128((const __m128i*) (buf + 32));
+	__m128i x3 = _mm_loadu_si128((const __m128i*) (buf + 48));
+	buf += 64;
+	buflen -= 64;
+	
+	while (buflen >= 64) {
+		x0 = _mm_xor_si128(crc_fold(x0, k512), _mm_loadu_si128((const __m128i*) buf));
+		x1 = _mm_xor_si128(crc_fold(x1, k512), _mm_loadu_si128((const __m128i*) (buf + 16)));
+		x2 = _mm_xor_si128(crc_fold(x2, k512), _mm_loadu_si128((const __m128i*) (buf + 32)));
+		x3 = _mm_xor_si128(crc_fold(x3, k512), _mm_loadu_si128((const __m128i*) (buf + 48)));
+		buf += 64;
+		buflen -= 64;
+	}
+	x0 = _mm_xor_si128(crc_fold(x0, k128), x1);
+	x0 = _mm_xor_si128(crc_fold(x0, k128), x2);
+	x0 = _mm_xor_si128(crc_fold(x0, k128), x3);
+	while (buflen >= 16) {
+		x0 = _mm_xor_si128(crc_fold(x0, k128), _mm_loadu_si128((const __m128i*) buf));
+		buf += 16;
+		buflen -= 16;
+	}
+	
+	uint8_t last[16];
+	_mm_storeu_si128((__m128i*) last, x0);
+	return crc_slice(0, last, 16);
+	
+}
+#endif
+
+#ifdef IMPACK_CRC_PMULL
+static inline uint64x2_t crc_fold(uint64x2_t val, uint64x2_t k) {
+	
+	poly128_t lo = vmull_p64((poly64_t) vgetq_lane_u64(val, 0), (poly64_t) vgetq_lane_u64(k, 0));
+	poly128_t hi = vmull_high_p64(vreinterpretq_p64_u64(val), vreinterpretq_p64_u64(k));
+	return veorq_u64(vreinterpretq_u64_p128(lo), vreinterpretq_u64_p128(hi));
+	
+}
+
+static inline uint64x2_t crc_load128(const uint8_t *buf) {
+	
+	return vreinterpretq_u64_u8(vld1q_u8(buf));
 	
-	for (int i = 0; i < 256; i++) {
-		uint64_t crc = i;
-		for (int j = 0; j < 8; j++) {
-			if (crc & 1) {
-				crc = (crc >> 1) ^ CRC_POLY;
-			} else {
-				crc >>= 1;
+}
+
+static uint64_t crc_clmul(uint64_t crc, const uint8_t *buf, size_t buflen) {
+	
+	uint64x2_t k512 = vcombine_u64(vcreate_u64(crc_fold_512[0]), vcreate_u64(crc_fold_512[1]));
+	uint64x2_t k128 = vcombine_u64(vcreate_u64(crc_fold_128[0]), vcreate_u64(crc_fold_128[1]));
+	uint64x2_t x0 = veorq_u64(crc_load128(buf), vcombine_u64(vcreate_u64(crc), vcreate_u64(0)));
+	uint64x2_t x1 = crc_load128(buf + 16);
+	uint64x2_t x2 = crc_load128(buf + 32);
+	uint64x2_t x3 = crc_load128(buf + 48);
+	buf += 64;
+	buflen -= 64;
+	
+	while (buflen >= 64) {
+		x0 = veorq_u64(crc_fold(x0, k512), crc_load128(buf));
+		x1 = veorq_u64(crc_fold(x1, k512), crc_load128(buf + 16));
+		x2 = veorq_u64(crc_fold(x2, k512), crc_load128(buf + 32));
+		x3 = veorq_u64(crc_fold(x3, k512), crc_load128(buf + 48));
+		buf += 64;
+		buflen -= 64;
+	}
+	x0 = veorq_u64(crc_fold(x0, k128), x1);
+	x0 = veorq_u64(crc_fold(x0, k128), x2);
+	x0 = veorq_u64(crc_fold(x0, k128), x3);
+	while (buflen >= 16) {
+		x0 = veorq_u64(crc_fold(x0, k128), crc_load128(buf));
+		buf += 16;
+		buflen -= 16;
+	}
+	
+	uint8_t last[16];
+	vst1q_u8(last, vreinterpretq_u8_u64(x0));
+	return crc_slice(0, last, 16);
+	
+}
+#endif
+
+void impack_crc(uint64_t *crc, uint8_t *buf, size_t buflen) {
+	
+	uint64_t val = ~(*crc);
+#if defined(IMPACK_CRC_CLMUL) || defined(IMPACK_CRC_PMULL)
+#ifdef IMPACK_CRC_CLMUL
+	if (buflen >= 64 && __builtin_cpu_supports("pclmul")) {
+#else
+	if (buflen >= 64) {
+#endif
+		size_t len = buflen & ~((size_t) 15);
+		val = crc_clmul(val, buf, len);
+		buf += len;
+		buflen -= len;
+	}
+#endif
+	*crc = ~crc_slice(val, buf, buflen);
+	
+}
+
+bool impack_crc_impl(impack_crc_impl_t impl, uint64_t *crc, const uint8_t *buf, size_t buflen) {
+	
+	uint64_t val = ~(*crc);
+	switch (impl) {
+		case CRC_IMPL_BYTEWISE:
+			val = crc_bytewise(val, buf, buflen);
+			break;
+		case CRC_IMPL_SLICE:
+			val = crc_slice(val, buf, buflen);
+			break;
+		case CRC_IMPL_CLMUL:
+#if defined(IMPACK_CRC_CLMUL) || defined(IMPACK_CRC_PMULL)
+#ifdef IMPACK_CRC_CLMUL
+			if (!__builtin_cpu_supports("pclmul")) {
+				return false;
 			}
+#endif
+			if (buflen >= 64) {
+				size_t len = buflen & ~((size_t) 15);
+				val = crc_clmul(val, buf, len);
+				buf += len;
+				buflen -= len;
+			}
+			val = crc_slice(val, buf, buflen);
+			break;
+#else
+			return false;
+#endif
+	}
+	*crc = ~val;
+	return true;
+	
+}
+
+uint64_t impack_crc_combine(uint64_t crc1, uint64_t crc2, uint64_t len2) {
+	
+	// crc1 * x^(8 * len2) + crc2, the inversions cancel out
+	uint64_t xpow = 1ULL << 63;
+	for (int i = 3; len2 != 0; i++) {
+		if (len2 & 1) {
+			xpow = crc_multmodp(crc_x2n[i], xpow);
 		}
-		crc_table[i] = crc;
+		len2 >>= 1;
 	}
+	return crc_multmodp(xpow, crc1) ^ crc2;
 	
 }
 
-void impack_crc(uint64_t *crc, uint8_t *buf, size_t buflen) {
+static void crc_job(void *arg) {
 	
-	*crc = ~(*crc);
-	for (size_t i = 0; i < buflen; i++) {
-		*crc = crc_table[buf[i] ^ (*crc & 255)] ^ (*crc >> 8);
+	crc_job_t *job = arg;
+	job->crc = 0;
+	impack_crc(&job->crc, job->buf, job->len);
+	
+}
+
+void impack_crc_parallel(uint64_t *crc, uint8_t *buf, size_t buflen, impack_workers_t *workers) {
+	
+	size_t count = buflen / CRC_SLICE_MIN;
+	if (count > impack_workers_count(workers)) {
+		count = impack_workers_count(workers);
+	}
+	crc_job_t *jobs = NULL;
+	if (count > 1) {
+		jobs = malloc(sizeof(crc_job_t) * count);
+	}
+	if (jobs == NULL) {
+		impack_crc(crc, buf, buflen);
+		return;
+	}
+	
+	size_t slicelen = buflen / count;
+	for (size_t i = 0; i < count; i++) {
+		jobs[i].buf = buf + (i * slicelen);
+		jobs[i].len = (i == count - 1) ? buflen - (i * slicelen) : slicelen;
+	}
+	impack_workers_run(workers, crc_job, jobs, sizeof(crc_job_t), count);
+	for (size_t i = 0; i < count; i++) {
+		*crc = impack_crc_combine(*crc, jobs[i].crc, jobs[i].len);
 	}
-	*crc = ~(*crc);
+	free(jobs);
 	
 }
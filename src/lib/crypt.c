@@ -27,29 +27,67 @@
 #include <nettle/aes.h>
 #include <nettle/camellia.h>
 #include <nettle/cbc.h>
+#include <nettle/chacha-poly1305.h>
+#include <nettle/gcm.h>
+#include <nettle/hkdf.h>
 #include <nettle/hmac.h>
+#include <nettle/memops.h>
 #include <nettle/pbkdf2.h>
 #include <nettle/serpent.h>
 #include <nettle/twofish.h>
 #include "impack.h"
 #include "impack_internal.h"
 
-#define ARGON2_ITERATIONS 10
-#define ARGON2_MEMORY (1 << 17) // 128 MiB
-#define ARGON2_PARALLEL 1
+#define ARGON2_MEMORY_MIN 8 // Per lane
 #define PBKDF2_ITERATIONS 100000
 
-bool impack_derive_key(char *passphrase, uint8_t *keyout, size_t keysize, uint8_t *salt, size_t saltsize, impack_encryption_type_t type) {
+bool impack_crypt_argon2(impack_encryption_type_t type) {
 	
-	if (type >= ENCRYPTION_AES_ARGON2 && type <= ENCRYPTION_TWOFISH_ARGON2) {
+	return (type >= ENCRYPTION_AES_ARGON2 && type <= ENCRYPTION_TWOFISH_ARGON2) || type == ENCRYPTION_AES_GCM_ARGON2 || type == ENCRYPTION_CHACHA20_POLY1305_ARGON2;
+	
+}
+
+bool impack_kdf_params_valid(const impack_kdf_params_t *params) {
+	
+	if (params->iterations == 0 || params->iterations > IMPACK_ARGON2_ITERATIONS_MAX) {
+		return false;
+	}
+	if (params->lanes > IMPACK_ARGON2_LANES_MAX) {
+		return false;
+	}
+	uint32_t lanes = (params->lanes == 0) ? 1 : params->lanes;
+	return params->memory >= ARGON2_MEMORY_MIN * lanes && params->memory <= IMPACK_ARGON2_MEMORY_MAX;
+	
+}
+
+uint32_t impack_kdf_default_lanes(uint32_t memory) {
+	
+	uint32_t lanes = impack_cpu_count();
+	if (lanes > IMPACK_ARGON2_LANES_MAX) {
+		lanes = IMPACK_ARGON2_LANES_MAX;
+	}
+	if (lanes > memory / ARGON2_MEMORY_MIN) {
+		lanes = memory / ARGON2_MEMORY_MIN;
+	}
+	return (lanes > 0) ? lanes : 1;
+	
+}
+
+bool impack_derive_key(char *passphrase, uint8_t *keyout, size_t keysize, uint8_t *salt, size_t saltsize, impack_encryption_type_t type, const impack_kdf_params_t *kdf_params) {
+	
+	if (impack_crypt_argon2(type)) {
 #ifdef IMPACK_WITH_ARGON2
+		uint32_t threads = impack_cpu_count(); // Lanes are part of the parameters, but they don't need to run on separate threads
+		if (threads > kdf_params->lanes) {
+			threads = kdf_params->lanes;
+		}
 		argon2_context ctx = {
 			keyout, keysize,
 			(uint8_t*) passphrase, strlen(passphrase),
 			salt, saltsize,
 			NULL, 0, // Secret
 			NULL, 0, // AD
-			ARGON2_ITERATIONS, ARGON2_MEMORY, ARGON2_PARALLEL, ARGON2_PARALLEL,
+			kdf_params->iterations, kdf_params->memory, kdf_params->lanes, threads,
 			ARGON2_VERSION_13,
 			NULL, NULL, // Custom memory allocator
 			ARGON2_DEFAULT_FLAGS
@@ -79,6 +117,78 @@ void impack_derive_key_legacy(char *passphrase, uint8_t *keyout, size_t keysize,
 	
 }
 
+impack_error_t impack_key_cache_init(impack_key_cache_t *cache, impack_encryption_type_t encrypt, char *passphrase, const impack_kdf_params_t *kdf_params) {
+	
+	cache->encryption = encrypt;
+	if (kdf_params != NULL) {
+		cache->kdf_params = *kdf_params;
+	} else {
+		cache->kdf_params.iterations = IMPACK_ARGON2_ITERATIONS;
+		cache->kdf_params.memory = IMPACK_ARGON2_MEMORY;
+		cache->kdf_params.lanes = 0;
+	}
+	if (cache->kdf_params.lanes == 0) {
+		cache->kdf_params.lanes = impack_kdf_default_lanes(cache->kdf_params.memory);
+	}
+	impack_error_t ret = ERROR_OK;
+	if (!impack_random(cache->salt, IMPACK_CRYPT_BLOCK_SIZE)) {
+		ret = ERROR_RANDOM;
+	} else if (!impack_derive_key(passphrase, cache->master_key, IMPACK_CRYPT_KEY_SIZE, cache->salt, IMPACK_CRYPT_BLOCK_SIZE, encrypt, &cache->kdf_params)) {
+		ret = ERROR_MALLOC;
+	} else {
+		impack_passphrase_check(cache->master_key, passphrase, cache->passphrase_check);
+	}
+	impack_secure_erase((uint8_t*) passphrase, strlen(passphrase));
+	if (ret != ERROR_OK) {
+		impack_secure_erase(cache->master_key, IMPACK_CRYPT_KEY_SIZE);
+	}
+	return ret;
+	
+}
+
+void impack_passphrase_check(const uint8_t *master_key, const char *passphrase, uint8_t *checkout) {
+	
+	struct hmac_sha256_ctx ctx;
+	hmac_sha256_set_key(&ctx, IMPACK_CRYPT_KEY_SIZE, master_key);
+	hmac_sha256_update(&ctx, strlen(passphrase), (const uint8_t*) passphrase);
+	hmac_sha256_digest(&ctx, IMPACK_CRYPT_KEY_SIZE, checkout);
+	impack_secure_erase((uint8_t*) &ctx, sizeof(struct hmac_sha256_ctx));
+	
+}
+
+bool impack_key_cache_match(const impack_key_cache_t *cache, impack_encryption_type_t type, const uint8_t *salt, const impack_kdf_params_t *kdf_params, const char *passphrase) {
+	
+	if (cache->encryption != type || memcmp(cache->salt, salt, IMPACK_CRYPT_BLOCK_SIZE) != 0 || memcmp(&cache->kdf_params, kdf_params, sizeof(impack_kdf_params_t)) != 0) {
+		return false;
+	}
+	uint8_t check[IMPACK_CRYPT_KEY_SIZE];
+	impack_passphrase_check(cache->master_key, passphrase, check);
+	bool match = memeql_sec(check, cache->passphrase_check, IMPACK_CRYPT_KEY_SIZE);
+	impack_secure_erase(check, IMPACK_CRYPT_KEY_SIZE);
+	return match;
+	
+}
+
+void impack_key_cache_free(impack_key_cache_t *cache) {
+	
+	impack_secure_erase((uint8_t*) cache, sizeof(impack_key_cache_t));
+	
+}
+
+void impack_derive_file_key(const uint8_t *master_key, const uint8_t *iv, uint8_t *keyout) {
+	
+	struct hmac_sha256_ctx ctx;
+	uint8_t prk[SHA256_DIGEST_SIZE];
+	hmac_sha256_set_key(&ctx, IMPACK_CRYPT_BLOCK_SIZE, iv);
+	hkdf_extract(&ctx, (nettle_hash_update_func*) hmac_sha256_update, (nettle_hash_digest_func*) hmac_sha256_digest, SHA256_DIGEST_SIZE, IMPACK_CRYPT_KEY_SIZE, master_key, prk);
+	hmac_sha256_set_key(&ctx, SHA256_DIGEST_SIZE, prk);
+	const char *info = "ImPack2 file key";
+	hkdf_expand(&ctx, (nettle_hash_update_func*) hmac_sha256_update, (nettle_hash_digest_func*) hmac_sha256_digest, SHA256_DIGEST_SIZE, strlen(info), (const uint8_t*) info, IMPACK_CRYPT_KEY_SIZE, keyout);
+	impack_secure_erase(prk, SHA256_DIGEST_SIZE);
+	impack_secure_erase((uint8_t*) &ctx, sizeof(struct hmac_sha256_ctx));
+	
+}
+
 void impack_set_encrypt_key(impack_crypt_ctx_t *ctx, uint8_t *key, impack_encryption_type_t type) {
 	
 	switch (type) {
@@ -98,6 +208,14 @@ void impack_set_encrypt_key(impack_crypt_ctx_t *ctx, uint8_t *key, impack_encryp
 		case ENCRYPTION_TWOFISH_ARGON2:
 			twofish_set_key(&ctx->twofish, IMPACK_CRYPT_KEY_SIZE, key);
 			break;
+		case ENCRYPTION_AES_GCM:
+		case ENCRYPTION_AES_GCM_ARGON2:
+			gcm_aes256_set_key(&ctx->gcm_aes, key);
+			break;
+		case ENCRYPTION_CHACHA20_POLY1305:
+		case ENCRYPTION_CHACHA20_POLY1305_ARGON2:
+			chacha_poly1305_set_key(&ctx->chacha_poly1305, key);
+			break;
 		default:
 			abort();
 	}
@@ -123,6 +241,14 @@ void impack_set_decrypt_key(impack_crypt_ctx_t *ctx, uint8_t *key, impack_encryp
 		case ENCRYPTION_TWOFISH_ARGON2:
 			twofish_set_key(&ctx->twofish, IMPACK_CRYPT_KEY_SIZE, key);
 			break;
+		case ENCRYPTION_AES_GCM:
+		case ENCRYPTION_AES_GCM_ARGON2:
+			gcm_aes256_set_key(&ctx->gcm_aes, key);
+			break;
+		case ENCRYPTION_CHACHA20_POLY1305:
+		case ENCRYPTION_CHACHA20_POLY1305_ARGON2:
+			chacha_poly1305_set_key(&ctx->chacha_poly1305, key);
+			break;
 		default:
 			abort();
 	}
@@ -193,4 +319,57 @@ void impack_decrypt(impack_crypt_ctx_t *ctx, uint8_t *data, uint64_t length, imp
 	
 }
 
+void impack_encrypt_aead(impack_crypt_ctx_t *ctx, const uint8_t *nonce, uint8_t *data, uint64_t length, uint8_t *tag, impack_encryption_type_t type) {
+	
+	switch (type) {
+		case ENCRYPTION_AES_GCM:
+		case ENCRYPTION_AES_GCM_ARGON2:
+			gcm_aes256_set_iv(&ctx->gcm_aes, IMPACK_CRYPT_NONCE_SIZE, nonce);
+			gcm_aes256_encrypt(&ctx->gcm_aes, length, data, data);
+			gcm_aes256_digest(&ctx->gcm_aes, IMPACK_CRYPT_TAG_SIZE, tag);
+			break;
+		case ENCRYPTION_CHACHA20_POLY1305:
+		case ENCRYPTION_CHACHA20_POLY1305_ARGON2:
+			chacha_poly1305_set_nonce(&ctx->chacha_poly1305, nonce);
+			chacha_poly1305_encrypt(&ctx->chacha_poly1305, length, data, data);
+			chacha_poly1305_digest(&ctx->chacha_poly1305, IMPACK_CRYPT_TAG_SIZE, tag);
+			break;
+		default:
+			abort();
+	}
+	
+}
+
+bool impack_decrypt_aead(impack_crypt_ctx_t *ctx, const uint8_t *nonce, uint8_t *data, uint64_t length, const uint8_t *tag, impack_encryption_type_t type) {
+	
+	uint8_t tag_data[IMPACK_CRYPT_TAG_SIZE];
+	switch (type) {
+		case ENCRYPTION_AES_GCM:
+		case ENCRYPTION_AES_GCM_ARGON2:
+			gcm_aes256_set_iv(&ctx->gcm_aes, IMPACK_CRYPT_NONCE_SIZE, nonce);
+			gcm_aes256_decrypt(&ctx->gcm_aes, length, data, data);
+			gcm_aes256_digest(&ctx->gcm_aes, IMPACK_CRYPT_TAG_SIZE, tag_data);
+			break;
+		case ENCRYPTION_CHACHA20_POLY1305:
+		case ENCRYPTION_CHACHA20_POLY1305_ARGON2:
+			chacha_poly1305_set_nonce(&ctx->chacha_poly1305, nonce);
+			chacha_poly1305_decrypt(&ctx->chacha_poly1305, length, data, data);
+			chacha_poly1305_digest(&ctx->chacha_poly1305, IMPACK_CRYPT_TAG_SIZE, tag_data);
+			break;
+		default:
+			abort();
+	}
+	return memeql_sec(tag, tag_data, IMPACK_CRYPT_TAG_SIZE);
+	
+}
+
+void impack_crypt_nonce(uint8_t *nonce, uint64_t number, impack_nonce_type_t type) {
+	
+	uint64_t number_endian = impack_endian64(number);
+	memcpy(nonce, &number_endian, 8);
+	nonce[8] = type;
+	memset(nonce + 9, 0, IMPACK_CRYPT_NONCE_SIZE - 9);
+	
+}
+
 #endif
@@ -0,0 +1,127 @@
+/* This file is part of ImPack2.
+ *
+ * ImPack2 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ImPack2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ImPack2. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "config.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "impack.h"
+#include "impack_internal.h"
+
+#define CTX_KEEP_MAX 33554432 // 32 MiB, larger buffers are freed after each call instead of being kept
+
+impack_ctx_t* impack_ctx_new() {
+	
+	impack_ctx_t *ctx = malloc(sizeof(impack_ctx_t));
+	if (ctx != NULL) {
+		impack_ctx_init(ctx);
+	}
+	return ctx;
+	
+}
+
+void impack_ctx_free(impack_ctx_t *ctx) {
+	
+	if (ctx == NULL) {
+		return;
+	}
+	impack_ctx_clear(ctx);
+	free(ctx);
+	
+}
+
+void impack_ctx_init(impack_ctx_t *ctx) {
+	
+	memset(ctx, 0, sizeof(impack_ctx_t));
+	
+}
+
+void impack_ctx_clear(impack_ctx_t *ctx) {
+	
+	impack_block_free(ctx->blocks, ctx->blocks_count);
+	free(ctx->buf);
+	free(ctx->index);
+	free(ctx->pixeldata);
+	impack_ctx_init(ctx);
+	
+}
+
+impack_block_t* impack_ctx_blocks(impack_ctx_t *ctx, uint32_t count) {
+	
+	if (count <= ctx->blocks_count) {
+		return ctx->blocks;
+	}
+	impack_block_t *newblocks = realloc(ctx->blocks, sizeof(impack_block_t) * count);
+	if (newblocks == NULL) {
+		return NULL;
+	}
+	memset(newblocks + ctx->blocks_count, 0, sizeof(impack_block_t) * (count - ctx->blocks_count));
+	ctx->blocks = newblocks;
+	ctx->blocks_count = count;
+	return newblocks;
+	
+}
+
+uint8_t* impack_ctx_take_pixeldata(impack_ctx_t *ctx, uint64_t *size) {
+	
+	uint8_t *pixeldata = ctx->pixeldata;
+	if (pixeldata != NULL) {
+		memset(pixeldata, 0, ctx->pixeldata_dirty); // Only this part needs to be cleared, the rest is still zero
+		*size = ctx->pixeldata_size;
+		ctx->pixeldata = NULL;
+		ctx->pixeldata_size = 0;
+		ctx->pixeldata_dirty = 0;
+	}
+	return pixeldata;
+	
+}
+
+void impack_ctx_keep_pixeldata(impack_ctx_t *ctx, uint8_t *pixeldata, uint64_t size, uint64_t dirty) {
+	
+	free(ctx->pixeldata);
+	ctx->pixeldata = pixeldata;
+	ctx->pixeldata_size = size;
+	ctx->pixeldata_dirty = (dirty < size) ? dirty : size;
+	
+}
+
+static void trim_buf(uint8_t **buf, uint64_t *size) {
+	
+	if (*size > CTX_KEEP_MAX) {
+		free(*buf);
+		*buf = NULL;
+		*size = 0;
+	}
+	
+}
+
+void impack_ctx_trim(impack_ctx_t *ctx) {
+	
+	for (uint32_t i = 0; i < ctx->blocks_count; i++) {
+		trim_buf(&ctx->blocks[i].data, &ctx->blocks[i].data_size);
+		trim_buf(&ctx->blocks[i].tmp, &ctx->blocks[i].tmp_size);
+	}
+	trim_buf(&ctx->buf, &ctx->buf_size);
+	trim_buf(&ctx->index, &ctx->index_size);
+	if (ctx->pixeldata_size > CTX_KEEP_MAX) {
+		free(ctx->pixeldata);
+		ctx->pixeldata = NULL;
+		ctx->pixeldata_size = 0;
+		ctx->pixeldata_dirty = 0;
+	}
+	
+}
@@ -27,58 +27,160 @@
 #include "impack.h"
 #include "impack_internal.h"
 
-#define BUFSIZE 16384 // 16 KiB
+#define BUFSIZE_UNCOMPRESSED 16777216 // 16 MiB, large enough to checksum with multiple threads
+
+#define PIXELBUF_WINDOW 4194304 // 4 MiB, amount of rows buffered when reading an image row by row
+#define DECODE_PIPELINE_DEPTH 2 // Blocks in flight per thread, so reading and writing overlap with decoding
+
+static uint64_t pixelbuf_window_rows(uint64_t row_size) {
+	
+	uint64_t rows = PIXELBUF_WINDOW / row_size;
+	if (rows == 0) {
+		rows = 1;
+	}
+	return rows;
+	
+}
+
+// Replace the buffered rows with the next ones from the image
+static bool pixelbuf_fill(impack_decode_state_t *state) {
+	
+	uint64_t row_size = state->reader.img_width * 3;
+	uint64_t end = state->pixeldata_offset + state->pixeldata_buffered;
+	if (end >= state->pixeldata_size) {
+		return false;
+	}
+	uint64_t rows = (state->pixeldata_size - end) / row_size;
+	if (rows > pixelbuf_window_rows(row_size)) {
+		rows = pixelbuf_window_rows(row_size);
+	}
+	state->pixeldata_offset = end;
+	state->pixeldata_buffered = 0;
+	for (uint64_t i = 0; i < rows; i++) {
+		if (state->reader.func_row(state->reader.ctx, state->pixeldata + (i * row_size)) != ERROR_OK) {
+			return false;
+		}
+		state->pixeldata_buffered += row_size;
+	}
+	return true;
+	
+}
 
 bool pixelbuf_read(impack_decode_state_t *state, uint8_t *buf, uint64_t len) {
 	
+	if (impack_channels_end(state->pixeldata_pos, state->channels, len) > state->pixeldata_size) {
+		return false;
+	}
+	if (state->reader.func_row == NULL) {
+		impack_channels_load(state->pixeldata, &state->pixeldata_pos, state->channels, buf, len);
+		return true;
+	}
+	
 	while (len > 0) {
-		if (state->pixeldata_pos == state->pixeldata_size) {
-			return false;
+		uint64_t window_end = state->pixeldata_offset + state->pixeldata_buffered;
+		if (state->pixeldata_pos >= window_end) {
+			if (!pixelbuf_fill(state)) {
+				return false;
+			}
+			continue;
+		}
+		uint64_t count = impack_channels_count(state->pixeldata_pos, state->channels, window_end);
+		if (count == 0) { // Only unused channels left in the buffered rows
+			state->pixeldata_pos = window_end;
+			continue;
 		}
-		if (((state->pixeldata_pos % 3) == 0 && (state->channels & CHANNEL_RED)) || \
-			(((state->pixeldata_pos % 3) == 1) && (state->channels & CHANNEL_GREEN)) || \
-			(((state->pixeldata_pos % 3) == 2) && (state->channels & CHANNEL_BLUE))) {
-			*buf = (state->pixeldata)[state->pixeldata_pos];
-			buf++;
-			len--;
+		if (count > len) {
+			count = len;
 		}
-		state->pixeldata_pos++;
+		uint64_t pos = state->pixeldata_pos - state->pixeldata_offset; // Rows always start at a full pixel, so the channel positions stay the same
+		impack_channels_load(state->pixeldata, &pos, state->channels, buf, count);
+		state->pixeldata_pos = state->pixeldata_offset + pos;
+		buf += count;
+		len -= count;
 	}
 	return true;
 	
 }
 
-impack_error_t impack_decode_stage1(impack_decode_state_t *state, char *input_path) {
+// Move past len bytes of data without loading them (rows from an image that is read row by row still need to be read)
+static bool pixelbuf_skip(impack_decode_state_t *state, uint64_t len) {
 	
-	FILE *input_file;
-	if (strlen(input_path) == 1 && input_path[0] == '-') {
-		input_file = stdin;
-	} else {
-		input_file = fopen(input_path, "rb+"); // Need to request write access to detect if the file is a directory
-		if (input_file == NULL && errno != EISDIR) {
-			input_file = fopen(input_path, "rb"); // Not a directory, try without requesting write access (in case we don't have write permissions)
-		}
-		if (input_file == NULL) {
-			if (errno == ENOENT) {
-				return ERROR_INPUT_NOT_FOUND;
-			} else if (errno == EACCES) {
-				return ERROR_INPUT_PERMISSION;
-			} else if (errno == EISDIR) {
-				return ERROR_INPUT_DIRECTORY;
-			} else {
-				return ERROR_INPUT_IO;
+	uint64_t end = impack_channels_end(state->pixeldata_pos, state->channels, len);
+	if (end > state->pixeldata_size) {
+		return false;
+	}
+	if (state->reader.func_row != NULL) {
+		while (end > state->pixeldata_offset + state->pixeldata_buffered) {
+			if (!pixelbuf_fill(state)) {
+				return false;
 			}
 		}
 	}
+	state->pixeldata_pos = end;
+	return true;
+	
+}
+
+void impack_decode_free(impack_decode_state_t *state) {
+	
+	if (state->ctx == NULL || state->pixeldata != state->ctx->pixeldata) { // Otherwise, the buffer stays in the context
+		free(state->pixeldata);
+	}
+	state->pixeldata = NULL;
+	if (state->reader.func_row != NULL) {
+		state->reader.func_close(state->reader.ctx);
+		state->reader.func_row = NULL;
+	}
+	if (state->input_open) {
+		impack_io_close(&state->input);
+		state->input_open = false;
+	}
+	
+}
+
+// Read the image from state->input and check the header, the input is closed when it's no longer needed
+static impack_error_t decode_stage1_file(impack_ctx_t *ctx, impack_decode_state_t *state) {
 	
-	impack_error_t res = impack_read_img(input_file, &state->pixeldata, &state->pixeldata_size);
+	state->input_open = true;
+	impack_error_t res = impack_read_img(&state->input, &state->pixeldata, &state->pixeldata_size, &state->reader);
 	state->pixeldata_pos = 0;
-	fclose(input_file);
 	if (res != ERROR_OK) {
+		impack_io_close(&state->input);
+		state->input_open = false;
 		return res;
 	}
 	
-	impack_error_t ret = ERROR_INPUT_IMG_INVALID;
+	impack_error_t ret = ERROR_MALLOC;
+	if (state->reader.func_row != NULL) { // Keep the input open, rows are read while decoding
+		uint64_t row_size = state->reader.img_width * 3;
+		state->pixeldata_size = row_size * state->reader.img_height;
+		state->pixeldata_offset = 0;
+		state->pixeldata_buffered = 0;
+		if (state->pixeldata_size != 0) {
+			uint64_t window_size = pixelbuf_window_rows(row_size) * row_size;
+			if (ctx != NULL) { // Reuse the buffer from the context
+				if (!impack_block_reserve(&ctx->pixeldata, &ctx->pixeldata_size, window_size)) {
+					goto cleanup;
+				}
+				ctx->pixeldata_dirty = ctx->pixeldata_size;
+				state->pixeldata = ctx->pixeldata;
+			} else {
+				state->pixeldata = malloc(window_size);
+			}
+			if (state->pixeldata == NULL) {
+				goto cleanup;
+			}
+			ret = ERROR_INPUT_IMG_INVALID;
+			if (!pixelbuf_fill(state)) {
+				goto cleanup;
+			}
+		}
+	} else {
+		impack_io_close(&state->input);
+		state->input_open = false;
+	}
+	
+	ret = ERROR_INPUT_IMG_INVALID;
 	if (state->pixeldata_size < 3) {
 		goto cleanup;
 	}
@@ -109,6 +211,7 @@ impack_error_t impack_decode_stage1(impack_decode_state_t *state, char *input_pa
 		goto cleanup;
 	}
 	state->legacy = false;
+	state->format_version = 0;
 	if (magic_buf[3] != magic[3]) {
 		if (magic_buf[3] == 97) { // 'a', could be a legacy file
 			if (!pixelbuf_read(state, magic_buf, 2)) {
@@ -135,9 +238,11 @@ impack_error_t impack_decode_stage1(impack_decode_state_t *state, char *input_pa
 		if (!pixelbuf_read(state, flags, 3)) {
 			goto cleanup;
 		}
-		if (flags[0] != 0) { // Version number
+		if (flags[0] > IMPACK_FORMAT_VERSION) {
+			ret = ERROR_INPUT_IMG_VERSION;
 			goto cleanup;
 		}
+		state->format_version = flags[0];
 		state->encryption = flags[1];
 		state->compression = flags[2];
 	} else {
@@ -161,12 +266,15 @@ impack_error_t impack_decode_stage1(impack_decode_state_t *state, char *input_pa
 	}
 	
 #ifdef IMPACK_WITH_CRYPTO
-	if (state->encryption > ENCRYPTION_TWOFISH_ARGON2) {
+	if (state->encryption > ENCRYPTION_CHACHA20_POLY1305_ARGON2) {
 		ret = ERROR_ENCRYPTION_UNKNOWN;
 		goto cleanup;
 	}
+	if (state->format_version == IMPACK_FORMAT_VERSION_STREAM && impack_encryption_authenticated(state->encryption)) {
+		goto cleanup;
+	}
 #ifndef IMPACK_WITH_ARGON2
-	if (state->encryption >= ENCRYPTION_AES_ARGON2 && state->encryption <= ENCRYPTION_TWOFISH_ARGON2) {
+	if (impack_crypt_argon2(state->encryption)) {
 		ret = ERROR_ENCRYPTION_UNSUPPORTED;
 		goto cleanup;
 	}
@@ -225,15 +333,91 @@ impack_error_t impack_decode_stage1(impack_decode_state_t *state, char *input_pa
 	return ERROR_OK;
 	
 cleanup:
-	free(state->pixeldata);
+	impack_decode_free(state);
 	return ret;
 	
 }
 
+impack_error_t impack_decode_stage1(impack_decode_state_t *state, char *input_path) {
+	
+	return impack_decode_stage1_ctx(NULL, state, input_path);
+	
+}
+
+impack_error_t impack_decode_stage1_ctx(impack_ctx_t *ctx, impack_decode_state_t *state, char *input_path) {
+	
+	state->ctx = ctx;
+	state->threads = 0;
+	state->pixeldata = NULL;
+	state->reader.func_row = NULL;
+	state->input_open = false;
+	FILE *input_file;
+	if (strlen(input_path) == 1 && input_path[0] == '-') {
+		input_file = stdin;
+	} else {
+		input_file = fopen(input_path, "rb+"); // Need to request write access to detect if the file is a directory
+		if (input_file == NULL && errno != EISDIR) {
+			input_file = fopen(input_path, "rb"); // Not a directory, try without requesting write access (in case we don't have write permissions)
+		}
+		if (input_file == NULL) {
+			if (errno == ENOENT) {
+				return ERROR_INPUT_NOT_FOUND;
+			} else if (errno == EACCES) {
+				return ERROR_INPUT_PERMISSION;
+			} else if (errno == EISDIR) {
+				return ERROR_INPUT_DIRECTORY;
+			} else {
+				return ERROR_INPUT_IO;
+			}
+		}
+	}
+	if (!impack_io_open_file(&state->input, input_file)) {
+		fclose(input_file);
+		return ERROR_MALLOC;
+	}
+	return decode_stage1_file(ctx, state);
+	
+}
+
+impack_error_t impack_decode_stage1_mem(impack_ctx_t *ctx, impack_decode_state_t *state, const uint8_t *input, uint64_t input_size) {
+	
+	state->ctx = ctx;
+	state->threads = 0;
+	state->pixeldata = NULL;
+	state->reader.func_row = NULL;
+	state->input_open = false;
+	if (!impack_io_open_mem(&state->input, input, input_size)) {
+		return ERROR_MALLOC;
+	}
+	return decode_stage1_file(ctx, state);
+	
+}
+
+impack_error_t impack_decode_stage1_io(impack_ctx_t *ctx, impack_decode_state_t *state, impack_io_t *input) {
+	
+	state->ctx = ctx;
+	state->threads = 0;
+	state->pixeldata = NULL;
+	state->reader.func_row = NULL;
+	state->input_open = false;
+	memcpy(&state->input, input, sizeof(impack_io_t));
+	impack_io_start(&state->input);
+	return decode_stage1_file(ctx, state);
+	
+}
+
 impack_error_t impack_decode_stage2(impack_decode_state_t *state, char *passphrase) {
 	
+	return impack_decode_stage2_cache(state, passphrase, NULL);
+	
+}
+
+impack_error_t impack_decode_stage2_cache(impack_decode_state_t *state, char *passphrase, impack_key_cache_t *key_cache) {
+	
 	impack_error_t ret = ERROR_INPUT_IMG_INVALID;
 	state->filename = NULL;
+	state->volume_number = 0;
+	state->volume_count = 1;
 	if (!state->legacy) {
 		if (!pixelbuf_read(state, (uint8_t*) &state->data_length, 8)) {
 			goto cleanup;
@@ -250,13 +434,16 @@ impack_error_t impack_decode_stage2(impack_decode_state_t *state, char *passphra
 	if (state->filename_length > bytes_remaining || state->filename_length == 0) {
 		goto cleanup;
 	}
-	if (state->data_length > bytes_remaining - state->filename_length) {
+	if (state->format_version == IMPACK_FORMAT_VERSION_STREAM && state->data_length > bytes_remaining - state->filename_length) { // Compressed blocks can hold more data than the image
 		goto cleanup;
 	}
 	
 	uint64_t filename_length;
 #ifdef IMPACK_WITH_CRYPTO
 	impack_crypt_ctx_t decrypt_ctx;
+	impack_key_cache_t session; // Newly derived master key, only cached once the passphrase is verified
+	bool session_new = false;
+	bool key_verified = true;
 #endif
 	if (!state->legacy) {
 		uint64_t crc;
@@ -264,19 +451,83 @@ impack_error_t impack_decode_stage2(impack_decode_state_t *state, char *passphra
 			goto cleanup;
 		}
 		state->crc = impack_endian64(crc);
+		if (state->format_version != IMPACK_FORMAT_VERSION_STREAM) {
+			if (!pixelbuf_read(state, (uint8_t*) &state->block_size, 4)) {
+				goto cleanup;
+			}
+			state->block_size = impack_endian32(state->block_size);
+			if (state->block_size == 0 || state->block_size > IMPACK_BLOCK_SIZE_MAX) {
+				goto cleanup;
+			}
+		}
+		if (state->format_version == IMPACK_FORMAT_VERSION_VOLUMES) {
+			uint32_t volume_number[2];
+			uint64_t volume_position[2];
+			if (!pixelbuf_read(state, (uint8_t*) volume_number, 8) || !pixelbuf_read(state, (uint8_t*) volume_position, 16) || !pixelbuf_read(state, state->volume_id, IMPACK_VOLUME_ID_SIZE)) {
+				goto cleanup;
+			}
+			state->volume_number = impack_endian32(volume_number[0]);
+			state->volume_count = impack_endian32(volume_number[1]);
+			state->volume_offset = impack_endian64(volume_position[0]);
+			state->volume_total = impack_endian64(volume_position[1]);
+			if (state->volume_number >= state->volume_count || state->volume_offset > state->volume_total || state->data_length > state->volume_total - state->volume_offset) {
+				goto cleanup;
+			}
+		}
 		filename_length = state->filename_length;
 #ifdef IMPACK_WITH_CRYPTO
 		if (state->encryption != ENCRYPTION_NONE) {
-			if (!pixelbuf_read(state, decrypt_ctx.iv, IMPACK_CRYPT_BLOCK_SIZE)) {
+			uint8_t salt[IMPACK_CRYPT_BLOCK_SIZE];
+			if (!pixelbuf_read(state, salt, IMPACK_CRYPT_BLOCK_SIZE)) {
 				goto cleanup;
 			}
-			if (!impack_derive_key(passphrase, state->crypt_key, IMPACK_CRYPT_KEY_SIZE, decrypt_ctx.iv, IMPACK_CRYPT_BLOCK_SIZE, state->encryption)) {
-				ret = ERROR_MALLOC;
-				goto cleanup;
+			impack_kdf_params_t kdf = { IMPACK_ARGON2_ITERATIONS, IMPACK_ARGON2_MEMORY, 1 };
+			if (state->format_version != IMPACK_FORMAT_VERSION_STREAM && impack_crypt_argon2(state->encryption)) { // The parameters are stored after the salt
+				uint32_t kdf_header[3];
+				if (!pixelbuf_read(state, (uint8_t*) kdf_header, 12)) {
+					goto cleanup;
+				}
+				kdf.iterations = impack_endian32(kdf_header[0]);
+				kdf.memory = impack_endian32(kdf_header[1]);
+				kdf.lanes = impack_endian32(kdf_header[2]);
+				if (kdf.lanes == 0 || !impack_kdf_params_valid(&kdf)) {
+					goto cleanup;
+				}
+			}
+			if (state->format_version != IMPACK_FORMAT_VERSION_STREAM) { // Derive the master key from the session salt, then the key for this file from the IV
+				if (!pixelbuf_read(state, decrypt_ctx.iv, IMPACK_CRYPT_BLOCK_SIZE)) {
+					goto cleanup;
+				}
+				if (key_cache != NULL && impack_key_cache_match(key_cache, state->encryption, salt, &kdf, passphrase)) { // Same session and passphrase as an earlier image
+					impack_derive_file_key(key_cache->master_key, decrypt_ctx.iv, state->crypt_key);
+				} else {
+					if (!impack_derive_key(passphrase, session.master_key, IMPACK_CRYPT_KEY_SIZE, salt, IMPACK_CRYPT_BLOCK_SIZE, state->encryption, &kdf)) {
+						ret = ERROR_MALLOC;
+						goto cleanup;
+					}
+					impack_derive_file_key(session.master_key, decrypt_ctx.iv, state->crypt_key);
+					if (key_cache != NULL) {
+						session.encryption = state->encryption;
+						session.kdf_params = kdf;
+						memcpy(session.salt, salt, IMPACK_CRYPT_BLOCK_SIZE);
+						impack_passphrase_check(session.master_key, passphrase, session.passphrase_check);
+						session_new = true;
+					} else {
+						impack_secure_erase(session.master_key, IMPACK_CRYPT_KEY_SIZE);
+					}
+				}
+			} else { // The salt is also the IV
+				memcpy(decrypt_ctx.iv, salt, IMPACK_CRYPT_BLOCK_SIZE);
+				if (!impack_derive_key(passphrase, state->crypt_key, IMPACK_CRYPT_KEY_SIZE, salt, IMPACK_CRYPT_BLOCK_SIZE, state->encryption, &kdf)) {
+					ret = ERROR_MALLOC;
+					goto cleanup;
+				}
 			}
 			impack_secure_erase((uint8_t*) passphrase, strlen(passphrase));
 			impack_set_decrypt_key(&decrypt_ctx, state->crypt_key, state->encryption);
-			if (filename_length % IMPACK_CRYPT_BLOCK_SIZE != 0) {
+			if (impack_encryption_authenticated(state->encryption)) {
+				filename_length += IMPACK_CRYPT_TAG_SIZE;
+			} else if (filename_length % IMPACK_CRYPT_BLOCK_SIZE != 0) {
 				filename_length += IMPACK_CRYPT_BLOCK_SIZE - (filename_length % IMPACK_CRYPT_BLOCK_SIZE);
 			}
 		}
@@ -307,10 +558,25 @@ impack_error_t impack_decode_stage2(impack_decode_state_t *state, char *passphra
 		goto cleanup;
 	}
 #ifdef IMPACK_WITH_CRYPTO
-	if (state->encryption != ENCRYPTION_NONE && !state->legacy) {
+	if (impack_encryption_authenticated(state->encryption)) {
+		uint8_t nonce[IMPACK_CRYPT_NONCE_SIZE];
+		impack_crypt_nonce(nonce, 0, NONCE_FILENAME);
+		bool valid = impack_decrypt_aead(&decrypt_ctx, nonce, (uint8_t*) state->filename, state->filename_length, (uint8_t*) state->filename + state->filename_length, state->encryption);
+		impack_secure_erase((uint8_t*) &decrypt_ctx, sizeof(impack_crypt_ctx_t));
+		if (!valid) { // Most likely an incorrect passphrase
+			goto cleanup;
+		}
+	} else if (state->encryption != ENCRYPTION_NONE && !state->legacy) {
 		impack_decrypt(&decrypt_ctx, (uint8_t*) state->filename, filename_length, state->encryption);
 		memcpy(state->crypt_iv, decrypt_ctx.iv, IMPACK_CRYPT_BLOCK_SIZE);
 		impack_secure_erase((uint8_t*) &decrypt_ctx, sizeof(impack_crypt_ctx_t));
+		// Without a tag, only the zero padding after the filename shows the key is right (the key isn't cached if there is none)
+		key_verified = (filename_length > state->filename_length);
+		for (uint64_t i = state->filename_length; i < filename_length; i++) {
+			if (state->filename[i] != 0) {
+				key_verified = false;
+			}
+		}
 	}
 #endif
 	
@@ -320,10 +586,18 @@ impack_error_t impack_decode_stage2(impack_decode_state_t *state, char *passphra
 		}
 	}
 	
+#ifdef IMPACK_WITH_CRYPTO
+	if (session_new) {
+		if (key_verified) {
+			*key_cache = session;
+		}
+		impack_secure_erase((uint8_t*) &session, sizeof(impack_key_cache_t));
+	}
+#endif
 	return ERROR_OK;
 	
 cleanup:
-	free(state->pixeldata);
+	impack_decode_free(state);
 	if (state->filename != NULL) {
 		free(state->filename);
 	}
@@ -331,16 +605,294 @@ cleanup:
 	if (state->encryption != ENCRYPTION_NONE) {
 		impack_secure_erase(state->crypt_key, IMPACK_CRYPT_KEY_SIZE);
 		impack_secure_erase((uint8_t*) &decrypt_ctx, sizeof(impack_crypt_ctx_t));
+		impack_secure_erase((uint8_t*) &session, sizeof(impack_key_cache_t));
 	}
 #endif
 	return ret;
 	
 }
 
-impack_error_t impack_decode_stage3(impack_decode_state_t *state, char *output_path) {
+typedef struct {
+	uint32_t stored_length;
+	uint64_t crc;
+	uint8_t iv[IMPACK_CRYPT_BLOCK_SIZE];
+	uint8_t tag[IMPACK_CRYPT_TAG_SIZE];
+} decode_index_t;
+
+typedef struct {
+	impack_decode_state_t *state;
+	impack_io_t *output;
+	const impack_block_params_t *params;
+	const decode_index_t *index;
+	uint64_t block_count;
+	uint64_t next; // Next block to read
+	uint64_t end; // One after the last block to read
+	uint64_t range_offset;
+	uint64_t range_end;
+	bool authenticated;
+	uint64_t crc;
+	bool crc_error;
+	impack_error_t read_error;
+	impack_error_t ret;
+} decode_pipeline_t;
+
+// Reader stage, loads the next block from the pixel data
+static bool decode_blocks_read(void *ctx, void *item, bool *last) {
+	
+	decode_pipeline_t *pipeline = ctx;
+	impack_block_t *block = item;
+	impack_decode_state_t *state = pipeline->state;
+	if (pipeline->next >= pipeline->end) {
+		return false;
+	}
+	uint64_t number = pipeline->next;
+	const decode_index_t *entry = &pipeline->index[number];
+	uint64_t padded_length = impack_block_padded_length(pipeline->params, entry->stored_length);
+	if (!impack_block_reserve(&block->data, &block->data_size, padded_length)) {
+		pipeline->read_error = ERROR_MALLOC;
+		return false;
+	}
+	if (!pixelbuf_read(state, block->data, padded_length)) {
+		pipeline->read_error = ERROR_INPUT_IMG_INVALID;
+		return false;
+	}
+	block->params = pipeline->params;
+	block->length = state->block_size;
+	if (number == pipeline->block_count - 1) {
+		block->length = state->data_length - (number * state->block_size);
+	}
+	block->stored_length = entry->stored_length;
+	block->crc = entry->crc;
+	memcpy(block->iv, entry->iv, IMPACK_CRYPT_BLOCK_SIZE);
+	memcpy(block->tag, entry->tag, IMPACK_CRYPT_TAG_SIZE);
+	block->number = number;
+	block->last = (number == pipeline->block_count - 1);
+	pipeline->next++;
+	*last = (pipeline->next == pipeline->end);
+	return true;
+	
+}
+
+// Writer stage, checks the decoded blocks in order and writes the part of them that is inside the range
+static bool decode_blocks_write(void *ctx, void *item) {
+	
+	decode_pipeline_t *pipeline = ctx;
+	impack_block_t *block = item;
+	if (block->res == ERROR_CRC && !pipeline->authenticated) { // Still write the data, like with format version 0
+		pipeline->crc_error = true;
+	} else if (block->res != ERROR_OK) {
+		pipeline->ret = block->res;
+		return false;
+	}
+	if (!pipeline->authenticated) { // Blocks are checked with their tags instead
+		pipeline->crc = impack_crc_combine(pipeline->crc, block->crc, block->length);
+	}
+	uint64_t block_offset = block->number * pipeline->state->block_size;
+	uint64_t write_start = (pipeline->range_offset > block_offset) ? pipeline->range_offset - block_offset : 0;
+	uint64_t write_end = (pipeline->range_end < block_offset + block->length) ? pipeline->range_end - block_offset : block->length;
+	if (write_end > write_start && !impack_io_write(pipeline->output, block->data + write_start, write_end - write_start)) {
+		pipeline->ret = ERROR_OUTPUT_IO;
+		return false;
+	}
+	return true;
+	
+}
+
+static uint32_t decode_threads(const impack_decode_state_t *state) {
+	
+	return (state->threads != 0) ? state->threads : impack_cpu_count();
+	
+}
+
+// Format version 1: Read the block index, then read, decode (as many blocks in parallel as there are threads) and write the blocks at the same time
+// Only the blocks containing range_length bytes from range_offset are decoded, the others are skipped using the index
+static impack_error_t decode_blocks(impack_ctx_t *ctx, impack_decode_state_t *state, impack_io_t *output, uint64_t range_offset, uint64_t range_length) {
+	
+	impack_error_t ret = ERROR_INPUT_IMG_INVALID;
+	uint32_t threads = decode_threads(state);
+	decode_index_t *index = NULL;
+	impack_block_t *blocks = NULL;
+	impack_block_params_t params;
+	params.encryption = state->encryption;
+	params.compression = state->compression;
+	params.compress_level = 0;
+#ifdef IMPACK_WITH_CRYPTO
+	if (state->encryption != ENCRYPTION_NONE) {
+		impack_set_decrypt_key(&params.crypt_ctx, state->crypt_key, state->encryption);
+		impack_secure_erase(state->crypt_key, IMPACK_CRYPT_KEY_SIZE);
+	}
+#endif
+	
+	bool authenticated = impack_encryption_authenticated(state->encryption);
+	uint64_t block_count;
+	if (!pixelbuf_read(state, (uint8_t*) &block_count, 8)) {
+		goto cleanup;
+	}
+	block_count = impack_endian64(block_count);
+	if (authenticated) { // The last block is always stored and shorter than the block size (may be empty)
+		if (block_count != state->data_length / state->block_size + 1) {
+			goto cleanup;
+		}
+	} else if (block_count != state->data_length / state->block_size + ((state->data_length % state->block_size != 0) ? 1 : 0)) {
+		goto cleanup;
+	}
+	uint64_t entry_length = impack_block_entry_length(&params);
+	uint64_t bytes_remaining = state->pixeldata_size - state->pixeldata_pos;
+	if (block_count > bytes_remaining / entry_length) { // Quick sanity check to avoid allocating giant buffers
+		goto cleanup;
+	}
+	if (block_count > 0) {
+		index = malloc(sizeof(decode_index_t) * block_count);
+		if (index == NULL) {
+			ret = ERROR_MALLOC;
+			goto cleanup;
+		}
+	}
+	uint64_t stored_total = 0;
+	for (uint64_t i = 0; i < block_count; i++) {
+		uint8_t entry[IMPACK_BLOCK_ENTRY_MAX];
+		if (!pixelbuf_read(state, entry, entry_length)) {
+			goto cleanup;
+		}
+		memcpy(&index[i].stored_length, entry, 4);
+		index[i].stored_length = impack_endian32(index[i].stored_length);
+		if (authenticated) {
+			memcpy(index[i].tag, entry + 4, IMPACK_CRYPT_TAG_SIZE);
+			index[i].crc = 0; // Not stored
+		} else {
+			memcpy(&index[i].crc, entry + 4, 8);
+			index[i].crc = impack_endian64(index[i].crc);
+			if (state->encryption != ENCRYPTION_NONE) {
+				memcpy(index[i].iv, entry + 12, IMPACK_CRYPT_BLOCK_SIZE);
+			}
+		}
+		uint64_t length = state->block_size;
+		if (i == block_count - 1) {
+			length = state->data_length - (i * state->block_size);
+		}
+		if ((index[i].stored_length == 0 && length != 0) || (state->compression == COMPRESSION_NONE && index[i].stored_length != length)) {
+			goto cleanup;
+		}
+		stored_total += impack_block_padded_length(&params, index[i].stored_length);
+		if (stored_total > bytes_remaining) {
+			goto cleanup;
+		}
+	}
+	
+	uint64_t range_end = state->data_length;
+	if (range_offset > range_end) {
+		range_offset = range_end;
+	}
+	if (range_length < range_end - range_offset) {
+		range_end = range_offset + range_length;
+	}
+	bool range_full = (range_offset == 0 && range_end == state->data_length);
+	uint64_t range_first = range_offset / state->block_size;
+	uint64_t range_last = range_end / state->block_size + ((range_end % state->block_size != 0) ? 1 : 0); // One after the last block
+	if (range_full || range_last > block_count) { // Also includes the empty block at the end with authenticated encryption
+		range_last = block_count;
+	}
+	if (range_first > range_last) {
+		range_first = range_last;
+	}
+	uint64_t skip = 0;
+	for (uint64_t i = 0; i < range_first; i++) {
+		skip += impack_block_padded_length(&params, index[i].stored_length);
+	}
+	if (!pixelbuf_skip(state, skip)) {
+		goto cleanup;
+	}
+	
+	if (threads > range_last - range_first) {
+		threads = (range_last > range_first) ? range_last - range_first : 1;
+	}
+	uint32_t slots = impack_block_slots(&threads, DECODE_PIPELINE_DEPTH, state->block_size);
+	blocks = impack_ctx_blocks(ctx, slots);
+	if (blocks == NULL) {
+		ret = ERROR_MALLOC;
+		goto cleanup;
+	}
+	decode_pipeline_t pipeline;
+	pipeline.state = state;
+	pipeline.output = output;
+	pipeline.params = &params;
+	pipeline.index = index;
+	pipeline.block_count = block_count;
+	pipeline.next = range_first;
+	pipeline.end = range_last;
+	pipeline.range_offset = range_offset;
+	pipeline.range_end = range_end;
+	pipeline.authenticated = authenticated;
+	pipeline.crc = 0;
+	pipeline.crc_error = false;
+	pipeline.read_error = ERROR_OK;
+	pipeline.ret = ERROR_OK;
+	impack_pipeline(decode_blocks_read, impack_block_decode, decode_blocks_write, &pipeline, blocks, sizeof(impack_block_t), slots, threads);
+	if (pipeline.ret != ERROR_OK) {
+		ret = pipeline.ret;
+		goto cleanup;
+	}
+	if (pipeline.read_error != ERROR_OK) {
+		ret = pipeline.read_error;
+		goto cleanup;
+	}
+	if (pipeline.crc_error || (!authenticated && range_full && pipeline.crc != state->crc)) { // Each block is still checked on its own if only a range was decoded
+		ret = ERROR_CRC;
+	} else {
+		ret = ERROR_OK;
+	}
+	
+cleanup:
+#ifdef IMPACK_WITH_CRYPTO
+	if (state->encryption != ENCRYPTION_NONE) {
+		impack_secure_erase((uint8_t*) &params.crypt_ctx, sizeof(impack_crypt_ctx_t));
+	}
+#endif
+	if (index != NULL) {
+		free(index);
+	}
+	return ret;
+	
+}
+
+// Temporary contexts are freed, the buffers in other ones are kept for the next call
+static void decode_ctx_release(impack_ctx_t *ctx, impack_ctx_t *ctx_local) {
+	
+	if (ctx == ctx_local) {
+		impack_ctx_clear(ctx);
+	} else {
+		impack_ctx_trim(ctx);
+	}
+	
+}
+
+// Stage 3 failed before decoding started
+static void decode_stage3_abort(impack_decode_state_t *state) {
+	
+	impack_decode_free(state);
+	free(state->filename);
+	state->filename = NULL;
+#ifdef IMPACK_WITH_CRYPTO
+	if (state->encryption != ENCRYPTION_NONE) {
+		impack_secure_erase(state->crypt_key, IMPACK_CRYPT_KEY_SIZE);
+	}
+#endif
+	
+}
+
+// Decode the data into output, which is closed by the caller
+// Format version 1 and 2 only decode the given range, format version 0 always decodes everything
+static impack_error_t decode_stage3_file(impack_decode_state_t *state, impack_io_t *output, uint64_t range_offset, uint64_t range_length) {
 	
 	impack_error_t ret = ERROR_INPUT_IMG_INVALID;
 	uint8_t *buf = NULL;
+	impack_ctx_t ctx_local; // Used if stage 1 was called without a context
+	impack_ctx_t *ctx = state->ctx;
+	if (ctx == NULL) {
+		impack_ctx_init(&ctx_local);
+		ctx = &ctx_local;
+	}
+	impack_workers_t *crc_workers = NULL;
 #ifdef IMPACK_WITH_COMPRESSION
 	impack_compress_state_t decompress_state;
 	decompress_state.bufsize = 0;
@@ -348,48 +900,28 @@ impack_error_t impack_decode_stage3(impack_decode_state_t *state, char *output_p
 #ifdef IMPACK_WITH_CRYPTO
 	impack_crypt_ctx_t decrypt_ctx;
 #endif
-	FILE *output_file;
-	if (strlen(output_path) == 1 && output_path[0] == '-') {
-		output_file = stdout;
-	} else {
-		output_file = fopen(output_path, "wb");
-		if (output_file == NULL) {
-			if (errno == EISDIR) { // Used selected a directory, append the filename from the image
-				size_t output_path_length = strlen(output_path);
-				char *newname = malloc(state->filename_length + output_path_length + 2);
-				if (newname == NULL) {
-					ret = ERROR_MALLOC;
-					goto cleanup;
-				}
-				strcpy(newname, output_path);
-				newname[output_path_length] = '/'; // This should also work on windows
-				strncpy(newname + output_path_length + 1, state->filename, state->filename_length);
-				newname[output_path_length + state->filename_length + 1] = 0;
-				output_file = fopen(newname, "wb");
-				free(newname);
-			}
-			if (output_file == NULL) {
-				if (errno == ENOENT) {
-					ret = ERROR_OUTPUT_NOT_FOUND;
-				} else if (errno == EACCES) {
-					ret = ERROR_OUTPUT_PERMISSION;
-				} else if (errno == EISDIR) {
-					ret = ERROR_OUTPUT_DIRECTORY;
-				} else {
-					ret = ERROR_OUTPUT_IO;
-				}
-				goto cleanup;
-			}
-		}
-	}
 	free(state->filename);
 	state->filename = NULL;
 	
-	buf = malloc(BUFSIZE);
-	if (buf == NULL) {
+	if (state->format_version != IMPACK_FORMAT_VERSION_STREAM) {
+		ret = decode_blocks(ctx, state, output, range_offset, range_length);
+		impack_decode_free(state);
+		decode_ctx_release(ctx, &ctx_local);
+		return ret;
+	}
+	
+	uint64_t bufsize = IMPACK_CHUNK_SIZE * 2; // The decompressor reads from the second half while writing into the first one
+	if (state->compression == COMPRESSION_NONE) {
+		bufsize = BUFSIZE_UNCOMPRESSED;
+	}
+	if (!impack_block_reserve(&ctx->buf, &ctx->buf_size, bufsize)) {
 		ret = ERROR_MALLOC;
 		goto cleanup;
 	}
+	buf = ctx->buf;
+	if (state->compression == COMPRESSION_NONE && !state->legacy) { // Compressed chunks are too small to be split up, legacy images use SHA-512
+		crc_workers = impack_workers_new(decode_threads(state));
+	}
 	
 #ifdef IMPACK_WITH_CRYPTO
 	if (state->encryption != ENCRYPTION_NONE) {
@@ -403,7 +935,8 @@ impack_error_t impack_decode_stage3(impack_decode_state_t *state, char *output_p
 	if (state->compression != COMPRESSION_NONE) {
 		decompress_state.type = state->compression;
 		decompress_state.is_compress = false;
-		decompress_state.bufsize = BUFSIZE;
+		decompress_state.threads = 1;
+		decompress_state.bufsize = IMPACK_CHUNK_SIZE;
 		if (!impack_compress_init(&decompress_state)) {
 			ret = ERROR_MALLOC;
 			goto cleanup;
@@ -411,9 +944,6 @@ impack_error_t impack_decode_stage3(impack_decode_state_t *state, char *output_p
 	}
 #endif
 	
-	if (!state->legacy) {
-		impack_crc_init();
-	}
 	uint64_t crc = 0;
 #ifdef IMPACK_WITH_CRYPTO
 	struct sha512_ctx legacy_checksum;
@@ -432,7 +962,7 @@ impack_error_t impack_decode_stage3(impack_decode_state_t *state, char *output_p
 				if (res == COMPRESSION_RES_ERROR) {
 					goto cleanup;
 				} else if (res == COMPRESSION_RES_AGAIN) {
-					remaining = BUFSIZE;
+					remaining = IMPACK_CHUNK_SIZE;
 					if (state->data_length < remaining) {
 						remaining = state->data_length;
 					}
@@ -448,21 +978,22 @@ impack_error_t impack_decode_stage3(impack_decode_state_t *state, char *output_p
 						}
 					}
 #endif
-					if (!pixelbuf_read(state, buf, remaining)) {
+					uint8_t *compress_buf = buf + IMPACK_CHUNK_SIZE;
+					if (!pixelbuf_read(state, compress_buf, remaining)) {
 						goto cleanup;
 					}
 #ifdef IMPACK_WITH_CRYPTO
 					if (state->encryption != ENCRYPTION_NONE) {
-						impack_decrypt(&decrypt_ctx, buf, remaining, state->encryption);
+						impack_decrypt(&decrypt_ctx, compress_buf, remaining, state->encryption);
 						if (state->legacy && remaining == state->data_length) {
-							padding = buf[remaining - 1];
+							padding = compress_buf[remaining - 1];
 						}
 						remaining -= padding;
 					}
 #endif
-					impack_compress_write(&decompress_state, buf, remaining);
+					impack_compress_write(&decompress_state, compress_buf, remaining);
 					if (!state->legacy) {
-						impack_crc(&crc, buf, remaining);
+						impack_crc(&crc, compress_buf, remaining);
 					}
 					state->data_length -= remaining;
 					if (state->legacy) {
@@ -481,7 +1012,7 @@ impack_error_t impack_decode_stage3(impack_decode_state_t *state, char *output_p
 			}
 		} else {
 #endif
-			remaining = BUFSIZE;
+			remaining = bufsize;
 			if (state->data_length < remaining) {
 				remaining = state->data_length;
 			}
@@ -507,7 +1038,7 @@ impack_error_t impack_decode_stage3(impack_decode_state_t *state, char *output_p
 			}
 #endif
 			if (!state->legacy) {
-				impack_crc(&crc, buf, remaining);
+				impack_crc_parallel(&crc, buf, remaining, crc_workers);
 			}
 			state->data_length -= remaining;
 			if (state->legacy) {
@@ -525,7 +1056,7 @@ impack_error_t impack_decode_stage3(impack_decode_state_t *state, char *output_p
 			sha512_update(&legacy_checksum, remaining, buf);
 		}
 #endif
-		if (fwrite(buf, 1, remaining, output_file) != remaining) {
+		if (!impack_io_write(output, buf, remaining)) {
 			ret = ERROR_OUTPUT_IO;
 			goto cleanup;
 		}
@@ -541,9 +1072,9 @@ impack_error_t impack_decode_stage3(impack_decode_state_t *state, char *output_p
 		impack_compress_free(&decompress_state);
 	}
 #endif
-	fclose(output_file);
-	free(buf);
-	free(state->pixeldata);
+	impack_decode_free(state);
+	decode_ctx_release(ctx, &ctx_local);
+	impack_workers_free(crc_workers);
 	if (!state->legacy) {
 		if (crc != state->crc) {
 			return ERROR_CRC;
@@ -560,16 +1091,12 @@ impack_error_t impack_decode_stage3(impack_decode_state_t *state, char *output_p
 	return ERROR_OK;
 	
 cleanup:
-	free(state->pixeldata);
+	impack_decode_free(state);
 	if (state->filename != NULL) {
 		free(state->filename);
 	}
-	if (buf != NULL) {
-		free(buf);
-	}
-	if (output_file != NULL) {
-		fclose(output_file);
-	}
+	decode_ctx_release(ctx, &ctx_local);
+	impack_workers_free(crc_workers);
 #ifdef IMPACK_WITH_CRYPTO
 	if (state->encryption != ENCRYPTION_NONE) {
 		impack_secure_erase(state->crypt_key, IMPACK_CRYPT_KEY_SIZE);
@@ -584,3 +1111,326 @@ cleanup:
 	return ret;
 	
 }
+
+// Same as decode_stage3_file(), but format version 0 also only writes the range (the data before it still has to be decoded)
+static impack_error_t decode_stage3_range(impack_decode_state_t *state, impack_io_t *output, uint64_t range_offset, uint64_t range_length) {
+	
+	if (state->format_version != IMPACK_FORMAT_VERSION_STREAM || (range_offset == 0 && range_length == UINT64_MAX)) {
+		return decode_stage3_file(state, output, range_offset, range_length);
+	}
+	impack_io_t window;
+	if (!impack_io_open_window(&window, output, range_offset, range_length)) {
+		decode_stage3_abort(state);
+		return ERROR_MALLOC;
+	}
+	impack_error_t ret = decode_stage3_file(state, &window, 0, UINT64_MAX);
+	impack_io_close(&window);
+	return ret;
+	
+}
+
+// Error after fopen() failed on the output
+static impack_error_t decode_output_error() {
+	
+	if (errno == ENOENT) {
+		return ERROR_OUTPUT_NOT_FOUND;
+	} else if (errno == EACCES) {
+		return ERROR_OUTPUT_PERMISSION;
+	} else if (errno == EISDIR) {
+		return ERROR_OUTPUT_DIRECTORY;
+	} else {
+		return ERROR_OUTPUT_IO;
+	}
+	
+}
+
+// Create the output file, the filename from the image is appended if output_path is a directory
+// The path that was used is returned in *output_used if it isn't NULL (from malloc())
+static impack_error_t decode_output_open(impack_decode_state_t *state, char *output_path, FILE **output_file, char **output_used) {
+	
+	char *newname = NULL;
+	*output_file = fopen(output_path, "wb");
+	if (*output_file == NULL && errno == EISDIR) { // Used selected a directory, append the filename from the image
+		size_t output_path_length = strlen(output_path);
+		newname = malloc(state->filename_length + output_path_length + 2);
+		if (newname == NULL) {
+			return ERROR_MALLOC;
+		}
+		strcpy(newname, output_path);
+		newname[output_path_length] = '/'; // This should also work on windows
+		strncpy(newname + output_path_length + 1, state->filename, state->filename_length);
+		newname[output_path_length + state->filename_length + 1] = 0;
+		*output_file = fopen(newname, "wb");
+	}
+	if (*output_file == NULL) {
+		impack_error_t ret = decode_output_error();
+		free(newname);
+		return ret;
+	}
+	if (output_used != NULL) {
+		if (newname == NULL) {
+			newname = malloc(strlen(output_path) + 1);
+			if (newname == NULL) {
+				fclose(*output_file);
+				return ERROR_MALLOC;
+			}
+			strcpy(newname, output_path);
+		}
+		*output_used = newname;
+	} else {
+		free(newname);
+	}
+	return ERROR_OK;
+	
+}
+
+impack_error_t impack_decode_stage3(impack_decode_state_t *state, char *output_path) {
+	
+	return impack_decode_range(state, 0, UINT64_MAX, output_path);
+	
+}
+
+impack_error_t impack_decode_range(impack_decode_state_t *state, uint64_t offset, uint64_t length, char *output_path) {
+	
+	impack_error_t ret;
+	FILE *output_file;
+	if (strlen(output_path) == 1 && output_path[0] == '-') {
+		output_file = stdout;
+	} else {
+		ret = decode_output_open(state, output_path, &output_file, NULL);
+		if (ret != ERROR_OK) {
+			decode_stage3_abort(state);
+			return ret;
+		}
+	}
+	impack_io_t output;
+	if (!impack_io_open_file(&output, output_file)) {
+		fclose(output_file);
+		decode_stage3_abort(state);
+		return ERROR_MALLOC;
+	}
+	ret = decode_stage3_range(state, &output, offset, length);
+	impack_io_close(&output);
+	return ret;
+	
+}
+
+impack_error_t impack_decode_stage3_io(impack_decode_state_t *state, impack_io_t *output) {
+	
+	return impack_decode_range_io(state, 0, UINT64_MAX, output);
+	
+}
+
+impack_error_t impack_decode_range_io(impack_decode_state_t *state, uint64_t offset, uint64_t length, impack_io_t *output) {
+	
+	impack_io_start(output);
+	impack_error_t ret = decode_stage3_range(state, output, offset, length);
+	impack_io_close(output);
+	return ret;
+	
+}
+
+impack_error_t impack_decode_stage3_mem(impack_decode_state_t *state, uint8_t **output, uint64_t *output_size) {
+	
+	*output = NULL;
+	*output_size = 0;
+	impack_io_t output_io;
+	impack_io_buf_t output_buf;
+	impack_io_open_buf(&output_io, &output_buf);
+	impack_error_t ret = impack_decode_stage3_io(state, &output_io);
+	if (ret == ERROR_OK) {
+		*output = output_buf.data;
+		*output_size = output_buf.size;
+	} else {
+		free(output_buf.data);
+	}
+	return ret;
+	
+}
+
+impack_error_t impack_decode_mem(impack_ctx_t *ctx, const uint8_t *input, uint64_t input_size, char *passphrase, uint8_t **output, uint64_t *output_size, char **filename) {
+	
+	*output = NULL;
+	*output_size = 0;
+	if (filename != NULL) {
+		*filename = NULL;
+	}
+	impack_decode_state_t state;
+	impack_error_t res = impack_decode_stage1_mem(ctx, &state, input, input_size);
+	if (res != ERROR_OK) {
+		return res;
+	}
+	res = impack_decode_stage2(&state, (state.encryption != ENCRYPTION_NONE) ? passphrase : NULL);
+	if (res != ERROR_OK) {
+		return res;
+	}
+	if (filename != NULL) {
+		*filename = malloc(state.filename_length + 1);
+		if (*filename == NULL) {
+			decode_stage3_abort(&state);
+			return ERROR_MALLOC;
+		}
+		memcpy(*filename, state.filename, state.filename_length);
+		(*filename)[state.filename_length] = 0;
+	}
+	res = impack_decode_stage3_mem(&state, output, output_size);
+	if (res != ERROR_OK && filename != NULL) {
+		free(*filename);
+		*filename = NULL;
+	}
+	return res;
+	
+}
+
+typedef struct {
+	char *input_path;
+	impack_decode_state_t state;
+	impack_error_t res;
+	int stage; // Last stage that succeeded, the state must be freed if this is 1 or 2
+	char *output_path;
+} decode_volumes_job_t;
+
+// Load one volume, used with impack_parallel()
+static void decode_volumes_stage1(void *item) {
+	
+	decode_volumes_job_t *job = item;
+	job->res = impack_decode_stage1(&job->state, job->input_path);
+	if (job->res == ERROR_OK) {
+		job->stage = 1;
+	}
+	
+}
+
+// Decode one volume into its part of the output file, used with impack_parallel()
+static void decode_volumes_stage3(void *item) {
+	
+	decode_volumes_job_t *job = item;
+	job->stage = 3; // Stage 3 always frees the state
+	FILE *output_file = fopen(job->output_path, "rb+"); // Keeps the data written by the other volumes
+	if (output_file == NULL) {
+		job->res = decode_output_error();
+		decode_stage3_abort(&job->state);
+		return;
+	}
+	impack_io_t file, output;
+	if (!impack_io_open_file(&file, output_file)) {
+		fclose(output_file);
+		job->res = ERROR_MALLOC;
+		decode_stage3_abort(&job->state);
+		return;
+	}
+	if (!impack_io_open_slice(&output, &file, job->state.volume_offset, job->state.data_length)) {
+		impack_io_close(&file);
+		job->res = ERROR_OUTPUT_IO;
+		decode_stage3_abort(&job->state);
+		return;
+	}
+	job->res = impack_decode_stage3_io(&job->state, &output);
+	
+}
+
+impack_error_t impack_decode_volumes(char **input_paths, uint32_t volume_count, char *passphrase, char *output_path, uint32_t threads) {
+	
+	impack_error_t ret = ERROR_MALLOC;
+	size_t passphrase_length = (passphrase != NULL) ? strlen(passphrase) : 0;
+	char *passphrase_copy = malloc(passphrase_length + 1);
+	decode_volumes_job_t *jobs = calloc(volume_count, sizeof(decode_volumes_job_t));
+	decode_volumes_job_t **order = calloc(volume_count, sizeof(decode_volumes_job_t*)); // Sorted by volume number
+	char *output_used = NULL;
+	impack_key_cache_t key_cache;
+	memset(&key_cache, 0, sizeof(impack_key_cache_t));
+	if (passphrase_copy == NULL || jobs == NULL || order == NULL) {
+		goto cleanup;
+	}
+	ret = ERROR_VOLUMES_INCOMPLETE;
+	if (volume_count == 0) {
+		goto cleanup;
+	}
+	
+	// Loading the images takes most of the time, so these run in parallel
+	for (uint32_t i = 0; i < volume_count; i++) {
+		jobs[i].input_path = input_paths[i];
+	}
+	if (threads == 0) {
+		threads = impack_cpu_count();
+	}
+	impack_parallel(decode_volumes_stage1, jobs, sizeof(decode_volumes_job_t), volume_count, threads);
+	for (uint32_t i = 0; i < volume_count; i++) {
+		if (jobs[i].res != ERROR_OK) {
+			ret = jobs[i].res;
+			goto cleanup;
+		}
+	}
+	
+	// The key is only derived for the first volume, the others take it from the cache
+	for (uint32_t i = 0; i < volume_count; i++) {
+		impack_decode_state_t *state = &jobs[i].state;
+		memcpy(passphrase_copy, (passphrase != NULL) ? passphrase : "", passphrase_length + 1);
+		jobs[i].stage = 0; // Stage 2 frees the state if it fails
+		ret = impack_decode_stage2_cache(state, (state->encryption != ENCRYPTION_NONE) ? passphrase_copy : NULL, &key_cache);
+		if (ret != ERROR_OK) {
+			goto cleanup;
+		}
+		jobs[i].stage = 2;
+		state->threads = (threads / volume_count > 1) ? threads / volume_count : 1; // All volumes are decoded at the same time, each uses its share of the threads
+		ret = ERROR_VOLUMES_INCOMPLETE;
+		if (state->format_version != IMPACK_FORMAT_VERSION_VOLUMES || state->volume_count != volume_count || order[state->volume_number] != NULL) {
+			goto cleanup;
+		}
+		if (memcmp(state->volume_id, jobs[0].state.volume_id, IMPACK_VOLUME_ID_SIZE) != 0 || state->volume_total != jobs[0].state.volume_total) {
+			goto cleanup;
+		}
+		order[state->volume_number] = &jobs[i];
+	}
+	uint64_t offset = 0;
+	for (uint32_t i = 0; i < volume_count; i++) { // The volumes must cover the whole file without gaps
+		if (order[i]->state.volume_offset != offset) {
+			goto cleanup;
+		}
+		offset += order[i]->state.data_length;
+	}
+	if (offset != jobs[0].state.volume_total) {
+		goto cleanup;
+	}
+	
+	FILE *output_file;
+	ret = decode_output_open(&jobs[0].state, output_path, &output_file, &output_used);
+	if (ret != ERROR_OK) {
+		goto cleanup;
+	}
+	fclose(output_file);
+	for (uint32_t i = 0; i < volume_count; i++) {
+		jobs[i].output_path = output_used;
+	}
+	impack_parallel(decode_volumes_stage3, jobs, sizeof(decode_volumes_job_t), volume_count, volume_count);
+	ret = ERROR_OK;
+	for (uint32_t i = 0; i < volume_count && ret == ERROR_OK; i++) {
+		ret = jobs[i].res;
+	}
+	
+cleanup:
+	if (jobs != NULL) {
+		for (uint32_t i = 0; i < volume_count; i++) {
+			if (jobs[i].stage == 1) {
+				impack_decode_free(&jobs[i].state);
+			} else if (jobs[i].stage == 2) {
+				decode_stage3_abort(&jobs[i].state);
+			}
+		}
+	}
+#ifdef IMPACK_WITH_CRYPTO
+	if (passphrase != NULL) {
+		impack_secure_erase((uint8_t*) passphrase, passphrase_length);
+	}
+	if (passphrase_copy != NULL) {
+		impack_secure_erase((uint8_t*) passphrase_copy, passphrase_length);
+	}
+	impack_key_cache_free(&key_cache);
+#endif
+	free(passphrase_copy);
+	free(jobs);
+	free(order);
+	free(output_used);
+	return ret;
+	
+}
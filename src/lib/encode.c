@@ -23,152 +23,530 @@
 #include "impack.h"
 #include "impack_internal.h"
 
-#define BUFSIZE 16384 // 16 KiB
-#define PIXELBUF_STEP 131072 // 128 KiB
+#define BUFSIZE_UNCOMPRESSED 16777216 // 16 MiB, large enough to checksum with multiple threads
+#define PIXELBUF_INITIAL 131072 // 128 KiB
+#define ENCODE_PIPELINE_DEPTH 2 // Blocks in flight per thread, so the next blocks can be read while the others are processed
+#define ENCODE_BLOCKS_PER_THREAD 4 // Minimum number of blocks per thread when selecting the block size, so the threads stay busy until the end
+
+bool pixelbuf_resize(uint8_t **pixeldata, uint64_t *pixeldata_size, uint64_t newsize) {
+	
+	uint8_t *newbuf = realloc(*pixeldata, newsize);
+	if (newbuf == NULL) {
+		return false;
+	}
+	*pixeldata = newbuf;
+	if (newsize > *pixeldata_size) {
+		memset(*pixeldata + *pixeldata_size, 0, newsize - *pixeldata_size);
+	}
+	*pixeldata_size = newsize;
+	return true;
+	
+}
 
 bool pixelbuf_add(uint8_t **pixeldata, uint64_t *pixeldata_size, uint64_t *pixeldata_pos, uint8_t channels, uint8_t *data, uint64_t len) {
 	
-	while (len > 0) {
-		if (*pixeldata_pos >= *pixeldata_size - 3) { // Keep space for one full pixel
-			uint8_t *newbuf = realloc(*pixeldata, *pixeldata_size + PIXELBUF_STEP);
-			if (newbuf == NULL) {
-				return false;
-			}
-			*pixeldata = newbuf;
-			memset(*pixeldata + *pixeldata_size, 0, PIXELBUF_STEP);
-			*pixeldata_size += PIXELBUF_STEP;
-		}
-		
-		if (channels != 0) {
-			if (((*pixeldata_pos % 3 == 0) && (channels & CHANNEL_RED)) || \
-				((*pixeldata_pos % 3 == 1) && (channels & CHANNEL_GREEN)) || \
-				((*pixeldata_pos % 3 == 2) && (channels & CHANNEL_BLUE))) { // Current channel enabled
-				(*pixeldata)[*pixeldata_pos] = *data;
-				data++;
-				len--;
-			}
-			(*pixeldata_pos)++;
-		} else { // Grayscale mode
-			(*pixeldata)[*pixeldata_pos] = *data;
-			(*pixeldata)[*pixeldata_pos + 1] = *data;
-			(*pixeldata)[*pixeldata_pos + 2] = *data;
-			data++;
-			len--;
-			(*pixeldata_pos) += 3;
+	uint64_t end = impack_channels_end(*pixeldata_pos, channels, len);
+	if (end > *pixeldata_size) { // Final size unknown, grow geometrically
+		uint64_t newsize = *pixeldata_size * 2;
+		if (newsize < end) {
+			newsize = end;
+		}
+		if (!pixelbuf_resize(pixeldata, pixeldata_size, newsize)) {
+			return false;
 		}
 	}
+	
+	impack_channels_store(*pixeldata, pixeldata_pos, channels, data, len);
 	return true;
 	
 }
 
-impack_error_t impack_encode(char *input_path, char *output_path, impack_encryption_type_t encrypt, char *passphrase, impack_compression_type_t compress, int32_t compress_level, uint8_t channels, uint64_t img_width, uint64_t img_height, impack_img_format_t format, char *filename_include) {
+typedef struct {
+	impack_io_t *data;
+	uint64_t data_remaining;
+	uint8_t *buf;
+	uint8_t channels;
+	impack_encryption_type_t encrypt;
+#ifdef IMPACK_WITH_CRYPTO
+	impack_crypt_ctx_t *crypt_ctx;
+#endif
+	uint8_t *pixeldata; // Only contains pixels that were not passed to the image writer yet
+	uint64_t pixeldata_size;
+	uint64_t pixeldata_pos;
+	uint64_t row_start;
+	uint64_t row_size;
+} encode_stream_t;
+
+// Provides image rows to streaming image writers, pixels are generated as needed
+static impack_error_t encode_stream_row(void *ctx, uint8_t *row) {
 	
-	FILE *input_file, *output_file;
-	if (strlen(input_path) == 1 && input_path[0] == '-') {
-		input_file = stdin;
-	} else {
-		input_file = fopen(input_path, "rb+"); // Need to request write access to detect if the file is a directory
-		if (input_file == NULL && errno != EISDIR) { // Not a directory, try without requesting write access (in case we don't have write permissions)
-			input_file = fopen(input_path, "rb");
+	encode_stream_t *stream = ctx;
+	if (stream->row_start + stream->row_size > stream->pixeldata_pos) { // Not enough pixels for a full row, move the rest to the front and add more data
+		uint64_t rest = 0;
+		if (stream->pixeldata_pos > stream->row_start) {
+			rest = stream->pixeldata_pos - stream->row_start;
+			memmove(stream->pixeldata, stream->pixeldata + stream->row_start, rest);
 		}
-		if (input_file == NULL) {
+		memset(stream->pixeldata + rest, 0, stream->pixeldata_pos - rest); // Unused channels need to stay zero
+		stream->pixeldata_pos = rest;
+		stream->row_start = 0;
+		while (stream->pixeldata_pos < stream->row_size && stream->data_remaining > 0) {
+			uint64_t len = IMPACK_CHUNK_SIZE;
+			if (stream->data_remaining < len) {
+				len = stream->data_remaining;
+			}
+			if (impack_io_read(stream->data, stream->buf, len) != len) {
+				return ERROR_INPUT_IO;
+			}
+			stream->data_remaining -= len;
 #ifdef IMPACK_WITH_CRYPTO
-			if (encrypt != ENCRYPTION_NONE) {
-				impack_secure_erase((uint8_t*) passphrase, strlen(passphrase));
+			if (stream->encrypt != ENCRYPTION_NONE) {
+				if (len % IMPACK_CRYPT_BLOCK_SIZE != 0) {
+					uint32_t padding = IMPACK_CRYPT_BLOCK_SIZE - (len % IMPACK_CRYPT_BLOCK_SIZE);
+					memset(stream->buf + len, 0, padding);
+					len += padding;
+				}
+				impack_encrypt(stream->crypt_ctx, stream->buf, len, stream->encrypt);
 			}
 #endif
-			if (errno == ENOENT) {
-				return ERROR_INPUT_NOT_FOUND;
-			} else if (errno == EACCES) {
-				return ERROR_INPUT_PERMISSION;
-			} else if (errno == EISDIR) {
-				return ERROR_INPUT_DIRECTORY;
-			} else {
-				return ERROR_INPUT_IO;
+			if (!pixelbuf_add(&stream->pixeldata, &stream->pixeldata_size, &stream->pixeldata_pos, stream->channels, stream->buf, len)) {
+				return ERROR_MALLOC;
 			}
 		}
 	}
-	if (strlen(output_path) == 1 && output_path[0] == '-') {
-		output_file = stdout;
+	
+	uint64_t avail = 0;
+	if (stream->pixeldata_pos > stream->row_start) {
+		avail = stream->pixeldata_pos - stream->row_start;
+		if (avail > stream->row_size) {
+			avail = stream->row_size;
+		}
+		memcpy(row, stream->pixeldata + stream->row_start, avail);
+	}
+	memset(row + avail, 0, stream->row_size - avail);
+	stream->row_start += stream->row_size;
+	return ERROR_OK;
+	
+}
+
+typedef struct {
+	impack_io_t *file; // Processed blocks are written to this file, or kept in data if it is NULL
+	uint8_t *data;
+	uint64_t data_size;
+	uint64_t length; // Amount of processed data, including encryption padding
+	uint8_t *index; // Block index, in the format used inside the image
+	uint64_t index_size;
+	uint64_t index_length;
+	uint64_t block_count;
+} encode_blocks_t;
+
+typedef struct {
+	uint32_t number;
+	uint32_t count;
+	uint64_t offset; // Position of the data in the whole input
+	uint64_t length;
+	uint64_t total;
+	uint8_t id[IMPACK_VOLUME_ID_SIZE];
+} encode_volume_t;
+
+typedef struct {
+	char *input_path;
+	impack_encode_params_t encode; // Shared by all volumes, threads is per volume
+} encode_volumes_params_t;
+
+typedef struct {
+	const encode_volumes_params_t *params;
+	char *output_path;
+	encode_volume_t volume;
+	impack_error_t res;
+} encode_volumes_job_t;
+
+typedef struct {
+	impack_io_t *input;
+	encode_blocks_t *out;
+	const impack_block_params_t *params;
+	bool authenticated;
+	uint32_t block_size;
+	uint64_t blocks_read;
+	impack_error_t read_error;
+	impack_error_t ret;
+	uint64_t *data_length;
+	uint64_t *crc;
+} encode_pipeline_t;
+
+// Reader stage, fills the next block from the input
+static bool encode_blocks_read(void *ctx, void *item, bool *last) {
+	
+	encode_pipeline_t *pipeline = ctx;
+	impack_block_t *block = item;
+	if (!impack_block_reserve(&block->data, &block->data_size, pipeline->block_size + IMPACK_CRYPT_BLOCK_SIZE)) { // Extra space for encryption padding
+		pipeline->read_error = ERROR_MALLOC;
+		return false;
+	}
+	block->params = pipeline->params;
+	block->length = impack_io_read(pipeline->input, block->data, pipeline->block_size);
+	block->number = pipeline->blocks_read;
+	block->last = false;
+	if (block->length != pipeline->block_size) {
+		*last = true;
+		block->last = true;
+		if (block->length == 0 && !pipeline->authenticated) { // With authenticated encryption, the last block is always stored (even if it's empty) to mark the end of the data
+			return false;
+		}
+	}
+	if (pipeline->params->encryption != ENCRYPTION_NONE && !pipeline->authenticated && !impack_random(block->iv, IMPACK_CRYPT_BLOCK_SIZE)) {
+		pipeline->read_error = ERROR_RANDOM;
+		return false;
+	}
+	pipeline->blocks_read++;
+	return true;
+	
+}
+
+// Writer stage, adds the processed blocks to the index and the output in order
+static bool encode_blocks_write(void *ctx, void *item) {
+	
+	encode_pipeline_t *pipeline = ctx;
+	impack_block_t *block = item;
+	encode_blocks_t *out = pipeline->out;
+	const impack_block_params_t *params = pipeline->params;
+	if (block->res != ERROR_OK) {
+		pipeline->ret = block->res;
+		return false;
+	}
+	*pipeline->data_length += block->length;
+	if (!pipeline->authenticated) {
+		*pipeline->crc = impack_crc_combine(*pipeline->crc, block->crc, block->length);
+	}
+	
+	uint8_t entry[IMPACK_BLOCK_ENTRY_MAX]; // Stored length, then either the tag or the CRC and IV (if encrypted)
+	uint64_t entry_length = impack_block_entry_length(params);
+	uint32_t stored_length = impack_endian32(block->stored_length);
+	memcpy(entry, &stored_length, 4);
+	if (pipeline->authenticated) {
+		memcpy(entry + 4, block->tag, IMPACK_CRYPT_TAG_SIZE);
+	} else {
+		uint64_t block_crc = impack_endian64(block->crc);
+		memcpy(entry + 4, &block_crc, 8);
+		if (params->encryption != ENCRYPTION_NONE) {
+			memcpy(entry + 12, block->iv, IMPACK_CRYPT_BLOCK_SIZE);
+		}
+	}
+	if (!impack_block_reserve(&out->index, &out->index_size, out->index_length + entry_length)) {
+		pipeline->ret = ERROR_MALLOC;
+		return false;
+	}
+	memcpy(out->index + out->index_length, entry, entry_length);
+	out->index_length += entry_length;
+	out->block_count++;
+	
+	uint64_t padded_length = impack_block_padded_length(params, block->stored_length);
+	if (out->file != NULL) {
+		if (!impack_io_write(out->file, block->data, padded_length)) {
+			pipeline->ret = ERROR_OUTPUT_IO;
+			return false;
+		}
 	} else {
-		output_file = fopen(output_path, "wb");
-		if (output_file == NULL) {
-			fclose(input_file);
+		if (!impack_block_reserve(&out->data, &out->data_size, out->length + padded_length)) {
+			pipeline->ret = ERROR_MALLOC;
+			return false;
+		}
+		memcpy(out->data + out->length, block->data, padded_length);
+	}
+	out->length += padded_length;
+	return true;
+	
+}
+
+// Format version 1: Split the input into blocks, reading, processing (as many blocks in parallel as there are threads) and writing them all happen at the same time
+static impack_error_t encode_blocks(impack_ctx_t *ctx, impack_io_t *input, encode_blocks_t *out, const impack_block_params_t *params, uint32_t block_size, uint32_t threads, uint64_t *data_length, uint64_t *crc) {
+	
+	uint32_t slots = impack_block_slots(&threads, ENCODE_PIPELINE_DEPTH, block_size);
+	impack_block_t *blocks = impack_ctx_blocks(ctx, slots);
+	if (blocks == NULL) {
+		return ERROR_MALLOC;
+	}
+	encode_pipeline_t pipeline;
+	pipeline.input = input;
+	pipeline.out = out;
+	pipeline.params = params;
+	pipeline.authenticated = impack_encryption_authenticated(params->encryption);
+	pipeline.block_size = block_size;
+	pipeline.blocks_read = out->block_count;
+	pipeline.read_error = ERROR_OK;
+	pipeline.ret = ERROR_OK;
+	pipeline.data_length = data_length;
+	pipeline.crc = crc;
+	impack_pipeline(encode_blocks_read, impack_block_encode, encode_blocks_write, &pipeline, blocks, sizeof(impack_block_t), slots, threads);
+	if (pipeline.ret != ERROR_OK) { // The blocks and their buffers stay in the context
+		return pipeline.ret;
+	}
+	return pipeline.read_error;
+	
+}
+
+// Add the processed blocks to the pixel data, after the header and block index
+static impack_error_t encode_blocks_copy(encode_blocks_t *blocks, uint8_t *buf, uint64_t bufsize, uint8_t **pixeldata, uint64_t *pixeldata_size, uint64_t *pixeldata_pos, uint8_t channels, uint64_t img_width, uint64_t img_height) {
+	
+	uint64_t width = img_width;
+	uint64_t height = img_height;
+	if (impack_img_size(impack_channels_end(*pixeldata_pos, channels, blocks->length), &width, &height) == ERROR_OK) { // Otherwise, the error is reported when writing the image
+		if (width * height * 3 > *pixeldata_size && !pixelbuf_resize(pixeldata, pixeldata_size, width * height * 3)) {
+			return ERROR_MALLOC;
+		}
+	}
+	
+	if (blocks->file == NULL) {
+		if (!pixelbuf_add(pixeldata, pixeldata_size, pixeldata_pos, channels, blocks->data, blocks->length)) {
+			return ERROR_MALLOC;
+		}
+		return ERROR_OK;
+	}
+	if (!impack_io_seek(blocks->file, 0)) {
+		return ERROR_INPUT_IO;
+	}
+	uint64_t remaining = blocks->length;
+	while (remaining > 0) {
+		uint64_t len = bufsize;
+		if (remaining < len) {
+			len = remaining;
+		}
+		if (impack_io_read(blocks->file, buf, len) != len) {
+			return ERROR_INPUT_IO;
+		}
+		if (!pixelbuf_add(pixeldata, pixeldata_size, pixeldata_pos, channels, buf, len)) {
+			return ERROR_MALLOC;
+		}
+		remaining -= len;
+	}
+	return ERROR_OK;
+	
+}
+
+// Authenticated encryption and cached keys both need format version 1
+// Checks the format version requested by the caller, version 2 is only written by impack_encode_volumes()
+static impack_error_t encode_version_check(const impack_encode_params_t *params) {
+	
+	impack_error_t ret = ERROR_OK;
+	if (params->format_version != IMPACK_FORMAT_VERSION_STREAM && params->format_version != IMPACK_FORMAT_VERSION_BLOCKS) {
+		ret = ERROR_FORMAT_VERSION_INVALID;
+	} else if (params->format_version == IMPACK_FORMAT_VERSION_STREAM && (impack_encryption_authenticated(params->encrypt) || params->key_cache != NULL)) {
+		ret = ERROR_ENCRYPTION_UNSUPPORTED;
+	}
 #ifdef IMPACK_WITH_CRYPTO
-			if (encrypt != ENCRYPTION_NONE) {
-				impack_secure_erase((uint8_t*) passphrase, strlen(passphrase));
-			}
+	if (ret != ERROR_OK && params->passphrase != NULL) {
+		impack_secure_erase((uint8_t*) params->passphrase, strlen(params->passphrase));
+	}
 #endif
-			if (errno == ENOENT) {
-				return ERROR_OUTPUT_NOT_FOUND;
-			} else if (errno == EACCES) {
-				return ERROR_OUTPUT_PERMISSION;
-			} else if (errno == EISDIR) {
-				return ERROR_OUTPUT_DIRECTORY;
-			} else { 
-				return ERROR_OUTPUT_IO;
-			}
+	return ret;
+	
+}
+
+// Temporary file for data that needs to be read again later
+static bool encode_tmpfile(impack_io_t *io) {
+	
+	FILE *f = tmpfile();
+	if (f == NULL) {
+		return false;
+	}
+	if (!impack_io_open_file(io, f)) {
+		fclose(f);
+		return false;
+	}
+	return true;
+	
+}
+
+// Open an input or output file, the error from fopen() is turned into an impack_error_t
+static impack_error_t encode_open(char *path, bool input, FILE **file) {
+	
+	if (input) {
+		*file = fopen(path, "rb+"); // Need to request write access to detect if the file is a directory
+		if (*file == NULL && errno != EISDIR) { // Not a directory, try without requesting write access (in case we don't have write permissions)
+			*file = fopen(path, "rb");
+		}
+	} else {
+		*file = fopen(path, "wb");
+	}
+	if (*file != NULL) {
+		return ERROR_OK;
+	}
+	if (errno == ENOENT) {
+		return input ? ERROR_INPUT_NOT_FOUND : ERROR_OUTPUT_NOT_FOUND;
+	} else if (errno == EACCES) {
+		return input ? ERROR_INPUT_PERMISSION : ERROR_OUTPUT_PERMISSION;
+	} else if (errno == EISDIR) {
+		return input ? ERROR_INPUT_DIRECTORY : ERROR_OUTPUT_DIRECTORY;
+	} else {
+		return input ? ERROR_INPUT_IO : ERROR_OUTPUT_IO;
+	}
+	
+}
+
+// Without a block size from the caller, use the largest one (a power of two, so it also lines up with the blocks of the filesystem) that still gives every thread a few blocks
+static uint32_t encode_block_size(uint32_t block_size, bool size_known, uint64_t input_size, uint32_t threads) {
+	
+	if (block_size != 0) {
+		if (block_size < IMPACK_BLOCK_SIZE_MIN) {
+			return IMPACK_BLOCK_SIZE_MIN;
+		} else if (block_size > IMPACK_BLOCK_SIZE_MAX) {
+			return IMPACK_BLOCK_SIZE_MAX;
 		}
+		return block_size;
+	}
+	if (!size_known) {
+		return IMPACK_BLOCK_SIZE;
+	}
+	uint64_t target = input_size / ((uint64_t) threads * ENCODE_BLOCKS_PER_THREAD);
+	block_size = IMPACK_BLOCK_SIZE_AUTO_MIN;
+	while (block_size < IMPACK_BLOCK_SIZE_AUTO_MAX && (uint64_t) block_size * 2 <= target) {
+		block_size *= 2;
 	}
+	return block_size;
+	
+}
+
+// Encode everything from input into output, both are closed by the caller
+// volume is only used with format version 2 (and must be set for it)
+static impack_error_t encode_file(impack_ctx_t *ctx, impack_io_t *input, impack_io_t *output, const impack_encode_params_t *params, impack_img_format_t format, const encode_volume_t *volume) {
+	
+	const impack_key_cache_t *key_cache = params->key_cache;
+	uint32_t threads = (params->threads != 0) ? params->threads : impack_cpu_count();
+	const impack_img_format_desc_t *format_desc = impack_img_format_desc(format);
+	
+	uint64_t input_size = 0;
+	bool input_regular = (input->func_seek != NULL && input->func_size != NULL && input->func_size(input->ctx, &input_size)); // The size is known and the input can be read again
+	uint32_t block_size = encode_block_size(params->block_size, input_regular, input_size, threads);
 	
 	impack_error_t ret = ERROR_MALLOC;
-	uint8_t *input_buf = malloc(BUFSIZE);
+	impack_io_t data_tmp;
+	impack_io_t *data = NULL;
+	encode_blocks_t blocks;
+	memset(&blocks, 0, sizeof(encode_blocks_t));
+	blocks.index = ctx->index; // Keeps the buffer from earlier calls
+	blocks.index_size = ctx->index_size;
+	ctx->index = NULL;
+	ctx->index_size = 0;
+	uint64_t bufsize = IMPACK_CHUNK_SIZE;
+	uint64_t bufsize_total = IMPACK_CHUNK_SIZE * 2; // The compressor writes into input_buf while reading from the second half
+	if (params->compress == COMPRESSION_NONE) {
+		bufsize = BUFSIZE_UNCOMPRESSED;
+		bufsize_total = BUFSIZE_UNCOMPRESSED;
+	}
+	uint8_t *input_buf = NULL;
 	uint8_t *pixeldata = NULL;
+	uint64_t pixeldata_size = PIXELBUF_INITIAL;
+	impack_workers_t *crc_workers = NULL;
 #ifdef IMPACK_WITH_CRYPTO
 	impack_crypt_ctx_t encrypt_ctx;
 #endif
-	if (input_buf == NULL) {
+	if (!impack_block_reserve(&ctx->buf, &ctx->buf_size, bufsize_total)) {
 		goto cleanup;
 	}
-	pixeldata = malloc(PIXELBUF_STEP);
+	input_buf = ctx->buf;
+	pixeldata = impack_ctx_take_pixeldata(ctx, &pixeldata_size);
 	if (pixeldata == NULL) {
-		goto cleanup;
+		pixeldata_size = PIXELBUF_INITIAL;
+		pixeldata = calloc(1, PIXELBUF_INITIAL); // Unused channels must be zero
+		if (pixeldata == NULL) {
+			goto cleanup;
+		}
 	}
-	uint64_t pixeldata_size = PIXELBUF_STEP;
 	uint64_t pixeldata_pos = 3;
 	
-	pixeldata[0] = ((channels & CHANNEL_RED) != 0) ? 255 : 0;
-	pixeldata[1] = ((channels & CHANNEL_GREEN) != 0) ? 255 : 0;
-	pixeldata[2] = ((channels & CHANNEL_BLUE) != 0) ? 255 : 0;
+	pixeldata[0] = ((params->channels & CHANNEL_RED) != 0) ? 255 : 0;
+	pixeldata[1] = ((params->channels & CHANNEL_GREEN) != 0) ? 255 : 0;
+	pixeldata[2] = ((params->channels & CHANNEL_BLUE) != 0) ? 255 : 0;
 	
 	uint8_t magic[] = IMPACK_MAGIC_NUMBER;
-	pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, channels, magic, 4); // These will not fail, the buffer is large enough
-	uint8_t format_version = IMPACK_FORMAT_VERSION;
-	pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, channels, &format_version, 1);
-	uint8_t encryption_flag = encrypt;
-	pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, channels, &encryption_flag, 1);
-	uint8_t compression_flag = compress;
-	pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, channels, &compression_flag, 1);
+	pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, magic, 4); // These will not fail, the buffer is large enough
+	uint8_t version_flag = params->format_version;
+	pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, &version_flag, 1);
+	uint8_t encryption_flag = params->encrypt;
+	pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, &encryption_flag, 1);
+	uint8_t compression_flag = params->compress;
+	pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, &compression_flag, 1);
 	uint64_t length_offset = pixeldata_pos;
 	for (int i = 0; i < 8; i++) { // Add a dummy value that will be replaced when the length is known
 		uint8_t dummy = 0;
-		pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, channels, &dummy, 1);
+		pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, &dummy, 1);
 	}
-	char *input_filename = impack_filename(filename_include);
+	char *input_filename = impack_filename(params->filename_include);
 	uint32_t input_filename_length = strlen(input_filename);
 	uint32_t input_filename_length_endian = impack_endian32(input_filename_length);
-	pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, channels, (uint8_t*) &input_filename_length_endian, 4);
+	pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, (uint8_t*) &input_filename_length_endian, 4);
 	uint64_t crc_offset = pixeldata_pos;
 	for (int i = 0; i < 8; i++) { // More dummy bytes for the CRC
 		uint8_t dummy = 0;
-		pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, channels, &dummy, 1);
+		pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, &dummy, 1);
+	}
+	if (params->format_version != IMPACK_FORMAT_VERSION_STREAM) {
+		uint32_t block_size_endian = impack_endian32(block_size);
+		pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, (uint8_t*) &block_size_endian, 4);
+	}
+	if (params->format_version == IMPACK_FORMAT_VERSION_VOLUMES) {
+		uint32_t volume_number[2] = { impack_endian32(volume->number), impack_endian32(volume->count) };
+		uint64_t volume_position[2] = { impack_endian64(volume->offset), impack_endian64(volume->total) };
+		pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, (uint8_t*) volume_number, 8);
+		pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, (uint8_t*) volume_position, 16);
+		pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, (uint8_t*) volume->id, IMPACK_VOLUME_ID_SIZE);
 	}
 	
 #ifdef IMPACK_WITH_CRYPTO
-	if (encrypt) {
-		if (!impack_random(encrypt_ctx.iv, IMPACK_CRYPT_BLOCK_SIZE)) {
-			ret = ERROR_RANDOM;
-			goto cleanup;
-		}
-		if (!pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, channels, encrypt_ctx.iv, IMPACK_CRYPT_BLOCK_SIZE)) {
-			goto cleanup;
-		}
+	if (params->encrypt) {
 		uint8_t key[IMPACK_CRYPT_KEY_SIZE];
-		if (!impack_derive_key(passphrase, key, IMPACK_CRYPT_KEY_SIZE, encrypt_ctx.iv, IMPACK_CRYPT_BLOCK_SIZE, encrypt)) {
-			goto cleanup;
+		if (params->format_version != IMPACK_FORMAT_VERSION_STREAM) { // The key is derived from a master key (which may be reused for multiple files) and the IV
+			impack_key_cache_t session;
+			if (key_cache == NULL) {
+				ret = impack_key_cache_init(&session, params->encrypt, params->passphrase, params->kdf_params);
+				if (ret != ERROR_OK) {
+					goto cleanup;
+				}
+				key_cache = &session;
+			} else if (key_cache->encryption != params->encrypt) {
+				ret = ERROR_ENCRYPTION_UNSUPPORTED;
+				goto cleanup;
+			} else if (params->passphrase != NULL) {
+				impack_secure_erase((uint8_t*) params->passphrase, strlen(params->passphrase));
+			}
+			uint8_t kdf_header[IMPACK_CRYPT_BLOCK_SIZE + 12]; // Session salt, Argon2 parameters
+			uint64_t kdf_header_length = IMPACK_CRYPT_BLOCK_SIZE;
+			memcpy(kdf_header, key_cache->salt, IMPACK_CRYPT_BLOCK_SIZE);
+			if (impack_crypt_argon2(params->encrypt)) {
+				uint32_t kdf_params_endian[3] = { impack_endian32(key_cache->kdf_params.iterations), impack_endian32(key_cache->kdf_params.memory), impack_endian32(key_cache->kdf_params.lanes) };
+				memcpy(kdf_header + kdf_header_length, kdf_params_endian, 12);
+				kdf_header_length += 12;
+			}
+			bool random_ok = impack_random(encrypt_ctx.iv, IMPACK_CRYPT_BLOCK_SIZE);
+			if (random_ok) {
+				impack_derive_file_key(key_cache->master_key, encrypt_ctx.iv, key);
+			}
+			impack_secure_erase((uint8_t*) &session, sizeof(impack_key_cache_t));
+			key_cache = NULL;
+			ret = ERROR_RANDOM;
+			if (!random_ok) {
+				goto cleanup;
+			}
+			ret = ERROR_MALLOC;
+			if (!pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, kdf_header, kdf_header_length) || !pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, encrypt_ctx.iv, IMPACK_CRYPT_BLOCK_SIZE)) {
+				impack_secure_erase(key, IMPACK_CRYPT_KEY_SIZE);
+				goto cleanup;
+			}
+		} else {
+			if (!impack_random(encrypt_ctx.iv, IMPACK_CRYPT_BLOCK_SIZE)) {
+				ret = ERROR_RANDOM;
+				goto cleanup;
+			}
+			if (!pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, encrypt_ctx.iv, IMPACK_CRYPT_BLOCK_SIZE)) {
+				goto cleanup;
+			}
+			impack_kdf_params_t kdf = { IMPACK_ARGON2_ITERATIONS, IMPACK_ARGON2_MEMORY, 1 }; // Fixed parameters, the IV is also the salt
+			if (!impack_derive_key(params->passphrase, key, IMPACK_CRYPT_KEY_SIZE, encrypt_ctx.iv, IMPACK_CRYPT_BLOCK_SIZE, params->encrypt, &kdf)) {
+				goto cleanup;
+			}
+			impack_secure_erase((uint8_t*) params->passphrase, strlen(params->passphrase));
 		}
-		impack_set_encrypt_key(&encrypt_ctx, key, encrypt);
-		impack_secure_erase((uint8_t*) passphrase, strlen(passphrase));
+		impack_set_encrypt_key(&encrypt_ctx, key, params->encrypt);
 		impack_secure_erase(key, IMPACK_CRYPT_KEY_SIZE);
 	}
 #endif
@@ -176,7 +554,18 @@ impack_error_t impack_encode(char *input_path, char *output_path, impack_encrypt
 	char *input_filename_add = input_filename;
 	uint64_t input_filename_add_length = input_filename_length;
 #ifdef IMPACK_WITH_CRYPTO
-	if (encrypt != ENCRYPTION_NONE) {
+	if (impack_encryption_authenticated(params->encrypt)) { // The tag follows the filename, no padding
+		char *input_filename_sealed = malloc(input_filename_length + IMPACK_CRYPT_TAG_SIZE);
+		if (input_filename_sealed == NULL) {
+			goto cleanup;
+		}
+		memcpy(input_filename_sealed, input_filename, input_filename_length);
+		uint8_t nonce[IMPACK_CRYPT_NONCE_SIZE];
+		impack_crypt_nonce(nonce, 0, NONCE_FILENAME);
+		impack_encrypt_aead(&encrypt_ctx, nonce, (uint8_t*) input_filename_sealed, input_filename_length, (uint8_t*) input_filename_sealed + input_filename_length, params->encrypt);
+		input_filename_add = input_filename_sealed;
+		input_filename_add_length += IMPACK_CRYPT_TAG_SIZE;
+	} else if (params->encrypt != ENCRYPTION_NONE) {
 		if (input_filename_length % IMPACK_CRYPT_BLOCK_SIZE != 0) {
 			uint32_t padding = IMPACK_CRYPT_BLOCK_SIZE - (input_filename_length % IMPACK_CRYPT_BLOCK_SIZE);
 			char *input_filename_padded = malloc(input_filename_length + padding);
@@ -188,10 +577,10 @@ impack_error_t impack_encode(char *input_path, char *output_path, impack_encrypt
 			input_filename_add = input_filename_padded;
 			input_filename_add_length += padding;
 		}
-		impack_encrypt(&encrypt_ctx, (uint8_t*) input_filename_add, input_filename_add_length, encrypt);
+		impack_encrypt(&encrypt_ctx, (uint8_t*) input_filename_add, input_filename_add_length, params->encrypt);
 	}
 #endif
-	if (!pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, channels, (uint8_t*) input_filename_add, input_filename_add_length)) {
+	if (!pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, (uint8_t*) input_filename_add, input_filename_add_length)) {
 		if (input_filename_add != input_filename) {
 			free(input_filename_add);
 		}
@@ -201,119 +590,525 @@ impack_error_t impack_encode(char *input_path, char *output_path, impack_encrypt
 		free(input_filename_add);
 	}
 	
-#ifdef IMPACK_WITH_COMPRESSION
-	impack_compress_state_t compress_state;
-	if (compress != COMPRESSION_NONE) {
-		compress_state.type = compress;
-		compress_state.level = compress_level;
-		compress_state.is_compress = true;
-		compress_state.bufsize = BUFSIZE;
-		if (!impack_compress_init(&compress_state)) {
-			goto cleanup;
+	bool streaming = false;
+	if (params->format_version != IMPACK_FORMAT_VERSION_STREAM) {
+		if (encode_tmpfile(&data_tmp)) { // Processed blocks are kept here until the block index is complete (or in memory, if this fails)
+			data = &data_tmp;
+		}
+		streaming = (data != NULL && format_desc->func_write_rows != NULL);
+	} else if (format_desc->func_write_rows != NULL) { // Write the image row by row, the data is processed first to get the length and CRC
+		if (params->compress == COMPRESSION_NONE && input_regular) {
+			data = input; // Read the input twice
+			streaming = true;
+		} else {
+			if (encode_tmpfile(&data_tmp)) { // Keep a copy of the (compressed) data
+				data = &data_tmp;
+			}
+			streaming = (data != NULL); // Otherwise, fall back to building the image in memory
 		}
 	}
-	bool file_read_done = false;
+	if (params->format_version == IMPACK_FORMAT_VERSION_STREAM && !streaming && input_regular && params->compress == COMPRESSION_NONE) {
+		// The amount of data is known, so the final image size can be calculated and the pixel buffer only needs to be allocated once
+		uint64_t data_size = input_size;
+#ifdef IMPACK_WITH_CRYPTO
+		if (params->encrypt != ENCRYPTION_NONE && data_size % IMPACK_CRYPT_BLOCK_SIZE != 0) {
+			data_size += IMPACK_CRYPT_BLOCK_SIZE - (data_size % IMPACK_CRYPT_BLOCK_SIZE);
+		}
 #endif
+		uint64_t width = params->img_width;
+		uint64_t height = params->img_height;
+		ret = impack_img_size(impack_channels_end(pixeldata_pos, params->channels, data_size), &width, &height);
+		if (ret != ERROR_OK) {
+			goto cleanup;
+		}
+		ret = ERROR_MALLOC;
+		if (width * height * 3 > pixeldata_size && !pixelbuf_resize(&pixeldata, &pixeldata_size, width * height * 3)) {
+			goto cleanup;
+		}
+	}
 	
-	impack_crc_init();
 	uint64_t crc = 0;
 	uint64_t data_length = 0;
-	size_t bytes_read;
-	bool loop_running = true;
-	do {
+	if (params->format_version != IMPACK_FORMAT_VERSION_STREAM) {
+		impack_block_params_t block_params;
+		block_params.encryption = params->encrypt;
+		block_params.compression = params->compress;
+		block_params.compress_level = params->compress_level;
+#ifdef IMPACK_WITH_CRYPTO
+		if (params->encrypt != ENCRYPTION_NONE) {
+			memcpy(&block_params.crypt_ctx, &encrypt_ctx, sizeof(impack_crypt_ctx_t));
+		}
+#endif
+		blocks.file = data;
+		ret = encode_blocks(ctx, input, &blocks, &block_params, block_size, threads, &data_length, &crc);
+#ifdef IMPACK_WITH_CRYPTO
+		if (params->encrypt != ENCRYPTION_NONE) {
+			impack_secure_erase((uint8_t*) &block_params.crypt_ctx, sizeof(impack_crypt_ctx_t));
+		}
+#endif
+		if (ret != ERROR_OK) {
+			goto cleanup;
+		}
+		ret = ERROR_MALLOC;
+	} else {
 #ifdef IMPACK_WITH_COMPRESSION
-		if (compress != COMPRESSION_NONE) {
-			while (true) {
-				if (file_read_done) {
-					uint64_t flushlen;
-					if (impack_compress_flush(&compress_state, input_buf, &flushlen) == COMPRESSION_RES_FINAL) {
-						bytes_read = flushlen;
-						loop_running = false;
-						break;
-					} else {
-						bytes_read = BUFSIZE;
-						break;
-					}
-				} else {
-					uint64_t dummy;
-					if (impack_compress_read(&compress_state, input_buf, &dummy) == COMPRESSION_RES_AGAIN) {
-						bytes_read = fread(input_buf, 1, BUFSIZE, input_file);
-						impack_compress_write(&compress_state, input_buf, bytes_read);
-						if (bytes_read != BUFSIZE) {
-							file_read_done = true;
+		impack_compress_state_t compress_state;
+		if (params->compress != COMPRESSION_NONE) {
+			compress_state.type = params->compress;
+			compress_state.level = params->compress_level;
+			compress_state.threads = threads;
+			compress_state.is_compress = true;
+			compress_state.bufsize = IMPACK_CHUNK_SIZE;
+			if (!impack_compress_init(&compress_state)) {
+				goto cleanup;
+			}
+		}
+		bool file_read_done = false;
+#endif
+		if (bufsize > IMPACK_CHUNK_SIZE) { // Compressed chunks are too small to be split up
+			crc_workers = impack_workers_new(threads);
+		}
+	
+		size_t bytes_read;
+		bool loop_running = true;
+		do {
+#ifdef IMPACK_WITH_COMPRESSION
+			if (params->compress != COMPRESSION_NONE) {
+				while (true) {
+					if (file_read_done) {
+						uint64_t flushlen;
+						if (impack_compress_flush(&compress_state, input_buf, &flushlen) == COMPRESSION_RES_FINAL) {
+							bytes_read = flushlen;
+							loop_running = false;
+							break;
+						} else {
+							bytes_read = IMPACK_CHUNK_SIZE;
+							break;
 						}
 					} else {
-						bytes_read = BUFSIZE;
-						break;
+						uint64_t dummy;
+						if (impack_compress_read(&compress_state, input_buf, &dummy) == COMPRESSION_RES_AGAIN) {
+							uint8_t *compress_buf = input_buf + IMPACK_CHUNK_SIZE;
+							bytes_read = impack_io_read(input, compress_buf, IMPACK_CHUNK_SIZE);
+							impack_compress_write(&compress_state, compress_buf, bytes_read);
+							if (bytes_read != IMPACK_CHUNK_SIZE) {
+								file_read_done = true;
+							}
+						} else {
+							bytes_read = IMPACK_CHUNK_SIZE;
+							break;
+						}
 					}
 				}
-			}
-		} else {
+			} else {
 #endif
-			bytes_read = fread(input_buf, 1, BUFSIZE, input_file);
+				bytes_read = impack_io_read(input, input_buf, bufsize);
 #ifdef IMPACK_WITH_COMPRESSION
-		}
-#endif
-		data_length += bytes_read;
-		impack_crc(&crc, input_buf, bytes_read);
-#ifdef IMPACK_WITH_CRYPTO
-		if (encrypt != ENCRYPTION_NONE) {
-			if (bytes_read % IMPACK_CRYPT_BLOCK_SIZE != 0) {
-				uint32_t padding = IMPACK_CRYPT_BLOCK_SIZE - (bytes_read % IMPACK_CRYPT_BLOCK_SIZE);
-				memset(input_buf + bytes_read, 0, padding); // The buffer size is a multiple of the block size, there is always enough space for padding when it's needed
-				bytes_read += padding;
 			}
-			impack_encrypt(&encrypt_ctx, input_buf, bytes_read, encrypt);
-		}
 #endif
-		if (!pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, channels, input_buf, bytes_read)) {
-			goto cleanup;
-		}
-	} while (bytes_read == BUFSIZE && loop_running);
-	free(input_buf);
+			data_length += bytes_read;
+			impack_crc_parallel(&crc, input_buf, bytes_read, crc_workers);
+			if (streaming) {
+				if (data != input && !impack_io_write(data, input_buf, bytes_read)) {
+					ret = ERROR_OUTPUT_IO;
+					goto cleanup;
+				}
+			} else {
 #ifdef IMPACK_WITH_CRYPTO
-	if (encrypt != ENCRYPTION_NONE) {
-		impack_secure_erase((uint8_t*) &encrypt_ctx, sizeof(impack_encryption_type_t));
-	}
+				if (params->encrypt != ENCRYPTION_NONE) {
+					if (bytes_read % IMPACK_CRYPT_BLOCK_SIZE != 0) {
+						uint32_t padding = IMPACK_CRYPT_BLOCK_SIZE - (bytes_read % IMPACK_CRYPT_BLOCK_SIZE);
+						memset(input_buf + bytes_read, 0, padding); // The buffer size is a multiple of the block size, there is always enough space for padding when it's needed
+						bytes_read += padding;
+					}
+					impack_encrypt(&encrypt_ctx, input_buf, bytes_read, params->encrypt);
+				}
 #endif
+				if (!pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, input_buf, bytes_read)) {
+					goto cleanup;
+				}
+			}
+		} while (bytes_read == bufsize && loop_running);
 #ifdef IMPACK_WITH_COMPRESSION
-	if (compress != COMPRESSION_NONE) {
-		impack_compress_free(&compress_state);
-	}
+		if (params->compress != COMPRESSION_NONE) {
+			impack_compress_free(&compress_state);
+		}
 #endif
-	if (!feof(input_file)) {
+	}
+	if (input->error) {
+		ret = ERROR_INPUT_IO;
 		goto cleanup;
 	}
-	fclose(input_file);
 	
+	uint64_t data_length_stored = data_length;
+	impack_encryption_type_t encrypt_stream = params->encrypt; // Encryption that still needs to be applied while building the image
 	data_length = impack_endian64(data_length);
-	pixelbuf_add(&pixeldata, &pixeldata_size, &length_offset, channels, (uint8_t*) &data_length, 8);
+	pixelbuf_add(&pixeldata, &pixeldata_size, &length_offset, params->channels, (uint8_t*) &data_length, 8);
 	crc = impack_endian64(crc);
-	pixelbuf_add(&pixeldata, &pixeldata_size, &crc_offset, channels, (uint8_t*) &crc, 8);
+	pixelbuf_add(&pixeldata, &pixeldata_size, &crc_offset, params->channels, (uint8_t*) &crc, 8);
+	if (params->format_version != IMPACK_FORMAT_VERSION_STREAM) {
+		uint64_t block_count = impack_endian64(blocks.block_count);
+		if (!pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, (uint8_t*) &block_count, 8)) {
+			goto cleanup;
+		}
+		if (!pixelbuf_add(&pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, blocks.index, blocks.index_length)) {
+			goto cleanup;
+		}
+		data_length_stored = blocks.length; // The blocks are already encrypted and padded
+		encrypt_stream = ENCRYPTION_NONE;
+	}
 	
-	impack_error_t res = impack_write_img(output_path, output_file, &pixeldata, pixeldata_size, pixeldata_pos, img_width, img_height, format);
-	fclose(output_file);
-	free(pixeldata);
+	impack_error_t res;
+	if (streaming) {
+		uint64_t data_size = data_length_stored;
+#ifdef IMPACK_WITH_CRYPTO
+		if (encrypt_stream != ENCRYPTION_NONE && data_size % IMPACK_CRYPT_BLOCK_SIZE != 0) {
+			data_size += IMPACK_CRYPT_BLOCK_SIZE - (data_size % IMPACK_CRYPT_BLOCK_SIZE);
+		}
+#endif
+		uint64_t width = params->img_width;
+		uint64_t height = params->img_height;
+		res = impack_img_size(impack_channels_end(pixeldata_pos, params->channels, data_size), &width, &height);
+		if (res == ERROR_OK && !impack_io_seek(data, 0)) {
+			res = ERROR_INPUT_IO;
+		}
+		if (res == ERROR_OK) {
+			encode_stream_t stream;
+			stream.data = data;
+			stream.data_remaining = data_length_stored;
+			stream.buf = input_buf;
+			stream.channels = params->channels;
+			stream.encrypt = encrypt_stream;
+#ifdef IMPACK_WITH_CRYPTO
+			stream.crypt_ctx = &encrypt_ctx;
+#endif
+			stream.pixeldata = pixeldata;
+			stream.pixeldata_size = pixeldata_size;
+			stream.pixeldata_pos = pixeldata_pos;
+			stream.row_start = 0;
+			stream.row_size = width * 3;
+			res = format_desc->func_write_rows(output, encode_stream_row, &stream, width, height);
+			pixeldata = stream.pixeldata;
+			pixeldata_size = stream.pixeldata_size;
+			pixeldata_pos = stream.pixeldata_pos;
+		}
+	} else {
+		if (params->format_version != IMPACK_FORMAT_VERSION_STREAM) {
+			ret = encode_blocks_copy(&blocks, input_buf, bufsize, &pixeldata, &pixeldata_size, &pixeldata_pos, params->channels, params->img_width, params->img_height);
+			if (ret != ERROR_OK) {
+				goto cleanup;
+			}
+		}
+		res = impack_write_img(output, &pixeldata, pixeldata_size, pixeldata_pos, params->img_width, params->img_height, format);
+	}
+#ifdef IMPACK_WITH_CRYPTO
+	if (params->encrypt != ENCRYPTION_NONE) {
+		impack_secure_erase((uint8_t*) &encrypt_ctx, sizeof(impack_crypt_ctx_t));
+	}
+#endif
+	if (data == &data_tmp) {
+		impack_io_close(&data_tmp);
+	}
+	impack_workers_free(crc_workers);
+	free(blocks.data);
+	ctx->index = blocks.index;
+	ctx->index_size = blocks.index_size;
+	impack_ctx_keep_pixeldata(ctx, pixeldata, pixeldata_size, pixeldata_pos); // Everything after pixeldata_pos is still zero
+	impack_ctx_trim(ctx);
 	return res;
 	
 cleanup:
 #ifdef IMPACK_WITH_CRYPTO
-	if (encrypt != ENCRYPTION_NONE) {
-		if (passphrase[0] != 0) {
-			impack_secure_erase((uint8_t*) passphrase, strlen(passphrase));
+	if (params->encrypt != ENCRYPTION_NONE) {
+		if (params->passphrase != NULL && params->passphrase[0] != 0) {
+			impack_secure_erase((uint8_t*) params->passphrase, strlen(params->passphrase));
 		} else {
 			impack_secure_erase((uint8_t*) &encrypt_ctx, sizeof(impack_crypt_ctx_t));
 		}
 	}
 #endif
-	fclose(input_file);
-	fclose(output_file);
-	if (input_buf != NULL) {
-		free(input_buf);
+	if (data == &data_tmp) {
+		impack_io_close(&data_tmp);
 	}
+	impack_workers_free(crc_workers);
+	free(blocks.data);
+	ctx->index = blocks.index;
+	ctx->index_size = blocks.index_size;
 	if (pixeldata != NULL) {
 		free(pixeldata);
 	}
+	impack_ctx_trim(ctx);
+	return ret;
+	
+}
+
+void impack_encode_params_init(impack_encode_params_t *params) {
+	
+	params->encrypt = ENCRYPTION_NONE;
+	params->passphrase = NULL;
+	params->kdf_params = NULL;
+	params->key_cache = NULL;
+	params->compress = COMPRESSION_NONE;
+	params->compress_level = 0;
+	params->channels = CHANNEL_RED | CHANNEL_GREEN | CHANNEL_BLUE;
+	params->img_width = 0;
+	params->img_height = 0;
+	params->format = FORMAT_AUTO;
+	params->filename_include = NULL;
+	params->format_version = IMPACK_FORMAT_VERSION_STREAM;
+	params->threads = 0;
+	params->block_size = 0;
+	
+}
+
+impack_error_t impack_encode(char *input_path, char *output_path, const impack_encode_params_t *params) {
+	
+	impack_ctx_t ctx;
+	impack_ctx_init(&ctx);
+	impack_error_t res = impack_encode_ctx(&ctx, input_path, output_path, params);
+	impack_ctx_clear(&ctx);
+	return res;
+	
+}
+
+impack_error_t impack_encode_ctx(impack_ctx_t *ctx, char *input_path, char *output_path, const impack_encode_params_t *params) {
+	
+	impack_error_t res = encode_version_check(params);
+	if (res != ERROR_OK) {
+		return res;
+	}
+	FILE *input_file, *output_file;
+	if (strlen(input_path) == 1 && input_path[0] == '-') {
+		input_file = stdin;
+	} else {
+		res = encode_open(input_path, true, &input_file);
+	}
+	if (res == ERROR_OK) {
+		if (strlen(output_path) == 1 && output_path[0] == '-') {
+			output_file = stdout;
+		} else {
+			res = encode_open(output_path, false, &output_file);
+			if (res != ERROR_OK) {
+				fclose(input_file);
+			}
+		}
+	}
+	if (res != ERROR_OK) {
+#ifdef IMPACK_WITH_CRYPTO
+		if (params->encrypt != ENCRYPTION_NONE && params->passphrase != NULL) {
+			impack_secure_erase((uint8_t*) params->passphrase, strlen(params->passphrase));
+		}
+#endif
+		return res;
+	}
+	
+	impack_io_t input, output;
+	bool input_open = impack_io_open_file(&input, input_file);
+	if (!input_open || !impack_io_open_file(&output, output_file)) {
+		if (input_open) {
+			impack_io_close(&input);
+		} else {
+			fclose(input_file);
+		}
+		fclose(output_file);
+#ifdef IMPACK_WITH_CRYPTO
+		if (params->encrypt != ENCRYPTION_NONE && params->passphrase != NULL) {
+			impack_secure_erase((uint8_t*) params->passphrase, strlen(params->passphrase));
+		}
+#endif
+		return ERROR_MALLOC;
+	}
+	res = encode_file(ctx, &input, &output, params, impack_output_format(output_path, params->format), NULL);
+	impack_io_close(&input);
+	impack_io_close(&output);
+	return res;
+	
+}
+
+impack_error_t impack_encode_mem(impack_ctx_t *ctx, const uint8_t *input, uint64_t input_size, uint8_t **output, uint64_t *output_size, const impack_encode_params_t *params) {
+	
+	*output = NULL;
+	*output_size = 0;
+	impack_io_t input_io, output_io;
+	if (!impack_io_open_mem(&input_io, input, input_size)) {
+#ifdef IMPACK_WITH_CRYPTO
+		if (params->encrypt != ENCRYPTION_NONE && params->passphrase != NULL) {
+			impack_secure_erase((uint8_t*) params->passphrase, strlen(params->passphrase));
+		}
+#endif
+		return ERROR_MALLOC;
+	}
+	impack_io_buf_t output_buf;
+	impack_io_open_buf(&output_io, &output_buf);
+	impack_error_t res = impack_encode_io(ctx, &input_io, &output_io, params);
+	if (res == ERROR_OK) {
+		*output = output_buf.data;
+		*output_size = output_buf.size;
+	} else {
+		free(output_buf.data);
+	}
+	return res;
+	
+}
+
+impack_error_t impack_encode_io(impack_ctx_t *ctx, impack_io_t *input, impack_io_t *output, const impack_encode_params_t *params) {
+	
+	impack_io_start(input);
+	impack_io_start(output);
+	impack_error_t res = encode_version_check(params);
+	if (res == ERROR_OK) {
+		impack_img_format_t format = params->format;
+		if (format == FORMAT_AUTO) { // No filename to take the format from
+			format = impack_default_img_format();
+		}
+		impack_ctx_t ctx_local;
+		if (ctx == NULL) {
+			impack_ctx_init(&ctx_local);
+		}
+		res = encode_file((ctx != NULL) ? ctx : &ctx_local, input, output, params, format, NULL);
+		if (ctx == NULL) {
+			impack_ctx_clear(&ctx_local);
+		}
+	}
+	impack_io_close(input);
+	impack_io_close(output);
+	return res;
+	
+}
+
+// Encode one volume, used with impack_parallel()
+static void encode_volumes_job(void *item) {
+	
+	encode_volumes_job_t *job = item;
+	const encode_volumes_params_t *params = job->params;
+	FILE *input_file, *output_file;
+	job->res = encode_open(params->input_path, true, &input_file);
+	if (job->res != ERROR_OK) {
+		return;
+	}
+	impack_io_t file, input, output;
+	if (!impack_io_open_file(&file, input_file)) {
+		fclose(input_file);
+		job->res = ERROR_MALLOC;
+		return;
+	}
+	if (!impack_io_open_slice(&input, &file, job->volume.offset, job->volume.length)) {
+		impack_io_close(&file);
+		job->res = ERROR_INPUT_IO;
+		return;
+	}
+	job->res = encode_open(job->output_path, false, &output_file);
+	if (job->res != ERROR_OK) {
+		impack_io_close(&input);
+		return;
+	}
+	if (!impack_io_open_file(&output, output_file)) {
+		fclose(output_file);
+		impack_io_close(&input);
+		job->res = ERROR_MALLOC;
+		return;
+	}
+	impack_ctx_t ctx;
+	impack_ctx_init(&ctx);
+	job->res = encode_file(&ctx, &input, &output, &params->encode, impack_output_format(job->output_path, params->encode.format), &job->volume);
+	impack_ctx_clear(&ctx);
+	impack_io_close(&input);
+	impack_io_close(&output);
+	
+}
+
+impack_error_t impack_encode_volumes(char *input_path, char **output_paths, uint32_t volume_count, const impack_encode_params_t *params) {
+	
+	encode_volumes_job_t *jobs = NULL;
+	char *passphrase = params->passphrase;
+	const impack_key_cache_t *key_cache = params->key_cache;
+	impack_error_t ret = ERROR_VOLUMES_INCOMPLETE;
+	if (volume_count == 0) {
+		goto cleanup;
+	}
+	
+	// The volumes are cut from the input by offset, so its size must be known
+	FILE *input_file;
+	ret = encode_open(input_path, true, &input_file);
+	if (ret != ERROR_OK) {
+		goto cleanup;
+	}
+	impack_io_t input;
+	if (!impack_io_open_file(&input, input_file)) {
+		fclose(input_file);
+		ret = ERROR_MALLOC;
+		goto cleanup;
+	}
+	uint64_t input_size;
+	bool input_regular = (input.func_seek != NULL && input.func_size != NULL && input.func_size(input.ctx, &input_size));
+	impack_io_close(&input);
+	if (!input_regular) {
+		ret = ERROR_INPUT_IO;
+		goto cleanup;
+	}
+	
+	ret = ERROR_MALLOC;
+	jobs = malloc(sizeof(encode_volumes_job_t) * volume_count);
+	if (jobs == NULL) {
+		goto cleanup;
+	}
+	uint8_t volume_id[IMPACK_VOLUME_ID_SIZE];
+	if (!impack_random(volume_id, IMPACK_VOLUME_ID_SIZE)) {
+		ret = ERROR_RANDOM;
+		goto cleanup;
+	}
+#ifdef IMPACK_WITH_CRYPTO
+	impack_key_cache_t session;
+	if (params->encrypt != ENCRYPTION_NONE && key_cache == NULL) { // Derive the key only once for all volumes
+		ret = impack_key_cache_init(&session, params->encrypt, passphrase, params->kdf_params);
+		passphrase = NULL;
+		if (ret != ERROR_OK) {
+			goto cleanup;
+		}
+		key_cache = &session;
+	}
+#endif
+	
+	uint32_t threads = (params->threads != 0) ? params->threads : impack_cpu_count();
+	uint32_t workers = (volume_count < threads) ? volume_count : threads;
+	encode_volumes_params_t volumes_params;
+	volumes_params.input_path = input_path;
+	volumes_params.encode = *params;
+	volumes_params.encode.passphrase = NULL;
+	volumes_params.encode.kdf_params = NULL;
+	volumes_params.encode.key_cache = key_cache;
+	volumes_params.encode.format_version = IMPACK_FORMAT_VERSION_VOLUMES;
+	volumes_params.encode.threads = (threads / workers > 1) ? threads / workers : 1; // Each volume uses its share of the threads for its blocks
+	uint64_t part = input_size / volume_count;
+	for (uint32_t i = 0; i < volume_count; i++) {
+		jobs[i].params = &volumes_params;
+		jobs[i].output_path = output_paths[i];
+		jobs[i].volume.number = i;
+		jobs[i].volume.count = volume_count;
+		jobs[i].volume.offset = part * i;
+		jobs[i].volume.length = (i == volume_count - 1) ? input_size - (part * i) : part; // The last volume also gets the remainder
+		jobs[i].volume.total = input_size;
+		memcpy(jobs[i].volume.id, volume_id, IMPACK_VOLUME_ID_SIZE);
+		jobs[i].res = ERROR_OK;
+	}
+	impack_parallel(encode_volumes_job, jobs, sizeof(encode_volumes_job_t), volume_count, workers);
+#ifdef IMPACK_WITH_CRYPTO
+	if (key_cache == &session) {
+		impack_key_cache_free(&session);
+	}
+#endif
+	ret = ERROR_OK;
+	for (uint32_t i = 0; i < volume_count && ret == ERROR_OK; i++) {
+		ret = jobs[i].res;
+	}
+	
+cleanup:
+#ifdef IMPACK_WITH_CRYPTO
+	if (params->encrypt != ENCRYPTION_NONE && passphrase != NULL) {
+		impack_secure_erase((uint8_t*) passphrase, strlen(passphrase));
+	}
+#endif
+	free(jobs);
 	return ret;
 	
 }
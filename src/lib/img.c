@@ -16,8 +16,10 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include "config.h"
 #include "impack.h"
+#include "impack_internal.h"
 #include "img.h"
 
 #ifdef IMPACK_WITH_PNG
@@ -28,7 +30,9 @@ const impack_img_format_desc_t impack_img_format_png = {
 	"*.png",
 	NULL,
 	impack_read_img_png,
+	impack_read_img_png_rows,
 	impack_write_img_png,
+	impack_write_img_png_rows,
 	impack_magic_png,
 	8, 0, 1
 };
@@ -42,7 +46,9 @@ const impack_img_format_desc_t impack_img_format_webp = {
 	"*.webp",
 	NULL,
 	impack_read_img_webp,
+	NULL,
 	impack_write_img_webp,
+	NULL,
 	impack_magic_webp,
 	4, 0, 1
 };
@@ -60,7 +66,9 @@ const impack_img_format_desc_t impack_img_format_tiff = {
 	"*.tiff",
 	impack_extension_alt_tiff,
 	impack_read_img_tiff,
+	impack_read_img_tiff_rows,
 	impack_write_img_tiff,
+	impack_write_img_tiff_rows,
 	impack_magic_tiff,
 	4, 0, 2
 };
@@ -74,7 +82,9 @@ const impack_img_format_desc_t impack_img_format_bmp = {
 	"*.bmp",
 	NULL,
 	impack_read_img_bmp,
+	impack_read_img_bmp_rows,
 	impack_write_img_bmp,
+	impack_write_img_bmp_rows,
 	impack_magic_bmp,
 	2, 0, 1
 };
@@ -89,7 +99,9 @@ const impack_img_format_desc_t impack_img_format_jp2k = {
 	"*.jp2",
 	impack_extension_alt_jp2k,
 	impack_read_img_jp2k,
+	NULL,
 	impack_write_img_jp2k,
+	NULL,
 	impack_magic_jp2k,
 	12, 0, 1
 };
@@ -103,7 +115,9 @@ const impack_img_format_desc_t impack_img_format_flif = {
 	"*.flif",
 	NULL,
 	impack_read_img_flif,
+	NULL,
 	impack_write_img_flif,
+	NULL,
 	impack_magic_flif,
 	4, 0, 1
 };
@@ -118,7 +132,9 @@ const impack_img_format_desc_t impack_img_format_jxr = {
 	"*.jxr",
 	impack_extension_alt_jxr,
 	impack_read_img_jxr,
+	NULL,
 	impack_write_img_jxr,
+	NULL,
 	impack_magic_jxr,
 	8, 0, 1
 };
@@ -133,7 +149,9 @@ const impack_img_format_desc_t impack_img_format_jpegls = {
 	"*.jls",
 	impack_extension_alt_jpegls,
 	impack_read_img_jpegls,
+	NULL,
 	impack_write_img_jpegls,
+	NULL,
 	impack_magic_jpegls,
 	4, 0, 1
 };
@@ -148,7 +166,9 @@ const impack_img_format_desc_t impack_img_format_heif = {
 	"*.heic",
 	impack_extension_alt_heif,
 	impack_read_img_heif,
+	NULL,
 	impack_write_img_heif,
+	NULL,
 	impack_magic_heif,
 	8, 4, 1
 };
@@ -162,7 +182,9 @@ const impack_img_format_desc_t impack_img_format_avif = {
 	"*.avif",
 	NULL,
 	impack_read_img_avif,
+	NULL,
 	impack_write_img_avif,
+	NULL,
 	impack_magic_avif,
 	8, 4, 1
 };
@@ -176,7 +198,9 @@ const impack_img_format_desc_t impack_img_format_jxl = {
 	"*.jxl",
 	NULL,
 	impack_read_img_jxl,
+	NULL,
 	impack_write_img_jxl,
+	NULL,
 	impack_magic_jxl,
 	2, 0, 1
 };
@@ -218,3 +242,49 @@ const impack_img_format_desc_t *impack_img_formats[] = {
 #endif
 	NULL
 };
+
+// Same formats, indexed by impack_img_format_t (NULL for formats that aren't compiled in)
+static const impack_img_format_desc_t *img_formats_by_id[IMPACK_IMG_FORMAT_COUNT] = {
+#ifdef IMPACK_WITH_PNG
+	[FORMAT_PNG] = &impack_img_format_png,
+#endif
+#ifdef IMPACK_WITH_WEBP
+	[FORMAT_WEBP] = &impack_img_format_webp,
+#endif
+#ifdef IMPACK_WITH_TIFF
+	[FORMAT_TIFF] = &impack_img_format_tiff,
+#endif
+#ifdef IMPACK_WITH_BMP
+	[FORMAT_BMP] = &impack_img_format_bmp,
+#endif
+#ifdef IMPACK_WITH_JP2K
+	[FORMAT_JP2K] = &impack_img_format_jp2k,
+#endif
+#ifdef IMPACK_WITH_FLIF
+	[FORMAT_FLIF] = &impack_img_format_flif,
+#endif
+#ifdef IMPACK_WITH_JXR
+	[FORMAT_JXR] = &impack_img_format_jxr,
+#endif
+#ifdef IMPACK_WITH_JPEGLS
+	[FORMAT_JPEGLS] = &impack_img_format_jpegls,
+#endif
+#ifdef IMPACK_WITH_HEIF
+	[FORMAT_HEIF] = &impack_img_format_heif,
+#endif
+#ifdef IMPACK_WITH_AVIF
+	[FORMAT_AVIF] = &impack_img_format_avif,
+#endif
+#ifdef IMPACK_WITH_JXL
+	[FORMAT_JXL] = &impack_img_format_jxl,
+#endif
+};
+
+const impack_img_format_desc_t* impack_img_format_desc(impack_img_format_t format) {
+	
+	if ((unsigned int) format >= IMPACK_IMG_FORMAT_COUNT || img_formats_by_id[format] == NULL) {
+		abort(); // Requested a format that isn't compiled in
+	}
+	return img_formats_by_id[format];
+	
+}
@@ -0,0 +1,470 @@
+/* This file is part of ImPack2.
+ *
+ * ImPack2 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ImPack2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ImPack2. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _POSIX_C_SOURCE 200112L // For fileno() and fseeko()
+#include "config.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef IMPACK_WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "impack.h"
+#include "impack_internal.h"
+
+typedef struct {
+	FILE *file;
+	uint8_t *map; // Whole file, if it was memory-mapped
+	uint64_t map_size;
+	bool map_failed;
+} io_file_t;
+
+typedef struct {
+	const uint8_t *data;
+	uint64_t size;
+	uint64_t pos;
+} io_mem_t;
+
+typedef struct {
+	impack_io_t base;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t pos;
+} io_slice_t;
+
+typedef struct {
+	impack_io_t *base;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t pos;
+} io_window_t;
+
+void impack_io_start(impack_io_t *io) {
+	
+	io->pos = 0;
+	io->eof = false;
+	io->error = false;
+	
+}
+
+uint64_t impack_io_read(impack_io_t *io, uint8_t *buf, uint64_t len) {
+	
+	uint64_t done = 0;
+	while (done < len) {
+		int64_t res = io->func_read(io->ctx, buf + done, len - done);
+		if (res <= 0) {
+			if (res < 0) {
+				io->error = true;
+			} else {
+				io->eof = true;
+			}
+			break;
+		}
+		done += res;
+	}
+	io->pos += done;
+	return done;
+	
+}
+
+bool impack_io_write(impack_io_t *io, const uint8_t *buf, uint64_t len) {
+	
+	if (len == 0) {
+		return true;
+	}
+	if (!io->func_write(io->ctx, buf, len)) {
+		io->error = true;
+		return false;
+	}
+	io->pos += len;
+	return true;
+	
+}
+
+bool impack_io_seek(impack_io_t *io, uint64_t pos) {
+	
+	if (io->func_seek == NULL || !io->func_seek(io->ctx, pos)) {
+		return false;
+	}
+	io->pos = pos;
+	io->eof = false;
+	return true;
+	
+}
+
+void impack_io_close(impack_io_t *io) {
+	
+	if (io->func_close != NULL) {
+		io->func_close(io->ctx);
+		io->func_close = NULL;
+	}
+	
+}
+
+static int64_t io_file_read(void *ctx, uint8_t *buf, uint64_t len) {
+	
+	io_file_t *file = ctx;
+	size_t bytes_read = fread(buf, 1, (len > SIZE_MAX) ? SIZE_MAX : len, file->file);
+	if (bytes_read == 0 && ferror(file->file)) {
+		return -1;
+	}
+	return bytes_read;
+	
+}
+
+static bool io_file_write(void *ctx, const uint8_t *buf, uint64_t len) {
+	
+	io_file_t *file = ctx;
+	return fwrite(buf, 1, len, file->file) == len;
+	
+}
+
+static bool io_file_seek(void *ctx, uint64_t pos) {
+	
+	io_file_t *file = ctx;
+#ifndef IMPACK_WINDOWS
+	return fseeko(file->file, pos, SEEK_SET) == 0;
+#else
+	return _fseeki64(file->file, pos, SEEK_SET) == 0;
+#endif
+	
+}
+
+static bool io_file_size(void *ctx, uint64_t *size) {
+	
+#ifndef IMPACK_WINDOWS
+	io_file_t *file = ctx;
+	struct stat st;
+	if (fstat(fileno(file->file), &st) != 0 || !S_ISREG(st.st_mode)) {
+		return false;
+	}
+	*size = st.st_size;
+	return true;
+#else
+	return false;
+#endif
+	
+}
+
+// Map the whole file, this only works if it's a regular file
+static const uint8_t* io_file_data(void *ctx, uint64_t *size) {
+	
+#ifndef IMPACK_WINDOWS
+	io_file_t *file = ctx;
+	if (file->map == NULL && !file->map_failed) {
+		file->map_failed = true;
+		uint64_t filesize;
+		if (!io_file_size(ctx, &filesize) || filesize == 0 || filesize > SIZE_MAX) {
+			return NULL;
+		}
+		// Private mapping, in case a library writes to its input buffer (this won't change the file)
+		uint8_t *map = mmap(NULL, filesize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file->file), 0);
+		if (map == MAP_FAILED) {
+			return NULL;
+		}
+		file->map = map;
+		file->map_size = filesize;
+		file->map_failed = false;
+	}
+	*size = file->map_size;
+	return file->map;
+#else
+	return NULL;
+#endif
+	
+}
+
+static void io_file_close(void *ctx) {
+	
+	io_file_t *file = ctx;
+#ifndef IMPACK_WINDOWS
+	if (file->map != NULL) {
+		munmap(file->map, file->map_size);
+	}
+#endif
+	fclose(file->file);
+	free(file);
+	
+}
+
+bool impack_io_open_file(impack_io_t *io, FILE *f) {
+	
+	io_file_t *file = malloc(sizeof(io_file_t));
+	if (file == NULL) {
+		return false;
+	}
+	file->file = f;
+	file->map = NULL;
+	file->map_size = 0;
+	file->map_failed = false;
+	io->ctx = file;
+	io->func_read = io_file_read;
+	io->func_write = io_file_write;
+	io->func_seek = io_file_seek;
+#ifndef IMPACK_WINDOWS
+	int flags = fcntl(fileno(f), F_GETFL);
+	if (flags != -1 && (flags & O_APPEND)) { // Writes always go to the end, seeking back can't update the output
+		io->func_seek = NULL;
+	}
+#endif
+	io->func_size = io_file_size;
+	io->func_data = io_file_data;
+	io->func_close = io_file_close;
+	impack_io_start(io);
+	return true;
+	
+}
+
+static int64_t io_mem_read(void *ctx, uint8_t *buf, uint64_t len) {
+	
+	io_mem_t *mem = ctx;
+	if (len > mem->size - mem->pos) {
+		len = mem->size - mem->pos;
+	}
+	memcpy(buf, mem->data + mem->pos, len);
+	mem->pos += len;
+	return len;
+	
+}
+
+static bool io_mem_seek(void *ctx, uint64_t pos) {
+	
+	io_mem_t *mem = ctx;
+	if (pos > mem->size) {
+		return false;
+	}
+	mem->pos = pos;
+	return true;
+	
+}
+
+static bool io_mem_size(void *ctx, uint64_t *size) {
+	
+	io_mem_t *mem = ctx;
+	*size = mem->size;
+	return true;
+	
+}
+
+static const uint8_t* io_mem_data(void *ctx, uint64_t *size) {
+	
+	io_mem_t *mem = ctx;
+	*size = mem->size;
+	return mem->data;
+	
+}
+
+bool impack_io_open_mem(impack_io_t *io, const uint8_t *data, uint64_t size) {
+	
+	io_mem_t *mem = malloc(sizeof(io_mem_t));
+	if (mem == NULL) {
+		return false;
+	}
+	mem->data = data;
+	mem->size = size;
+	mem->pos = 0;
+	io->ctx = mem;
+	io->func_read = io_mem_read;
+	io->func_write = NULL;
+	io->func_seek = io_mem_seek;
+	io->func_size = io_mem_size;
+	io->func_data = io_mem_data;
+	io->func_close = free;
+	impack_io_start(io);
+	return true;
+	
+}
+
+static bool io_buf_write(void *ctx, const uint8_t *buf, uint64_t len) {
+	
+	impack_io_buf_t *out = ctx;
+	if (!impack_block_reserve(&out->data, &out->capacity, out->pos + len)) {
+		return false;
+	}
+	if (out->pos > out->size) { // Seeked past the end, fill the gap
+		memset(out->data + out->size, 0, out->pos - out->size);
+	}
+	memcpy(out->data + out->pos, buf, len);
+	out->pos += len;
+	if (out->pos > out->size) {
+		out->size = out->pos;
+	}
+	return true;
+	
+}
+
+static bool io_buf_seek(void *ctx, uint64_t pos) {
+	
+	impack_io_buf_t *out = ctx;
+	out->pos = pos;
+	return true;
+	
+}
+
+void impack_io_open_buf(impack_io_t *io, impack_io_buf_t *buf) {
+	
+	buf->data = NULL;
+	buf->size = 0;
+	buf->capacity = 0;
+	buf->pos = 0;
+	io->ctx = buf;
+	io->func_read = NULL;
+	io->func_write = io_buf_write;
+	io->func_seek = io_buf_seek;
+	io->func_size = NULL;
+	io->func_data = NULL;
+	io->func_close = NULL;
+	impack_io_start(io);
+	
+}
+
+static int64_t io_slice_read(void *ctx, uint8_t *buf, uint64_t len) {
+	
+	io_slice_t *slice = ctx;
+	if (len > slice->length - slice->pos) {
+		len = slice->length - slice->pos;
+	}
+	uint64_t done = impack_io_read(&slice->base, buf, len);
+	if (slice->base.error) {
+		return -1;
+	}
+	slice->pos += done;
+	return done;
+	
+}
+
+static bool io_slice_write(void *ctx, const uint8_t *buf, uint64_t len) {
+	
+	io_slice_t *slice = ctx;
+	if (!impack_io_write(&slice->base, buf, len)) {
+		return false;
+	}
+	slice->pos += len;
+	return true;
+	
+}
+
+static bool io_slice_seek(void *ctx, uint64_t pos) {
+	
+	io_slice_t *slice = ctx;
+	if (pos > slice->length || !impack_io_seek(&slice->base, slice->offset + pos)) {
+		return false;
+	}
+	slice->pos = pos;
+	return true;
+	
+}
+
+static bool io_slice_size(void *ctx, uint64_t *size) {
+	
+	io_slice_t *slice = ctx;
+	*size = slice->length;
+	return true;
+	
+}
+
+static const uint8_t* io_slice_data(void *ctx, uint64_t *size) {
+	
+	io_slice_t *slice = ctx;
+	uint64_t base_size;
+	if (slice->base.func_data == NULL) {
+		return NULL;
+	}
+	const uint8_t *data = slice->base.func_data(slice->base.ctx, &base_size);
+	if (data == NULL || base_size < slice->offset + slice->length) {
+		return NULL;
+	}
+	*size = slice->length;
+	return data + slice->offset;
+	
+}
+
+static void io_slice_close(void *ctx) {
+	
+	io_slice_t *slice = ctx;
+	impack_io_close(&slice->base);
+	free(slice);
+	
+}
+
+bool impack_io_open_slice(impack_io_t *io, impack_io_t *base, uint64_t offset, uint64_t length) {
+	
+	io_slice_t *slice = malloc(sizeof(io_slice_t));
+	if (slice == NULL) {
+		return false;
+	}
+	memcpy(&slice->base, base, sizeof(impack_io_t));
+	if (!impack_io_seek(&slice->base, offset)) {
+		free(slice);
+		return false;
+	}
+	slice->offset = offset;
+	slice->length = length;
+	slice->pos = 0;
+	io->ctx = slice;
+	io->func_read = (base->func_read != NULL) ? io_slice_read : NULL;
+	io->func_write = (base->func_write != NULL) ? io_slice_write : NULL;
+	io->func_seek = io_slice_seek;
+	io->func_size = io_slice_size;
+	io->func_data = (base->func_read != NULL) ? io_slice_data : NULL;
+	io->func_close = io_slice_close;
+	impack_io_start(io);
+	return true;
+	
+}
+
+static bool io_window_write(void *ctx, const uint8_t *buf, uint64_t len) {
+	
+	io_window_t *window = ctx;
+	uint64_t start = window->pos;
+	window->pos += len;
+	if (window->pos <= window->offset || start >= window->offset + window->length) {
+		return true;
+	}
+	uint64_t skip = (start < window->offset) ? window->offset - start : 0;
+	uint64_t end = len;
+	if (window->pos > window->offset + window->length) {
+		end -= window->pos - (window->offset + window->length);
+	}
+	return impack_io_write(window->base, buf + skip, end - skip);
+	
+}
+
+bool impack_io_open_window(impack_io_t *io, impack_io_t *base, uint64_t offset, uint64_t length) {
+	
+	io_window_t *window = malloc(sizeof(io_window_t));
+	if (window == NULL) {
+		return false;
+	}
+	window->base = base;
+	window->offset = offset;
+	window->length = (length > UINT64_MAX - offset) ? UINT64_MAX - offset : length;
+	window->pos = 0;
+	io->ctx = window;
+	io->func_read = NULL;
+	io->func_write = io_window_write;
+	io->func_seek = NULL;
+	io->func_size = NULL;
+	io->func_data = NULL;
+	io->func_close = free;
+	impack_io_start(io);
+	return true;
+	
+}
@@ -24,120 +24,119 @@
 #include <stdlib.h>
 #include <string.h>
 #include "impack.h"
+#include "impack_internal.h"
 #include "img.h"
+#include "libtiff_io.h"
 #include <tiffio.h>
 
-#define BUFSTEP 16384 // 16 KiB
+#define BUFSIZE_INITIAL 16384 // 16 KiB, the buffer size is doubled when more is needed
 
-uint8_t *impack_tiff_filebuf;
-uint64_t impack_tiff_bufsize;
-uint64_t impack_tiff_filesize;
-uint64_t impack_tiff_fileoff;
-bool impack_tiff_writing;
+// Grow the output buffer to at least size bytes, new space is zeroed (libtiff may seek past the end before writing)
+static bool tiff_reserve(impack_tiff_file_t *file, uint64_t size) {
+	
+	uint64_t oldsize = file->bufsize;
+	if (!impack_block_reserve(&file->buf, &file->bufsize, size)) {
+		return false;
+	}
+	if (file->bufsize > oldsize) {
+		memset(file->buf + oldsize, 0, file->bufsize - oldsize);
+	}
+	return true;
+	
+}
 
-impack_error_t impack_tiff_init_read(FILE *input_file, uint8_t *magic) {
+impack_error_t impack_tiff_init_read(impack_tiff_file_t *file, impack_io_t *input, uint8_t *magic) {
 	
 	TIFFSetErrorHandler(NULL);
 	
-	impack_tiff_bufsize = BUFSTEP + 4;
-	impack_tiff_filebuf = malloc(impack_tiff_bufsize);
-	if (impack_tiff_filebuf == NULL) {
-		return ERROR_MALLOC;
+	impack_error_t res = impack_loadfile(input, magic, 4, &file->input);
+	if (res != ERROR_OK) {
+		return res;
 	}
-	impack_tiff_filesize = 4;
-	memcpy(impack_tiff_filebuf, magic, 4);
-	
-	size_t bytes_read;
-	do {
-		bytes_read = fread(impack_tiff_filebuf + impack_tiff_filesize, 1, BUFSTEP, input_file);
-		impack_tiff_filesize += bytes_read;
-		if (bytes_read == BUFSTEP) {
-			uint8_t *newbuf = realloc(impack_tiff_filebuf, impack_tiff_bufsize + BUFSTEP);
-			if (newbuf == NULL) {
-				free(impack_tiff_filebuf);
-				return ERROR_MALLOC;
-			}
-			impack_tiff_filebuf = newbuf;
-			impack_tiff_bufsize += BUFSTEP;
-		}
-	} while (bytes_read == BUFSTEP);
-	if (!feof(input_file)) {
-		return ERROR_INPUT_IO;
-	}
-	impack_tiff_fileoff = 0;
-	impack_tiff_writing = false;
+	file->buf = file->input.data;
+	file->filesize = file->input.size;
+	file->bufsize = file->input.size;
+	file->fileoff = 0;
+	file->writing = false;
+	file->output = NULL;
+	file->direct = false;
 	return ERROR_OK;
 	
 }
 
-bool impack_tiff_init_write() {
+bool impack_tiff_init_write(impack_tiff_file_t *file, impack_io_t *output) {
 	
 	TIFFSetErrorHandler(NULL);
 	
-	impack_tiff_filebuf = malloc(BUFSTEP);
-	if (impack_tiff_filebuf == NULL) {
-		return false;
-	}
-	memset(impack_tiff_filebuf, 0, BUFSTEP);
-	impack_tiff_filesize = 0;
-	impack_tiff_bufsize = BUFSTEP;
-	impack_tiff_writing = true;
-	return true;
+	file->buf = NULL;
+	file->bufsize = 0;
+	file->filesize = 0;
+	file->fileoff = 0;
+	file->writing = true;
+	file->output = output;
+	file->output_start = output->pos;
+	file->direct = impack_io_seek(output, output->pos); // Fails for pipes etc.
+	return (file->direct || tiff_reserve(file, BUFSIZE_INITIAL));
 	
 }
 
-void impack_tiff_finish_read() {
+void impack_tiff_finish_read(impack_tiff_file_t *file) {
 	
-	free(impack_tiff_filebuf);
+	impack_unloadfile(&file->input);
 	
 }
 
-bool impack_tiff_finish_write(FILE *output_file) {
+bool impack_tiff_finish_write(impack_tiff_file_t *file, bool ok) {
 	
-	if (fwrite(impack_tiff_filebuf, 1, impack_tiff_filesize, output_file) != impack_tiff_filesize) {
-		free(impack_tiff_filebuf);
-		return false;
+	if (file->direct) { // libtiff may have seeked back to update the header
+		return ok && impack_io_seek(file->output, file->output_start + file->filesize);
 	}
-	fflush(output_file);
-	free(impack_tiff_filebuf);
-	return true;
+	bool res = (!ok || impack_io_write(file->output, file->buf, file->filesize));
+	free(file->buf);
+	file->buf = NULL;
+	return res;
 	
 }
 
 tsize_t impack_tiff_read(thandle_t data, tdata_t buf, tsize_t len) {
 	
-	if (impack_tiff_fileoff >= impack_tiff_filesize) {
+	impack_tiff_file_t *file = (impack_tiff_file_t*) data;
+	if (file->direct) { // Not needed for writing new images
+		return -1;
+	}
+	if (file->fileoff >= file->filesize) {
 		return 0;
 	}
 	uint64_t res = len;
-	if (impack_tiff_fileoff + len >= impack_tiff_filesize) {
-		res = impack_tiff_filesize - impack_tiff_fileoff;
+	if (file->fileoff + len >= file->filesize) {
+		res = file->filesize - file->fileoff;
 	}
-	memcpy(buf, impack_tiff_filebuf + impack_tiff_fileoff, res);
-	impack_tiff_fileoff += res;
+	memcpy(buf, file->buf + file->fileoff, res);
+	file->fileoff += res;
 	return res;
 	
 }
 
 tsize_t impack_tiff_write(thandle_t data, tdata_t buf, tsize_t len) {
 	
-	if (impack_tiff_fileoff + len >= impack_tiff_bufsize) {
-		uint64_t newsize = impack_tiff_bufsize;
-		while (impack_tiff_fileoff + len >= newsize) {
-			newsize += BUFSTEP;
-		}
-		uint8_t *newbuf = realloc(impack_tiff_filebuf, newsize);
-		if (newbuf == NULL) {
+	impack_tiff_file_t *file = (impack_tiff_file_t*) data;
+	if (file->direct) {
+		if (!impack_io_write(file->output, buf, len)) {
 			return -1;
 		}
-		impack_tiff_filebuf = newbuf;
-		memset(impack_tiff_filebuf + impack_tiff_fileoff, 0, newsize - impack_tiff_bufsize);
-		impack_tiff_bufsize = newsize;
+		file->fileoff += len;
+		if (file->fileoff > file->filesize) {
+			file->filesize = file->fileoff;
+		}
+		return len;
+	}
+	if (!file->writing || !tiff_reserve(file, file->fileoff + len)) {
+		return -1;
 	}
-	memcpy(impack_tiff_filebuf + impack_tiff_fileoff, buf, len);
-	impack_tiff_fileoff += len;
-	if (impack_tiff_fileoff > impack_tiff_filesize) {
-		impack_tiff_filesize = impack_tiff_fileoff;
+	memcpy(file->buf + file->fileoff, buf, len);
+	file->fileoff += len;
+	if (file->fileoff > file->filesize) {
+		file->filesize = file->fileoff;
 	}
 	return len;
 	
@@ -145,31 +144,41 @@ tsize_t impack_tiff_write(thandle_t data, tdata_t buf, tsize_t len) {
 
 toff_t impack_tiff_seek(thandle_t data, toff_t offset, int whence) {
 	
+	impack_tiff_file_t *file = (impack_tiff_file_t*) data;
 	uint64_t newoff;
 	switch (whence) {
 		case SEEK_SET:
 			newoff = offset;
 			break;
 		case SEEK_CUR:
-			newoff = impack_tiff_fileoff + offset;
+			newoff = file->fileoff + offset;
 			break;
 		case SEEK_END:
-			newoff = impack_tiff_filesize + offset;
+			newoff = file->filesize + offset;
 			break;
 		default:
 			return -1;
 	}
-	if (impack_tiff_writing) {
-		impack_tiff_fileoff = newoff;
-		if (newoff > impack_tiff_filesize) {
-			impack_tiff_filesize = newoff;
+	if (file->direct) {
+		if (!impack_io_seek(file->output, file->output_start + newoff)) {
+			return -1;
+		}
+		file->fileoff = newoff;
+		return newoff; // filesize is only updated by writing, like with a real file
+	} else if (file->writing) {
+		if (!tiff_reserve(file, newoff)) { // The gap up to newoff becomes part of the file
+			return -1;
+		}
+		file->fileoff = newoff;
+		if (newoff > file->filesize) {
+			file->filesize = newoff;
 		}
 		return newoff;
 	} else {
-		if (newoff >= impack_tiff_filesize) {
+		if (newoff >= file->filesize) {
 			return -1;
 		}
-		impack_tiff_fileoff = newoff;
+		file->fileoff = newoff;
 		return newoff;
 	}
 	
@@ -183,19 +192,26 @@ int impack_tiff_close(thandle_t data) {
 
 toff_t impack_tiff_size(thandle_t data) {
 	
-	return impack_tiff_filesize;
+	impack_tiff_file_t *file = (impack_tiff_file_t*) data;
+	return file->filesize;
 	
 }
 
 int impack_tiff_map(thandle_t data, tdata_t *buf, toff_t *len) {
 	
-	return 0; // Dummy function
+	impack_tiff_file_t *file = (impack_tiff_file_t*) data;
+	if (file->writing) {
+		return 0;
+	}
+	*buf = file->buf; // The whole file is in memory already, no need to copy it around
+	*len = file->filesize;
+	return 1;
 	
 }
 
 void impack_tiff_unmap(thandle_t data, tdata_t buf, toff_t len) {
 	
-	return; // Dummy function
+	return; // Freed by impack_tiff_finish_read()
 	
 }
 
@@ -13,39 +13,69 @@
  * You should have received a copy of the GNU General Public License
  * along with ImPack2. If not, see <http://www.gnu.org/licenses/>. */
 
+#include "config.h"
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "impack.h"
+#include "impack_internal.h"
 
 #define BUFSTEP 131072 // 128 KiB
 
-impack_error_t impack_loadfile(FILE *f, uint8_t **buf, uint64_t *bufsize, uint64_t skip) {
+impack_error_t impack_loadfile(impack_io_t *input, const uint8_t *magic, uint64_t magic_len, impack_filebuf_t *buf) {
 	
-	*buf = malloc(BUFSTEP + skip);
-	*bufsize = BUFSTEP + skip;
-	if (*buf == NULL) {
+	buf->data = NULL;
+	buf->borrowed = false;
+	if (input->func_data != NULL && input->pos == magic_len) { // Only works if the input was read from the start
+		uint64_t size;
+		const uint8_t *data = input->func_data(input->ctx, &size);
+		if (data != NULL && size > magic_len && memcmp(data, magic, magic_len) == 0) {
+			buf->data = (uint8_t*) data; // Libraries only read from it
+			buf->size = size;
+			buf->borrowed = true;
+			return ERROR_OK;
+		}
+	}
+	
+	uint64_t capacity = BUFSTEP + magic_len;
+	buf->data = malloc(capacity);
+	if (buf->data == NULL) {
 		return ERROR_MALLOC;
 	}
-	size_t bytes_read;
+	memcpy(buf->data, magic, magic_len);
+	buf->size = magic_len;
+	uint64_t bytes_read;
 	do {
-		bytes_read = fread(*buf + *bufsize - BUFSTEP, 1, BUFSTEP, f);
-		if (bytes_read == BUFSTEP) {
-			uint8_t *newbuf = realloc(*buf, *bufsize + BUFSTEP);
+		if (capacity - buf->size < BUFSTEP) {
+			capacity *= 2;
+			uint8_t *newbuf = realloc(buf->data, capacity);
 			if (newbuf == NULL) {
-				free(*buf);
+				free(buf->data);
+				buf->data = NULL;
 				return ERROR_MALLOC;
 			}
-			*buf = newbuf;
-			*bufsize += BUFSTEP;
+			buf->data = newbuf;
 		}
-	} while (bytes_read == BUFSTEP);
-	*bufsize = *bufsize - BUFSTEP + bytes_read;
-	if (!feof(f)) {
-		free(buf);
+		bytes_read = impack_io_read(input, buf->data + buf->size, capacity - buf->size);
+		buf->size += bytes_read;
+	} while (!input->eof && !input->error);
+	if (input->error) {
+		free(buf->data);
+		buf->data = NULL;
 		return ERROR_INPUT_IO;
 	}
 	return ERROR_OK;
 	
 }
+
+void impack_unloadfile(impack_filebuf_t *buf) {
+	
+	if (!buf->borrowed) { // Otherwise, the stream frees it
+		free(buf->data);
+	}
+	buf->data = NULL;
+	
+}
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <openjpeg.h>
 #include "impack.h"
+#include "impack_internal.h"
 #include "img.h"
 
 #define BUFSTEP 131072 // 128 KiB
@@ -37,7 +38,8 @@ typedef struct {
 	uint64_t filesize;
 	uint64_t pos;
 	bool is_input;
-	FILE *f;
+	impack_filebuf_t input; // Only used for input streams, buf points to its data
+	impack_io_t *io;
 } impack_opj_stream_state_t;
 
 impack_error_t impack_opj_stream_write_errno;
@@ -65,7 +67,7 @@ OPJ_SIZE_T impack_opj_stream_read(void *buf, OPJ_SIZE_T count, void *userdata) {
 	
 	impack_opj_stream_state_t *state = (impack_opj_stream_state_t*) userdata;
 	uint64_t toread = count;
-	if (toread > state->filesize) {
+	if (state->pos + toread > state->filesize) {
 		toread = state->filesize - state->pos;
 	}
 	if (toread == 0) {
@@ -95,7 +97,11 @@ OPJ_SIZE_T impack_opj_stream_write(void *buf, OPJ_SIZE_T count, void *userdata)
 OPJ_OFF_T impack_opj_stream_skip(OPJ_OFF_T count, void *userdata) {
 	
 	impack_opj_stream_state_t *state = (impack_opj_stream_state_t*) userdata;
-	if (!resize_buf_maybe(state, state->pos + count)) {
+	if (state->is_input) { // The input buffer might not be ours, it can't grow
+		if (state->pos + count > state->filesize) {
+			return -1;
+		}
+	} else if (!resize_buf_maybe(state, state->pos + count)) {
 		return -1;
 	}
 	state->pos += count;
@@ -110,7 +116,7 @@ OPJ_BOOL impack_opj_stream_seek(OPJ_OFF_T offset, void *userdata) {
 	
 	impack_opj_stream_state_t *state = (impack_opj_stream_state_t*) userdata;
 	if (state->is_input) {
-		if (offset > state->bufsize) {
+		if (offset > state->filesize) {
 			return false;
 		}
 	} else {
@@ -129,20 +135,21 @@ OPJ_BOOL impack_opj_stream_seek(OPJ_OFF_T offset, void *userdata) {
 void impack_opj_stream_free(void *userdata) {
 	
 	impack_opj_stream_state_t *state = (impack_opj_stream_state_t*) userdata;
-	if (!state->is_input) {
-		if (fwrite(state->buf, 1, state->filesize, state->f) != state->filesize) {
+	if (state->is_input) {
+		impack_unloadfile(&state->input);
+	} else {
+		if (!impack_io_write(state->io, state->buf, state->filesize)) {
 			impack_opj_stream_write_errno = ERROR_OUTPUT_IO;
 		} else {
 			impack_opj_stream_write_errno = ERROR_OK;
 		}
+		free(state->buf);
 	}
-	fflush(state->f);
-	free(state->buf);
 	free(state);
 	
 }
 
-opj_stream_t *impack_create_opj_stream(FILE *f, bool is_input) {
+opj_stream_t *impack_create_opj_stream(impack_io_t *io, bool is_input) {
 	
 	opj_stream_t *strm = opj_stream_default_create(is_input);
 	if (strm == NULL) {
@@ -155,35 +162,26 @@ opj_stream_t *impack_create_opj_stream(FILE *f, bool is_input) {
 	}
 	state->is_input = is_input;
 	state->pos = 0;
-	state->filesize = 0;
-	state->bufsize = BUFSTEP + 12;
-	state->buf = malloc(BUFSTEP + 12);
-	state->f = f;
-	if (state->buf == NULL) {
-		opj_stream_destroy(strm);
-		free(state);
-		return NULL;
-	}
-	if (is_input) {
-		memcpy(state->buf, impack_magic_jp2k, 12);
-		state->filesize = 12;
-		size_t bytes_read;
-		do {
-			bytes_read = fread(state->buf + state->filesize, 1, BUFSTEP, f);
-			if (bytes_read == BUFSTEP) {
-				uint8_t *newbuf = realloc(state->buf, state->bufsize + BUFSTEP);
-				if (newbuf == NULL) {
-					free(state->buf);
-					free(state);
-					opj_stream_destroy(strm);
-					return NULL;
-				}
-				state->buf = newbuf;
-				state->bufsize += BUFSTEP;
-			}
-			state->filesize += bytes_read;
-		} while (bytes_read == BUFSTEP);
+	state->io = io;
+	if (is_input) { // The input is only read, so it can be used without copying
+		if (impack_loadfile(io, impack_magic_jp2k, 12, &state->input) != ERROR_OK) {
+			opj_stream_destroy(strm);
+			free(state);
+			return NULL;
+		}
+		state->buf = state->input.data;
+		state->bufsize = state->input.size;
+		state->filesize = state->input.size;
 		opj_stream_set_user_data_length(strm, state->filesize);
+	} else {
+		state->filesize = 0;
+		state->bufsize = BUFSTEP;
+		state->buf = malloc(BUFSTEP);
+		if (state->buf == NULL) {
+			opj_stream_destroy(strm);
+			free(state);
+			return NULL;
+		}
 	}
 	opj_stream_set_user_data(strm, state, impack_opj_stream_free);
 	opj_stream_set_read_function(strm, impack_opj_stream_read);
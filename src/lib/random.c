@@ -14,9 +14,6 @@
  * along with ImPack2. If not, see <http://www.gnu.org/licenses/>. */
 
 #include "config.h"
-
-#ifdef IMPACK_WITH_CRYPTO
-
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -53,5 +50,3 @@ bool impack_random(uint8_t *dst, size_t count) {
 #endif
 	
 }
-
-#endif
@@ -18,9 +18,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "impack.h"
+#include "impack_internal.h"
 #include "img.h"
 
-impack_error_t impack_read_img(FILE *input_file, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+impack_error_t impack_read_img(impack_io_t *input, uint8_t **pixeldata, uint64_t *pixeldata_size, impack_img_reader_t *reader) {
 	
 	int format_count = 0;
 	int magic_len_max = 0;
@@ -40,7 +41,7 @@ impack_error_t impack_read_img(FILE *input_file, uint8_t **pixeldata, uint64_t *
 	}
 	
 	for (int i = 0; i < magic_len_max; i++) {
-		if (fread(magic_buf + i, 1, 1, input_file) != 1) {
+		if (impack_io_read(input, magic_buf + i, 1) != 1) {
 			free(magic_buf);
 			return ERROR_INPUT_IO;
 		}
@@ -55,7 +56,16 @@ impack_error_t impack_read_img(FILE *input_file, uint8_t **pixeldata, uint64_t *
 			}
 			if (i == current->magic_len + current->magic_offset - 1) {
 				if (magic_match[j]) {
-					impack_error_t res = current->func_read(input_file, magic_buf, pixeldata, pixeldata_size);
+					impack_error_t res;
+					if (reader != NULL && current->func_read_rows != NULL) {
+						*pixeldata = NULL;
+						res = current->func_read_rows(input, magic_buf, reader);
+					} else {
+						if (reader != NULL) {
+							reader->func_row = NULL;
+						}
+						res = current->func_read(input, magic_buf, pixeldata, pixeldata_size);
+					}
 					free(magic_buf);
 					return res;
 				}
@@ -67,3 +77,25 @@ impack_error_t impack_read_img(FILE *input_file, uint8_t **pixeldata, uint64_t *
 	return ERROR_IMG_FORMAT_UNKNOWN;
 	
 }
+
+impack_error_t impack_read_img_from_rows(impack_img_reader_t *reader, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+	
+	uint64_t row_size = reader->img_width * 3;
+	*pixeldata_size = row_size * reader->img_height;
+	*pixeldata = malloc(*pixeldata_size);
+	if (*pixeldata == NULL) {
+		reader->func_close(reader->ctx);
+		return ERROR_MALLOC;
+	}
+	for (uint64_t y = 0; y < reader->img_height; y++) {
+		impack_error_t res = reader->func_row(reader->ctx, (*pixeldata) + (y * row_size));
+		if (res != ERROR_OK) {
+			free(*pixeldata);
+			reader->func_close(reader->ctx);
+			return res;
+		}
+	}
+	reader->func_close(reader->ctx);
+	return ERROR_OK;
+	
+}
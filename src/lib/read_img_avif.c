@@ -32,22 +32,20 @@
 #define LIBAVIF_COMPAT_081
 #endif
 
-impack_error_t impack_read_img_avif(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+impack_error_t impack_read_img_avif(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
 	
 	avifDecoder *dec = NULL;
-	uint8_t *buf = NULL;
+	impack_filebuf_t buf;
 	impack_error_t ret = ERROR_MALLOC;
 	
-	uint64_t bufsize;
-	impack_error_t loadres = impack_loadfile(input_file, &buf, &bufsize, 12);
+	impack_error_t loadres = impack_loadfile(input, magic, 12, &buf);
 	if (loadres != ERROR_OK) {
 		return loadres;
 	}
-	memcpy(buf, magic, 12);
 #ifdef LIBAVIF_COMPAT_081
 	avifROData in;
-	in.data = buf;
-	in.size = bufsize;
+	in.data = buf.data;
+	in.size = buf.size;
 #endif
 	
 	dec = avifDecoderCreate();
@@ -55,7 +53,7 @@ impack_error_t impack_read_img_avif(FILE *input_file, uint8_t *magic, uint8_t **
 		goto cleanup;
 	}
 #ifndef LIBAVIF_COMPAT_081
-	if (avifDecoderSetIOMemory(dec, buf, bufsize) != AVIF_RESULT_OK) {
+	if (avifDecoderSetIOMemory(dec, buf.data, buf.size) != AVIF_RESULT_OK) {
 		ret = ERROR_INPUT_IMG_INVALID;
 		goto cleanup;
 	}
@@ -94,15 +92,15 @@ impack_error_t impack_read_img_avif(FILE *input_file, uint8_t *magic, uint8_t **
 	}
 	
 	avifDecoderDestroy(dec);
-	free(buf);
+	impack_unloadfile(&buf);
 	return ERROR_OK;
 	
 cleanup:
 	if (dec != NULL) {
 		avifDecoderDestroy(dec);
 	}
-	if (buf != NULL) {
-		free(buf);
+	if (buf.data != NULL) {
+		impack_unloadfile(&buf);
 	}
 	return ret;
 	
@@ -17,6 +17,7 @@
 
 #ifdef IMPACK_WITH_BMP
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -44,57 +45,224 @@ void impack_bmp_destroy(void *bitmap) {
 	
 }
 
-impack_error_t impack_read_img_bmp(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+#define BAND_SIZE 4194304 // 4 MiB, amount of data read from the file at once
+
+typedef struct {
+	impack_io_t *input;
+	bmp_image img; // Only used for images that are decoded by libnsbmp
+	bool use_libnsbmp;
+	bool top_down;
+	uint32_t bytes_per_pixel;
+	uint64_t stride; // Bytes per row in the file, including padding
+	uint8_t *band; // Rows read from the file
+	uint64_t band_rows;
+	uint64_t band_start; // First file row in band
+	uint64_t band_count;
+	uint64_t file_row; // File row at the current file position
+	uint64_t row; // Next image row
+	uint64_t width;
+	uint64_t height;
+} bmp_reader_t;
+
+static bool bmp_seek_rows(bmp_reader_t *reader, uint64_t file_row) {
+	
+	int64_t offset = ((int64_t) file_row - (int64_t) reader->file_row) * (int64_t) reader->stride;
+	if (offset != 0 && !impack_io_seek(reader->input, reader->input->pos + offset)) {
+		return false;
+	}
+	reader->file_row = file_row;
+	return true;
+	
+}
+
+static impack_error_t bmp_read_next_row(void *ctx, uint8_t *row) {
+	
+	bmp_reader_t *reader = ctx;
+	if (reader->use_libnsbmp) {
+		uint8_t *img_data = ((uint8_t*) reader->img.bitmap) + (reader->row * reader->width * 4);
+		for (uint64_t x = 0; x < reader->width; x++) {
+			row[x * 3] = img_data[x * 4];
+			row[(x * 3) + 1] = img_data[(x * 4) + 1];
+			row[(x * 3) + 2] = img_data[(x * 4) + 2];
+		}
+		reader->row++;
+		return ERROR_OK;
+	}
+	
+	uint64_t file_row = reader->top_down ? reader->row : reader->height - reader->row - 1;
+	if (file_row < reader->band_start || file_row >= reader->band_start + reader->band_count) {
+		uint64_t rows = reader->band_rows;
+		uint64_t band_start = file_row;
+		if (reader->top_down) {
+			if (rows > reader->height - file_row) {
+				rows = reader->height - file_row;
+			}
+		} else { // Rows are stored bottom to top, read the band that ends with the current row
+			if (rows > file_row + 1) {
+				rows = file_row + 1;
+			}
+			band_start = file_row + 1 - rows;
+			if (!bmp_seek_rows(reader, band_start)) {
+				return ERROR_INPUT_IO;
+			}
+		}
+		if (impack_io_read(reader->input, reader->band, rows * reader->stride) != rows * reader->stride) {
+			return ERROR_INPUT_IO;
+		}
+		reader->band_start = band_start;
+		reader->band_count = rows;
+		reader->file_row = band_start + rows;
+	}
+	
+	uint8_t *img_data = reader->band + ((file_row - reader->band_start) * reader->stride);
+	for (uint64_t x = 0; x < reader->width; x++) { // BGR -> RGB
+		row[x * 3] = img_data[(x * reader->bytes_per_pixel) + 2];
+		row[(x * 3) + 1] = img_data[(x * reader->bytes_per_pixel) + 1];
+		row[(x * 3) + 2] = img_data[x * reader->bytes_per_pixel];
+	}
+	reader->row++;
+	return ERROR_OK;
+	
+}
+
+static void bmp_reader_close(void *ctx) {
+	
+	bmp_reader_t *reader = ctx;
+	if (reader->use_libnsbmp) {
+		bmp_finalise(&reader->img);
+	}
+	free(reader->band);
+	free(reader);
 	
-	uint8_t *buf;
-	uint64_t bufsize;
-	impack_error_t loadres = impack_loadfile(input_file, &buf, &bufsize, 2);
+}
+
+// Let libnsbmp decode the whole image (for compressed images, palettes, etc.)
+static impack_error_t bmp_decode_libnsbmp(bmp_reader_t *reader, uint8_t *header, uint64_t header_len) {
+	
+	impack_filebuf_t buf;
+	impack_error_t loadres = impack_loadfile(reader->input, header, header_len, &buf);
 	if (loadres != ERROR_OK) {
 		return loadres;
 	}
-	memcpy(buf, magic, 2);
 	
 	bmp_bitmap_callback_vt callbacks = {
 		impack_bmp_create,
 		impack_bmp_destroy,
 		impack_bmp_get_buffer
 	};
-	bmp_image img;
-	bmp_create(&img, &callbacks);
-	if (bmp_analyse(&img, bufsize, buf) != BMP_OK) {
-		free(buf);
-		bmp_finalise(&img);
+	bmp_create(&reader->img, &callbacks);
+	if (bmp_analyse(&reader->img, buf.size, buf.data) != BMP_OK) {
+		impack_unloadfile(&buf);
+		bmp_finalise(&reader->img);
 		return ERROR_INPUT_IMG_INVALID;
 	}
-	bmp_result res = bmp_decode(&img);
+	bmp_result res = bmp_decode(&reader->img);
+	impack_unloadfile(&buf);
 	if (res != BMP_OK) {
-		free(buf);
-		bmp_finalise(&img);
+		bmp_finalise(&reader->img);
 		if (res == BMP_INSUFFICIENT_MEMORY) {
 			return ERROR_MALLOC;
 		} else {
 			return ERROR_INPUT_IMG_INVALID;
 		}
 	}
-	free(buf);
+	reader->use_libnsbmp = true;
+	reader->width = reader->img.width;
+	reader->height = reader->img.height;
+	return ERROR_OK;
 	
-	*pixeldata_size = img.width * img.height * 3;
-	*pixeldata = malloc(*pixeldata_size);
-	if (*pixeldata == NULL) {
-		bmp_finalise(&img);
+}
+
+impack_error_t impack_read_img_bmp_rows(impack_io_t *input, uint8_t *magic, impack_img_reader_t *img_reader) {
+	
+	bmp_reader_t *reader = malloc(sizeof(bmp_reader_t));
+	if (reader == NULL) {
 		return ERROR_MALLOC;
 	}
-	uint64_t pixeldata_index = 0;
-	uint8_t *img_data = (uint8_t*) img.bitmap;
-	for (uint64_t i = 0; i < (img.width * img.height * 4); i += 4) {
-		(*pixeldata)[pixeldata_index] = img_data[i];
-		(*pixeldata)[pixeldata_index + 1] = img_data[i + 1];
-		(*pixeldata)[pixeldata_index + 2] = img_data[i + 2];
-		pixeldata_index += 3;
+	reader->input = input;
+	reader->use_libnsbmp = false;
+	reader->band = NULL;
+	reader->row = 0;
+	
+	// Uncompressed 24/32 bit images (like the ones written by ImPack2) are read directly, row by row
+	uint8_t header[54];
+	memcpy(header, magic, 2);
+	uint64_t header_len = 2 + impack_io_read(input, header + 2, 52);
+	bool direct = (header_len == 54);
+	uint32_t data_offset = 0;
+	int32_t width = 0;
+	int32_t height = 0;
+	if (direct) {
+		memcpy(&data_offset, header + 10, 4);
+		data_offset = impack_endian32_le(data_offset);
+		uint32_t header_size;
+		memcpy(&header_size, header + 14, 4);
+		memcpy(&width, header + 18, 4);
+		memcpy(&height, header + 22, 4);
+		uint16_t bpp;
+		memcpy(&bpp, header + 28, 2);
+		uint32_t compression;
+		memcpy(&compression, header + 30, 4);
+		width = impack_endian32_le(width);
+		height = impack_endian32_le(height);
+		bpp = impack_endian16_le(bpp);
+		direct = (impack_endian32_le(header_size) >= 40 && impack_endian32_le(compression) == 0 && (bpp == 24 || bpp == 32));
+		direct &= (width > 0 && height != 0 && height != INT32_MIN && data_offset >= header_len);
+		reader->bytes_per_pixel = bpp / 8;
+	}
+	if (direct && height > 0 && !impack_io_seek(input, input->pos)) { // Bottom-up images need seeking
+		direct = false;
 	}
-	bmp_finalise(&img);
+	if (!direct) {
+		impack_error_t res = bmp_decode_libnsbmp(reader, header, header_len);
+		if (res != ERROR_OK) {
+			free(reader);
+			return res;
+		}
+	} else {
+		reader->top_down = (height < 0);
+		reader->width = width;
+		reader->height = reader->top_down ? -((int64_t) height) : height;
+		reader->stride = (reader->width * reader->bytes_per_pixel + 3) & ~((uint64_t) 3);
+		for (uint64_t i = header_len; i < data_offset; i++) { // Skip anything between the headers and the pixels
+			uint8_t skipped;
+			if (impack_io_read(input, &skipped, 1) != 1) {
+				free(reader);
+				return ERROR_INPUT_IMG_INVALID;
+			}
+		}
+		reader->band_rows = BAND_SIZE / reader->stride;
+		if (reader->band_rows == 0) {
+			reader->band_rows = 1;
+		}
+		reader->band = malloc(reader->band_rows * reader->stride);
+		if (reader->band == NULL) {
+			free(reader);
+			return ERROR_MALLOC;
+		}
+		reader->band_start = 0;
+		reader->band_count = 0;
+		reader->file_row = 0;
+	}
+	
+	img_reader->ctx = reader;
+	img_reader->func_row = bmp_read_next_row;
+	img_reader->func_close = bmp_reader_close;
+	img_reader->img_width = reader->width;
+	img_reader->img_height = reader->height;
 	return ERROR_OK;
 	
 }
 
+impack_error_t impack_read_img_bmp(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+	
+	impack_img_reader_t reader;
+	impack_error_t res = impack_read_img_bmp_rows(input, magic, &reader);
+	if (res != ERROR_OK) {
+		return res;
+	}
+	return impack_read_img_from_rows(&reader, pixeldata, pixeldata_size);
+	
+}
+
 #endif
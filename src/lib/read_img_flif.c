@@ -25,15 +25,13 @@
 #include "impack_internal.h"
 #include "img.h"
 
-impack_error_t impack_read_img_flif(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+impack_error_t impack_read_img_flif(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
 	
-	uint8_t *buf;
-	uint64_t bufsize;
-	impack_error_t res = impack_loadfile(input_file, &buf, &bufsize, 4);
+	impack_filebuf_t buf;
+	impack_error_t res = impack_loadfile(input, magic, 4, &buf);
 	if (res != ERROR_OK) {
 		return res;
 	}
-	memcpy(buf, magic, 4);
 	
 	impack_error_t ret = ERROR_MALLOC;
 	*pixeldata = NULL;
@@ -41,12 +39,11 @@ impack_error_t impack_read_img_flif(FILE *input_file, uint8_t *magic, uint8_t **
 	if (decoder == NULL) {
 		goto cleanup;
 	}
-	if (flif_decoder_decode_memory(decoder, buf, bufsize) == 0) {
+	if (flif_decoder_decode_memory(decoder, buf.data, buf.size) == 0) {
 		ret = ERROR_INPUT_IMG_INVALID;
 		goto cleanup;
 	}
-	free(buf);
-	buf = NULL;
+	impack_unloadfile(&buf);
 	
 	FLIF_IMAGE *img = flif_decoder_get_image(decoder, 0);
 	if (img == NULL) {
@@ -77,8 +74,8 @@ impack_error_t impack_read_img_flif(FILE *input_file, uint8_t *magic, uint8_t **
 	return ERROR_OK;
 	
 cleanup:
-	if (buf != NULL) {
-		free(buf);
+	if (buf.data != NULL) {
+		impack_unloadfile(&buf);
 	}
 	if (*pixeldata != NULL) {
 		free(*pixeldata);
@@ -27,26 +27,24 @@
 #include "impack_internal.h"
 #include "img.h"
 
-impack_error_t impack_read_img_heif(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+impack_error_t impack_read_img_heif(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
 	
 	struct heif_context *ctx = NULL;
 	struct heif_image_handle *handle = NULL;
 	struct heif_image *img = NULL;
-	uint8_t *buf = NULL;
+	impack_filebuf_t buf;
 	impack_error_t ret = ERROR_MALLOC;
 	
-	uint64_t bufsize;
-	impack_error_t loadres = impack_loadfile(input_file, &buf, &bufsize, 12);
+	impack_error_t loadres = impack_loadfile(input, magic, 12, &buf);
 	if (loadres != ERROR_OK) {
 		return loadres;
 	}
-	memcpy(buf, magic, 12);
 	
 	ctx = heif_context_alloc();
 	if (ctx == NULL) {
 		goto cleanup;
 	}
-	struct heif_error res = heif_context_read_from_memory_without_copy(ctx, buf, bufsize, NULL);
+	struct heif_error res = heif_context_read_from_memory_without_copy(ctx, buf.data, buf.size, NULL);
 	if (res.code != heif_error_Ok) {
 		if (res.code != heif_error_Memory_allocation_error) {
 			ret = ERROR_INPUT_IMG_INVALID;
@@ -68,8 +66,7 @@ impack_error_t impack_read_img_heif(FILE *input_file, uint8_t *magic, uint8_t **
 	handle = NULL;
 	heif_context_free(ctx);
 	ctx = NULL;
-	free(buf);
-	buf = NULL;
+	impack_unloadfile(&buf);
 	
 	int width = heif_image_get_width(img, heif_chroma_interleaved_RGB);
 	int height = heif_image_get_height(img, heif_chroma_interleaved_RGB);
@@ -93,8 +90,8 @@ cleanup:
 	if (ctx != NULL) {
 		heif_context_free(ctx);
 	}
-	if (buf != NULL) {
-		free(buf);
+	if (buf.data != NULL) {
+		impack_unloadfile(&buf);
 	}
 	if (img != NULL) {
 		heif_image_release(img);
@@ -27,15 +27,11 @@
 #include "img.h"
 #include "openjpeg_io.h"
 
-impack_error_t impack_read_img_jp2k(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+impack_error_t impack_read_img_jp2k(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
 	
-	opj_stream_t *strm = impack_create_opj_stream(input_file, true);
+	opj_stream_t *strm = impack_create_opj_stream(input, true);
 	if (strm == NULL) {
-		return ERROR_MALLOC;
-	}
-	if (!feof(input_file)) {
-		opj_stream_destroy(strm);
-		return ERROR_INPUT_IO;
+		return input->error ? ERROR_INPUT_IO : ERROR_MALLOC;
 	}
 	
 	impack_error_t ret = ERROR_INPUT_IMG_INVALID;
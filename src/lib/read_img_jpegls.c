@@ -26,26 +26,24 @@
 #include "impack_internal.h"
 #include "img.h"
 
-impack_error_t impack_read_img_jpegls(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+impack_error_t impack_read_img_jpegls(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
 	
 	impack_error_t err = ERROR_INPUT_IMG_INVALID;
 	charls_jpegls_decoder *dec = NULL;
 	uint8_t *out_buf = NULL;
 	
-	uint8_t *buf;
-	uint64_t bufsize;
-	impack_error_t loadres = impack_loadfile(input_file, &buf, &bufsize, 4);
+	impack_filebuf_t buf;
+	impack_error_t loadres = impack_loadfile(input, magic, 4, &buf);
 	if (loadres != ERROR_OK) {
 		return loadres;
 	}
-	memcpy(buf, magic, 4);
 	
 	dec = charls_jpegls_decoder_create();
 	if (dec == NULL) {
 		err = ERROR_MALLOC;
 		goto cleanup;
 	}
-	if (charls_jpegls_decoder_set_source_buffer(dec, buf, bufsize) != CHARLS_JPEGLS_ERRC_SUCCESS) {
+	if (charls_jpegls_decoder_set_source_buffer(dec, buf.data, buf.size) != CHARLS_JPEGLS_ERRC_SUCCESS) {
 		err = ERROR_MALLOC;
 		goto cleanup;
 	}
@@ -78,7 +76,7 @@ impack_error_t impack_read_img_jpegls(FILE *input_file, uint8_t *magic, uint8_t
 		goto cleanup;
 	}
 	charls_jpegls_decoder_destroy(dec);
-	free(buf);
+	impack_unloadfile(&buf);
 	
 	uint64_t img_size = frame_info.width * frame_info.height;
 	if (interleave == CHARLS_INTERLEAVE_MODE_NONE) {
@@ -103,8 +101,8 @@ cleanup:
 	if (dec != NULL) {
 		charls_jpegls_decoder_destroy(dec);
 	}
-	if (buf != NULL) {
-		free(buf);
+	if (buf.data != NULL) {
+		impack_unloadfile(&buf);
 	}
 	if (out_buf != NULL) {
 		free(out_buf);
@@ -29,7 +29,7 @@
 
 #define BUFSTEP 131072 // 128 KiB
 
-impack_error_t impack_read_img_jxl(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+impack_error_t impack_read_img_jxl(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
 	
 	impack_error_t ret = ERROR_MALLOC;
 	
@@ -58,12 +58,10 @@ impack_error_t impack_read_img_jxl(FILE *input_file, uint8_t *magic, uint8_t **p
 	pixel_format.align = 0;
 	
 	while (true) {
-		size_t bytes_read = fread(buf + bufpos, 1, bufsize - bufpos, input_file);
-		if (bytes_read != bufsize - bufpos) {
-			if (!feof(input_file)) {
-				ret = ERROR_INPUT_IO;
-				goto cleanup;
-			}
+		uint64_t bytes_read = impack_io_read(input, buf + bufpos, bufsize - bufpos);
+		if (input->error) {
+			ret = ERROR_INPUT_IO;
+			goto cleanup;
 		}
 		bufpos += bytes_read;
 		
@@ -75,7 +73,7 @@ impack_error_t impack_read_img_jxl(FILE *input_file, uint8_t *magic, uint8_t **p
 			ret = ERROR_INPUT_IMG_INVALID;
 			goto cleanup;
 		} else if (status == JXL_DEC_NEED_MORE_INPUT) {
-			if (feof(input_file)) { // End of file but decoder wants more (file truncated?)
+			if (input->eof) { // End of file but decoder wants more (file truncated?)
 				ret = ERROR_INPUT_IMG_INVALID;
 				goto cleanup;
 			}
@@ -26,22 +26,20 @@
 #include "impack_internal.h"
 #include "img.h"
 
-impack_error_t impack_read_img_jxr(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+impack_error_t impack_read_img_jxr(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
 	
-	uint8_t *buf;
-	uint64_t bufsize;
-	impack_error_t res = impack_loadfile(input_file, &buf, &bufsize, 8);
+	impack_filebuf_t buf;
+	impack_error_t res = impack_loadfile(input, magic, 8, &buf);
 	if (res != ERROR_OK) {
 		return res;
 	}
-	memcpy(buf, magic, 8);
 	
 	impack_error_t ret = ERROR_MALLOC;
 	PKImageDecode *decoder = NULL;
 	PKFormatConverter *converter = NULL;
 	struct WMPStream *strm = NULL;
 	*pixeldata = NULL;
-	if (CreateWS_Memory(&strm, buf, bufsize) != WMP_errSuccess) {
+	if (CreateWS_Memory(&strm, buf.data, buf.size) != WMP_errSuccess) {
 		goto cleanup;
 	}
 	if (PKImageDecode_Create_WMP(&decoder) != WMP_errSuccess) {
@@ -79,7 +77,7 @@ impack_error_t impack_read_img_jxr(FILE *input_file, uint8_t *magic, uint8_t **p
 	converter->Release(&converter);
 	decoder->Release(&decoder);
 	CloseWS_Memory(&strm);
-	free(buf);
+	impack_unloadfile(&buf);
 	return ERROR_OK;
 	
 cleanup:
@@ -92,8 +90,8 @@ cleanup:
 	if (converter != NULL) {
 		converter->Release(&converter);
 	}
-	if (buf != NULL) {
-		free(buf);
+	if (buf.data != NULL) {
+		impack_unloadfile(&buf);
 	}
 	if (*pixeldata != NULL) {
 		free(*pixeldata);
@@ -21,83 +21,152 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <png.h>
 #include "impack.h"
+#include "impack_internal.h"
+#include "img.h"
 
-impack_error_t impack_read_img_png(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+typedef struct {
+	png_structp read_struct;
+	png_infop info_struct;
+	uint8_t *pixeldata; // Complete image, only used for interlaced images
+	uint64_t row_size;
+	uint64_t row;
+} png_reader_t;
+
+static void png_read_input(png_structp read_struct, png_bytep data, png_size_t len) {
+	
+	if (impack_io_read(png_get_io_ptr(read_struct), data, len) != len) {
+		png_error(read_struct, "Read error");
+	}
+	
+}
+
+static impack_error_t png_read_next_row(void *ctx, uint8_t *row) {
+	
+	png_reader_t *reader = ctx;
+	if (reader->pixeldata != NULL) {
+		memcpy(row, reader->pixeldata + (reader->row * reader->row_size), reader->row_size);
+		reader->row++;
+		return ERROR_OK;
+	}
+	if (setjmp(png_jmpbuf(reader->read_struct))) {
+		return ERROR_INPUT_IO;
+	}
+	png_read_row(reader->read_struct, row, NULL);
+	return ERROR_OK;
+	
+}
+
+static void png_reader_close(void *ctx) {
+	
+	png_reader_t *reader = ctx;
+	png_destroy_read_struct(&reader->read_struct, &reader->info_struct, NULL);
+	free(reader->pixeldata);
+	free(reader);
 	
-	png_structp read_struct = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (read_struct == NULL) {
+}
+
+impack_error_t impack_read_img_png_rows(impack_io_t *input, uint8_t *magic, impack_img_reader_t *img_reader) {
+	
+	png_reader_t *reader = malloc(sizeof(png_reader_t));
+	if (reader == NULL) {
 		return ERROR_MALLOC;
 	}
-	impack_error_t ret = ERROR_MALLOC;
-	*pixeldata = NULL;
-	png_infop info_struct = png_create_info_struct(read_struct);
-	if (info_struct == NULL) {
-		png_destroy_read_struct(&read_struct, NULL, NULL);
+	reader->pixeldata = NULL;
+	reader->row = 0;
+	reader->info_struct = NULL;
+	reader->read_struct = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (reader->read_struct == NULL) {
+		free(reader);
 		return ERROR_MALLOC;
 	}
+	impack_error_t ret = ERROR_MALLOC;
+	reader->info_struct = png_create_info_struct(reader->read_struct);
+	if (reader->info_struct == NULL) {
+		goto cleanup;
+	}
 	
-	*pixeldata = NULL;
-	uint8_t **row_pointers = NULL;
-	if (setjmp(png_jmpbuf(read_struct))) {
+	uint8_t ** volatile row_pointers = NULL; // Modified after setjmp()
+	if (setjmp(png_jmpbuf(reader->read_struct))) {
 		ret = ERROR_INPUT_IO;
 		goto cleanup;
 	}
 	
-	png_init_io(read_struct, input_file);
-	png_set_sig_bytes(read_struct, 8); // Skip the magic number that was already read previously
-	png_set_user_limits(read_struct, INT32_MAX, INT32_MAX); // Let the user process stupidly large images (if they have the required memory)
+	png_set_read_fn(reader->read_struct, input, png_read_input);
+	png_set_sig_bytes(reader->read_struct, 8); // Skip the magic number that was already read previously
+	png_set_user_limits(reader->read_struct, INT32_MAX, INT32_MAX); // Let the user process stupidly large images
 	
-	png_read_info(read_struct, info_struct);
+	png_read_info(reader->read_struct, reader->info_struct);
 	uint32_t width, height;
-	int32_t bit_depth, color_type;
-	png_get_IHDR(read_struct, info_struct, &width, &height, &bit_depth, &color_type, NULL, NULL, NULL);
+	int32_t bit_depth, color_type, interlace_type;
+	png_get_IHDR(reader->read_struct, reader->info_struct, &width, &height, &bit_depth, &color_type, &interlace_type, NULL, NULL);
 	if (bit_depth > 8) {
 #if PNG_LIBPNG_VER >= 10504
-		png_set_scale_16(read_struct);
+		png_set_scale_16(reader->read_struct);
 #else
-		png_set_strip_16(read_struct);
+		png_set_strip_16(reader->read_struct);
 #endif
 	}
 	if (color_type == PNG_COLOR_TYPE_PALETTE) {
-		png_set_palette_to_rgb(read_struct);
+		png_set_palette_to_rgb(reader->read_struct);
 	}
 	if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
-		png_set_gray_to_rgb(read_struct);
+		png_set_gray_to_rgb(reader->read_struct);
 	}
 	if (bit_depth < 8) {
-		png_set_packing(read_struct);
+		png_set_packing(reader->read_struct);
 	}
 	if (color_type & PNG_COLOR_MASK_ALPHA) {
-		png_set_strip_alpha(read_struct);
+		png_set_strip_alpha(reader->read_struct);
 	}
-	
-	*pixeldata = malloc((uint64_t) width * (uint64_t) height * 3);
-	if (*pixeldata == NULL) {
-		goto cleanup;
+	if (interlace_type != PNG_INTERLACE_NONE) {
+		png_set_interlace_handling(reader->read_struct);
 	}
-	*pixeldata_size = (uint64_t) width * (uint64_t) height * 3;
-	row_pointers = malloc(sizeof(uint8_t*) * height);
-	if (row_pointers == NULL) {
-		goto cleanup;
-	}
-	for (uint64_t i = 0; i < height; i++) {
-		row_pointers[i] = (*pixeldata) + (i * width * 3);
+	png_read_update_info(reader->read_struct, reader->info_struct);
+	reader->row_size = (uint64_t) width * 3;
+	
+	if (interlace_type != PNG_INTERLACE_NONE) { // Rows are only complete after the last pass, so the whole image has to be loaded
+		reader->pixeldata = malloc(reader->row_size * (uint64_t) height);
+		if (reader->pixeldata == NULL) {
+			goto cleanup;
+		}
+		row_pointers = malloc(sizeof(uint8_t*) * height);
+		if (row_pointers == NULL) {
+			goto cleanup;
+		}
+		for (uint64_t i = 0; i < height; i++) {
+			row_pointers[i] = reader->pixeldata + (i * reader->row_size);
+		}
+		png_read_image(reader->read_struct, row_pointers);
+		free(row_pointers);
+		row_pointers = NULL;
 	}
-	png_read_image(read_struct, row_pointers);
-	png_read_end(read_struct, NULL);
-	png_destroy_read_struct(&read_struct, &info_struct, NULL);
-	free(row_pointers);
+	
+	img_reader->ctx = reader;
+	img_reader->func_row = png_read_next_row;
+	img_reader->func_close = png_reader_close;
+	img_reader->img_width = width;
+	img_reader->img_height = height;
 	return ERROR_OK;
 	
 cleanup:
-	png_destroy_read_struct(&read_struct, &info_struct, NULL);
-	if (*pixeldata != NULL) {
-		free(*pixeldata);
-	}
+	free(row_pointers);
+	png_reader_close(reader);
 	return ret;
 	
 }
 
+impack_error_t impack_read_img_png(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+	
+	impack_img_reader_t reader;
+	impack_error_t res = impack_read_img_png_rows(input, magic, &reader);
+	if (res != ERROR_OK) {
+		return res;
+	}
+	return impack_read_img_from_rows(&reader, pixeldata, pixeldata_size);
+	
+}
+
 #endif
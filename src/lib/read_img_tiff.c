@@ -21,60 +21,146 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "impack.h"
+#include "impack_internal.h"
+#include "img.h"
 #include "libtiff_io.h"
 #include <tiffio.h>
 
-impack_error_t impack_read_img_tiff(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+#define BAND_SIZE 4194304 // 4 MiB, amount of RGBA data decoded at once
+
+typedef struct {
+	impack_tiff_file_t file;
+	TIFF *img;
+	TIFFRGBAImage rgba_img;
+	uint32_t *band; // Decoded rows
+	uint32_t band_rows;
+	uint32_t band_count; // Rows currently in band
+	uint32_t band_next;
+	uint32_t row; // First row of the next band
+	uint32_t width;
+	uint32_t height;
+} tiff_reader_t;
+
+static impack_error_t tiff_read_next_row(void *ctx, uint8_t *row) {
+	
+	tiff_reader_t *reader = ctx;
+	if (reader->band_next == reader->band_count) {
+		uint32_t rows = reader->height - reader->row;
+		if (rows > reader->band_rows) {
+			rows = reader->band_rows;
+		}
+		reader->rgba_img.row_offset = reader->row;
+		reader->rgba_img.col_offset = 0;
+		if (TIFFRGBAImageGet(&reader->rgba_img, reader->band, reader->width, rows) != 1) {
+			return ERROR_INPUT_IMG_INVALID;
+		}
+		reader->row += rows;
+		reader->band_count = rows;
+		reader->band_next = 0;
+	}
+	uint32_t *rgba = reader->band + ((uint64_t) reader->band_next * reader->width);
+	for (uint32_t x = 0; x < reader->width; x++) {
+		row[x * 3] = TIFFGetR(rgba[x]);
+		row[(x * 3) + 1] = TIFFGetG(rgba[x]);
+		row[(x * 3) + 2] = TIFFGetB(rgba[x]);
+	}
+	reader->band_next++;
+	return ERROR_OK;
+	
+}
+
+static void tiff_reader_close(void *ctx) {
+	
+	tiff_reader_t *reader = ctx;
+	TIFFRGBAImageEnd(&reader->rgba_img);
+	TIFFClose(reader->img);
+	impack_tiff_finish_read(&reader->file);
+	free(reader->band);
+	free(reader);
+	
+}
+
+impack_error_t impack_read_img_tiff_rows(impack_io_t *input, uint8_t *magic, impack_img_reader_t *img_reader) {
 	
-	impack_error_t res = impack_tiff_init_read(input_file, magic);
+	tiff_reader_t *reader = malloc(sizeof(tiff_reader_t));
+	if (reader == NULL) {
+		return ERROR_MALLOC;
+	}
+	impack_error_t res = impack_tiff_init_read(&reader->file, input, magic);
 	if (res != ERROR_OK) {
+		free(reader);
 		return res;
 	}
 	impack_error_t ret = ERROR_MALLOC;
-	uint32_t *rgba = NULL;
-	TIFF *img = TIFFClientOpen("", "rm", NULL, impack_tiff_read, impack_tiff_write, impack_tiff_seek, impack_tiff_close, impack_tiff_size, impack_tiff_map, impack_tiff_unmap);
-	if (img == NULL) {
-		goto cleanup;
+	reader->band = NULL;
+	reader->img = TIFFClientOpen("", "r", (thandle_t) &reader->file, impack_tiff_read, impack_tiff_write, impack_tiff_seek, impack_tiff_close, impack_tiff_size, impack_tiff_map, impack_tiff_unmap);
+	if (reader->img == NULL) {
+		impack_tiff_finish_read(&reader->file);
+		free(reader);
+		return ERROR_MALLOC;
 	}
 	
-	uint32_t width, height;
-	if (TIFFGetField(img, TIFFTAG_IMAGEWIDTH, &width) != 1 || TIFFGetField(img, TIFFTAG_IMAGELENGTH, &height) != 1) {
+	char errmsg[1024];
+	if (TIFFGetField(reader->img, TIFFTAG_IMAGEWIDTH, &reader->width) != 1 || TIFFGetField(reader->img, TIFFTAG_IMAGELENGTH, &reader->height) != 1 || reader->width == 0 || reader->height == 0) {
 		ret = ERROR_INPUT_IMG_INVALID;
 		goto cleanup;
 	}
-	rgba = malloc(width * height * 4);
-	if (rgba == NULL) {
-		goto cleanup;
-	}
-	if (TIFFReadRGBAImageOriented(img, width, height, rgba, ORIENTATION_TOPLEFT, 1) != 1) {
+	if (TIFFRGBAImageOK(reader->img, errmsg) != 1 || TIFFRGBAImageBegin(&reader->rgba_img, reader->img, 1, errmsg) != 1) {
 		ret = ERROR_INPUT_IMG_INVALID;
 		goto cleanup;
 	}
-	TIFFClose(img);
-	impack_tiff_finish_read();
+	reader->rgba_img.req_orientation = ORIENTATION_TOPLEFT;
 	
-	*pixeldata = malloc(width * height * 3);
-	if (*pixeldata == NULL) {
-		free(rgba);
-		return ERROR_MALLOC;
+	uint32_t rows_per_strip = 0; // Decode whole strips/tiles, so none of them has to be decompressed more than once
+	if (TIFFIsTiled(reader->img)) {
+		TIFFGetField(reader->img, TIFFTAG_TILELENGTH, &rows_per_strip);
+	} else {
+		TIFFGetFieldDefaulted(reader->img, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
 	}
-	*pixeldata_size = width * height * 3;
-	uint64_t index_pixeldata = 0;
-	for (uint64_t index_rgba = 0; index_rgba < width * height; index_rgba++) {
-		(*pixeldata)[index_pixeldata] = TIFFGetR(rgba[index_rgba]);
-		(*pixeldata)[index_pixeldata + 1] = TIFFGetG(rgba[index_rgba]);
-		(*pixeldata)[index_pixeldata + 2] = TIFFGetB(rgba[index_rgba]);
-		index_pixeldata += 3;
+	if (rows_per_strip == 0 || rows_per_strip > reader->height || reader->rgba_img.orientation != ORIENTATION_TOPLEFT) { // Bands are flipped separately, need the whole image at once to get rows in the right order
+		rows_per_strip = reader->height;
+	}
+	uint64_t strips = BAND_SIZE / ((uint64_t) rows_per_strip * reader->width * 4);
+	if (strips == 0) {
+		strips = 1;
+	}
+	reader->band_rows = reader->height;
+	if (strips * rows_per_strip < reader->height) {
+		reader->band_rows = strips * rows_per_strip;
+	}
+	reader->band = malloc((uint64_t) reader->width * reader->band_rows * 4);
+	if (reader->band == NULL) {
+		TIFFRGBAImageEnd(&reader->rgba_img);
+		goto cleanup;
 	}
-	free(rgba);
+	reader->band_count = 0;
+	reader->band_next = 0;
+	reader->row = 0;
+	
+	img_reader->ctx = reader;
+	img_reader->func_row = tiff_read_next_row;
+	img_reader->func_close = tiff_reader_close;
+	img_reader->img_width = reader->width;
+	img_reader->img_height = reader->height;
 	return ERROR_OK;
 	
 cleanup:
-	TIFFClose(img);
-	impack_tiff_finish_read();
-	free(rgba);
+	TIFFClose(reader->img);
+	impack_tiff_finish_read(&reader->file);
+	free(reader);
 	return ret;
 	
 }
 
+impack_error_t impack_read_img_tiff(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+	
+	impack_img_reader_t reader;
+	impack_error_t res = impack_read_img_tiff_rows(input, magic, &reader);
+	if (res != ERROR_OK) {
+		return res;
+	}
+	return impack_read_img_from_rows(&reader, pixeldata, pixeldata_size);
+	
+}
+
 #endif
@@ -26,7 +26,7 @@
 #include "impack_internal.h"
 #include "img.h"
 
-impack_error_t impack_read_img_webp(FILE *input_file, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
+impack_error_t impack_read_img_webp(impack_io_t *input, uint8_t *magic, uint8_t **pixeldata, uint64_t *pixeldata_size) {
 	
 	uint8_t *buf = malloc(12);
 	if (buf == NULL) {
@@ -35,7 +35,7 @@ impack_error_t impack_read_img_webp(FILE *input_file, uint8_t *magic, uint8_t **
 	impack_error_t ret = ERROR_INPUT_IMG_INVALID;
 	*pixeldata = NULL;
 	memcpy(buf, magic, 4);
-	if (fread(buf + 4, 1, 8, input_file) != 8) {
+	if (impack_io_read(input, buf + 4, 8) != 8) {
 		ret = ERROR_INPUT_IO;
 		goto cleanup;
 	}
@@ -53,7 +53,7 @@ impack_error_t impack_read_img_webp(FILE *input_file, uint8_t *magic, uint8_t **
 	}
 	buf = newbuf;
 	
-	if (fread(buf + 12, 1, filesize - 4, input_file) != filesize - 4) {
+	if (impack_io_read(input, buf + 12, filesize - 4) != filesize - 4) {
 		ret = ERROR_INPUT_IO;
 		goto cleanup;
 	}
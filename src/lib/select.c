@@ -166,6 +166,20 @@ impack_encryption_type_t impack_select_encryption(char *name, bool force_pbkdf2)
 			return ENCRYPTION_CAMELLIA_ARGON2;
 		}
 	}
+	if (compare_case(name, "aes-gcm")) {
+		if (force_pbkdf2) {
+			return ENCRYPTION_AES_GCM;
+		} else {
+			return ENCRYPTION_AES_GCM_ARGON2;
+		}
+	}
+	if (compare_case(name, "chacha20-poly1305")) {
+		if (force_pbkdf2) {
+			return ENCRYPTION_CHACHA20_POLY1305;
+		} else {
+			return ENCRYPTION_CHACHA20_POLY1305_ARGON2;
+		}
+	}
 	return ENCRYPTION_NONE;
 	
 }
@@ -183,3 +197,9 @@ impack_encryption_type_t impack_default_encryption(bool force_pbkdf2) {
 #endif
 	
 }
+
+bool impack_encryption_authenticated(impack_encryption_type_t type) {
+	
+	return type >= ENCRYPTION_AES_GCM && type <= ENCRYPTION_CHACHA20_POLY1305_ARGON2;
+	
+}
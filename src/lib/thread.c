@@ -0,0 +1,456 @@
+/* This file is part of ImPack2.
+ *
+ * ImPack2 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ImPack2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ImPack2. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "config.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#ifdef IMPACK_WINDOWS
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "impack.h"
+#include "impack_internal.h"
+
+typedef struct {
+	pthread_mutex_t lock;
+	impack_parallel_func_t func;
+	uint8_t *items;
+	size_t itemsize;
+	size_t count;
+	size_t next;
+} parallel_state_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // Signalled whenever one of the counters below changes
+	impack_pipeline_produce_t produce;
+	impack_parallel_func_t func;
+	void *ctx;
+	uint8_t *items;
+	size_t itemsize;
+	size_t slots;
+	bool *done; // Per slot, func has finished with the item
+	uint64_t produced;
+	uint64_t started; // Items taken by func
+	uint64_t consumed;
+	bool input_done;
+	bool stop;
+} pipeline_state_t;
+
+struct impack_workers {
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // Signalled when a batch is started or finished and on shutdown
+	pthread_t *threads;
+	uint32_t started;
+	uint64_t batch; // Incremented for every call to impack_workers_run()
+	uint32_t busy; // Threads that haven't finished the current batch yet
+	bool shutdown;
+	impack_parallel_func_t func;
+	uint8_t *items;
+	size_t itemsize;
+	size_t count;
+	size_t next;
+};
+
+uint32_t impack_cpu_count() {
+	
+#ifdef IMPACK_WINDOWS
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	long count = info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (count < 1) {
+		return 1;
+	}
+	return count;
+	
+}
+
+uint64_t impack_memory_size() {
+	
+#ifdef IMPACK_WINDOWS
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof(status);
+	if (!GlobalMemoryStatusEx(&status)) {
+		return 0;
+	}
+	return status.ullTotalPhys;
+#elif defined(_SC_PHYS_PAGES)
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long pagesize = sysconf(_SC_PAGESIZE);
+	if (pages < 1 || pagesize < 1) {
+		return 0;
+	}
+	return (uint64_t) pages * pagesize;
+#else
+	return 0;
+#endif
+	
+}
+
+static void* parallel_worker(void *arg) {
+	
+	parallel_state_t *state = arg;
+	while (true) {
+		pthread_mutex_lock(&state->lock);
+		size_t i = state->next;
+		if (i < state->count) {
+			state->next++;
+		}
+		pthread_mutex_unlock(&state->lock);
+		if (i >= state->count) {
+			return NULL;
+		}
+		state->func(state->items + (i * state->itemsize));
+	}
+	
+}
+
+void impack_parallel(impack_parallel_func_t func, void *items, size_t itemsize, size_t count, uint32_t threads) {
+	
+	parallel_state_t state;
+	state.func = func;
+	state.items = items;
+	state.itemsize = itemsize;
+	state.count = count;
+	state.next = 0;
+	if (threads > count) {
+		threads = count;
+	}
+	pthread_t *workers = NULL;
+	if (threads > 1) {
+		workers = malloc(sizeof(pthread_t) * (threads - 1));
+		if (workers != NULL && pthread_mutex_init(&state.lock, NULL) != 0) {
+			free(workers);
+			workers = NULL;
+		}
+	}
+	if (workers == NULL) { // Single thread or out of resources, still get the work done
+		for (size_t i = 0; i < count; i++) {
+			func(state.items + (i * itemsize));
+		}
+		return;
+	}
+	
+	uint32_t started = 0;
+	while (started < threads - 1) {
+		if (pthread_create(&workers[started], NULL, parallel_worker, &state) != 0) {
+			break; // Continue with the threads we have
+		}
+		started++;
+	}
+	parallel_worker(&state); // The calling thread helps out
+	for (uint32_t i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	pthread_mutex_destroy(&state.lock);
+	free(workers);
+	
+}
+
+// Runs items of the current batch until there are none left, called with the lock held
+static void workers_take(impack_workers_t *workers) {
+	
+	while (workers->next < workers->count) {
+		size_t i = workers->next;
+		workers->next++;
+		pthread_mutex_unlock(&workers->lock);
+		workers->func(workers->items + (i * workers->itemsize));
+		pthread_mutex_lock(&workers->lock);
+	}
+	
+}
+
+static void* workers_thread(void *arg) {
+	
+	impack_workers_t *workers = arg;
+	uint64_t batch = 0;
+	pthread_mutex_lock(&workers->lock);
+	while (true) {
+		while (!workers->shutdown && workers->batch == batch) {
+			pthread_cond_wait(&workers->cond, &workers->lock);
+		}
+		if (workers->shutdown) {
+			pthread_mutex_unlock(&workers->lock);
+			return NULL;
+		}
+		batch = workers->batch;
+		workers_take(workers);
+		workers->busy--;
+		if (workers->busy == 0) {
+			pthread_cond_broadcast(&workers->cond);
+		}
+	}
+	
+}
+
+impack_workers_t* impack_workers_new(uint32_t threads) {
+	
+	if (threads <= 1) {
+		return NULL;
+	}
+	impack_workers_t *workers = malloc(sizeof(impack_workers_t));
+	if (workers == NULL) {
+		return NULL;
+	}
+	workers->threads = malloc(sizeof(pthread_t) * (threads - 1));
+	if (workers->threads == NULL) {
+		free(workers);
+		return NULL;
+	}
+	if (pthread_mutex_init(&workers->lock, NULL) != 0) {
+		free(workers->threads);
+		free(workers);
+		return NULL;
+	}
+	if (pthread_cond_init(&workers->cond, NULL) != 0) {
+		pthread_mutex_destroy(&workers->lock);
+		free(workers->threads);
+		free(workers);
+		return NULL;
+	}
+	workers->batch = 0;
+	workers->busy = 0;
+	workers->shutdown = false;
+	workers->started = 0;
+	while (workers->started < threads - 1) { // The calling thread helps out
+		if (pthread_create(&workers->threads[workers->started], NULL, workers_thread, workers) != 0) {
+			break; // Continue with the threads we have
+		}
+		workers->started++;
+	}
+	return workers;
+	
+}
+
+uint32_t impack_workers_count(const impack_workers_t *workers) {
+	
+	if (workers == NULL) {
+		return 1;
+	}
+	return workers->started + 1;
+	
+}
+
+void impack_workers_run(impack_workers_t *workers, impack_parallel_func_t func, void *items, size_t itemsize, size_t count) {
+	
+	if (workers == NULL || workers->started == 0 || count <= 1) {
+		for (size_t i = 0; i < count; i++) {
+			func(((uint8_t*) items) + (i * itemsize));
+		}
+		return;
+	}
+	pthread_mutex_lock(&workers->lock);
+	workers->func = func;
+	workers->items = items;
+	workers->itemsize = itemsize;
+	workers->count = count;
+	workers->next = 0;
+	workers->busy = workers->started;
+	workers->batch++;
+	pthread_cond_broadcast(&workers->cond);
+	workers_take(workers);
+	while (workers->busy != 0) { // Every thread has to see the batch before the next one can start
+		pthread_cond_wait(&workers->cond, &workers->lock);
+	}
+	pthread_mutex_unlock(&workers->lock);
+	
+}
+
+void impack_workers_free(impack_workers_t *workers) {
+	
+	if (workers == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&workers->lock);
+	workers->shutdown = true;
+	pthread_cond_broadcast(&workers->cond);
+	pthread_mutex_unlock(&workers->lock);
+	for (uint32_t i = 0; i < workers->started; i++) {
+		pthread_join(workers->threads[i], NULL);
+	}
+	pthread_cond_destroy(&workers->cond);
+	pthread_mutex_destroy(&workers->lock);
+	free(workers->threads);
+	free(workers);
+	
+}
+
+static void* pipeline_producer(void *arg) {
+	
+	pipeline_state_t *state = arg;
+	while (true) {
+		pthread_mutex_lock(&state->lock);
+		while (!state->stop && state->produced - state->consumed >= state->slots) { // Ring is full
+			pthread_cond_wait(&state->cond, &state->lock);
+		}
+		if (state->stop) {
+			state->input_done = true;
+			pthread_cond_broadcast(&state->cond);
+			pthread_mutex_unlock(&state->lock);
+			return NULL;
+		}
+		size_t slot = state->produced % state->slots;
+		pthread_mutex_unlock(&state->lock);
+		
+		bool last = false;
+		bool produced = state->produce(state->ctx, state->items + (slot * state->itemsize), &last);
+		pthread_mutex_lock(&state->lock);
+		if (produced) {
+			state->done[slot] = false;
+			state->produced++;
+		}
+		if (!produced || last) {
+			state->input_done = true;
+		}
+		pthread_cond_broadcast(&state->cond);
+		pthread_mutex_unlock(&state->lock);
+		if (!produced || last) {
+			return NULL;
+		}
+	}
+	
+}
+
+static void* pipeline_worker(void *arg) {
+	
+	pipeline_state_t *state = arg;
+	while (true) {
+		pthread_mutex_lock(&state->lock);
+		while (!state->stop && state->started == state->produced && !state->input_done) {
+			pthread_cond_wait(&state->cond, &state->lock);
+		}
+		if (state->stop || state->started == state->produced) {
+			pthread_mutex_unlock(&state->lock);
+			return NULL;
+		}
+		size_t slot = state->started % state->slots;
+		state->started++;
+		pthread_mutex_unlock(&state->lock);
+		
+		state->func(state->items + (slot * state->itemsize));
+		pthread_mutex_lock(&state->lock);
+		state->done[slot] = true;
+		pthread_cond_broadcast(&state->cond);
+		pthread_mutex_unlock(&state->lock);
+	}
+	
+}
+
+void impack_pipeline(impack_pipeline_produce_t produce, impack_parallel_func_t func, impack_pipeline_consume_t consume, void *ctx, void *items, size_t itemsize, size_t slots, uint32_t threads) {
+	
+	pipeline_state_t state;
+	state.produce = produce;
+	state.func = func;
+	state.ctx = ctx;
+	state.items = items;
+	state.itemsize = itemsize;
+	state.slots = slots;
+	state.produced = 0;
+	state.started = 0;
+	state.consumed = 0;
+	state.input_done = false;
+	state.stop = false;
+	if (threads == 0) {
+		threads = 1;
+	}
+	state.done = malloc(sizeof(bool) * slots);
+	pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+	bool sync_ok = false;
+	if (state.done != NULL && workers != NULL && pthread_mutex_init(&state.lock, NULL) == 0) {
+		sync_ok = (pthread_cond_init(&state.cond, NULL) == 0);
+		if (!sync_ok) {
+			pthread_mutex_destroy(&state.lock);
+		}
+	}
+	uint32_t started = 0;
+	pthread_t producer;
+	bool producer_started = false;
+	if (sync_ok) {
+		while (started < threads) {
+			if (pthread_create(&workers[started], NULL, pipeline_worker, &state) != 0) {
+				break; // Continue with the threads we have
+			}
+			started++;
+		}
+		producer_started = (started > 0 && pthread_create(&producer, NULL, pipeline_producer, &state) == 0);
+	}
+	
+	if (!producer_started) { // Out of resources, still get the work done one item at a time
+		if (started > 0) {
+			pthread_mutex_lock(&state.lock);
+			state.stop = true;
+			pthread_cond_broadcast(&state.cond);
+			pthread_mutex_unlock(&state.lock);
+			for (uint32_t i = 0; i < started; i++) {
+				pthread_join(workers[i], NULL);
+			}
+		}
+		if (sync_ok) {
+			pthread_cond_destroy(&state.cond);
+			pthread_mutex_destroy(&state.lock);
+		}
+		free(state.done);
+		free(workers);
+		bool last = false;
+		while (!last && produce(ctx, items, &last)) {
+			func(items);
+			if (!consume(ctx, items)) {
+				break;
+			}
+		}
+		return;
+	}
+	
+	while (true) {
+		pthread_mutex_lock(&state.lock);
+		while (state.consumed == state.produced ? !state.input_done : !state.done[state.consumed % slots]) {
+			pthread_cond_wait(&state.cond, &state.lock);
+		}
+		if (state.consumed == state.produced) { // Everything is done
+			pthread_mutex_unlock(&state.lock);
+			break;
+		}
+		size_t slot = state.consumed % slots;
+		pthread_mutex_unlock(&state.lock);
+		
+		bool ok = consume(ctx, state.items + (slot * itemsize));
+		pthread_mutex_lock(&state.lock);
+		state.consumed++;
+		if (!ok) {
+			state.stop = true;
+		}
+		pthread_cond_broadcast(&state.cond);
+		pthread_mutex_unlock(&state.lock);
+		if (!ok) {
+			break;
+		}
+	}
+	pthread_join(producer, NULL);
+	for (uint32_t i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.lock);
+	free(state.done);
+	free(workers);
+	
+}
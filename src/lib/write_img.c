@@ -19,12 +19,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include "impack.h"
+#include "impack_internal.h"
 #include "img.h"
 
-impack_error_t impack_write_img(char *output_path, FILE *output_file, uint8_t **pixeldata, uint64_t pixeldata_size, uint64_t pixeldata_pos, uint64_t img_width, uint64_t img_height, impack_img_format_t format) {
+impack_error_t impack_img_size(uint64_t pixeldata_pos, uint64_t *img_width, uint64_t *img_height) {
 	
-	uint64_t width = img_width;
-	uint64_t height = img_height;
+	uint64_t width = *img_width;
+	uint64_t height = *img_height;
 	if (width == 0 && height == 0) { // Auto-select image size, should result in a nearly-square image
 		width = 1;
 		height = 1;
@@ -54,15 +55,36 @@ impack_error_t impack_write_img(char *output_path, FILE *output_file, uint8_t **
 			return ERROR_IMG_TOO_SMALL;
 		}
 	}
+	*img_width = width;
+	*img_height = height;
+	return ERROR_OK;
+	
+}
+
+impack_error_t impack_write_img(impack_io_t *output, uint8_t **pixeldata, uint64_t pixeldata_size, uint64_t pixeldata_pos, uint64_t img_width, uint64_t img_height, impack_img_format_t format) {
+	
+	uint64_t width = img_width;
+	uint64_t height = img_height;
+	impack_error_t res = impack_img_size(pixeldata_pos, &width, &height);
+	if (res != ERROR_OK) {
+		return res;
+	}
 	
-	if (pixeldata_size < (width * height * 3)) { // Need more pixels to fill in unused space
-		uint8_t *newbuf = realloc(*pixeldata, width * height * 3);
+	uint64_t img_size = width * height * 3;
+	if (pixeldata_size < img_size) { // Need more pixels to fill in unused space
+		uint8_t *newbuf = realloc(*pixeldata, img_size);
 		if (newbuf == NULL) {
 			return ERROR_MALLOC;
 		}
 		*pixeldata = newbuf;
 	}
-	memset((*pixeldata) + pixeldata_pos, 0, pixeldata_size - pixeldata_pos);
+	memset((*pixeldata) + pixeldata_pos, 0, img_size - pixeldata_pos);
+	
+	return impack_img_format_desc(format)->func_write(output, *pixeldata, img_size, width, height);
+	
+}
+
+impack_img_format_t impack_output_format(char *output_path, impack_img_format_t format) {
 	
 	if (format == FORMAT_AUTO) {
 		size_t pathlen = strlen(output_path);
@@ -80,14 +102,15 @@ impack_error_t impack_write_img(char *output_path, FILE *output_file, uint8_t **
 			format = impack_default_img_format();
 		}
 	}
+	return format;
 	
-	int current = 0;
-	while (impack_img_formats[current] != NULL) {
-		if (impack_img_formats[current]->id == format) {
-			return impack_img_formats[current]->func_write(output_file, *pixeldata, pixeldata_size, width, height);
-		}
-		current++;
-	}
-	abort(); // Requested a format that isn't compiled in
+}
+
+impack_error_t impack_row_from_buffer(void *ctx, uint8_t *row) {
+	
+	impack_row_buffer_t *buf = ctx;
+	memcpy(row, buf->pixeldata + (buf->row * buf->row_size), buf->row_size);
+	buf->row++;
+	return ERROR_OK;
 	
 }
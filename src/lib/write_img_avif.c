@@ -25,7 +25,7 @@
 #include "impack_internal.h"
 #include "img.h"
 
-impack_error_t impack_write_img_avif(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
+impack_error_t impack_write_img_avif(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
 	
 	if (img_width > INT32_MAX || img_height > INT32_MAX) {
 		return ERROR_IMG_SIZE;
@@ -69,7 +69,7 @@ impack_error_t impack_write_img_avif(FILE *output_file, uint8_t *pixeldata, uint
 	avifImageDestroy(img);
 	img = NULL;
 	
-	if (fwrite(out.data, 1, out.size, output_file) != out.size) {
+	if (!impack_io_write(output, out.data, out.size)) {
 		avifRWDataFree(&out);
 		return ERROR_OUTPUT_IO;
 	}
@@ -17,9 +17,11 @@
 
 #ifdef IMPACK_WITH_BMP
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "impack.h"
 #include "impack_internal.h"
@@ -28,16 +30,16 @@
 extern const uint8_t impack_magic_bmp[];
 
 // libnsbmp only does reading, but writing BMP is simple enough
-impack_error_t impack_write_img_bmp(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
+static impack_error_t bmp_write_header(impack_io_t *output, uint64_t img_width, uint64_t img_height, bool top_down, uint32_t *row_padding) {
 	
 	if (img_width > INT32_MAX || img_height > INT32_MAX) {
 		return ERROR_IMG_SIZE;
 	}
-	uint32_t row_padding = 4 - ((img_width * 3) % 4);
-	if (row_padding == 4) {
-		row_padding = 0;
+	*row_padding = 4 - ((img_width * 3) % 4);
+	if (*row_padding == 4) {
+		*row_padding = 0;
 	}
-	uint64_t filesize = (img_width * img_height * 3) + (img_height * row_padding) + 54;
+	uint64_t filesize = (img_width * img_height * 3) + (img_height * *row_padding) + 54;
 	if (filesize > UINT32_MAX) {
 		return ERROR_IMG_SIZE;
 	}
@@ -53,37 +55,89 @@ impack_error_t impack_write_img_bmp(FILE *output_file, uint8_t *pixeldata, uint6
 	memcpy(header + 14, (uint8_t*) &headersize, 4);
 	int32_t width_endian = impack_endian32_le((int32_t) img_width);
 	memcpy(header + 18, (uint8_t*) &width_endian, 4);
-	int32_t height_endian = impack_endian32_le((int32_t) img_height);
+	int32_t height_endian = impack_endian32_le(top_down ? -((int32_t) img_height) : (int32_t) img_height); // Negative height = rows are stored top to bottom
 	memcpy(header + 22, (uint8_t*) &height_endian, 4);
 	uint16_t colorplanes = impack_endian16_le(1);
 	memcpy(header + 26, (uint8_t*) &colorplanes, 2);
 	uint16_t bpp = impack_endian16_le(24);
 	memcpy(header + 28, (uint8_t*) &bpp, 2);
 	memset(header + 30, 0, 4); // Compression type (=0)
-	uint32_t image_size = impack_endian32_le((img_width * img_height * 3) + (img_height * row_padding));
+	uint32_t image_size = impack_endian32_le((img_width * img_height * 3) + (img_height * *row_padding));
 	memcpy(header + 34, (uint8_t*) &image_size, 4);
 	memset(header + 38, 0, 8); // Physical image size, not known/used
 	memset(header + 46, 0, 4); // Colors in palette, not used
 	memset(header + 50, 0, 4); // "Important" color, not used
-	if (fwrite(header, 1, 54, output_file) != 54) {
+	if (!impack_io_write(output, header, 54)) {
 		return ERROR_OUTPUT_IO;
 	}
+	return ERROR_OK;
+	
+}
+
+// rowbuf needs space for img_width * 3 + row_padding bytes
+static bool bmp_write_row(impack_io_t *output, uint8_t *rowbuf, uint8_t *row, uint64_t img_width, uint32_t row_padding) {
+	
+	for (uint64_t x = 0; x < img_width; x++) { // RGB -> BGR
+		rowbuf[x * 3] = row[(x * 3) + 2];
+		rowbuf[(x * 3) + 1] = row[(x * 3) + 1];
+		rowbuf[(x * 3) + 2] = row[x * 3];
+	}
+	memset(rowbuf + (img_width * 3), 0, row_padding);
+	uint64_t len = (img_width * 3) + row_padding;
+	return impack_io_write(output, rowbuf, len);
 	
-	uint8_t padding[] = { 0, 0, 0 }; // May need up to 3 bytes
+}
+
+impack_error_t impack_write_img_bmp(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
+	
+	uint32_t row_padding;
+	impack_error_t res = bmp_write_header(output, img_width, img_height, false, &row_padding);
+	if (res != ERROR_OK) {
+		return res;
+	}
+	uint8_t *rowbuf = malloc((img_width * 3) + row_padding);
+	if (rowbuf == NULL) {
+		return ERROR_MALLOC;
+	}
 	for (int32_t y = img_height - 1; y >= 0; y--) {
-		for (int32_t x = 0; x < img_width; x++) {
-			uint8_t *pixel_rgb = pixeldata + (y * img_width * 3) + (x * 3);
-			uint8_t pixel_bgr[3] = { pixel_rgb[2], pixel_rgb[1], pixel_rgb[0] };
-			if (fwrite(pixel_bgr, 1, 3, output_file) != 3) {
-				return ERROR_OUTPUT_IO;
-			}
-		}
-		if (fwrite(padding, 1, row_padding, output_file) != row_padding) {
+		if (!bmp_write_row(output, rowbuf, pixeldata + (y * img_width * 3), img_width, row_padding)) {
+			free(rowbuf);
 			return ERROR_OUTPUT_IO;
 		}
 	}
+	free(rowbuf);
 	return ERROR_OK;
 	
 }
 
+impack_error_t impack_write_img_bmp_rows(impack_io_t *output, impack_row_func_t func_row, void *row_ctx, uint64_t img_width, uint64_t img_height) {
+	
+	uint32_t row_padding;
+	impack_error_t res = bmp_write_header(output, img_width, img_height, true, &row_padding);
+	if (res != ERROR_OK) {
+		return res;
+	}
+	uint8_t *row = malloc(img_width * 3);
+	uint8_t *rowbuf = malloc((img_width * 3) + row_padding);
+	if (row == NULL || rowbuf == NULL) {
+		free(row);
+		free(rowbuf);
+		return ERROR_MALLOC;
+	}
+	for (uint64_t y = 0; y < img_height; y++) {
+		res = func_row(row_ctx, row);
+		if (res != ERROR_OK) {
+			break;
+		}
+		if (!bmp_write_row(output, rowbuf, row, img_width, row_padding)) {
+			res = ERROR_OUTPUT_IO;
+			break;
+		}
+	}
+	free(row);
+	free(rowbuf);
+	return res;
+	
+}
+
 #endif
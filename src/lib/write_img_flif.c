@@ -25,7 +25,7 @@
 #include "impack_internal.h"
 #include "img.h"
 
-impack_error_t impack_write_img_flif(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
+impack_error_t impack_write_img_flif(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
 	
 	if (img_width > UINT32_MAX || img_height > UINT32_MAX) {
 		return ERROR_IMG_SIZE;
@@ -49,11 +49,10 @@ impack_error_t impack_write_img_flif(FILE *output_file, uint8_t *pixeldata, uint
 		return ERROR_MALLOC;
 	}
 	
-	if (fwrite(imgdata, 1, imgdata_len, output_file) != imgdata_len) {
+	if (!impack_io_write(output, imgdata, imgdata_len)) {
 		flif_free_memory(imgdata);
 		return ERROR_OUTPUT_IO;
 	}
-	fflush(output_file);
 	flif_destroy_encoder(encoder);
 	flif_free_memory(imgdata);
 	return ERROR_OK;
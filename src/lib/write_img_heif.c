@@ -35,8 +35,7 @@
 struct heif_error impack_heif_write(struct heif_context* ctx, const void* data, size_t len, void *arg) {
 	
 	struct heif_error res;
-	FILE *output_file = (FILE*) arg;
-	if (fwrite(data, 1, len, output_file) == len) {
+	if (impack_io_write(arg, data, len)) {
 		res.code = heif_error_Ok;
 	} else {
 		res.code = heif_error_Encoding_error;
@@ -45,7 +44,7 @@ struct heif_error impack_heif_write(struct heif_context* ctx, const void* data,
 	
 }
 
-impack_error_t impack_write_img_heif(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
+impack_error_t impack_write_img_heif(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
 	
 	if (img_width > INT32_MAX || img_height > INT32_MAX) {
 		return ERROR_IMG_SIZE;
@@ -104,7 +103,7 @@ impack_error_t impack_write_img_heif(FILE *output_file, uint8_t *pixeldata, uint
 	struct heif_writer writer;
 	writer.writer_api_version = 1;
 	writer.write = impack_heif_write;
-	res = heif_context_write(ctx, &writer, output_file);
+	res = heif_context_write(ctx, &writer, output);
 	heif_context_free(ctx);
 	if (res.code == heif_error_Ok) {
 		return ERROR_OK;
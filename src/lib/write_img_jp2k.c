@@ -26,7 +26,7 @@
 #include "impack_internal.h"
 #include "openjpeg_io.h"
 
-impack_error_t impack_write_img_jp2k(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
+impack_error_t impack_write_img_jp2k(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
 	
 	if (img_width > UINT32_MAX || img_height > UINT32_MAX) {
 		return ERROR_IMG_SIZE;
@@ -71,7 +71,7 @@ impack_error_t impack_write_img_jp2k(FILE *output_file, uint8_t *pixeldata, uint
 		goto cleanup;
 	}
 	
-	strm = impack_create_opj_stream(output_file, false);
+	strm = impack_create_opj_stream(output, false);
 	if (!opj_start_compress(codec, img, strm)) {
 		goto cleanup;
 	}
@@ -25,7 +25,7 @@
 #include "impack_internal.h"
 #include "img.h"
 
-impack_error_t impack_write_img_jpegls(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
+impack_error_t impack_write_img_jpegls(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
 	
 	if (img_width > UINT32_MAX || img_height > UINT32_MAX) {
 		return ERROR_IMG_SIZE;
@@ -72,7 +72,7 @@ impack_error_t impack_write_img_jpegls(FILE *output_file, uint8_t *pixeldata, ui
 	}
 	
 	charls_jpegls_encoder_destroy(enc);
-	if (fwrite(out_buf, 1, out_size, output_file) != out_size) {
+	if (!impack_io_write(output, out_buf, out_size)) {
 		free(out_buf);
 		return ERROR_OUTPUT_IO;
 	}
@@ -29,7 +29,7 @@
 
 #define BUFSIZE 131072 // 128 KiB
 
-impack_error_t impack_write_img_jxl(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
+impack_error_t impack_write_img_jxl(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
 	
 	impack_error_t ret = ERROR_MALLOC;
 	if (img_width > UINT32_MAX || img_height > UINT32_MAX) {
@@ -93,7 +93,7 @@ impack_error_t impack_write_img_jxl(FILE *output_file, uint8_t *pixeldata, uint6
 		if (status == JXL_ENC_ERROR) {
 			goto cleanup;
 		}
-		if (fwrite(buf, 1, BUFSIZE - avail_out, output_file) != BUFSIZE - avail_out) {
+		if (!impack_io_write(output, buf, BUFSIZE - avail_out)) {
 			goto cleanup;
 		}
 	} while (status == JXL_ENC_NEED_MORE_OUTPUT);
@@ -106,7 +106,7 @@ ERR jxr_io_getpos(struct WMPStream *strm, size_t *pos) {
 	
 }
 
-impack_error_t impack_write_img_jxr(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
+impack_error_t impack_write_img_jxr(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
 	
 	if (img_width > INT32_MAX || img_height > INT32_MAX) {
 		return ERROR_IMG_SIZE;
@@ -161,7 +161,7 @@ impack_error_t impack_write_img_jxr(FILE *output_file, uint8_t *pixeldata, uint6
 	if (encoder->WritePixels(encoder, img_height, pixeldata, img_width * 3) != WMP_errSuccess) {
 		goto cleanup;
 	}
-	if (fwrite(io_state->buf, 1, io_state->filesize, output_file) != io_state->filesize) {
+	if (!impack_io_write(output, io_state->buf, io_state->filesize)) {
 		ret = ERROR_OUTPUT_IO;
 		goto cleanup;
 	}
@@ -23,8 +23,34 @@
 #include <stdlib.h>
 #include <png.h>
 #include "impack.h"
+#include "impack_internal.h"
+#include "img.h"
 
-impack_error_t impack_write_img_png(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
+static void png_write_output(png_structp write_struct, png_bytep data, png_size_t len) {
+	
+	if (!impack_io_write(png_get_io_ptr(write_struct), data, len)) {
+		png_error(write_struct, "Write error");
+	}
+	
+}
+
+static void png_flush_output(png_structp write_struct) {
+	
+	return; // Nothing is buffered
+	
+}
+
+impack_error_t impack_write_img_png(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
+	
+	impack_row_buffer_t buf;
+	buf.pixeldata = pixeldata;
+	buf.row_size = img_width * 3;
+	buf.row = 0;
+	return impack_write_img_png_rows(output, impack_row_from_buffer, &buf, img_width, img_height);
+	
+}
+
+impack_error_t impack_write_img_png_rows(impack_io_t *output, impack_row_func_t func_row, void *row_ctx, uint64_t img_width, uint64_t img_height) {
 	
 	if (img_width > INT32_MAX || img_height > INT32_MAX) { // Maximum dimensions for PNG
 		return ERROR_IMG_SIZE;
@@ -39,31 +65,36 @@ impack_error_t impack_write_img_png(FILE *output_file, uint8_t *pixeldata, uint6
 		png_destroy_write_struct(&write_struct, NULL);
 		return ERROR_MALLOC;
 	}
-
-	uint8_t **row_pointers = malloc(sizeof(uint8_t*) * img_height);
-	if (row_pointers == NULL) {
-		png_destroy_write_struct(&write_struct, NULL);
+	
+	uint8_t *row = malloc(img_width * 3);
+	if (row == NULL) {
+		png_destroy_write_struct(&write_struct, &info_struct);
 		return ERROR_MALLOC;
 	}
-	for (uint64_t i = 0; i < img_height; i++) {
-		row_pointers[i] = pixeldata + (i * img_width * 3);
-	}
 	
 	if (setjmp(png_jmpbuf(write_struct))) {
 		png_destroy_write_struct(&write_struct, &info_struct);
-		free(row_pointers);
+		free(row);
 		return ERROR_OUTPUT_IO;
 	}
 	
-	png_init_io(write_struct, output_file);
+	png_set_write_fn(write_struct, output, png_write_output, png_flush_output);
 	png_set_user_limits(write_struct, INT32_MAX, INT32_MAX);
 	png_set_IHDR(write_struct, info_struct, img_width, img_height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-	png_set_rows(write_struct, info_struct, row_pointers);
-	png_write_png(write_struct, info_struct, PNG_TRANSFORM_IDENTITY, NULL);
+	png_write_info(write_struct, info_struct);
+	for (uint64_t i = 0; i < img_height; i++) {
+		impack_error_t res = func_row(row_ctx, row);
+		if (res != ERROR_OK) {
+			png_destroy_write_struct(&write_struct, &info_struct);
+			free(row);
+			return res;
+		}
+		png_write_row(write_struct, row);
+	}
+	png_write_end(write_struct, info_struct);
 	
-	fflush(output_file);
 	png_destroy_write_struct(&write_struct, &info_struct);
-	free(row_pointers);
+	free(row);
 	return ERROR_OK;
 	
 }
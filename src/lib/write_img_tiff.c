@@ -21,23 +21,44 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "impack.h"
+#include "impack_internal.h"
+#include "img.h"
 #include "libtiff_io.h"
 #include <tiffio.h>
 
-impack_error_t impack_write_img_tiff(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
+impack_error_t impack_write_img_tiff(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
 	
-	if (img_width >= UINT32_MAX || img_height >= UINT32_MAX || pixeldata_size >= UINT32_MAX) {
+	impack_row_buffer_t buf;
+	buf.pixeldata = pixeldata;
+	buf.row_size = img_width * 3;
+	buf.row = 0;
+	return impack_write_img_tiff_rows(output, impack_row_from_buffer, &buf, img_width, img_height);
+	
+}
+
+impack_error_t impack_write_img_tiff_rows(impack_io_t *output, impack_row_func_t func_row, void *row_ctx, uint64_t img_width, uint64_t img_height) {
+	
+	if (img_width >= UINT32_MAX || img_height >= UINT32_MAX || img_width * img_height * 3 >= UINT32_MAX) {
 		return ERROR_IMG_SIZE;
 	}
 	
-	if (!impack_tiff_init_write()) {
+	uint8_t *row = malloc(img_width * 3);
+	if (row == NULL) {
+		return ERROR_MALLOC;
+	}
+	impack_tiff_file_t file;
+	if (!impack_tiff_init_write(&file, output)) {
+		free(row);
 		return ERROR_MALLOC;
 	}
-	TIFF *img = TIFFClientOpen("", "wm", NULL, impack_tiff_read, impack_tiff_write, impack_tiff_seek, impack_tiff_close, impack_tiff_size, impack_tiff_map, impack_tiff_unmap);
+	TIFF *img = TIFFClientOpen("", "wm", (thandle_t) &file, impack_tiff_read, impack_tiff_write, impack_tiff_seek, impack_tiff_close, impack_tiff_size, impack_tiff_map, impack_tiff_unmap);
 	if (img == NULL) {
+		impack_tiff_finish_write(&file, false);
+		free(row);
 		return ERROR_MALLOC;
 	}
 	
+	impack_error_t ret = ERROR_MALLOC;
 	bool ok = true;
 	ok &= (TIFFSetField(img, TIFFTAG_IMAGEWIDTH, img_width) == 1);
 	ok &= (TIFFSetField(img, TIFFTAG_IMAGELENGTH, img_height) == 1);
@@ -48,23 +69,33 @@ impack_error_t impack_write_img_tiff(FILE *output_file, uint8_t *pixeldata, uint
 	ok &= (TIFFSetField(img, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB) == 1);
 	ok &= (TIFFSetField(img, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(img, img_width * 3)) == 1);
 	if (!ok) {
-		TIFFClose(img);
-		return ERROR_MALLOC;
+		goto cleanup;
 	}
 	
 	for (uint32_t i = 0; i < img_height; i++) {
-		if (TIFFWriteScanline(img, pixeldata + (i * img_width * 3), i, 0) != 1) {
-			TIFFClose(img);
-			return ERROR_MALLOC;
+		impack_error_t res = func_row(row_ctx, row);
+		if (res != ERROR_OK) {
+			ret = res;
+			goto cleanup;
+		}
+		if (TIFFWriteScanline(img, row, i, 0) != 1) {
+			goto cleanup;
 		}
 	}
 	
 	TIFFClose(img);
-	if (!impack_tiff_finish_write(output_file)) {
+	free(row);
+	if (!impack_tiff_finish_write(&file, true)) {
 		return ERROR_OUTPUT_IO;
 	}
 	return ERROR_OK;
 	
+cleanup:
+	TIFFClose(img);
+	free(row);
+	impack_tiff_finish_write(&file, false);
+	return ret;
+	
 }
 
 #endif
@@ -22,8 +22,9 @@
 #include <stdio.h>
 #include <webp/encode.h>
 #include "impack.h"
+#include "impack_internal.h"
 
-impack_error_t impack_write_img_webp(FILE *output_file, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
+impack_error_t impack_write_img_webp(impack_io_t *output, uint8_t *pixeldata, uint64_t pixeldata_size, uint64_t img_width, uint64_t img_height) {
 	
 	if (img_width > 16383 || img_height > 16383) {
 		return ERROR_IMG_SIZE;
@@ -34,11 +35,10 @@ impack_error_t impack_write_img_webp(FILE *output_file, uint8_t *pixeldata, uint
 	if (img_size == 0) {
 		return ERROR_MALLOC;
 	}
-	if (fwrite(img, 1, img_size, output_file) != img_size) {
+	if (!impack_io_write(output, img, img_size)) {
 		WebPFree(img);
 		return ERROR_OUTPUT_IO;
 	}
-	fflush(output_file);
 	WebPFree(img);
 	return ERROR_OK;
 	
@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "impack.h"
+#include "impack_internal.h"
 #include "config.h"
 
 extern void impack_build_info();
@@ -28,8 +29,19 @@ extern void impack_build_info();
 #define PASSPHRASE_CORRECT "123456"
 #define PASSPHRASE_INCORRECT "abcdef"
 #define PASSPHRASE_LEN 6
+#define CRC_TEST_LENGTH 1024 // Checksums are compared for all lengths up to this
+#define CRC_TEST_OFFSET 64 // Random offset for each length, to test unaligned data
+#define CRC_TEST_PARALLEL_LENGTH 3145739 // 3 MiB + 11 bytes, split into slices by impack_crc_parallel()
+#define CRC_POLY 0xC96C5795D7870F42ULL
+#define REF_BLOCKS_LENGTH (4 * IMPACK_BLOCK_SIZE_MIN + 4099) // Several blocks of the minimum size and a partial last block
 uint8_t ref_file[REF_LENGTH];
+uint8_t *ref_blocks = NULL; // Generated input for REF_BLOCKS_LENGTH
 char namebuf[100];
+uint8_t format_version = IMPACK_FORMAT_VERSION_BLOCKS;
+impack_kdf_params_t *kdf_params = NULL;
+impack_key_cache_t *key_cache = NULL;
+impack_key_cache_t *decode_key_cache = NULL; // Passed to impack_decode_stage2_cache() if set
+impack_ctx_t *ctx = NULL; // Passed to impack_encode_ctx() and impack_decode_stage1_ctx() if set
 
 void print_error(impack_error_t error) {
 	
@@ -103,6 +115,12 @@ void print_error(impack_error_t error) {
 		case ERROR_COMPRESSION_UNKNOWN:
 			printf("Compression unknown\n");
 			return;
+		case ERROR_VOLUMES_INCOMPLETE:
+			printf("Volumes incomplete\n");
+			return;
+		case ERROR_FORMAT_VERSION_INVALID:
+			printf("Invalid format version\n");
+			return;
 		case ERROR_OK:
 			break;
 	}
@@ -113,7 +131,12 @@ void print_error(impack_error_t error) {
 bool decode_run(char *input_file, char *passphrase, bool shouldfail) {
 	
 	impack_decode_state_t state;
-	impack_error_t res = impack_decode_stage1(&state, input_file);
+	impack_error_t res;
+	if (ctx != NULL) {
+		res = impack_decode_stage1_ctx(ctx, &state, input_file);
+	} else {
+		res = impack_decode_stage1(&state, input_file);
+	}
 	if (res != ERROR_OK) {
 		if (shouldfail) {
 			printf("OK\n");
@@ -125,7 +148,11 @@ bool decode_run(char *input_file, char *passphrase, bool shouldfail) {
 			return false;
 		}
 	}
-	res = impack_decode_stage2(&state, passphrase);
+	if (decode_key_cache != NULL) {
+		res = impack_decode_stage2_cache(&state, passphrase, decode_key_cache);
+	} else {
+		res = impack_decode_stage2(&state, passphrase);
+	}
 	if (res != ERROR_OK) {
 		if (shouldfail) {
 			printf("OK\n");
@@ -234,7 +261,25 @@ bool test_decode_format(char *msg, char *filename, char *passphrase, bool should
 
 bool encode_run(impack_img_format_t format, impack_encryption_type_t encrypt, char *passphrase, impack_compression_type_t compress, uint64_t width, uint64_t height, uint8_t channels) {
 	
-	impack_error_t res = impack_encode("testdata/input.bin", "testout_encode.tmp", encrypt, passphrase, compress, 0, channels, width, height, format, "testdata/input.bin");
+	impack_encode_params_t encode_params;
+	impack_encode_params_init(&encode_params);
+	encode_params.encrypt = encrypt;
+	encode_params.passphrase = passphrase;
+	encode_params.kdf_params = kdf_params;
+	encode_params.key_cache = key_cache;
+	encode_params.compress = compress;
+	encode_params.channels = channels;
+	encode_params.img_width = width;
+	encode_params.img_height = height;
+	encode_params.format = format;
+	encode_params.filename_include = "testdata/input.bin";
+	encode_params.format_version = format_version;
+	impack_error_t res;
+	if (ctx != NULL) {
+		res = impack_encode_ctx(ctx, "testdata/input.bin", "testout_encode.tmp", &encode_params);
+	} else {
+		res = impack_encode("testdata/input.bin", "testout_encode.tmp", &encode_params);
+	}
 	if (res != ERROR_OK) {
 		printf("Error\n");
 		printf("  Unexpected error after encode: ");
@@ -278,6 +323,673 @@ bool test_cycle_format(char *msg, impack_encryption_type_t encrypt, char *passph
 	
 }
 
+bool test_cycle_mem_run(char *msg, impack_encryption_type_t encrypt, char *passphrase, impack_compression_type_t compress, impack_img_format_t format, char *format_name) {
+	
+	printf("%s, %s: ", msg, format_name);
+	char *passarg = NULL;
+	char passbuf[PASSPHRASE_LEN + 1];
+	if (passphrase != NULL) {
+		strcpy(passbuf, passphrase);
+		passarg = passbuf;
+	}
+	uint8_t *img;
+	uint64_t img_size;
+	impack_encode_params_t encode_params;
+	impack_encode_params_init(&encode_params);
+	encode_params.encrypt = encrypt;
+	encode_params.passphrase = passarg;
+	encode_params.kdf_params = kdf_params;
+	encode_params.compress = compress;
+	encode_params.format = format;
+	encode_params.filename_include = "input.bin";
+	encode_params.format_version = format_version;
+	impack_error_t res = impack_encode_mem(NULL, ref_file, REF_LENGTH, &img, &img_size, &encode_params);
+	if (res != ERROR_OK) {
+		printf("Error\n");
+		printf("  Unexpected error after encode: ");
+		print_error(res);
+		return false;
+	}
+	if (passphrase != NULL) {
+		strcpy(passbuf, passphrase);
+	}
+	uint8_t *data;
+	uint64_t data_size;
+	char *filename;
+	res = impack_decode_mem(NULL, img, img_size, passarg, &data, &data_size, &filename);
+	free(img);
+	if (res != ERROR_OK) {
+		printf("Error\n");
+		printf("  Unexpected error after decode: ");
+		print_error(res);
+		return false;
+	}
+	bool ok = (data_size == REF_LENGTH && memcmp(data, ref_file, REF_LENGTH) == 0 && strcmp(filename, "input.bin") == 0);
+	free(data);
+	free(filename);
+	if (!ok) {
+		printf("Error\n");
+		printf("  Decoded data or filename incorrect\n");
+		return false;
+	}
+	printf("OK\n");
+	return true;
+	
+}
+
+bool test_cycle_mem(char *msg, impack_encryption_type_t encrypt, char *passphrase, impack_compression_type_t compress) {
+	
+	bool res = true;
+	int i = 0;
+	while (impack_img_formats[i] != NULL) {
+		const impack_img_format_desc_t *current = impack_img_formats[i];
+		res &= test_cycle_mem_run(msg, encrypt, passphrase, compress, current->id, current->name);
+		i++;
+	}
+	return res;
+	
+}
+
+bool test_cycle_blocks_run(char *msg, impack_encryption_type_t encrypt, char *passphrase, uint32_t threads) {
+	
+	printf("%s, %u threads: ", msg, threads);
+	char *passarg = NULL;
+	char passbuf[PASSPHRASE_LEN + 1];
+	if (passphrase != NULL) {
+		strcpy(passbuf, passphrase);
+		passarg = passbuf;
+	}
+	uint8_t *img;
+	uint64_t img_size;
+	impack_encode_params_t encode_params;
+	impack_encode_params_init(&encode_params);
+	encode_params.encrypt = encrypt;
+	encode_params.passphrase = passarg;
+	encode_params.kdf_params = kdf_params;
+	encode_params.filename_include = "input.bin";
+	encode_params.format_version = format_version;
+	encode_params.threads = threads;
+	encode_params.block_size = IMPACK_BLOCK_SIZE_MIN;
+	impack_error_t res = impack_encode_mem(NULL, ref_blocks, REF_BLOCKS_LENGTH, &img, &img_size, &encode_params);
+	if (res != ERROR_OK) {
+		printf("Error\n");
+		printf("  Unexpected error after encode: ");
+		print_error(res);
+		return false;
+	}
+	if (passphrase != NULL) {
+		strcpy(passbuf, passphrase);
+	}
+	impack_decode_state_t state;
+	uint8_t *data = NULL;
+	uint64_t data_size;
+	bool nameok = false;
+	res = impack_decode_stage1_mem(NULL, &state, img, img_size);
+	if (res == ERROR_OK) {
+		state.threads = threads; // Decoded with the same number of threads
+		res = impack_decode_stage2(&state, passarg);
+	}
+	if (res == ERROR_OK) {
+		nameok = (state.filename_length == 9 && strncmp(state.filename, "input.bin", 9) == 0);
+		res = impack_decode_stage3_mem(&state, &data, &data_size);
+	}
+	free(img);
+	if (res != ERROR_OK) {
+		printf("Error\n");
+		printf("  Unexpected error after decode: ");
+		print_error(res);
+		return false;
+	}
+	bool ok = (data_size == REF_BLOCKS_LENGTH && memcmp(data, ref_blocks, REF_BLOCKS_LENGTH) == 0 && nameok);
+	free(data);
+	if (!ok) {
+		printf("Error\n");
+		printf("  Decoded data or filename incorrect\n");
+		return false;
+	}
+	printf("OK\n");
+	return true;
+	
+}
+
+// Input split into blocks of the minimum size, with more or fewer threads than blocks in flight
+bool test_cycle_blocks(char *msg, impack_encryption_type_t encrypt, char *passphrase) {
+	
+	bool res = true;
+	for (uint32_t threads = 1; threads <= 3; threads++) {
+		res &= test_cycle_blocks_run(msg, encrypt, passphrase, threads);
+	}
+	return res;
+	
+}
+
+typedef struct { // Stream that can't seek and only reads a few bytes at a time, like a pipe
+	uint8_t *data;
+	uint64_t size;
+	uint64_t pos;
+	bool closed;
+} test_stream_t;
+
+int64_t test_stream_read(void *ctx, uint8_t *buf, uint64_t len) {
+	
+	test_stream_t *stream = ctx;
+	if (len > 7) {
+		len = 7;
+	}
+	if (len > stream->size - stream->pos) {
+		len = stream->size - stream->pos;
+	}
+	memcpy(buf, stream->data + stream->pos, len);
+	stream->pos += len;
+	return len;
+	
+}
+
+bool test_stream_write(void *ctx, const uint8_t *buf, uint64_t len) {
+	
+	test_stream_t *stream = ctx;
+	uint8_t *newdata = realloc(stream->data, stream->size + len);
+	if (newdata == NULL) {
+		return false;
+	}
+	stream->data = newdata;
+	memcpy(stream->data + stream->size, buf, len);
+	stream->size += len;
+	return true;
+	
+}
+
+void test_stream_close(void *ctx) {
+	
+	test_stream_t *stream = ctx;
+	stream->closed = true;
+	
+}
+
+void test_stream_open(impack_io_t *io, test_stream_t *stream, uint8_t *data, uint64_t size) {
+	
+	stream->data = data;
+	stream->size = size;
+	stream->pos = 0;
+	stream->closed = false;
+	io->ctx = stream;
+	io->func_read = test_stream_read;
+	io->func_write = test_stream_write;
+	io->func_seek = NULL;
+	io->func_size = NULL;
+	io->func_data = NULL;
+	io->func_close = test_stream_close;
+	
+}
+
+bool test_cycle_io_run(char *msg, impack_compression_type_t compress, impack_img_format_t format, char *format_name) {
+	
+	printf("%s, %s: ", msg, format_name);
+	impack_io_t input, output;
+	test_stream_t input_stream, img_stream, output_stream;
+	test_stream_open(&input, &input_stream, ref_file, REF_LENGTH);
+	test_stream_open(&output, &img_stream, NULL, 0);
+	impack_encode_params_t encode_params;
+	impack_encode_params_init(&encode_params);
+	encode_params.compress = compress;
+	encode_params.format = format;
+	encode_params.filename_include = "input.bin";
+	encode_params.format_version = format_version;
+	impack_error_t res = impack_encode_io(NULL, &input, &output, &encode_params);
+	if (res != ERROR_OK || !input_stream.closed || !img_stream.closed) {
+		free(img_stream.data);
+		printf("Error\n");
+		printf("  Unexpected error after encode: ");
+		print_error(res);
+		return false;
+	}
+	
+	impack_decode_state_t state;
+	test_stream_open(&input, &input_stream, img_stream.data, img_stream.size);
+	test_stream_open(&output, &output_stream, NULL, 0);
+	res = impack_decode_stage1_io(NULL, &state, &input);
+	if (res == ERROR_OK) {
+		res = impack_decode_stage2(&state, NULL);
+	}
+	if (res == ERROR_OK) {
+		res = impack_decode_stage3_io(&state, &output);
+	}
+	free(img_stream.data);
+	if (res != ERROR_OK) {
+		printf("Error\n");
+		printf("  Unexpected error after decode: ");
+		print_error(res);
+		free(output_stream.data);
+		return false;
+	}
+	bool ok = (output_stream.size == REF_LENGTH && memcmp(output_stream.data, ref_file, REF_LENGTH) == 0 && input_stream.closed && output_stream.closed);
+	free(output_stream.data);
+	if (!ok) {
+		printf("Error\n");
+		printf("  Decoded data incorrect or stream not closed\n");
+		return false;
+	}
+	printf("OK\n");
+	return true;
+	
+}
+
+bool test_cycle_io(char *msg, impack_compression_type_t compress) {
+	
+	bool res = true;
+	int i = 0;
+	while (impack_img_formats[i] != NULL) {
+		const impack_img_format_desc_t *current = impack_img_formats[i];
+		res &= test_cycle_io_run(msg, compress, current->id, current->name);
+		i++;
+	}
+	return res;
+	
+}
+
+bool test_cycle_volumes_run(char *msg, impack_encryption_type_t encrypt, char *passphrase, impack_compression_type_t compress, impack_img_format_t format, char *format_name) {
+	
+	printf("%s, %s: ", msg, format_name);
+	char *volumes[] = { "testout_volume1.tmp", "testout_volume2.tmp", "testout_volume3.tmp" };
+	char *volumes_reversed[] = { volumes[2], volumes[1], volumes[0] };
+	char *passarg = NULL;
+	char passbuf[PASSPHRASE_LEN + 1];
+	if (passphrase != NULL) {
+		strcpy(passbuf, passphrase);
+		passarg = passbuf;
+	}
+	impack_encode_params_t encode_params;
+	impack_encode_params_init(&encode_params);
+	encode_params.encrypt = encrypt;
+	encode_params.passphrase = passarg;
+	encode_params.kdf_params = kdf_params;
+	encode_params.compress = compress;
+	encode_params.format = format;
+	encode_params.filename_include = "testdata/input.bin";
+	impack_error_t res = impack_encode_volumes("testdata/input.bin", volumes, 3, &encode_params);
+	if (res != ERROR_OK) {
+		printf("Error\n");
+		printf("  Unexpected error after encode: ");
+		print_error(res);
+		return false;
+	}
+	if (passphrase != NULL) {
+		strcpy(passbuf, passphrase);
+	}
+	res = impack_decode_volumes(volumes_reversed, 3, passarg, "testout_decode.tmp", 0); // The order of the volumes doesn't matter
+	bool ok = false;
+	if (res == ERROR_OK) {
+		char buf[REF_LENGTH + 1];
+		FILE *f = fopen("testout_decode.tmp", "rb");
+		if (f != NULL) {
+			ok = (fread(buf, 1, REF_LENGTH + 1, f) == REF_LENGTH && memcmp(buf, ref_file, REF_LENGTH) == 0);
+			fclose(f);
+		}
+	}
+	impack_error_t res_missing = ERROR_OK;
+	if (res == ERROR_OK) {
+		if (passphrase != NULL) {
+			strcpy(passbuf, passphrase);
+		}
+		res_missing = impack_decode_volumes(volumes, 2, passarg, "testout_decode.tmp", 0);
+	}
+	for (int i = 0; i < 3; i++) {
+		remove(volumes[i]);
+	}
+	if (res != ERROR_OK) {
+		printf("Error\n");
+		printf("  Unexpected error after decode: ");
+		print_error(res);
+		return false;
+	}
+	if (!ok) {
+		printf("Error\n");
+		printf("  Decoded data incorrect\n");
+		return false;
+	}
+	if (res_missing != ERROR_VOLUMES_INCOMPLETE) {
+		printf("Error\n");
+		printf("  Missing volume not detected\n");
+		return false;
+	}
+	printf("OK\n");
+	return true;
+	
+}
+
+bool test_cycle_volumes(char *msg, impack_encryption_type_t encrypt, char *passphrase, impack_compression_type_t compress) {
+	
+	bool res = true;
+	int i = 0;
+	while (impack_img_formats[i] != NULL) {
+		const impack_img_format_desc_t *current = impack_img_formats[i];
+		res &= test_cycle_volumes_run(msg, encrypt, passphrase, compress, current->id, current->name);
+		i++;
+	}
+	return res;
+	
+}
+
+// Compare the output of impack_decode_range() with the expected part of the input
+bool test_range_check(const uint8_t *expected, uint64_t expected_length) {
+	
+	uint8_t *buf = malloc(expected_length + 1);
+	if (buf == NULL) {
+		printf("Error\n");
+		printf("  Unable to allocate memory\n");
+		return false;
+	}
+	uint64_t bytes_read = 0;
+	FILE *f = fopen("testout_decode.tmp", "rb");
+	if (f != NULL) {
+		bytes_read = fread(buf, 1, expected_length + 1, f);
+		fclose(f);
+	}
+	bool ok = (bytes_read == expected_length && memcmp(buf, expected, expected_length) == 0);
+	free(buf);
+	if (!ok) {
+		printf("Error\n");
+		printf("  Extracted data incorrect\n");
+		return false;
+	}
+	printf("OK\n");
+	return true;
+	
+}
+
+bool test_range_run(char *msg, uint64_t offset, uint64_t length, uint64_t expected_length) {
+	
+	printf("%s, %llu bytes from %llu: ", msg, (unsigned long long) length, (unsigned long long) offset);
+	if (!encode_run(impack_default_img_format(), ENCRYPTION_NONE, NULL, COMPRESSION_NONE, 0, 0, CHANNEL_RED | CHANNEL_GREEN | CHANNEL_BLUE)) {
+		return false;
+	}
+	impack_decode_state_t state;
+	impack_error_t res = impack_decode_stage1(&state, "testout_encode.tmp");
+	if (res == ERROR_OK) {
+		res = impack_decode_stage2(&state, NULL);
+	}
+	if (res == ERROR_OK) {
+		res = impack_decode_range(&state, offset, length, "testout_decode.tmp");
+	}
+	if (res != ERROR_OK) {
+		printf("Error\n");
+		printf("  Unexpected error after decode: ");
+		print_error(res);
+		return false;
+	}
+	return test_range_check(ref_file + offset, expected_length);
+	
+}
+
+bool test_range(char *msg) {
+	
+	bool res = true;
+	res &= test_range_run(msg, 100, 50, 50);
+	res &= test_range_run(msg, 200, 100, REF_LENGTH - 200);
+	res &= test_range_run(msg, 0, 0, 0);
+	return res;
+	
+}
+
+// Same as test_range_run(), but on an image with several blocks of the minimum size
+bool test_range_blocks_run(char *msg, impack_encryption_type_t encrypt, char *passphrase, uint64_t offset, uint64_t length, uint64_t expected_length) {
+	
+	printf("%s, %llu bytes from %llu: ", msg, (unsigned long long) length, (unsigned long long) offset);
+	char *passarg = NULL;
+	char passbuf[PASSPHRASE_LEN + 1];
+	if (passphrase != NULL) {
+		strcpy(passbuf, passphrase);
+		passarg = passbuf;
+	}
+	uint8_t *img;
+	uint64_t img_size;
+	impack_encode_params_t encode_params;
+	impack_encode_params_init(&encode_params);
+	encode_params.encrypt = encrypt;
+	encode_params.passphrase = passarg;
+	encode_params.kdf_params = kdf_params;
+	encode_params.filename_include = "input.bin";
+	encode_params.format_version = format_version;
+	encode_params.block_size = IMPACK_BLOCK_SIZE_MIN;
+	impack_error_t res = impack_encode_mem(NULL, ref_blocks, REF_BLOCKS_LENGTH, &img, &img_size, &encode_params);
+	if (res != ERROR_OK) {
+		printf("Error\n");
+		printf("  Unexpected error after encode: ");
+		print_error(res);
+		return false;
+	}
+	if (passphrase != NULL) {
+		strcpy(passbuf, passphrase);
+	}
+	impack_decode_state_t state;
+	res = impack_decode_stage1_mem(NULL, &state, img, img_size);
+	if (res == ERROR_OK) {
+		res = impack_decode_stage2(&state, passarg);
+	}
+	if (res == ERROR_OK) {
+		res = impack_decode_range(&state, offset, length, "testout_decode.tmp");
+	}
+	free(img);
+	if (res != ERROR_OK) {
+		printf("Error\n");
+		printf("  Unexpected error after decode: ");
+		print_error(res);
+		return false;
+	}
+	return test_range_check(ref_blocks + offset, expected_length);
+	
+}
+
+bool test_range_blocks(char *msg, impack_encryption_type_t encrypt, char *passphrase) {
+	
+	bool res = true;
+	uint64_t last_block = 4 * IMPACK_BLOCK_SIZE_MIN;
+	res &= test_range_blocks_run(msg, encrypt, passphrase, IMPACK_BLOCK_SIZE_MIN - 100, 200, 200); // Starts mid-block, crosses into the next one
+	res &= test_range_blocks_run(msg, encrypt, passphrase, IMPACK_BLOCK_SIZE_MIN + 12345, 2 * IMPACK_BLOCK_SIZE_MIN, 2 * IMPACK_BLOCK_SIZE_MIN); // Spans three blocks
+	res &= test_range_blocks_run(msg, encrypt, passphrase, last_block, REF_BLOCKS_LENGTH - last_block, REF_BLOCKS_LENGTH - last_block); // Only the last, partial block
+	res &= test_range_blocks_run(msg, encrypt, passphrase, last_block + 10, 100, 100);
+	res &= test_range_blocks_run(msg, encrypt, passphrase, REF_BLOCKS_LENGTH - 1000, 1000, 1000); // Ends exactly at the end of the data
+	res &= test_range_blocks_run(msg, encrypt, passphrase, 3 * IMPACK_BLOCK_SIZE_MIN + 7, REF_BLOCKS_LENGTH, REF_BLOCKS_LENGTH - 3 * IMPACK_BLOCK_SIZE_MIN - 7); // Past the end
+	return res;
+	
+}
+
+bool test_format_version_invalid(char *msg, uint8_t version) {
+	
+	printf("%s: ", msg);
+	impack_encode_params_t encode_params;
+	impack_encode_params_init(&encode_params);
+	encode_params.format = impack_default_img_format();
+	encode_params.filename_include = "testdata/input.bin";
+	encode_params.format_version = version;
+	impack_error_t res = impack_encode("testdata/input.bin", "testout_encode.tmp", &encode_params);
+	if (res != ERROR_FORMAT_VERSION_INVALID) {
+		printf("Error\n");
+		printf("  Format version %u was not rejected\n", version);
+		return false;
+	}
+	printf("OK\n");
+	return true;
+	
+}
+
+// Images encoded with the default options must stay readable by older versions
+bool test_format_version_default(char *msg) {
+	
+	printf("%s: ", msg);
+	impack_encode_params_t encode_params;
+	impack_encode_params_init(&encode_params);
+	encode_params.filename_include = "testdata/input.bin";
+	impack_error_t res = impack_encode("testdata/input.bin", "testout_encode.tmp", &encode_params);
+	if (res != ERROR_OK) {
+		printf("Error\n");
+		printf("  Unexpected error after encode: ");
+		print_error(res);
+		return false;
+	}
+	impack_decode_state_t state;
+	res = impack_decode_stage1(&state, "testout_encode.tmp");
+	if (res != ERROR_OK) {
+		printf("Error\n");
+		printf("  Unexpected error after decode stage 1: ");
+		print_error(res);
+		return false;
+	}
+	uint8_t version = state.format_version;
+	impack_decode_free(&state);
+	if (version != IMPACK_FORMAT_VERSION_STREAM) {
+		printf("Error\n");
+		printf("  Default format version is %u\n", version);
+		return false;
+	}
+	printf("OK\n");
+	return true;
+	
+}
+
+// Decode with a shared key cache, a wrong passphrase must neither fill the cache nor be accepted from it
+bool test_key_cache_passphrase(char *msg, impack_encryption_type_t encrypt) {
+	
+	char *passphrases[4] = { PASSPHRASE_INCORRECT, PASSPHRASE_CORRECT, PASSPHRASE_INCORRECT, PASSPHRASE_CORRECT };
+	char *steps[4] = { "wrong passphrase first", "correct passphrase", "wrong passphrase with a cached key", "correct passphrase again" };
+	char passbuf[PASSPHRASE_LEN + 1];
+	strcpy(passbuf, PASSPHRASE_CORRECT);
+	printf("%s, encode: ", msg);
+	if (!encode_run(impack_default_img_format(), encrypt, passbuf, COMPRESSION_NONE, 0, 0, CHANNEL_RED | CHANNEL_GREEN | CHANNEL_BLUE)) {
+		return false;
+	}
+	printf("OK\n");
+	impack_key_cache_t cache;
+	memset(&cache, 0, sizeof(impack_key_cache_t));
+	decode_key_cache = &cache;
+	bool res = true;
+	for (int i = 0; i < 4; i++) {
+		printf("%s, %s: ", msg, steps[i]);
+		strcpy(passbuf, passphrases[i]);
+		res &= decode_run("testout_encode.tmp", passbuf, strcmp(passphrases[i], PASSPHRASE_INCORRECT) == 0);
+	}
+	decode_key_cache = NULL;
+	impack_key_cache_free(&cache);
+	return res;
+	
+}
+
+// Bitwise CRC-64, independent of the tables and constants used by the library
+uint64_t crc_reference(const uint8_t *buf, size_t len) {
+	
+	uint64_t crc = ~0ULL;
+	for (size_t i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (int j = 0; j < 8; j++) {
+			crc = (crc & 1) ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+		}
+	}
+	return ~crc;
+	
+}
+
+bool test_crc_impl(char *msg, impack_crc_impl_t impl, const uint8_t *data) {
+	
+	printf("%s: ", msg);
+	uint64_t crc = 0;
+	if (!impack_crc_impl(impl, &crc, data, 0)) {
+		printf("Not supported by this CPU, skipped\n");
+		return true;
+	}
+	for (size_t len = 0; len <= CRC_TEST_LENGTH; len++) {
+		size_t offset = rand() % CRC_TEST_OFFSET;
+		size_t split = rand() % (len + 1);
+		uint64_t expected = crc_reference(data + offset, len);
+		crc = 0;
+		impack_crc_impl(impl, &crc, data + offset, len);
+		uint64_t crc_split = 0; // Same data in two calls
+		impack_crc_impl(impl, &crc_split, data + offset, split);
+		impack_crc_impl(impl, &crc_split, data + offset + split, len - split);
+		if (crc != expected || crc_split != expected) {
+			printf("Error\n");
+			printf("  Incorrect checksum for %zu bytes at offset %zu\n", len, offset);
+			return false;
+		}
+	}
+	printf("OK\n");
+	return true;
+	
+}
+
+bool test_crc_combine(const uint8_t *data) {
+	
+	printf("Combined checksums: ");
+	for (size_t len = 0; len <= CRC_TEST_LENGTH; len++) {
+		size_t split = rand() % (len + 1);
+		uint64_t crc_a = 0;
+		uint64_t crc_b = 0;
+		impack_crc(&crc_a, (uint8_t*) data, split);
+		impack_crc(&crc_b, (uint8_t*) data + split, len - split);
+		if (impack_crc_combine(crc_a, crc_b, len - split) != crc_reference(data, len)) {
+			printf("Error\n");
+			printf("  Incorrect checksum for %zu + %zu bytes\n", split, len - split);
+			return false;
+		}
+	}
+	printf("OK\n");
+	return true;
+	
+}
+
+bool test_crc_parallel() {
+	
+	printf("Checksum calculated by multiple threads: ");
+	uint8_t *data = malloc(CRC_TEST_PARALLEL_LENGTH);
+	if (data == NULL) {
+		printf("Error\n  Out of memory\n");
+		return false;
+	}
+	for (size_t i = 0; i < CRC_TEST_PARALLEL_LENGTH; i++) {
+		data[i] = rand();
+	}
+	uint64_t expected = crc_reference(data, CRC_TEST_PARALLEL_LENGTH);
+	impack_workers_t *workers = impack_workers_new(4);
+	bool res = true;
+	for (int i = 0; i < 3; i++) { // The threads are reused
+		uint64_t crc = 0;
+		impack_crc_parallel(&crc, data, CRC_TEST_PARALLEL_LENGTH, workers);
+		res &= (crc == expected);
+	}
+	impack_workers_free(workers);
+	free(data);
+	if (!res) {
+		printf("Error\n  Incorrect checksum\n");
+		return false;
+	}
+	printf("OK\n");
+	return true;
+	
+}
+
+bool test_crc() {
+	
+	bool res = true;
+	printf("Reference implementation: ");
+	if (crc_reference((const uint8_t*) "123456789", 9) == 0x995DC9BBDF1939FAULL) { // Check value of CRC-64/XZ
+		printf("OK\n");
+	} else {
+		printf("Error\n  Incorrect check value\n");
+		res = false;
+	}
+	uint8_t data[CRC_TEST_LENGTH + CRC_TEST_OFFSET];
+	srand(1);
+	for (size_t i = 0; i < sizeof(data); i++) {
+		data[i] = rand();
+	}
+	res &= test_crc_impl("Bytewise checksum", CRC_IMPL_BYTEWISE, data);
+	res &= test_crc_impl("Slicing-by-16 checksum", CRC_IMPL_SLICE, data);
+	res &= test_crc_impl("Carry-less multiplication checksum", CRC_IMPL_CLMUL, data);
+	res &= test_crc_combine(data);
+	res &= test_crc_parallel();
+	return res;
+	
+}
+
 bool test_cycle() {
 	
 	bool res = true;
@@ -294,7 +1006,7 @@ bool test_cycle() {
 	res &= test_cycle_format("Custom height", false, NULL, COMPRESSION_NONE, 0, 2, allchannels);
 	res &= test_cycle_format("Custom width + height", false, NULL, COMPRESSION_NONE, 50, 50, allchannels);
 	
-	int baselen = strlen("Encrypted and compressed data, Camellia encryption, PBKDF2,  compression"); // Maximum length encryption name
+	int baselen = strlen("Encrypted and compressed data, ChaCha20-Poly1305 encryption, PBKDF2,  compression"); // Maximum length encryption name
 	int namelen = 0;
 	int current = 0;
 #ifdef IMPACK_WITH_COMPRESSION
@@ -319,11 +1031,47 @@ bool test_cycle() {
 	res &= test_cycle_format("Encrypted data, Camellia encryption, PBKDF2", ENCRYPTION_CAMELLIA, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
 	res &= test_cycle_format("Encrypted data, Serpent encryption, PBKDF2", ENCRYPTION_SERPENT, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
 	res &= test_cycle_format("Encrypted data, Twofish encryption, PBKDF2", ENCRYPTION_TWOFISH, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
+	res &= test_cycle_format("Encrypted data, AES-GCM encryption, PBKDF2", ENCRYPTION_AES_GCM, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
+	res &= test_cycle_format("Encrypted data, ChaCha20-Poly1305 encryption, PBKDF2", ENCRYPTION_CHACHA20_POLY1305, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
+	impack_key_cache_t key_cache_aes, key_cache_gcm, key_cache_decode;
+	char passbuf[PASSPHRASE_LEN + 1];
+	strcpy(passbuf, PASSPHRASE_CORRECT);
+	if (impack_key_cache_init(&key_cache_aes, ENCRYPTION_AES, passbuf, NULL) == ERROR_OK) { // The master key is reused for every image format
+		key_cache = &key_cache_aes;
+		res &= test_cycle_format("Encrypted data, AES encryption, PBKDF2, cached key", ENCRYPTION_AES, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
+		memset(&key_cache_decode, 0, sizeof(impack_key_cache_t)); // Only the first image needs to derive the key when decoding
+		decode_key_cache = &key_cache_decode;
+		res &= test_cycle_format("Encrypted data, AES encryption, PBKDF2, cached key when decoding", ENCRYPTION_AES, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
+		decode_key_cache = NULL;
+		impack_key_cache_free(&key_cache_decode);
+		impack_key_cache_free(&key_cache_aes);
+	} else {
+		printf("Encrypted data, AES encryption, PBKDF2, cached key: Error\n  Can not derive the master key\n");
+		res = false;
+	}
+	strcpy(passbuf, PASSPHRASE_CORRECT);
+	if (impack_key_cache_init(&key_cache_gcm, ENCRYPTION_AES_GCM, passbuf, NULL) == ERROR_OK) {
+		key_cache = &key_cache_gcm;
+		res &= test_cycle_format("Encrypted data, AES-GCM encryption, PBKDF2, cached key", ENCRYPTION_AES_GCM, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
+		impack_key_cache_free(&key_cache_gcm);
+	} else {
+		printf("Encrypted data, AES-GCM encryption, PBKDF2, cached key: Error\n  Can not derive the master key\n");
+		res = false;
+	}
+	key_cache = NULL;
+	res &= test_key_cache_passphrase("Encrypted data, AES encryption, PBKDF2, cached key when decoding", ENCRYPTION_AES);
+	res &= test_key_cache_passphrase("Encrypted data, AES-GCM encryption, PBKDF2, cached key when decoding", ENCRYPTION_AES_GCM);
 #ifdef IMPACK_WITH_ARGON2
 	res &= test_cycle_format("Encrypted data, AES encryption, Argon2", ENCRYPTION_AES_ARGON2, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
 	res &= test_cycle_format("Encrypted data, Camellia encryption, Argon2", ENCRYPTION_CAMELLIA_ARGON2, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
 	res &= test_cycle_format("Encrypted data, Serpent encryption, Argon2", ENCRYPTION_SERPENT_ARGON2, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
 	res &= test_cycle_format("Encrypted data, Twofish encryption, Argon2", ENCRYPTION_TWOFISH_ARGON2, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
+	res &= test_cycle_format("Encrypted data, AES-GCM encryption, Argon2", ENCRYPTION_AES_GCM_ARGON2, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
+	res &= test_cycle_format("Encrypted data, ChaCha20-Poly1305 encryption, Argon2", ENCRYPTION_CHACHA20_POLY1305_ARGON2, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
+	impack_kdf_params_t kdf_custom = { 2, 16384, 4 };
+	kdf_params = &kdf_custom;
+	res &= test_cycle_format("Encrypted data, AES encryption, Argon2, custom parameters", ENCRYPTION_AES_ARGON2, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
+	kdf_params = NULL;
 #endif
 #ifdef IMPACK_WITH_COMPRESSION
 	current = 0;
@@ -336,6 +1084,10 @@ bool test_cycle() {
 		res &= test_cycle_format(namebuf, ENCRYPTION_SERPENT, PASSPHRASE_CORRECT, impack_compression_types[current]->id, 0, 0, allchannels);
 		sprintf(namebuf, "Encrypted and compressed data, Twofish encryption, PBKDF2, %s compression", impack_compression_types[current]->name);
 		res &= test_cycle_format(namebuf, ENCRYPTION_TWOFISH, PASSPHRASE_CORRECT, impack_compression_types[current]->id, 0, 0, allchannels);
+		sprintf(namebuf, "Encrypted and compressed data, AES-GCM encryption, PBKDF2, %s compression", impack_compression_types[current]->name);
+		res &= test_cycle_format(namebuf, ENCRYPTION_AES_GCM, PASSPHRASE_CORRECT, impack_compression_types[current]->id, 0, 0, allchannels);
+		sprintf(namebuf, "Encrypted and compressed data, ChaCha20-Poly1305 encryption, PBKDF2, %s compression", impack_compression_types[current]->name);
+		res &= test_cycle_format(namebuf, ENCRYPTION_CHACHA20_POLY1305, PASSPHRASE_CORRECT, impack_compression_types[current]->id, 0, 0, allchannels);
 #ifdef IMPACK_WITH_ARGON2
 		sprintf(namebuf, "Encrypted and compressed data, AES encryption, Argon2, %s compression", impack_compression_types[current]->name);
 		res &= test_cycle_format(namebuf, ENCRYPTION_AES_ARGON2, PASSPHRASE_CORRECT, impack_compression_types[current]->id, 0, 0, allchannels);
@@ -345,11 +1097,88 @@ bool test_cycle() {
 		res &= test_cycle_format(namebuf, ENCRYPTION_SERPENT_ARGON2, PASSPHRASE_CORRECT, impack_compression_types[current]->id, 0, 0, allchannels);
 		sprintf(namebuf, "Encrypted and compressed data, Twofish encryption, Argon2, %s compression", impack_compression_types[current]->name);
 		res &= test_cycle_format(namebuf, ENCRYPTION_TWOFISH_ARGON2, PASSPHRASE_CORRECT, impack_compression_types[current]->id, 0, 0, allchannels);
+		sprintf(namebuf, "Encrypted and compressed data, AES-GCM encryption, Argon2, %s compression", impack_compression_types[current]->name);
+		res &= test_cycle_format(namebuf, ENCRYPTION_AES_GCM_ARGON2, PASSPHRASE_CORRECT, impack_compression_types[current]->id, 0, 0, allchannels);
+		sprintf(namebuf, "Encrypted and compressed data, ChaCha20-Poly1305 encryption, Argon2, %s compression", impack_compression_types[current]->name);
+		res &= test_cycle_format(namebuf, ENCRYPTION_CHACHA20_POLY1305_ARGON2, PASSPHRASE_CORRECT, impack_compression_types[current]->id, 0, 0, allchannels);
 #endif
 		current++;
 	}
 #endif
 #endif
+	
+	ctx = impack_ctx_new(); // Every cycle reuses the buffers and compressor states from the previous ones
+	if (ctx != NULL) {
+		res &= test_cycle_format("Reused context", false, NULL, COMPRESSION_NONE, 0, 0, allchannels);
+		res &= test_cycle_format("Reused context, grayscale mode", false, NULL, COMPRESSION_NONE, 0, 0, 0);
+#ifdef IMPACK_WITH_COMPRESSION
+		current = 0;
+		while (impack_compression_types[current] != NULL) {
+			sprintf(namebuf, "Reused context, %s compression", impack_compression_types[current]->name);
+			res &= test_cycle_format(namebuf, false, NULL, impack_compression_types[current]->id, 0, 0, allchannels);
+			res &= test_cycle_format(namebuf, false, NULL, impack_compression_types[current]->id, 0, 0, allchannels);
+			current++;
+		}
+#endif
+#ifdef IMPACK_WITH_CRYPTO
+		res &= test_cycle_format("Reused context, encrypted data", ENCRYPTION_AES, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
+#endif
+		impack_ctx_free(ctx);
+		ctx = NULL;
+	} else {
+		printf("Reused context: Error\n  Can not create the context\n");
+		res = false;
+	}
+	
+	res &= test_cycle_mem("In-memory API", false, NULL, COMPRESSION_NONE);
+#ifdef IMPACK_WITH_COMPRESSION
+	res &= test_cycle_mem("In-memory API, compressed data", false, NULL, impack_default_compression());
+#endif
+#ifdef IMPACK_WITH_CRYPTO
+	res &= test_cycle_mem("In-memory API, encrypted data", ENCRYPTION_AES_GCM, PASSPHRASE_CORRECT, COMPRESSION_NONE);
+#endif
+	res &= test_cycle_blocks("Multiple blocks", ENCRYPTION_NONE, NULL);
+#ifdef IMPACK_WITH_CRYPTO
+	res &= test_cycle_blocks("Multiple blocks, AES encryption", ENCRYPTION_AES, PASSPHRASE_CORRECT);
+	res &= test_cycle_blocks("Multiple blocks, AES-GCM encryption", ENCRYPTION_AES_GCM, PASSPHRASE_CORRECT);
+#endif
+	res &= test_cycle_io("Stream API", COMPRESSION_NONE);
+#ifdef IMPACK_WITH_COMPRESSION
+	res &= test_cycle_io("Stream API, compressed data", impack_default_compression());
+#endif
+	res &= test_cycle_volumes("Volumes", ENCRYPTION_NONE, NULL, COMPRESSION_NONE);
+	res &= test_range("Range");
+	res &= test_range_blocks("Range, multiple blocks", ENCRYPTION_NONE, NULL);
+#ifdef IMPACK_WITH_CRYPTO
+	res &= test_range_blocks("Range, multiple blocks, AES encryption", ENCRYPTION_AES, PASSPHRASE_CORRECT);
+	res &= test_range_blocks("Range, multiple blocks, AES-GCM encryption", ENCRYPTION_AES_GCM, PASSPHRASE_CORRECT);
+#endif
+#ifdef IMPACK_WITH_COMPRESSION
+	res &= test_cycle_volumes("Volumes, compressed data", ENCRYPTION_NONE, NULL, impack_default_compression());
+#endif
+#ifdef IMPACK_WITH_CRYPTO
+	res &= test_cycle_volumes("Volumes, encrypted data", ENCRYPTION_AES_GCM, PASSPHRASE_CORRECT, COMPRESSION_NONE);
+#endif
+	
+	res &= test_format_version_invalid("Volume format without volumes", IMPACK_FORMAT_VERSION_VOLUMES);
+	res &= test_format_version_invalid("Unknown format version", IMPACK_FORMAT_VERSION + 1);
+	res &= test_format_version_default("Default format version");
+	
+	format_version = IMPACK_FORMAT_VERSION_STREAM;
+	res &= test_cycle_format("Single stream format", false, NULL, COMPRESSION_NONE, 0, 0, allchannels);
+	res &= test_cycle_mem("Single stream format, in-memory API", false, NULL, COMPRESSION_NONE);
+	res &= test_cycle_io("Single stream format, stream API", COMPRESSION_NONE);
+	res &= test_range("Single stream format, range");
+#ifdef IMPACK_WITH_COMPRESSION
+	res &= test_cycle_format("Single stream format, compressed data", false, NULL, impack_default_compression(), 0, 0, allchannels);
+#endif
+#ifdef IMPACK_WITH_CRYPTO
+	res &= test_cycle_format("Single stream format, encrypted data", ENCRYPTION_AES, PASSPHRASE_CORRECT, COMPRESSION_NONE, 0, 0, allchannels);
+#ifdef IMPACK_WITH_COMPRESSION
+	res &= test_cycle_format("Single stream format, encrypted and compressed data", ENCRYPTION_AES, PASSPHRASE_CORRECT, impack_default_compression(), 0, 0, allchannels);
+#endif
+#endif
+	format_version = IMPACK_FORMAT_VERSION_BLOCKS;
 	return res;
 	
 }
@@ -764,7 +1593,24 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 	fclose(f);
+	ref_blocks = malloc(REF_BLOCKS_LENGTH);
+	if (ref_blocks == NULL) {
+		printf("\nError: Unable to allocate memory");
+		return 1;
+	}
+	uint32_t x = 2463534242U; // Xorshift, so the blocks don't compress or repeat
+	for (uint32_t i = 0; i < REF_BLOCKS_LENGTH; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		ref_blocks[i] = x;
+	}
 	printf("OK\n\n");
+	printf("Testing checksums...\n");
+	if (!test_crc()) {
+		res = 1;
+	}
+	printf("\n");
 	printf("Testing encode + decode cycles...\n");
 	if (!test_cycle()) {
 		res = 1;
@@ -781,6 +1627,7 @@ int main(int argc, char **argv) {
 		printf("Some tests FAILED\n");
 		printf("Please report a bug\n");
 	}
+	free(ref_blocks);
 	
 	return res;
 	